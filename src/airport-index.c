@@ -0,0 +1,493 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+#include <kore/kore.h>
+
+#include "airport-index.h"
+#include "util.h"
+
+// each worker keeps every airport in memory so the autocomplete search on `/api/airports` never
+// has to go to the query service. all the strings are copied into one pool and airports refer to
+// them by offset. each search key has its own array of airport numbers sorted by that key, so a
+// search is a binary search for the first candidate followed by a short scan.
+
+static const char   AIRPORT_INDEX_QUERY_STRING[] = "SELECT airportname, faa, icao"
+                    " FROM `travel-sample`.inventory.airport";
+static const size_t AIRPORT_INDEX_QUERY_STRLEN = sizeof(AIRPORT_INDEX_QUERY_STRING) - 1;
+
+// how often the index is reloaded in the background
+#define AIRPORT_INDEX_REFRESH_MS    (15 * 60 * 1000)
+
+#define AIRPORT_POOL_INITIAL_SIZE   (64 * 1024)
+#define AIRPORT_INITIAL_COUNT       2048
+
+typedef struct tcblcb_AIRPORT {
+    u_int32_t name;
+    u_int32_t name_lower;
+    u_int32_t faa;
+    u_int32_t icao;
+} tcblcb_AIRPORT;
+
+typedef struct tcblcb_AIRPORTINDEX {
+    char *pool;
+    size_t pool_len;
+    size_t pool_cap;
+    tcblcb_AIRPORT *airports;
+    size_t num_airports;
+    size_t cap_airports;
+    u_int32_t *by_name;
+    u_int32_t *by_faa;
+    u_int32_t *by_icao;
+    lcb_STATUS status;
+} tcblcb_AIRPORTINDEX;
+
+static _Thread_local tcblcb_AIRPORTINDEX *_airport_index = NULL;
+static _Thread_local tcblcb_AIRPORTINDEX *_airport_index_loading = NULL;
+static _Thread_local lcb_INSTANCE *_airport_index_instance = NULL;
+static _Thread_local struct kore_timer *_airport_index_timer = NULL;
+
+// qsort has no context argument so the comparators read the index being sorted from here
+static _Thread_local const tcblcb_AIRPORTINDEX *_airport_index_sorting = NULL;
+
+static void airport_index_free(tcblcb_AIRPORTINDEX *index)
+{
+    if (index->pool != NULL) {
+        free(index->pool);
+    }
+    if (index->airports != NULL) {
+        free(index->airports);
+    }
+    if (index->by_name != NULL) {
+        free(index->by_name);
+    }
+    if (index->by_faa != NULL) {
+        free(index->by_faa);
+    }
+    if (index->by_icao != NULL) {
+        free(index->by_icao);
+    }
+    free(index);
+}
+
+static tcblcb_AIRPORTINDEX *airport_index_create()
+{
+    bool valid = false;
+
+    tcblcb_AIRPORTINDEX *index = calloc(1, sizeof(tcblcb_AIRPORTINDEX));
+    IfNULLGotoDone(index, "Failed to allocate airport index");
+
+    index->pool = malloc(AIRPORT_POOL_INITIAL_SIZE);
+    IfNULLGotoDone(index->pool, "Failed to allocate airport index string pool");
+    index->pool_cap = AIRPORT_POOL_INITIAL_SIZE;
+
+    // offset zero is the empty string used for missing values
+    index->pool[0] = '\0';
+    index->pool_len = 1;
+
+    index->airports = malloc(AIRPORT_INITIAL_COUNT * sizeof(tcblcb_AIRPORT));
+    IfNULLGotoDone(index->airports, "Failed to allocate airport index entries");
+    index->cap_airports = AIRPORT_INITIAL_COUNT;
+
+    index->status = LCB_SUCCESS;
+    valid = true;
+
+done:
+    if (!valid && index != NULL) {
+        airport_index_free(index);
+        index = NULL;
+    }
+
+    return index;
+}
+
+// copy a string into the pool and return its offset (or zero if it could not be added).
+static u_int32_t airport_index_add_string(tcblcb_AIRPORTINDEX *index, const char *str, bool lower)
+{
+    if (str == NULL || *str == '\0') {
+        return 0;
+    }
+
+    size_t len = strlen(str) + 1;
+    if (index->pool_len + len > index->pool_cap) {
+        size_t pool_cap = index->pool_cap * 2;
+        while (index->pool_len + len > pool_cap) {
+            pool_cap *= 2;
+        }
+        if (pool_cap > UINT32_MAX) {
+            return 0;
+        }
+
+        char *pool = realloc(index->pool, pool_cap);
+        if (pool == NULL) {
+            return 0;
+        }
+        index->pool = pool;
+        index->pool_cap = pool_cap;
+    }
+
+    u_int32_t offset = (u_int32_t)index->pool_len;
+    memcpy(index->pool + offset, str, len);
+    if (lower) {
+        to_lower_case(index->pool + offset);
+    }
+    index->pool_len += len;
+
+    return offset;
+}
+
+static bool airport_index_add(tcblcb_AIRPORTINDEX *index, const char *name, const char *faa, const char *icao)
+{
+    if (index->num_airports == index->cap_airports) {
+        size_t cap_airports = index->cap_airports * 2;
+        tcblcb_AIRPORT *airports = realloc(index->airports, cap_airports * sizeof(tcblcb_AIRPORT));
+        if (airports == NULL) {
+            return false;
+        }
+        index->airports = airports;
+        index->cap_airports = cap_airports;
+    }
+
+    tcblcb_AIRPORT *airport = &index->airports[index->num_airports];
+    airport->name = airport_index_add_string(index, name, false);
+    airport->name_lower = airport_index_add_string(index, name, true);
+    airport->faa = airport_index_add_string(index, faa, false);
+    airport->icao = airport_index_add_string(index, icao, false);
+
+    // a zero name offset means the string pool could not grow
+    if (airport->name == 0 || airport->name_lower == 0) {
+        return false;
+    }
+
+    index->num_airports++;
+    return true;
+}
+
+static const char *airport_index_key(const tcblcb_AIRPORTINDEX *index, u_int32_t airport_num, tcblcb_AIRPORT_FIELD field)
+{
+    const tcblcb_AIRPORT *airport = &index->airports[airport_num];
+    switch (field) {
+        case AIRPORT_FIELD_FAA:
+            return index->pool + airport->faa;
+        case AIRPORT_FIELD_ICAO:
+            return index->pool + airport->icao;
+        case AIRPORT_FIELD_NAME:
+        default:
+            return index->pool + airport->name_lower;
+    }
+}
+
+static int airport_index_compare(const void *a, const void *b, tcblcb_AIRPORT_FIELD field)
+{
+    return strcmp(
+        airport_index_key(_airport_index_sorting, *(const u_int32_t *)a, field),
+        airport_index_key(_airport_index_sorting, *(const u_int32_t *)b, field)
+    );
+}
+
+static int airport_index_compare_faa(const void *a, const void *b)
+{
+    return airport_index_compare(a, b, AIRPORT_FIELD_FAA);
+}
+
+static int airport_index_compare_icao(const void *a, const void *b)
+{
+    return airport_index_compare(a, b, AIRPORT_FIELD_ICAO);
+}
+
+static int airport_index_compare_name(const void *a, const void *b)
+{
+    return airport_index_compare(a, b, AIRPORT_FIELD_NAME);
+}
+
+static u_int32_t *airport_index_sort_by(tcblcb_AIRPORTINDEX *index, int (*compare)(const void *, const void *))
+{
+    u_int32_t *sorted = malloc(index->num_airports * sizeof(u_int32_t));
+    if (sorted == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < index->num_airports; i++) {
+        sorted[i] = (u_int32_t)i;
+    }
+
+    _airport_index_sorting = index;
+    qsort(sorted, index->num_airports, sizeof(u_int32_t), compare);
+    _airport_index_sorting = NULL;
+
+    return sorted;
+}
+
+static bool airport_index_build(tcblcb_AIRPORTINDEX *index)
+{
+    index->by_name = airport_index_sort_by(index, airport_index_compare_name);
+    index->by_faa = airport_index_sort_by(index, airport_index_compare_faa);
+    index->by_icao = airport_index_sort_by(index, airport_index_compare_icao);
+
+    return index->by_name != NULL && index->by_faa != NULL && index->by_icao != NULL;
+}
+
+// swap in the index once the load query has completed (or drop it if the load failed)
+static void airport_index_loaded(tcblcb_AIRPORTINDEX *index)
+{
+    if (_airport_index_loading == index) {
+        _airport_index_loading = NULL;
+    }
+
+    if (index->status != LCB_SUCCESS || index->num_airports == 0 || !airport_index_build(index)) {
+        kore_log(LOG_WARNING, "Failed to load airport index (%s)", lcb_strerror_short(index->status));
+        airport_index_free(index);
+        return;
+    }
+
+    if (_airport_index != NULL) {
+        airport_index_free(_airport_index);
+    }
+    _airport_index = index;
+
+    kore_log(LOG_NOTICE, "Airport index loaded: %zu airports (%zu string bytes)", index->num_airports, index->pool_len);
+}
+
+static void airport_index_query_callback(__unused lcb_INSTANCE *instance, __unused int type, const lcb_RESPQUERY *resp)
+{
+    tcblcb_JSONDoc *row_doc = NULL;
+
+    tcblcb_AIRPORTINDEX *index = NULL;
+    IfLCBFailGotoDone(
+        lcb_respquery_cookie(resp, (void**)(&index)),
+        "Failed to get airport index query response cookie"
+    );
+    IfNULLGotoDone(
+        index,
+        "Airport index query cookie was NULL"
+    );
+
+    lcb_STATUS rc = lcb_respquery_status(resp);
+    if (rc != LCB_SUCCESS) {
+        index->status = rc;
+        goto done;
+    }
+
+    const char *row;
+    size_t nrow;
+    IfLCBFailGotoDone(
+        lcb_respquery_row(resp, &row, &nrow),
+        "Failed to get airport index query response row"
+    );
+
+    if (lcb_respquery_is_final(resp)) {
+        LogDebug("Query Metadata:\n%.*s", (int)nrow, row);
+    } else {
+        row_doc = json_doc_parse(row, nrow);
+        IfNULLGotoDone(row_doc, "Failed to parse airport index row");
+
+        const tcblcb_JSONValue *row_json = json_doc_root(row_doc);
+        const char *name = json_get_string(json_object_get(row_json, "airportname"));
+        IfNULLGotoDone(name, "Airport index row has no airport name");
+
+        if (!airport_index_add(
+                index,
+                name,
+                json_get_string(json_object_get(row_json, "faa")),
+                json_get_string(json_object_get(row_json, "icao")))) {
+            index->status = LCB_ERR_NO_MEMORY;
+        }
+    }
+
+done:
+    if (row_doc != NULL) {
+        json_doc_free(row_doc);
+    }
+
+    if (index != NULL && lcb_respquery_is_final(resp)) {
+        airport_index_loaded(index);
+    }
+}
+
+// schedule a query that builds a new index (a no-op if one is already loading).
+static lcb_STATUS airport_index_load(lcb_INSTANCE *instance)
+{
+    lcb_STATUS rc = LCB_ERR_GENERIC;
+    lcb_CMDQUERY *cmd = NULL;
+    tcblcb_AIRPORTINDEX *index = NULL;
+
+    if (_airport_index_loading != NULL) {
+        return LCB_SUCCESS;
+    }
+
+    index = airport_index_create();
+    IfNULLGotoDone(index, "Failed to create airport index");
+
+    IfLCBFailGotoDone(
+        (rc = lcb_cmdquery_create(&cmd)),
+        "Failed to create airport index query command"
+    );
+    IfLCBFailGotoDone(
+        (rc = lcb_cmdquery_statement(cmd, AIRPORT_INDEX_QUERY_STRING, AIRPORT_INDEX_QUERY_STRLEN)),
+        "Failed to set airport index query command statement"
+    );
+    IfLCBFailGotoDone(
+        (rc = lcb_cmdquery_option(cmd, "pretty", strlen("pretty"), "false", strlen("false"))),
+        "Failed to set airport index query command pretty option"
+    );
+    IfLCBFailGotoDone(
+        (rc = lcb_cmdquery_callback(cmd, airport_index_query_callback)),
+        "Failed to set airport index query command callback"
+    );
+    IfLCBFailGotoDone(
+        (rc = lcb_query(instance, index, cmd)),
+        "Failed to schedule airport index query command"
+    );
+
+    _airport_index_loading = index;
+    index = NULL;
+
+done:
+    if (cmd != NULL) {
+        IfLCBFailLogWarningMsg(
+            lcb_cmdquery_destroy(cmd),
+            "Failed to destroy airport index query command"
+        );
+    }
+
+    // free memory if query was not scheduled
+    if (index != NULL) {
+        airport_index_free(index);
+    }
+
+    return rc;
+}
+
+static void airport_index_refresh(__unused void *arg, __unused u_int64_t now)
+{
+    IfLCBFailLogWarningMsg(
+        airport_index_load(_airport_index_instance),
+        "Failed to schedule airport index refresh"
+    );
+}
+
+bool tcblcb_airport_index_init(lcb_INSTANCE *instance)
+{
+    _airport_index_instance = instance;
+
+    // wait for the first load so the index is ready before serving requests
+    if (airport_index_load(instance) == LCB_SUCCESS) {
+        IfLCBFailLogWarningMsg(
+            lcb_wait(instance, LCB_WAIT_DEFAULT),
+            "Failed to complete airport index load"
+        );
+    }
+
+    // keep refreshing even if the first load failed so the index can recover
+    _airport_index_timer = kore_timer_add(airport_index_refresh, AIRPORT_INDEX_REFRESH_MS, NULL, 0);
+
+    return tcblcb_airport_index_ready();
+}
+
+void tcblcb_airport_index_destroy()
+{
+    if (_airport_index_timer != NULL) {
+        kore_timer_remove(_airport_index_timer);
+        _airport_index_timer = NULL;
+    }
+
+    // the instance is gone so a load that was still in flight will never complete
+    if (_airport_index_loading != NULL) {
+        airport_index_free(_airport_index_loading);
+        _airport_index_loading = NULL;
+    }
+
+    if (_airport_index != NULL) {
+        airport_index_free(_airport_index);
+        _airport_index = NULL;
+    }
+
+    _airport_index_instance = NULL;
+}
+
+bool tcblcb_airport_index_ready()
+{
+    return _airport_index != NULL;
+}
+
+size_t tcblcb_airport_index_find(tcblcb_AIRPORT_FIELD field, const char *search, tcblcb_RawResponse *resp)
+{
+    const tcblcb_AIRPORTINDEX *index = _airport_index;
+    if (index == NULL || search == NULL || *search == '\0') {
+        return 0;
+    }
+
+    const u_int32_t *sorted = NULL;
+    switch (field) {
+        case AIRPORT_FIELD_FAA:
+            sorted = index->by_faa;
+            break;
+        case AIRPORT_FIELD_ICAO:
+            sorted = index->by_icao;
+            break;
+        case AIRPORT_FIELD_NAME:
+        default:
+            sorted = index->by_name;
+            break;
+    }
+
+    // find the first key that is not less than the search, which is where any matches start
+    size_t lo = 0;
+    size_t hi = index->num_airports;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(airport_index_key(index, sorted[mid], field), search) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // codes must match exactly while names only need to start with the search
+    size_t search_strlen = strlen(search);
+    bool prefix = field == AIRPORT_FIELD_NAME;
+
+    static const char row_start[] = "{\"airportname\":";
+
+    struct kore_buf row_buf;
+    kore_buf_init(&row_buf, 128);
+
+    size_t num_found = 0;
+    for (size_t i = lo; i < index->num_airports; i++) {
+        const char *key = airport_index_key(index, sorted[i], field);
+        if (prefix ? strncmp(key, search, search_strlen) != 0 : strcmp(key, search) != 0) {
+            break;
+        }
+
+        kore_buf_reset(&row_buf);
+        kore_buf_append(&row_buf, row_start, sizeof(row_start) - 1);
+        append_json_string(&row_buf, index->pool + index->airports[sorted[i]].name);
+        kore_buf_append(&row_buf, "}", 1);
+        raw_response_add_row(resp, (const char *)row_buf.data, row_buf.offset);
+
+        num_found++;
+    }
+
+    kore_buf_cleanup(&row_buf);
+
+    return num_found;
+}
@@ -0,0 +1,53 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef tcblcb_AIRPORT_INDEX_HEADER_SEEN
+#define tcblcb_AIRPORT_INDEX_HEADER_SEEN
+
+#include <stdbool.h>
+#include <libcouchbase/couchbase.h>
+
+#include "util.h"
+
+// the airport fields that can be searched
+typedef enum {
+    AIRPORT_FIELD_FAA,      // exact match on the 3 character FAA code
+    AIRPORT_FIELD_ICAO,     // exact match on the 4 character ICAO code
+    AIRPORT_FIELD_NAME      // prefix match on the lowercased airport name
+} tcblcb_AIRPORT_FIELD;
+
+// load the per-worker airport index (blocks, so only call during worker configure) and start
+// the timer that periodically refreshes it in the background.
+bool tcblcb_airport_index_init(lcb_INSTANCE *instance);
+
+// stop refreshing and free the index. call after the instance has been destroyed.
+void tcblcb_airport_index_destroy();
+
+// true if the index is loaded and can answer searches.
+bool tcblcb_airport_index_ready();
+
+// add an `{"airportname": ...}` row for each airport matching `search` to the response.
+// FAA and ICAO searches expect upper case, name searches expect lower case.
+size_t tcblcb_airport_index_find(tcblcb_AIRPORT_FIELD field, const char *search, tcblcb_RawResponse *resp);
+
+#endif /* !tcblcb_AIRPORT_INDEX_HEADER_SEEN */
@@ -21,10 +21,74 @@
  */
 
 #include "try-cb-lcb.h"
+#include "airport-index.h"
 #include "util.h"
 
+#define AIRPORTS_STATE_QUERY     0
+#define AIRPORTS_STATE_RESPONSE  1
+
+#define AIRPORTS_CACHE_TTL_MS       (10 * 60 * 1000)
+// cached responses older than this are still served, but refreshed in the background
+#define AIRPORTS_CACHE_SOFT_TTL_MS  (8 * 60 * 1000)
+
+// airports hardly ever change, so clients can reuse a response for a while
+static const char   AIRPORTS_CACHE_CONTROL[] = "public, max-age=300";
+
+static const char   AIRPORTS_CACHE_PREFIX_STRING[] = "airports|";
+static const size_t AIRPORTS_CACHE_PREFIX_STRLEN = sizeof(AIRPORTS_CACHE_PREFIX_STRING) - 1;
+
+typedef struct tcblcb_AirportsState {
+    struct kore_buf *query_buf;
+    struct kore_buf *context_buf;
+    char *params_string;
+    char *cache_key;
+    tcblcb_RawResponse response;
+    bool complete;      // every row has arrived, so the response can be cached
+    bool failed;
+} tcblcb_AirportsState;
+
+static void airports_state_free(void *data)
+{
+    tcblcb_AirportsState *state = data;
+
+    if (state->params_string != NULL) {
+        tcblcb_free(state->params_string);
+    }
+
+    if (state->cache_key != NULL) {
+        tcblcb_free(state->cache_key);
+    }
+
+    if (state->query_buf != NULL) {
+	    kore_buf_free(state->query_buf);
+    }
+
+    if (state->context_buf != NULL) {
+        kore_buf_free(state->context_buf);
+    }
+
+    raw_response_cleanup(&state->response);
+}
+
 static void airports_query_callback(__unused lcb_INSTANCE *instance, __unused int type, const lcb_RESPQUERY *resp)
 {
+    tcblcb_ARENA *previous_arena = NULL;
+    bool arena_entered = false;
+
+    tcblcb_REQCTX *ctx = NULL;
+    IfLCBFailGotoDone(
+        lcb_respquery_cookie(resp, (void**)(&ctx)),
+        "Failed to get query response cookie"
+    );
+    IfFalseGotoDone(
+        tcblcb_reqctx_attached(ctx),
+        "Request went away before query response"
+    );
+
+    // whatever the rows decode to belongs to the request
+    previous_arena = tcblcb_arena_enter(ctx->arena);
+    arena_entered = true;
+
     IfLCBFailGotoDone(
         lcb_respquery_status(resp),
         "Failed to execute query"
@@ -37,109 +101,123 @@ static void airports_query_callback(__unused lcb_INSTANCE *instance, __unused in
         "Failed to get query response row"
     );
 
+    tcblcb_AirportsState *state = ctx->data;
+
     if (lcb_respquery_is_final(resp)) {
         LogDebug("Query Metadata:\n%.*s", (int)nrow, row);
+        tcblcb_reqctx_query_meta(ctx, row, nrow);
+        state->complete = true;
     } else {
-        cJSON *response_json_data_array = NULL;
-        IfLCBFailGotoDone(
-            lcb_respquery_cookie(resp, (void**)(&response_json_data_array)),
-            "Failed to get query response cookie"
-        );
-        IfFalseGotoDone(
-            cJSON_IsArray(response_json_data_array),
-            "Query response cookie is not a JSON array"
-        );
 
         LogDebug("Row Data: %.*s", (int)nrow, row);
 
-        // we will not delete this here because it will be added to the array
-        cJSON *row_json = cJSON_ParseWithLength(row, nrow);
-        IfNULLGotoDone(row_json, "Failed to parse row result");
-        IfFalseGotoDone(
-            cJSON_IsObject(row_json),
-            "Row data is not a JSON object"
-        );
-
-        IfFalseGotoDone(
-            cJSON_AddItemToArray(response_json_data_array, row_json),
-            "Failed to add row JSON to response data array"
-        );
+        // the row is already exactly the JSON object we return
+        raw_response_add_row(&state->response, row, nrow);
     }
 
 done:
-    // no clean up to do in this block
-    return;
+    // the request (and its arena) can be released once its query is done
+    if (arena_entered) {
+        tcblcb_arena_leave(previous_arena);
+    }
+
+    if (lcb_respquery_is_final(resp)) {
+        tcblcb_reqctx_query_done(ctx, lcb_respquery_status(resp) == LCB_SUCCESS);
+    }
 }
 
-int tcblcb_api_airports(struct http_request *req)
+static const char *airport_field_name(tcblcb_AIRPORT_FIELD search_field)
 {
-    ProcessCORSAndExitIfPreflight(req);
-    
-    http_populate_qs(req);
-    
-    struct kore_buf *query_buf = NULL;
-    struct kore_buf *context_buf = NULL;
-    char *params_string = NULL;
+    if (search_field == AIRPORT_FIELD_FAA) {
+        return "faa";
+    } else if (search_field == AIRPORT_FIELD_ICAO) {
+        return "icao";
+    }
+    return "airportname";
+}
 
-    cJSON *response_json = NULL;
-    char *response_string = NULL;
-    size_t response_strlen = 0;
+static tcblcb_AIRPORT_FIELD airport_field_from_name(const char *field_string, size_t field_strlen)
+{
+    if (field_strlen == 3 && strncmp(field_string, "faa", 3) == 0) {
+        return AIRPORT_FIELD_FAA;
+    } else if (field_strlen == 4 && strncmp(field_string, "icao", 4) == 0) {
+        return AIRPORT_FIELD_ICAO;
+    }
+    return AIRPORT_FIELD_NAME;
+}
 
-    char *search_string = NULL;
-    IfBadKoreResultGotoDone(
-        http_argument_get_string(req, "search", &search_string),
-        "search query param was not found"
-    );
+// build the response from the airport index without going to the query service.
+static void airports_index_response(tcblcb_AirportsState *state, tcblcb_AIRPORT_FIELD search_field, const char *search_string)
+{
+    const char *field_string = airport_field_name(search_field);
 
-    query_buf = kore_buf_alloc(BUFSIZ);
-    kore_buf_appendf(query_buf, "SELECT airportname FROM `travel-sample`.inventory.airport WHERE ");
+    state->context_buf = kore_buf_alloc(BUFSIZ);
+    kore_buf_appendf(state->context_buf, "Airport index lookup - %s: %s", field_string, search_string);
 
-    bool is_short_code = false;
-    bool same_case = is_same_case(search_string);
-    if (same_case) {
-        size_t search_strlen = strlen(search_string);
-        if (search_strlen == 3) {
-            is_short_code = true;
-            kore_buf_appendf(query_buf, "faa=$1");
-            to_upper_case(search_string);
-        } else if (search_strlen == 4) {
-            is_short_code = true;
-            kore_buf_appendf(query_buf, "icao=$1");
-            to_upper_case(search_string);
-        }
+    size_t context_strlen;
+    char *context_string = kore_buf_stringify(state->context_buf, &context_strlen);
+
+    raw_response_init(&state->response);
+    raw_response_add_context(&state->response, context_string);
+
+    tcblcb_airport_index_find(search_field, search_string, &state->response);
+    state->complete = true;
+}
+
+// search for airports, from the index or with a query (in which case the response is complete
+// once it has been answered). returns false if the search couldn't be started.
+static bool airports_search(tcblcb_REQCTX *ctx, tcblcb_AIRPORT_FIELD search_field, const char *search_string)
+{
+    bool scheduled = false;
+    tcblcb_AirportsState *state = ctx->data;
+
+    // answer from the in-memory index when it's loaded
+    if (tcblcb_airport_index_ready()) {
+        airports_index_response(state, search_field, search_string);
+        scheduled = true;
+        goto done;
     }
-    
-    if (!is_short_code) {
-        kore_buf_appendf(query_buf, "POSITION(LOWER(airportname), $1) = 0");
-        to_lower_case(search_string);
+
+    u_int64_t started = tcblcb_metrics_now();
+    state->query_buf = kore_buf_alloc(BUFSIZ);
+    kore_buf_appendf(state->query_buf, "SELECT airportname FROM `travel-sample`.inventory.airport WHERE ");
+
+    tcblcb_METRICS_STATEMENT statement;
+    switch (search_field) {
+        case AIRPORT_FIELD_FAA:
+            kore_buf_appendf(state->query_buf, "faa=$1");
+            statement = METRICS_STATEMENT_AIRPORTS_FAA;
+            break;
+        case AIRPORT_FIELD_ICAO:
+            kore_buf_appendf(state->query_buf, "icao=$1");
+            statement = METRICS_STATEMENT_AIRPORTS_ICAO;
+            break;
+        case AIRPORT_FIELD_NAME:
+        default:
+            kore_buf_appendf(state->query_buf, "POSITION(LOWER(airportname), $1) = 0");
+            statement = METRICS_STATEMENT_AIRPORTS_NAME;
+            break;
     }
 
-    char *params[1] = {search_string};
-    params_string = create_string_array_param_string(params, 1);
+    const char *params[1] = {search_string};
+    state->params_string = create_string_array_param_string(params, 1);
 
     size_t query_strlen;
-    char *query_string = kore_buf_stringify(query_buf, &query_strlen);
+    char *query_string = kore_buf_stringify(state->query_buf, &query_strlen);
 
-    context_buf = kore_buf_alloc(BUFSIZ);
-    kore_buf_appendf(context_buf, "N1QL query - scoped to inventory: %s", query_string);
+    state->context_buf = kore_buf_alloc(BUFSIZ);
+    kore_buf_appendf(state->context_buf, "N1QL query - scoped to inventory: %s", query_string);
 
     size_t context_strlen;
-    char *context_string = kore_buf_stringify(context_buf, &context_strlen);
+    char *context_string = kore_buf_stringify(state->context_buf, &context_strlen);
 
-    LogDebug("Query Request:\n%s\nQuery Params: %s", query_string, params_string);
+    LogDebug("Query Request:\n%s\nQuery Params: %s", query_string, state->params_string);
 
-    // prepare JSON response early so we can accumulate query results
-	response_json = cJSON_CreateObject();
-    cJSON *resp_json_data_array = cJSON_AddArrayToObject(response_json, "data");
-    IfNULLGotoDone(resp_json_data_array, "Failed to create response data array");
-    cJSON *resp_json_context_array = cJSON_AddArrayToObject(response_json, "context");
-    IfNULLGotoDone(resp_json_context_array, "Failed to create response context array");
-    IfFalseGotoDone(
-        cJSON_AddItemToArray(resp_json_context_array, cJSON_CreateStringReference(context_string)),
-        "Failed to add response context string to array"
-    );
+    // prepare the response early so the query rows can be copied straight into it
+    raw_response_init(&state->response);
+    raw_response_add_context(&state->response, context_string);
 
-    // execute the Couchbase airport query command and wait for results
+    // schedule the Couchbase airport query command (the response state runs once it completes)
     lcb_CMDQUERY *cmd;
     IfLCBFailGotoDone(
         lcb_cmdquery_create(&cmd),
@@ -150,7 +228,7 @@ int tcblcb_api_airports(struct http_request *req)
         "Failed to set query command statement"
     );
     IfLCBFailGotoDone(
-        lcb_cmdquery_positional_param(cmd, params_string, strlen(params_string)),
+        lcb_cmdquery_positional_param(cmd, state->params_string, strlen(state->params_string)),
         "Failed to set query command positional parameters"
     );
     IfLCBFailGotoDone(
@@ -165,46 +243,149 @@ int tcblcb_api_airports(struct http_request *req)
         lcb_cmdquery_callback(cmd, airports_query_callback),
         "Failed to set airports query command callback"
     );
+    IfLCBFailGotoDone(
+        lcb_cmdquery_parent_span(cmd, tcblcb_reqctx_span(ctx)),
+        "Failed to set query command parent span"
+    );
     DebugQueryPayload(cmd);
+    tcblcb_reqctx_phase(ctx, TIMING_PHASE_BUILD, started);
     IfLCBFailGotoDone(
-        lcb_query(_tcblcb_lcb_instance, resp_json_data_array, cmd),
+        lcb_query(_tcblcb_lcb_instance, ctx, cmd),
         "Failed to schedule query command"
     );
+    tcblcb_reqctx_query_scheduled(ctx, METRICS_OP_QUERY, statement);
     IfLCBFailLogWarningMsg(
         lcb_cmdquery_destroy(cmd),
         "Failed to destroy query command statement"
     );
-    IfLCBFailGotoDone(
-        lcb_wait(_tcblcb_lcb_instance, LCB_WAIT_DEFAULT),
-        "Failed while waiting for query operation to complete"
-    );
 
-    // query results are complete so we can get the JSON response 
-    response_string = cJSON_PrintBuffered(response_json, BUFSIZ, FMT_RESPONSE);
-    response_strlen = strlen(response_string);
+    scheduled = true;
+
+done:
+    return scheduled;
+}
+
+// refresh a stale cached response in the background. the cache key holds the normalized search.
+static void airports_refresh_start(tcblcb_REQCTX *ctx, const char *cache_key)
+{
+    tcblcb_AirportsState *state = ctx->data;
+
+    const char *field_string = cache_key + AIRPORTS_CACHE_PREFIX_STRLEN;
+    const char *search_string = strchr(field_string, '|');
+    IfNULLGotoDone(search_string, "Airports cache key has no search");
+
+    state->cache_key = tcblcb_strdup(cache_key);
+    IfNULLGotoDone(state->cache_key, "Failed to copy airports cache key");
+
+    LogDebug("Refreshing cached response: %s", cache_key);
+
+    tcblcb_AIRPORT_FIELD search_field = airport_field_from_name(field_string, (size_t)(search_string - field_string));
+    state->failed = !airports_search(ctx, search_field, search_string + 1);
 
 done:
-    http_response(req, 200, response_string, response_strlen);
+    // no clean up to do in this block
+    return;
+}
+
+static void airports_refresh_done(tcblcb_REQCTX *ctx)
+{
+    tcblcb_AirportsState *state = ctx->data;
 
-    if (params_string != NULL) {
-        free(params_string);
+    if (state->complete && !state->failed) {
+        raw_response_cache(&state->response, _tcblcb_response_cache, state->cache_key, AIRPORTS_CACHE_SOFT_TTL_MS, AIRPORTS_CACHE_TTL_MS);
+        raw_response_store(&state->response);
     }
+}
 
-    if (query_buf != NULL) {
-	    kore_buf_free(query_buf);
+static int airports_state_query(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_create(req, sizeof(tcblcb_AirportsState), airports_state_free);
+    if (ctx == NULL) {
+        send_response(req, 500, NULL, 0);
+        return (HTTP_STATE_COMPLETE);
     }
 
-    if (context_buf != NULL) {
-        kore_buf_free(context_buf);
+    tcblcb_AirportsState *state = ctx->data;
+    state->failed = true;
+    u_int64_t started = tcblcb_metrics_now();
+
+    http_populate_qs(req);
+
+    char *search_string = NULL;
+    IfBadKoreResultGotoDone(
+        http_argument_get_string(req, "search", &search_string),
+        "search query param was not found"
+    );
+
+    tcblcb_AIRPORT_FIELD search_field = AIRPORT_FIELD_NAME;
+    bool same_case = is_same_case(search_string);
+    if (same_case) {
+        size_t search_strlen = strlen(search_string);
+        if (search_strlen == 3) {
+            search_field = AIRPORT_FIELD_FAA;
+        } else if (search_strlen == 4) {
+            search_field = AIRPORT_FIELD_ICAO;
+        }
     }
 
-    if (response_string != NULL) {
-        free(response_string);
+    if (search_field == AIRPORT_FIELD_NAME) {
+        to_lower_case(search_string);
+    } else {
+        to_upper_case(search_string);
     }
-    
-    if (response_json != NULL) {
-        cJSON_Delete(response_json);
+    tcblcb_reqctx_phase(ctx, TIMING_PHASE_PARSE, started);
+
+    // the search is normalized, so equivalent searches share a cached response
+    const char *field_string = airport_field_name(search_field);
+    size_t cache_key_strlen = AIRPORTS_CACHE_PREFIX_STRLEN + strlen(field_string) + strlen(search_string) + 2;
+    state->cache_key = tcblcb_malloc(cache_key_strlen);
+    if (state->cache_key != NULL) {
+        snprintf(state->cache_key, cache_key_strlen, "%s%s|%s", AIRPORTS_CACHE_PREFIX_STRING, field_string, search_string);
+
+        tcblcb_CACHE_RESULT cached = send_cached_response(req, _tcblcb_response_cache, state->cache_key, AIRPORTS_CACHE_CONTROL);
+        if (cached == CACHE_STALE) {
+            tcblcb_background_schedule(
+                airports_refresh_start,
+                airports_refresh_done,
+                sizeof(tcblcb_AirportsState),
+                airports_state_free,
+                state->cache_key
+            );
+        }
+        if (cached != CACHE_MISS) {
+            return (HTTP_STATE_COMPLETE);
+        }
     }
 
-    return (KORE_RESULT_OK);
+    state->failed = !airports_search(ctx, search_field, search_string);
+
+done:
+    return tcblcb_reqctx_suspend(ctx, AIRPORTS_STATE_RESPONSE);
+}
+
+static int airports_state_response(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    tcblcb_AirportsState *state = ctx->data;
+
+    // only complete results are shared with the other workers
+    if (state->complete) {
+        raw_response_cache(&state->response, _tcblcb_response_cache, state->cache_key, AIRPORTS_CACHE_SOFT_TTL_MS, AIRPORTS_CACHE_TTL_MS);
+    }
+
+    // query results are complete so we can close the JSON response
+    raw_response_cache_control(&state->response, AIRPORTS_CACHE_CONTROL);
+    raw_response_send(&state->response, req, state->failed);
+
+    return (HTTP_STATE_COMPLETE);
+}
+
+static struct http_state airports_states[] = {
+    { "AIRPORTS_STATE_QUERY",    airports_state_query },
+    { "AIRPORTS_STATE_RESPONSE", airports_state_response },
+};
+
+int tcblcb_api_airports(struct http_request *req)
+{
+    return tcblcb_run_states(req, METRICS_ROUTE_AIRPORTS, airports_states, http_state_amount(airports_states));
 }
@@ -23,16 +23,228 @@
 #include <math.h>
 
 #include "try-cb-lcb.h"
+#include "cache.h"
+#include "singleflight.h"
 #include "util.h"
 
+// airport names rarely change so the FAA code for each is cached, as is a name with no airport.
+// like the routes below, codes past their soft TTL are still used, but refreshed in the background.
+#define FAA_CACHE_MAX_ENTRIES      4096
+#define FAA_CACHE_MAX_BYTES        (1024 * 1024)
+#define FAA_CACHE_TTL_MS           (60 * 60 * 1000)
+#define FAA_CACHE_SOFT_TTL_MS      (50 * 60 * 1000)
+#define FAA_CACHE_NEGATIVE_TTL_MS  (60 * 1000)
+
+// the raw route rows for each (from, to, weekday) are kept in the response cache shared by the
+// workers, with only the per-request flight time and price added afterwards. rows are stored back
+// to back, each prefixed by its length.
+#define ROUTES_CACHE_TTL_MS        (5 * 60 * 1000)
+#define ROUTES_CACHE_SOFT_TTL_MS   (4 * 60 * 1000)
+
+// every response quotes its own flight times and prices, so clients must always revalidate
+static const char   FPATHS_CACHE_CONTROL[] = "no-cache";
+
+static const char   ROUTES_CACHE_PREFIX_STRING[] = "routes|";
+static const size_t ROUTES_CACHE_PREFIX_STRLEN = sizeof(ROUTES_CACHE_PREFIX_STRING) - 1;
+
+// this lives for the life of the worker
+static _Thread_local tcblcb_CACHE *_faa_cache = NULL;
+
+#define FPATHS_STATE_AIRPORTS  0
+#define FPATHS_STATE_ROUTES    1
+#define FPATHS_STATE_COALESCED 2
+#define FPATHS_STATE_RESPONSE  3
+
+static const char ROUTES_QUERY_STRING[] =
+    "SELECT a.name, s.flight, s.utc, r.sourceairport, r.destinationairport, r.equipment "
+    "FROM `travel-sample`.inventory.route AS r "
+    "UNNEST r.schedule AS s "
+    "JOIN `travel-sample`.inventory.airline AS a ON KEYS r.airlineid "
+    "WHERE r.sourceairport = $fromfaa AND r.destinationairport = $tofaa AND s.day = $dayofweek "
+    "ORDER BY a.name ASC";
+static const size_t ROUTES_QUERY_STRLEN = sizeof(ROUTES_QUERY_STRING) - 1;
+
+static const char FPATHS_QUERY_STRING[] =
+    "SELECT faa as fromAirport FROM `travel-sample`.inventory.airport "
+    "WHERE airportname = $1 "
+    "UNION "
+    "SELECT faa as toAirport FROM `travel-sample`.inventory.airport "
+    "WHERE airportname = $2";
+static const size_t FPATHS_QUERY_STRLEN = sizeof(FPATHS_QUERY_STRING) - 1;
+
 typedef struct tcblcb_FlightPathResults {
   char *from_airport;
   char *to_airport;
 } tcblcb_FlightPathResults;
 
+// a row of the airports query, which has one of the two airports
+typedef struct tcblcb_FlightPathRow {
+    char *from_airport;
+    char *to_airport;
+} tcblcb_FlightPathRow;
+
+static const tcblcb_JSON_FIELD flight_path_row_fields[] = {
+    JSON_FIELD("fromAirport", JSON_FIELD_STRING, tcblcb_FlightPathRow, from_airport),
+    JSON_FIELD("toAirport",   JSON_FIELD_STRING, tcblcb_FlightPathRow, to_airport),
+};
+
+typedef struct tcblcb_FlightPathsState {
+    char *from_loc;
+    char *to_loc;
+    struct kore_buf *fpaths_context_buf;
+    struct kore_buf *routes_context_buf;
+    char *params_string;
+    char *leave_weekday_json_string;
+    char *routes_cache_key;
+    tcblcb_FLIGHT *routes_flight;       // set while this request leads the routes query for its cache key
+    struct kore_buf *routes_rows_buf;
+    tcblcb_FlightPathResults flight_path_results;
+    tcblcb_RawResponse response;
+    bool failed;
+} tcblcb_FlightPathsState;
+
+static void fpaths_state_free(void *data)
+{
+    tcblcb_FlightPathsState *state = data;
+
+    // the request went away before its response. its query has completed by now (and cached the
+    // rows, if it succeeded), so wake anything waiting on it
+    tcblcb_flight_land(state->routes_flight);
+
+    if (state->from_loc != NULL) {
+        tcblcb_free(state->from_loc);
+    }
+
+    if (state->to_loc != NULL) {
+        tcblcb_free(state->to_loc);
+    }
+
+    if (state->params_string != NULL) {
+        tcblcb_free(state->params_string);
+    }
+
+    if (state->flight_path_results.from_airport != NULL) {
+        tcblcb_free(state->flight_path_results.from_airport);
+    }
+
+    if (state->flight_path_results.to_airport != NULL) {
+        tcblcb_free(state->flight_path_results.to_airport);
+    }
+    
+    if (state->leave_weekday_json_string != NULL) {
+        tcblcb_free(state->leave_weekday_json_string);
+    }
+
+    if (state->routes_cache_key != NULL) {
+        tcblcb_free(state->routes_cache_key);
+    }
+
+    if (state->routes_rows_buf != NULL) {
+        kore_buf_free(state->routes_rows_buf);
+    }
+
+    if (state->fpaths_context_buf != NULL) {
+        kore_buf_free(state->fpaths_context_buf);
+    }
+
+    if (state->routes_context_buf != NULL) {
+        kore_buf_free(state->routes_context_buf);
+    }
+    
+    raw_response_cleanup(&state->response);
+}
+
+static tcblcb_CACHE *get_faa_cache()
+{
+    if (_faa_cache == NULL) {
+        _faa_cache = tcblcb_cache_create("airport-faa", FAA_CACHE_MAX_ENTRIES, FAA_CACHE_MAX_BYTES);
+    }
+    return _faa_cache;
+}
+
+// lookups can drop expired entries too, so this is recorded after either
+static void record_faa_cache_size(tcblcb_CACHE *faa_cache)
+{
+    tcblcb_metrics_cache_size(METRICS_CACHE_AIRPORT_FAA, tcblcb_cache_entries(faa_cache), tcblcb_cache_bytes(faa_cache));
+}
+
+void tcblcb_api_fpaths_destroy()
+{
+    if (_faa_cache != NULL) {
+        tcblcb_cache_destroy(_faa_cache);
+        _faa_cache = NULL;
+        tcblcb_metrics_cache_size(METRICS_CACHE_AIRPORT_FAA, 0, 0);
+    }
+}
+
+// look up the FAA code for an airport name, setting the JSON string param on a (stale) hit.
+static tcblcb_CACHE_RESULT get_cached_faa(const char *airport_name, char **faa_json_string)
+{
+    tcblcb_CACHE *faa_cache = get_faa_cache();
+    if (faa_cache == NULL) {
+        return CACHE_MISS;
+    }
+
+    const char *faa = NULL;
+    size_t faa_len = 0;
+    tcblcb_CACHE_RESULT result = tcblcb_cache_get(faa_cache, airport_name, strlen(airport_name), &faa, &faa_len);
+    record_faa_cache_size(faa_cache);
+    if (result == CACHE_HIT || result == CACHE_STALE) {
+        *faa_json_string = create_json_string_param(faa);
+        if (*faa_json_string == NULL) {
+            result = CACHE_MISS;
+        }
+    }
+
+    LogDebug(
+        "Airport FAA cache %s: %s",
+        result == CACHE_HIT ? "hit" : result == CACHE_STALE ? "stale hit" : result == CACHE_NEGATIVE ? "negative" : "miss",
+        airport_name
+    );
+    return result;
+}
+
+// cache the FAA code for an airport name (a NULL code caches that there is no such airport).
+static void put_cached_faa(const char *airport_name, const char *faa)
+{
+    tcblcb_CACHE *faa_cache = get_faa_cache();
+    if (faa_cache == NULL || airport_name == NULL) {
+        return;
+    }
+
+    bool cached = tcblcb_cache_put(
+        faa_cache,
+        airport_name, strlen(airport_name),
+        faa, faa == NULL ? 0 : strlen(faa),
+        FAA_CACHE_SOFT_TTL_MS,
+        faa == NULL ? FAA_CACHE_NEGATIVE_TTL_MS : FAA_CACHE_TTL_MS
+    );
+    record_faa_cache_size(faa_cache);
+    if (!cached) {
+        kore_log(LOG_WARNING, "Failed to cache airport FAA for: %s", airport_name);
+    }
+}
+
 static void fpaths_query_callback(__unused lcb_INSTANCE *instance, __unused int type, const lcb_RESPQUERY *resp)
 {
-    cJSON *row_json = NULL;
+    tcblcb_FlightPathRow path_row = {0};
+
+    tcblcb_ARENA *previous_arena = NULL;
+    bool arena_entered = false;
+
+    tcblcb_REQCTX *ctx = NULL;
+    IfLCBFailGotoDone(
+        lcb_respquery_cookie(resp, (void**)(&ctx)),
+        "Failed to get query response cookie"
+    );
+    IfFalseGotoDone(
+        tcblcb_reqctx_attached(ctx),
+        "Request went away before query response"
+    );
+
+    // whatever the rows decode to belongs to the request
+    previous_arena = tcblcb_arena_enter(ctx->arena);
+    arena_entered = true;
 
     IfLCBFailGotoDone(
         lcb_respquery_status(resp),
@@ -46,43 +258,85 @@ static void fpaths_query_callback(__unused lcb_INSTANCE *instance, __unused int
         "Failed to get query response row"
     );
 
+    tcblcb_FlightPathsState *state = ctx->data;
+    tcblcb_FlightPathResults *flight_path_results = &state->flight_path_results;
+
     if (lcb_respquery_is_final(resp)) {
         LogDebug("Query Metadata:\n%.*s", (int)nrow, row);
+        tcblcb_reqctx_query_meta(ctx, row, nrow);
+
+        // the query succeeded so any name without a result has no airport
+        if (flight_path_results->from_airport == NULL) {
+            put_cached_faa(state->from_loc, NULL);
+        }
+        if (flight_path_results->to_airport == NULL) {
+            put_cached_faa(state->to_loc, NULL);
+        }
     } else {
-        tcblcb_FlightPathResults *flight_path_results = NULL;
-        IfLCBFailGotoDone(
-            lcb_respquery_cookie(resp, (void**)(&flight_path_results)),
-            "Failed to get query response cookie"
-        );
 
         LogDebug("Row Data: %.*s", (int)nrow, row);
 
-        // this will be deleted because we're extracting JSON string copies
-        row_json = cJSON_ParseWithLength(row, nrow);
-        IfNULLGotoDone(row_json, "Failed to parse row result");
-
-        // this helper can iterate arrays or object entries
-        const cJSON *row_object = NULL;
-        cJSON_ArrayForEach(row_object, row_json) {
-            const char *current_key = row_object->string;
-            if (current_key != NULL && cJSON_IsString(row_object)) {
-                if (strcmp(current_key, "fromAirport") == 0) {
-                    flight_path_results->from_airport = create_json_string_param(row_object->valuestring);
-                } else if (strcmp(current_key, "toAirport") == 0) {
-                    flight_path_results->to_airport = create_json_string_param(row_object->valuestring);
-                }
-            } 
+        IfFalseGotoDone(
+            decode_json_object(row, nrow, flight_path_row_fields, json_fields_amount(flight_path_row_fields), &path_row),
+            "Failed to decode row result"
+        );
+
+        if (path_row.from_airport != NULL && flight_path_results->from_airport == NULL) {
+            flight_path_results->from_airport = create_json_string_param(path_row.from_airport);
+            put_cached_faa(state->from_loc, path_row.from_airport);
+        }
+        if (path_row.to_airport != NULL && flight_path_results->to_airport == NULL) {
+            flight_path_results->to_airport = create_json_string_param(path_row.to_airport);
+            put_cached_faa(state->to_loc, path_row.to_airport);
         }
     }
 
 done:
-    if (row_json != NULL) {
-        cJSON_Delete(row_json);
+    // the request (and its arena) can be released once its query is done
+    if (arena_entered) {
+        tcblcb_arena_leave(previous_arena);
+    }
+
+    free_json_fields(flight_path_row_fields, json_fields_amount(flight_path_row_fields), &path_row);
+
+    if (lcb_respquery_is_final(resp)) {
+        tcblcb_reqctx_query_done(ctx, lcb_respquery_status(resp) == LCB_SUCCESS);
+    }
+}
+
+// splice the per-request flight time and price into a raw route row and add it to the response.
+static void add_route_row(tcblcb_FlightPathsState *state, const char *row, size_t nrow)
+{
+    double flight_time = ceil(rand() / (double)RAND_MAX * 8000.0);
+    double flight_price = ceil(flight_time / 8.0 * 100.0) / 100.0;
+
+    char fields[64];
+    int nfields = snprintf(fields, sizeof(fields), "\"flighttime\":%.15g,\"price\":%.15g", flight_time, flight_price);
+
+    if (!raw_response_add_row_fields(&state->response, row, nrow, fields, (size_t)nfields)) {
+        kore_log(LOG_WARNING, "Route row is not a JSON object: %.*s", (int)nrow, row);
     }
 }
 
 static void routes_query_callback(__unused lcb_INSTANCE *instance, __unused int type, const lcb_RESPQUERY *resp)
 {
+    tcblcb_ARENA *previous_arena = NULL;
+    bool arena_entered = false;
+
+    tcblcb_REQCTX *ctx = NULL;
+    IfLCBFailGotoDone(
+        lcb_respquery_cookie(resp, (void**)(&ctx)),
+        "Failed to get query response cookie"
+    );
+    IfFalseGotoDone(
+        tcblcb_reqctx_attached(ctx),
+        "Request went away before query response"
+    );
+
+    // whatever the rows decode to belongs to the request
+    previous_arena = tcblcb_arena_enter(ctx->arena);
+    arena_entered = true;
+
     IfLCBFailGotoDone(
         lcb_respquery_status(resp),
         "Failed to execute query"
@@ -95,63 +349,165 @@ static void routes_query_callback(__unused lcb_INSTANCE *instance, __unused int
         "Failed to get query response row"
     );
 
+    tcblcb_FlightPathsState *state = ctx->data;
+
     if (lcb_respquery_is_final(resp)) {
         LogDebug("Query Metadata:\n%.*s", (int)nrow, row);
+        tcblcb_reqctx_query_meta(ctx, row, nrow);
+
+        // the row set is complete so it can be cached
+        if (_tcblcb_response_cache != NULL && state->routes_cache_key != NULL && state->routes_rows_buf != NULL) {
+            tcblcb_shmcache_put(
+                _tcblcb_response_cache,
+                state->routes_cache_key, strlen(state->routes_cache_key),
+                (const char *)state->routes_rows_buf->data, state->routes_rows_buf->offset,
+                ROUTES_CACHE_SOFT_TTL_MS, ROUTES_CACHE_TTL_MS
+            );
+        }
     } else {
-        cJSON *response_json_data_array;
-        IfLCBFailGotoDone(
-            lcb_respquery_cookie(resp, (void**)(&response_json_data_array)),
-            "Failed to get query response cookie"
-        );
-        IfFalseGotoDone(
-            cJSON_IsArray(response_json_data_array),
-            "Query response cookie is not a JSON array"
-        );
-
         LogDebug("Row Data: %.*s", (int)nrow, row);
 
-        // we will not delete this here because it will be added to the array
-        cJSON *row_json = cJSON_ParseWithLength(row, nrow);
-        IfNULLGotoDone(row_json, "Failed to parse row result");
-        IfFalseGotoDone(
-            cJSON_IsObject(row_json),
-            "Row data is not a JSON object"
-        );
+        // keep the raw row for the cache before it's decorated
+        if (state->routes_rows_buf != NULL) {
+            u_int32_t row_len = (u_int32_t)nrow;
+            kore_buf_append(state->routes_rows_buf, &row_len, sizeof(row_len));
+            kore_buf_append(state->routes_rows_buf, row, nrow);
+        }
 
-        double flight_time = ceil(rand() / (double)RAND_MAX * 8000.0);
-        double flight_price = ceil(flight_time / 8.0 * 100.0) / 100.0;
+        add_route_row(state, row, nrow);
+        if (ctx->req != NULL) {
+            raw_response_flush(&state->response);
+        }
+    }
 
-        cJSON_AddNumberToObject(row_json, "flighttime", flight_time);
-        cJSON_AddNumberToObject(row_json, "price", flight_price);
+done:
+    // the request (and its arena) can be released once its query is done
+    if (arena_entered) {
+        tcblcb_arena_leave(previous_arena);
+    }
 
-        IfFalseGotoDone(
-            cJSON_AddItemToArray(response_json_data_array, row_json),
-            "Failed to add row JSON to response data array"
+    if (lcb_respquery_is_final(resp)) {
+        tcblcb_reqctx_query_done(ctx, lcb_respquery_status(resp) == LCB_SUCCESS);
+    }
+}
+
+// schedule the N1QL query command to get the FAA codes for both airport names (the routes state
+// runs once it completes). the callback caches the codes as they arrive.
+static bool schedule_airports_query(tcblcb_REQCTX *ctx)
+{
+    bool scheduled = false;
+    tcblcb_FlightPathsState *state = ctx->data;
+
+    lcb_CMDQUERY *query_cmd = NULL;
+    u_int64_t started = tcblcb_metrics_now();
+
+    const char *params[2] = {state->from_loc, state->to_loc};
+    state->params_string = create_string_array_param_string(params, 2);
+    IfNULLGotoDone(state->params_string, "Failed to create fpaths query params");
+
+    LogDebug(
+        "Flight Paths Query Request:\n%s\nQuery Params: %s",
+        FPATHS_QUERY_STRING,
+        state->params_string
+    );
+
+    IfLCBFailGotoDone(
+        lcb_cmdquery_create(&query_cmd),
+        "Failed to create query command"
+    );
+    IfLCBFailGotoDone(
+        lcb_cmdquery_statement(query_cmd, FPATHS_QUERY_STRING, FPATHS_QUERY_STRLEN),
+        "Failed to set fpaths query command statement"
+    );
+    IfLCBFailGotoDone(
+        lcb_cmdquery_positional_param(query_cmd, state->params_string, strlen(state->params_string)),
+        "Failed to set query command positional parameters"
+    );
+    IfLCBFailGotoDone(
+        lcb_cmdquery_option(query_cmd, "pretty", strlen("pretty"), "false", strlen("false")),
+        "Failed to set query command pretty option"
+    );
+    IfLCBFailGotoDone(
+        lcb_cmdquery_adhoc(query_cmd, false),
+        "Failed to disable adhoc query (enable prepared statement)"
+    );
+    IfLCBFailGotoDone(
+        lcb_cmdquery_callback(query_cmd, fpaths_query_callback),
+        "Failed to set fpaths query command callback"
+    );
+    IfLCBFailGotoDone(
+        lcb_cmdquery_parent_span(query_cmd, tcblcb_reqctx_span(ctx)),
+        "Failed to set fpaths query command parent span"
+    );
+    DebugQueryPayload(query_cmd);
+    tcblcb_reqctx_phase(ctx, TIMING_PHASE_BUILD, started);
+    IfLCBFailGotoDone(
+        lcb_query(_tcblcb_lcb_instance, ctx, query_cmd),
+        "Failed to schedule fpaths query command"
+    );
+    tcblcb_reqctx_query_scheduled(ctx, METRICS_OP_QUERY, METRICS_STATEMENT_FPATHS_AIRPORTS);
+
+    scheduled = true;
+
+done:
+    if (query_cmd != NULL) {
+        IfLCBFailLogWarningMsg(
+            lcb_cmdquery_destroy(query_cmd),
+            "Failed to destroy fpaths query command statement"
         );
     }
 
+    return scheduled;
+}
+
+// the refresh callbacks (and those of a routes query whose request went away) have already cached
+// what they fetched
+static void fpaths_refresh_done(__unused tcblcb_REQCTX *ctx)
+{
+}
+
+// refresh the FAA code cached for an airport name in the background. the same name is looked up
+// for both ends of the path.
+static void faa_refresh_start(tcblcb_REQCTX *ctx, const char *airport_name)
+{
+    tcblcb_FlightPathsState *state = ctx->data;
+
+    state->from_loc = tcblcb_strdup(airport_name);
+    IfNULLGotoDone(state->from_loc, "Failed to copy airport name");
+    state->to_loc = tcblcb_strdup(airport_name);
+    IfNULLGotoDone(state->to_loc, "Failed to copy airport name");
+
+    LogDebug("Refreshing cached airport FAA: %s", airport_name);
+
+    schedule_airports_query(ctx);
+
 done:
     // no clean up to do in this block
     return;
 }
 
-int tcblcb_api_fpaths(struct http_request *req)
+static void schedule_faa_refresh(const char *airport_name)
 {
-    ProcessCORSAndExitIfPreflight(req);
-    
-    struct kore_buf *context_buf = NULL;
-
-    lcb_CMDQUERY *query_cmd = NULL;
-
-    char *params_string = NULL;
+    tcblcb_background_schedule(
+        faa_refresh_start,
+        fpaths_refresh_done,
+        sizeof(tcblcb_FlightPathsState),
+        fpaths_state_free,
+        airport_name
+    );
+}
 
-    char *from_faa_json_string = NULL;
-    char *to_faa_json_string = NULL;
-    char *leave_weekday_json_string = NULL;
+static int fpaths_state_airports(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_create(req, sizeof(tcblcb_FlightPathsState), fpaths_state_free);
+    if (ctx == NULL) {
+        send_response(req, 500, NULL, 0);
+        return (HTTP_STATE_COMPLETE);
+    }
 
-    cJSON *response_json = NULL;
-    char *response_string = NULL;
-    size_t response_strlen = 0;
+    tcblcb_FlightPathsState *state = ctx->data;
+    state->failed = true;
+    u_int64_t started = tcblcb_metrics_now();
 
     // grab a copy of the path to tokenize the path parameters
     size_t path_strlen = strlen(req->path);
@@ -192,95 +548,81 @@ int tcblcb_api_fpaths(struct http_request *req)
         http_argument_get_string(req, "leave", &leave_date_string),
         "leave query param was not found"
     );
+    int leave_weekday = weekday(leave_date_string);
+    state->leave_weekday_json_string = create_json_number_param(leave_weekday);
 
-    // prepare the N1QL query command to get the flight paths
-    char fpaths_query_string[] =
-        "SELECT faa as fromAirport FROM `travel-sample`.inventory.airport "
-        "WHERE airportname = $1 "
-        "UNION "
-        "SELECT faa as toAirport FROM `travel-sample`.inventory.airport "
-        "WHERE airportname = $2";
-    size_t fpaths_query_strlen = sizeof(fpaths_query_string) - 1;
-
-    char *params[2] = {from_loc_param, to_loc_param};
-    params_string = create_string_array_param_string(params, 2);
-
-    LogDebug(
-        "Flight Paths Query Request:\n%s\nQuery Params: %s",
-        fpaths_query_string,
-        params_string
-    );
+    state->from_loc = tcblcb_strdup(from_loc_param);
+    IfNULLGotoDone(state->from_loc, "Failed to copy 'from loc' parameter");
+    state->to_loc = tcblcb_strdup(to_loc_param);
+    IfNULLGotoDone(state->to_loc, "Failed to copy 'to loc' parameter");
+    tcblcb_reqctx_phase(ctx, TIMING_PHASE_PARSE, started);
 
     // add the query to the response context
-    context_buf = kore_buf_alloc(BUFSIZ);
-    kore_buf_appendf(context_buf, "N1QL query - scoped to inventory: %s", fpaths_query_string);
+    state->fpaths_context_buf = kore_buf_alloc(BUFSIZ);
+    kore_buf_appendf(state->fpaths_context_buf, "N1QL query - scoped to inventory: %s", FPATHS_QUERY_STRING);
 
     size_t context_strlen;
-    char *context_string = kore_buf_stringify(context_buf, &context_strlen);
-
-    // prepare JSON response early so we can accumulate the results
-	response_json = cJSON_CreateObject();
-    cJSON *resp_json_data_array = cJSON_AddArrayToObject(response_json, "data");
-    IfNULLGotoDone(resp_json_data_array, "Failed to create response data array");
-    cJSON *resp_json_context_array = cJSON_AddArrayToObject(response_json, "context");
-    IfNULLGotoDone(resp_json_context_array, "Failed to create response context array");
-    IfFalseGotoDone(
-        cJSON_AddItemToArray(resp_json_context_array, cJSON_CreateStringReference(context_string)),
-        "Failed to add response fpaths context string to array"
-    );
+    char *context_string = kore_buf_stringify(state->fpaths_context_buf, &context_strlen);
 
-    // execute the N1QL query command to get the flight paths and wait for results
-    tcblcb_FlightPathResults flight_path_results = {0};
-    IfLCBFailGotoDone(
-        lcb_cmdquery_create(&query_cmd),
-        "Failed to create query command"
-    );
-    IfLCBFailGotoDone(
-        lcb_cmdquery_statement(query_cmd, fpaths_query_string, fpaths_query_strlen),
-        "Failed to set fpaths query command statement"
-    );
-    IfLCBFailGotoDone(
-        lcb_cmdquery_positional_param(query_cmd, params_string, strlen(params_string)),
-        "Failed to set query command positional parameters"
-    );
-    IfLCBFailGotoDone(
-        lcb_cmdquery_option(query_cmd, "pretty", strlen("pretty"), "false", strlen("false")),
-        "Failed to set query command pretty option"
-    );
-    IfLCBFailGotoDone(
-        lcb_cmdquery_adhoc(query_cmd, false),
-        "Failed to disable adhoc query (enable prepared statement)"
-    );
-    IfLCBFailGotoDone(
-        lcb_cmdquery_callback(query_cmd, fpaths_query_callback),
-        "Failed to set fpaths query command callback"
-    );
-    DebugQueryPayload(query_cmd);
-    IfLCBFailGotoDone(
-        lcb_query(_tcblcb_lcb_instance, &flight_path_results, query_cmd),
-        "Failed to schedule fpaths query command"
-    );
-    IfLCBFailGotoDone(
-        lcb_wait(_tcblcb_lcb_instance, LCB_WAIT_DEFAULT),
-        "Failed while waiting for fpaths query operation to complete"
-    );
+    // prepare the response early so the route rows can be copied straight into it (or streamed
+    // out as they arrive, if the client asked for that)
+    raw_response_init(&state->response);
+    if (stream_requested(req)) {
+        raw_response_stream(&state->response, req);
+    }
 
-    // prepare the N1QL query command to get the routes
-    char routes_query_string[] =
-        "SELECT a.name, s.flight, s.utc, r.sourceairport, r.destinationairport, r.equipment "
-        "FROM `travel-sample`.inventory.route AS r "
-        "UNNEST r.schedule AS s "
-        "JOIN `travel-sample`.inventory.airline AS a ON KEYS r.airlineid "
-        "WHERE r.sourceairport = $fromfaa AND r.destinationairport = $tofaa AND s.day = $dayofweek "
-        "ORDER BY a.name ASC";
-    size_t routes_query_strlen = sizeof(routes_query_string) - 1;
+    // skip the airports query when both names are cached
+    tcblcb_FlightPathResults *flight_path_results = &state->flight_path_results;
+    tcblcb_CACHE_RESULT from_cached = get_cached_faa(from_loc_param, &flight_path_results->from_airport);
+    tcblcb_CACHE_RESULT to_cached = get_cached_faa(to_loc_param, &flight_path_results->to_airport);
+    if (from_cached != CACHE_MISS && to_cached != CACHE_MISS) {
+        kore_buf_appendf(state->fpaths_context_buf, " (cached)");
+        context_string = kore_buf_stringify(state->fpaths_context_buf, &context_strlen);
+        raw_response_add_context(&state->response, context_string);
 
-    from_faa_json_string = flight_path_results.from_airport;
-    IfNULLGotoDone(from_faa_json_string, "Failed to get 'fromfaa' parameter JSON string value");
-    to_faa_json_string = flight_path_results.to_airport;
-    IfNULLGotoDone(to_faa_json_string, "Failed to get 'tofaa' parameter JSON string value");
-    int leave_weekday = weekday(leave_date_string);
-    leave_weekday_json_string = create_json_number_param(leave_weekday);
+        // a name known to have no airport can't have any routes either
+        state->failed = from_cached == CACHE_NEGATIVE || to_cached == CACHE_NEGATIVE;
+
+        if (from_cached == CACHE_STALE) {
+            schedule_faa_refresh(from_loc_param);
+        }
+        if (to_cached == CACHE_STALE) {
+            schedule_faa_refresh(to_loc_param);
+        }
+        goto done;
+    }
+
+    // don't mix a cached result for one name with the query result for the other
+    if (flight_path_results->from_airport != NULL) {
+        tcblcb_free(flight_path_results->from_airport);
+        flight_path_results->from_airport = NULL;
+    }
+    if (flight_path_results->to_airport != NULL) {
+        tcblcb_free(flight_path_results->to_airport);
+        flight_path_results->to_airport = NULL;
+    }
+
+    raw_response_add_context(&state->response, context_string);
+
+    state->failed = !schedule_airports_query(ctx);
+
+done:
+    return tcblcb_reqctx_suspend(ctx, state->failed ? FPATHS_STATE_RESPONSE : FPATHS_STATE_ROUTES);
+}
+
+// schedule the N1QL query command to get the routes (the response state runs once it completes).
+// the raw rows are collected (in the rows buffer) as they arrive so they can be cached.
+static bool schedule_routes_query(tcblcb_REQCTX *ctx)
+{
+    bool scheduled = false;
+    tcblcb_FlightPathsState *state = ctx->data;
+
+    lcb_CMDQUERY *query_cmd = NULL;
+    u_int64_t started = tcblcb_metrics_now();
+
+    char *from_faa_json_string = state->flight_path_results.from_airport;
+    char *to_faa_json_string = state->flight_path_results.to_airport;
+    char *leave_weekday_json_string = state->leave_weekday_json_string;
 
     const char from_param_string[] = "fromfaa";
     const size_t from_param_strlen = sizeof(from_param_string) - 1;
@@ -291,7 +633,7 @@ int tcblcb_api_fpaths(struct http_request *req)
 
     LogDebug(
         "Routes Query Request:\n(%s)\n%s:(%s)  %s:(%s)  %s:(%s)",
-        routes_query_string,
+        ROUTES_QUERY_STRING,
         from_param_string,
         from_faa_json_string,
         to_param_string,
@@ -300,27 +642,12 @@ int tcblcb_api_fpaths(struct http_request *req)
         leave_weekday_json_string
     );
 
-    // add the query to the response context
-    kore_buf_reset(context_buf);
-    kore_buf_appendf(context_buf, "N1QL query - scoped to inventory: %s", routes_query_string);
-
-    context_string = kore_buf_stringify(context_buf, &context_strlen);
-    IfFalseGotoDone(
-        cJSON_AddItemToArray(resp_json_context_array, cJSON_CreateStringReference(context_string)),
-        "Failed to add response routes context string to array"
-    );
-
-    // execute the N1QL query command to get the routes and wait for results
-    IfLCBFailGotoDone(
-        lcb_cmdquery_reset(query_cmd),
-        "Failed to reset query command"
-    );
     IfLCBFailGotoDone(
         lcb_cmdquery_create(&query_cmd),
         "Failed to create routes query command"
     );
     IfLCBFailGotoDone(
-        lcb_cmdquery_statement(query_cmd, routes_query_string, routes_query_strlen),
+        lcb_cmdquery_statement(query_cmd, ROUTES_QUERY_STRING, ROUTES_QUERY_STRLEN),
         "Failed to set routes query command statement"
     );
     IfLCBFailGotoDone(
@@ -365,53 +692,216 @@ int tcblcb_api_fpaths(struct http_request *req)
         lcb_cmdquery_callback(query_cmd, routes_query_callback),
         "Failed to set routes query command callback"
     );
-    DebugQueryPayload(query_cmd);
     IfLCBFailGotoDone(
-        lcb_query(_tcblcb_lcb_instance, resp_json_data_array, query_cmd),
-        "Failed to schedule routes query command"
+        lcb_cmdquery_parent_span(query_cmd, tcblcb_reqctx_span(ctx)),
+        "Failed to set routes query command parent span"
     );
+    DebugQueryPayload(query_cmd);
+    tcblcb_reqctx_phase(ctx, TIMING_PHASE_BUILD, started);
     IfLCBFailGotoDone(
-        lcb_wait(_tcblcb_lcb_instance, LCB_WAIT_DEFAULT),
-        "Failed while waiting for routes query operation to complete"
+        lcb_query(_tcblcb_lcb_instance, ctx, query_cmd),
+        "Failed to schedule routes query command"
     );
+    tcblcb_reqctx_query_scheduled(ctx, METRICS_OP_QUERY, METRICS_STATEMENT_FPATHS_ROUTES);
 
-    // query results are complete so we can get the JSON response 
-    response_string = cJSON_PrintBuffered(response_json, BUFSIZ, FMT_RESPONSE);
-    response_strlen = strlen(response_string);
+    scheduled = true;
 
 done:
-    http_response(req, 200, response_string, response_strlen);
+    if (query_cmd != NULL) {
+        IfLCBFailLogWarningMsg(
+            lcb_cmdquery_destroy(query_cmd),
+            "Failed to destroy routes query command statement"
+        );
+    }
+
+    return scheduled;
+}
 
-    if (params_string != NULL) {
-        free(params_string);
+// copy `len` bytes of a string.
+static char *copy_key_part(const char *start, size_t len)
+{
+    char *part = tcblcb_malloc(len + 1);
+    if (part != NULL) {
+        memcpy(part, start, len);
+        part[len] = '\0';
     }
+    return part;
+}
+
+// refresh the route rows cached for a key in the background. the key holds the query params, and
+// the FAA params are JSON strings of airport codes, which never have a '|' in them.
+static void routes_refresh_start(tcblcb_REQCTX *ctx, const char *cache_key)
+{
+    tcblcb_FlightPathsState *state = ctx->data;
+
+    const char *from_faa = cache_key + ROUTES_CACHE_PREFIX_STRLEN;
+    const char *to_faa = strchr(from_faa, '|');
+    IfNULLGotoDone(to_faa, "Routes cache key has no 'tofaa' parameter");
+    to_faa++;
+    const char *leave_weekday = strchr(to_faa, '|');
+    IfNULLGotoDone(leave_weekday, "Routes cache key has no 'dayofweek' parameter");
+    leave_weekday++;
+
+    state->flight_path_results.from_airport = copy_key_part(from_faa, (size_t)(to_faa - from_faa - 1));
+    IfNULLGotoDone(state->flight_path_results.from_airport, "Failed to copy 'fromfaa' parameter");
+    state->flight_path_results.to_airport = copy_key_part(to_faa, (size_t)(leave_weekday - to_faa - 1));
+    IfNULLGotoDone(state->flight_path_results.to_airport, "Failed to copy 'tofaa' parameter");
+    state->leave_weekday_json_string = tcblcb_strdup(leave_weekday);
+    IfNULLGotoDone(state->leave_weekday_json_string, "Failed to copy 'dayofweek' parameter");
+    state->routes_cache_key = tcblcb_strdup(cache_key);
+    IfNULLGotoDone(state->routes_cache_key, "Failed to copy routes cache key");
+
+    LogDebug("Refreshing cached routes: %s", cache_key);
+
+    // the rows are still added to a response, which is thrown away
+    raw_response_init(&state->response);
+    state->routes_rows_buf = kore_buf_alloc(BUFSIZ);
+    schedule_routes_query(ctx);
+
+done:
+    // no clean up to do in this block
+    return;
+}
 
-    if (from_faa_json_string != NULL) {
-        free(from_faa_json_string);
+// add the routes from the shared cache to the response, if they're there.
+static bool add_cached_routes(tcblcb_FlightPathsState *state)
+{
+    if (_tcblcb_response_cache == NULL) {
+        return false;
     }
 
-    if (to_faa_json_string != NULL) {
-        free(to_faa_json_string);
+    // the shared cache hands back a copy of the rows
+    tcblcb_CACHE_RESULT cached = tcblcb_shmcache_get(_tcblcb_response_cache, state->routes_cache_key, strlen(state->routes_cache_key), state->routes_rows_buf);
+    if (cached == CACHE_MISS) {
+        return false;
     }
-    
-    if (leave_weekday_json_string != NULL) {
-        free(leave_weekday_json_string);
+
+    LogDebug("Routes cache %s: %s", cached == CACHE_STALE ? "stale hit" : "hit", state->routes_cache_key);
+
+    if (cached == CACHE_STALE) {
+        tcblcb_background_schedule(
+            routes_refresh_start,
+            fpaths_refresh_done,
+            sizeof(tcblcb_FlightPathsState),
+            fpaths_state_free,
+            state->routes_cache_key
+        );
     }
 
-    if (response_string != NULL) {
-        free(response_string);
+    const char *cached_rows = (const char *)state->routes_rows_buf->data;
+    size_t cached_rows_len = state->routes_rows_buf->offset;
+
+    kore_buf_appendf(state->routes_context_buf, " (cached)");
+    raw_response_add_context(&state->response, kore_buf_stringify(state->routes_context_buf, NULL));
+
+    // copy each cached row into the response with its own flight time and price
+    size_t offset = 0;
+    while (offset + sizeof(u_int32_t) <= cached_rows_len) {
+        u_int32_t row_len;
+        memcpy(&row_len, cached_rows + offset, sizeof(row_len));
+        offset += sizeof(row_len);
+        if (row_len > cached_rows_len - offset) {
+            kore_log(LOG_WARNING, "Cached routes are truncated for: %s", state->routes_cache_key);
+            break;
+        }
+
+        add_route_row(state, cached_rows + offset, row_len);
+        offset += row_len;
     }
-    
-    if (response_json != NULL) {
-        cJSON_Delete(response_json);
+
+    // the rows are already cached, so they aren't collected again
+    kore_buf_free(state->routes_rows_buf);
+    state->routes_rows_buf = NULL;
+
+    return true;
+}
+
+static int fpaths_state_routes(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    tcblcb_FlightPathsState *state = ctx->data;
+    state->failed = true;
+
+    char *from_faa_json_string = state->flight_path_results.from_airport;
+    IfNULLGotoDone(from_faa_json_string, "Failed to get 'fromfaa' parameter JSON string value");
+    char *to_faa_json_string = state->flight_path_results.to_airport;
+    IfNULLGotoDone(to_faa_json_string, "Failed to get 'tofaa' parameter JSON string value");
+    char *leave_weekday_json_string = state->leave_weekday_json_string;
+    IfNULLGotoDone(leave_weekday_json_string, "Failed to get 'dayofweek' parameter JSON number value");
+
+    // add the query to the response context
+    state->routes_context_buf = kore_buf_alloc(BUFSIZ);
+    kore_buf_appendf(state->routes_context_buf, "N1QL query - scoped to inventory: %s", ROUTES_QUERY_STRING);
+
+    // the FAA params are JSON strings and the weekday a JSON number so this can't be ambiguous
+    size_t routes_cache_key_strlen = ROUTES_CACHE_PREFIX_STRLEN + strlen(from_faa_json_string) + strlen(to_faa_json_string) + strlen(leave_weekday_json_string) + 3;
+    state->routes_cache_key = tcblcb_malloc(routes_cache_key_strlen);
+    IfNULLGotoDone(state->routes_cache_key, "Failed to allocate routes cache key");
+    snprintf(state->routes_cache_key, routes_cache_key_strlen, "%s%s|%s|%s", ROUTES_CACHE_PREFIX_STRING, from_faa_json_string, to_faa_json_string, leave_weekday_json_string);
+
+    state->routes_rows_buf = kore_buf_alloc(BUFSIZ);
+    if (add_cached_routes(state)) {
+        state->failed = false;
+        goto done;
     }
-    
-    if (query_cmd != NULL) {
-        IfLCBFailLogWarningMsg(
-            lcb_cmdquery_destroy(query_cmd),
-            "Failed to destroy fpaths query command statement"
-        );
+
+    // wait for an identical query already in flight instead of running another
+    if (tcblcb_flight_join(ctx, _tcblcb_response_cache, state->routes_cache_key, &state->routes_flight)) {
+        state->failed = false;
+        return tcblcb_reqctx_suspend(ctx, FPATHS_STATE_COALESCED);
+    }
+
+    // the rows are still cached for the waiters if this request goes away before they arrive
+    if (state->routes_flight != NULL) {
+        tcblcb_reqctx_finish_detached(ctx, fpaths_refresh_done);
     }
 
-    return (KORE_RESULT_OK);
+    raw_response_add_context(&state->response, kore_buf_stringify(state->routes_context_buf, NULL));
+    state->failed = !schedule_routes_query(ctx);
+
+done:
+    return tcblcb_reqctx_suspend(ctx, FPATHS_STATE_RESPONSE);
+}
+
+// the routes query this request waited for has landed, which usually left its rows in the cache.
+static int fpaths_state_coalesced(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    tcblcb_FlightPathsState *state = ctx->data;
+
+    if (!add_cached_routes(state)) {
+        // it failed, so query without waiting again
+        raw_response_add_context(&state->response, kore_buf_stringify(state->routes_context_buf, NULL));
+        state->failed = !schedule_routes_query(ctx);
+    }
+
+    return tcblcb_reqctx_suspend(ctx, FPATHS_STATE_RESPONSE);
+}
+
+static int fpaths_state_response(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    tcblcb_FlightPathsState *state = ctx->data;
+
+    // query results are complete so we can close the JSON response
+    raw_response_cache_control(&state->response, FPATHS_CACHE_CONTROL);
+    raw_response_send(&state->response, req, state->failed);
+
+    // the rows are cached (if the query succeeded), so requests waiting on it can use them
+    tcblcb_flight_land(state->routes_flight);
+    state->routes_flight = NULL;
+
+    return (HTTP_STATE_COMPLETE);
+}
+
+static struct http_state fpaths_states[] = {
+    { "FPATHS_STATE_AIRPORTS", fpaths_state_airports },
+    { "FPATHS_STATE_ROUTES",   fpaths_state_routes },
+    { "FPATHS_STATE_COALESCED", fpaths_state_coalesced },
+    { "FPATHS_STATE_RESPONSE", fpaths_state_response },
+};
+
+int tcblcb_api_fpaths(struct http_request *req)
+{
+    return tcblcb_run_states(req, METRICS_ROUTE_FPATHS, fpaths_states, http_state_amount(fpaths_states));
 }
@@ -20,6 +20,7 @@
  * IN THE SOFTWARE.
  */
 
+#include "singleflight.h"
 #include "try-cb-lcb.h"
 #include "util.h"
 
@@ -37,21 +38,138 @@ static const size_t COUNTRY_PATH_STRLEN = sizeof(COUNTRY_PATH_STRING) - 1;
 static const char   DESCRIPTION_PATH_STRING[] = "description";
 static const size_t DESCRIPTION_PATH_STRLEN = sizeof(DESCRIPTION_PATH_STRING) - 1;
 
-// called from a global callback and should not reference any other locals
-static void hotels_subdoc_callback(__unused lcb_INSTANCE *instance, void *cookie, const lcb_RESPSUBDOC *resp)
+#define HOTELS_STATE_SEARCH    0
+#define HOTELS_STATE_COALESCED 1
+#define HOTELS_STATE_RESPONSE  2
+
+// most hits a search returns, which bounds the hotels looked up per request
+#define HOTELS_SEARCH_LIMIT    100
+
+#define HOTELS_CACHE_TTL_MS       (5 * 60 * 1000)
+// cached responses older than this are still served, but refreshed in the background
+#define HOTELS_CACHE_SOFT_TTL_MS  (4 * 60 * 1000)
+
+// clients can reuse a search briefly, then revalidate it (cheaply, with its ETag)
+static const char   HOTELS_CACHE_CONTROL[] = "public, max-age=60";
+
+static const char   HOTELS_CACHE_PREFIX_STRING[] = "hotels|";
+static const size_t HOTELS_CACHE_PREFIX_STRLEN = sizeof(HOTELS_CACHE_PREFIX_STRING) - 1;
+
+// the only part of a search hit we need is the hotel's document id
+typedef struct tcblcb_HotelHit {
+    char *id;
+} tcblcb_HotelHit;
+
+static const tcblcb_JSON_FIELD hotel_hit_fields[] = {
+    JSON_FIELD("id", JSON_FIELD_STRING, tcblcb_HotelHit, id),
+};
+
+typedef struct tcblcb_HotelsState {
+    char *fts_json_payload_string;
+    char *cache_key;
+    tcblcb_FLIGHT *flight;      // set while this request leads the search for its cache key
+    struct kore_buf *context_buf;
+    tcblcb_RawResponse response;
+    char *hotel_ids[HOTELS_SEARCH_LIMIT];   // collected as the search rows arrive, looked up together at the end
+    size_t num_hotel_ids;
+    tcblcb_BATCH *batch;
+    size_t next_hotel;          // the next hotel (in search order) to add to the response
+    bool complete;              // the search finished, so the response can be cached
+    bool lookups_failed;        // a hotel is missing or empty, so the response is not cached
+    bool failed;
+} tcblcb_HotelsState;
+
+static void hotels_state_free(void *data)
 {
-    IfLCBFailGotoDone(
-        lcb_respsubdoc_status(resp),
-        "Subdoc operation failed"
-    );
+    tcblcb_HotelsState *state = data;
+
+    // the request went away before its response. its search and lookups have completed by now
+    // (and cached the response, if they could), so wake anything waiting on it
+    tcblcb_flight_land(state->flight);
+
+    if (state->fts_json_payload_string != NULL) {
+        tcblcb_free(state->fts_json_payload_string);
+    }
+
+    if (state->cache_key != NULL) {
+        tcblcb_free(state->cache_key);
+    }
+
+    if (state->context_buf != NULL) {
+        kore_buf_free(state->context_buf);
+    }
+
+    for (size_t i=0; i < state->num_hotel_ids; i++) {
+        tcblcb_free(state->hotel_ids[i]);
+    }
+
+    if (state->batch != NULL) {
+        tcblcb_batch_free(state->batch);
+    }
+
+    raw_response_cleanup(&state->response);
+}
+
+// add the hotels that have arrived to the response in search order, stopping at the first one
+// still pending. once the batch is complete, `skip_missing` passes over any lookup that failed.
+static void add_hotel_rows(tcblcb_HotelsState *state, bool skip_missing)
+{
+    tcblcb_BATCH *batch = state->batch;
+
+    for (; state->next_hotel < batch->nitems; state->next_hotel++) {
+        char *hotel_json = batch->results[state->next_hotel];
+        if (hotel_json == NULL) {
+            if (!skip_missing) {
+                break;
+            }
+            continue;
+        }
+
+        // hotels are written as raw JSON rows when they arrive
+        raw_response_add_row(&state->response, hotel_json, strlen(hotel_json));
+
+        tcblcb_free(hotel_json);
+        batch->results[state->next_hotel] = NULL;
+    }
+}
+
 
+// write a hotel row for the response. it's copied out of the writer so it can wait in the batch
+// results until the hotels before it have arrived.
+static char *create_hotel_json(const char *name, const char *description, const char *address)
+{
+    tcblcb_JSONWriter writer;
+    json_writer_init(&writer, false);
+    json_writer_begin_object(&writer);
+    if (name != NULL) {
+        json_writer_key(&writer, "name");
+        json_writer_string(&writer, name);
+    }
+    if (description != NULL) {
+        json_writer_key(&writer, "description");
+        json_writer_string(&writer, description);
+    }
+    if (address != NULL) {
+        json_writer_key(&writer, "address");
+        json_writer_string(&writer, address);
+    }
+    json_writer_end_object(&writer);
+
+    char *hotel_string = json_writer_finish(&writer, NULL);
+    return hotel_string != NULL ? tcblcb_strdup(hotel_string) : NULL;
+}
+
+// called from a global callback and should not reference any other locals
+static void hotels_subdoc_callback(__unused lcb_INSTANCE *instance, tcblcb_BATCH *batch, size_t index, const lcb_RESPSUBDOC *resp)
+{
     char *result_values[NUM_SUBDOC_PATHS] = {NULL};
     struct kore_buf *address_buf = NULL;
+    char *address_string = NULL;
+    bool found = false;
 
-    cJSON *hotel_json = (cJSON *)cookie;
-    IfNULLGotoDone(
-        hotel_json,
-        "Hotel JSON cookie was NULL"
+    IfLCBFailGotoDone(
+        lcb_respsubdoc_status(resp),
+        "Subdoc operation failed"
     );
 
     // populate: name, description, address
@@ -61,74 +179,57 @@ static void hotels_subdoc_callback(__unused lcb_INSTANCE *instance, void *cookie
             LogDebug("Hotels subdoc [%zu] value: %s", i, result_values[i]);
         }
 
-        IfNULLGotoDone(
-            cJSON_AddStringToObject(hotel_json, "name", result_values[0]),
-            "Failed to add `name` to hotel JSON document"
-        );
-        IfNULLGotoDone(
-            cJSON_AddStringToObject(hotel_json, "description", result_values[5]),
-            "Failed to add `description` to hotel JSON document"
-        );
-
         address_buf = kore_buf_alloc(512);
-        if (result_values[1] != NULL && *result_values[1] != '\0') {
-            kore_buf_appendf(address_buf, "%s", result_values[1]);
-        }
-        if (result_values[2] != NULL && *result_values[2] != '\0') {
-            if (address_buf->offset > 0) {
-                kore_buf_appendf(address_buf, ", ");
-            }
-            kore_buf_appendf(address_buf, "%s", result_values[2]);
-        }
-        if (result_values[3] != NULL && *result_values[3] != '\0') {
-            if (address_buf->offset > 0) {
-                kore_buf_appendf(address_buf, ", ");
-            }
-            kore_buf_appendf(address_buf, "%s", result_values[3]);
-        }
-        if (result_values[4] != NULL && *result_values[4] != '\0') {
-            if (address_buf->offset > 0) {
-                kore_buf_appendf(address_buf, ", ");
+        for (size_t i=1; i <= 4; i++) {
+            if (result_values[i] != NULL && *result_values[i] != '\0') {
+                if (address_buf->offset > 0) {
+                    kore_buf_append(address_buf, ", ", 2);
+                }
+                kore_buf_append(address_buf, result_values[i], strlen(result_values[i]));
             }
-            kore_buf_appendf(address_buf, "%s", result_values[4]);
         }
 
-        size_t address_strlen;
-        char *address_string = kore_buf_stringify(address_buf, &address_strlen);
-
-        IfNULLGotoDone(
-            cJSON_AddStringToObject(hotel_json, "address", address_string),
-            "Failed to add `address` to hotel JSON document"
-        );
-
+        address_string = kore_buf_stringify(address_buf, NULL);
+        found = true;
     } else {
         LogDebug("%s", "Hotels subdoc result was EMPTY");
     }
 
 done:
+    // the hotel keeps its place in the results even if the lookup fails
+    batch->results[index] = create_hotel_json(result_values[0], result_values[5], address_string);
+    if (batch->results[index] == NULL) {
+        kore_log(LOG_WARNING, "Failed to create hotel JSON row");
+    }
+
+    tcblcb_HotelsState *state = batch->cookie;
+    if (!found || batch->results[index] == NULL) {
+        state->lookups_failed = true;
+    }
+
     for (size_t i=0; i < NUM_SUBDOC_PATHS; i++) {
         if (result_values[i] != NULL) {
-            free(result_values[i]);
+            tcblcb_free(result_values[i]);
         }
     }
 
     if (address_buf != NULL) {
 	    kore_buf_free(address_buf);
     }
+
+    // streamed responses get each hotel as soon as those before it have arrived
+    add_hotel_rows(state, false);
+    if (batch->ctx->req != NULL) {
+        raw_response_flush(&state->response);
+    }
 }
 
-static cJSON *get_hotel_json(lcb_INSTANCE *instance, const char *hotel_id)
+// queues the subdoc lookup for a hotel, with the hotel JSON stored at `index` once it completes.
+static lcb_STATUS queue_hotel_lookup(tcblcb_BATCH *batch, size_t index, const char *hotel_id)
 {
+    lcb_STATUS rc = LCB_ERR_GENERIC;
     lcb_CMDSUBDOC *cmd = NULL;
     lcb_SUBDOCSPECS *ops = NULL;
-    tcblcb_RESPDELEGATE *subdoc_delegate = NULL;
-    bool cmd_scheduled = false;
-
-    cJSON *hotel_json = cJSON_CreateObject();
-    IfNULLGotoDone(
-        hotel_json,
-        "Failed to create hotel JSON object"
-    );
 
     IfLCBFailGotoDone(
         lcb_cmdsubdoc_create(&cmd),
@@ -138,6 +239,10 @@ static cJSON *get_hotel_json(lcb_INSTANCE *instance, const char *hotel_id)
         lcb_cmdsubdoc_key(cmd, hotel_id, strlen(hotel_id)),
         "Failed to set subdoc key"
     );
+    IfLCBFailGotoDone(
+        lcb_cmdsubdoc_parent_span(cmd, tcblcb_reqctx_span(batch->ctx)),
+        "Failed to set subdoc parent span"
+    );
 
     IfLCBFailGotoDone(
         lcb_subdocspecs_create(&ops, NUM_SUBDOC_PATHS),
@@ -175,17 +280,11 @@ static cJSON *get_hotel_json(lcb_INSTANCE *instance, const char *hotel_id)
 
     LogDebug("Get JSON via subdoc for hotel: %s", hotel_id);
 
-    // receiver is responsible for freeing this memory if command is scheduled
-    subdoc_delegate = malloc(sizeof(tcblcb_RESPDELEGATE));
-    subdoc_delegate->cookie = (void**)hotel_json;
-    subdoc_delegate->callback = (tcblcb_RESPDELEGATE_CALLBACK)hotels_subdoc_callback;
     IfLCBFailGotoDone(
-        lcb_subdoc(instance, subdoc_delegate, cmd),
-        "Failed to schedule subdoc command"
+        (rc = tcblcb_batch_subdoc(batch, index, cmd)),
+        "Failed to queue subdoc command"
     )
 
-    cmd_scheduled = true;
-
 done:
     if (ops != NULL) {
         IfLCBFailLogWarningMsg(
@@ -201,24 +300,76 @@ done:
         );
     }
 
-    if (cmd_scheduled) {
-        IfLCBFailLogWarningMsg(
-            lcb_wait(instance, LCB_WAIT_DEFAULT),
-            "Failed to complete subdoc command"
-        );
-    } else {
-        // free memory if command was not scheduled
-        if (subdoc_delegate != NULL) {
-            free(subdoc_delegate);
+    return rc;
+}
+
+// looks up every hotel from the search results in a single batch.
+static void schedule_hotel_lookups(lcb_INSTANCE *instance, tcblcb_REQCTX *ctx)
+{
+    tcblcb_HotelsState *state = ctx->data;
+
+    size_t num_hotels = state->num_hotel_ids;
+    if (num_hotels == 0) {
+        return;
+    }
+
+    // any hotel that isn't looked up is missing from the response, which keeps it out of the cache
+    state->lookups_failed = true;
+    state->batch = tcblcb_batch_create(
+        instance,
+        ctx,
+        num_hotels,
+        (tcblcb_BATCH_CALLBACK)hotels_subdoc_callback,
+        state,
+        tcblcb_free
+    );
+    IfNULLGotoDone(
+        state->batch,
+        "Failed to create hotel lookup batch"
+    );
+    state->lookups_failed = false;
+
+    tcblcb_batch_begin(state->batch);
+
+    for (size_t index=0; index < num_hotels; index++) {
+        lcb_STATUS rc = queue_hotel_lookup(state->batch, index, state->hotel_ids[index]);
+        if (rc != LCB_SUCCESS) {
+            state->lookups_failed = true;
         }
+        IfLCBFailLogWarningMsgRef(
+            rc,
+            "Failed to queue hotel lookup",
+            state->hotel_ids[index]
+        );
     }
 
-    return hotel_json;
+    tcblcb_batch_end(state->batch);
+
+done:
+    // no clean up to do in this block
+    return;
 }
 
 static void hotels_search_callback(__unused lcb_INSTANCE *instance, __unused int type, const lcb_RESPSEARCH *resp)
 {
-    cJSON *row_json = NULL;
+    tcblcb_HotelHit hit = {0};
+
+    tcblcb_ARENA *previous_arena = NULL;
+    bool arena_entered = false;
+
+    tcblcb_REQCTX *ctx = NULL;
+    IfLCBFailGotoDone(
+        lcb_respsearch_cookie(resp, (void**)(&ctx)),
+        "Failed to get search response cookie"
+    );
+    IfFalseGotoDone(
+        tcblcb_reqctx_attached(ctx),
+        "Request went away before search response"
+    );
+
+    // whatever the rows decode to belongs to the request
+    previous_arena = tcblcb_arena_enter(ctx->arena);
+    arena_entered = true;
 
     IfLCBFailGotoDone(
         lcb_respsearch_status(resp),
@@ -232,88 +383,165 @@ static void hotels_search_callback(__unused lcb_INSTANCE *instance, __unused int
         "Failed to get search response row"
     );
 
+    tcblcb_HotelsState *state = ctx->data;
+
     if (lcb_respsearch_is_final(resp)) {
         LogDebug("Query Metadata:\n%.*s", (int)nrow, row);
-    } else {
-        cJSON *response_json_data_array = NULL;
-        IfLCBFailGotoDone(
-            lcb_respsearch_cookie(resp, (void**)(&response_json_data_array)),
-            "Failed to get search response cookie"
-        );
-        IfFalseGotoDone(
-            cJSON_IsArray(response_json_data_array),
-            "Search response cookie is not a JSON array"
-        );
+        tcblcb_reqctx_query_meta(ctx, row, nrow);
 
+        state->complete = true;
+
+        // the lookups are counted against the request before the search completes so the
+        // request is only woken once every hotel has arrived
+        schedule_hotel_lookups(instance, ctx);
+    } else {
         LogDebug("Row Data: %.*s", (int)nrow, row);
 
-        row_json = cJSON_ParseWithLength(row, nrow);
-        IfNULLGotoDone(row_json, "Failed to parse row result");
         IfFalseGotoDone(
-            cJSON_IsObject(row_json),
+            decode_json_object(row, nrow, hotel_hit_fields, json_fields_amount(hotel_hit_fields), &hit),
             "Row data is not a JSON object"
         );
 
-        char *hotel_id = cJSON_GetStringValue(cJSON_GetObjectItem(row_json, "id"));
-        IfNULLGotoDone(row_json, "Failed to get hotel id from row data");
+        IfNULLGotoDone(hit.id, "Failed to get hotel id from row data");
         IfFalseGotoDone(
-            cJSON_AddItemToArray(
-                response_json_data_array,
-                get_hotel_json(instance, hotel_id)
-            ),
-            "Failed to add row JSON to response data array"
+            state->num_hotel_ids < HOTELS_SEARCH_LIMIT,
+            "Search returned more hits than its limit"
         );
+
+        // the id is handed over to the lookup list
+        state->hotel_ids[state->num_hotel_ids++] = hit.id;
+        hit.id = NULL;
     }
 
 done:
-    if (row_json != NULL) {
-        cJSON_Delete(row_json);
+    // the request (and its arena) can be released once its search is done
+    if (arena_entered) {
+        tcblcb_arena_leave(previous_arena);
+    }
+
+    free_json_fields(hotel_hit_fields, json_fields_amount(hotel_hit_fields), &hit);
+
+    if (lcb_respsearch_is_final(resp)) {
+        tcblcb_reqctx_query_done(ctx, lcb_respsearch_status(resp) == LCB_SUCCESS);
     }
 }
 
-static cJSON *create_match_phrase_json(const char *match_phrase_ref, const char *field_ref)
+static void write_match_phrase(tcblcb_JSONWriter *writer, const char *match_phrase, const char *field)
 {
-    bool valid = false;
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "match_phrase");
+    json_writer_string(writer, match_phrase);
+    json_writer_key(writer, "field");
+    json_writer_string(writer, field);
+    json_writer_end_object(writer);
+}
 
-    cJSON *fts_json_match_phrase = cJSON_CreateObject();
-    cJSON *fts_json_mp_value_ref = cJSON_CreateStringReference(match_phrase_ref);
-    IfFalseGotoDone(
-        cJSON_AddItemToObject(
-            fts_json_match_phrase,
-            "match_phrase",
-            fts_json_mp_value_ref
-        ),
-        "Failed to add match phrase value to object"
+// schedule the Couchbase hotel search command (the response state runs once it and the
+// per-hotel lookups it schedules have completed)
+static bool schedule_hotel_search(tcblcb_REQCTX *ctx)
+{
+    bool scheduled = false;
+    tcblcb_HotelsState *state = ctx->data;
+
+    lcb_CMDSEARCH *cmd;
+    IfLCBFailGotoDone(
+        lcb_cmdsearch_create(&cmd),
+        "Failed to create search command"
     );
-    cJSON *fts_json_mp_field_ref = cJSON_CreateStringReference(field_ref);
-    IfFalseGotoDone(
-        cJSON_AddItemToObject(
-            fts_json_match_phrase,
-            "field",
-            fts_json_mp_field_ref
-        ),
-        "Failed to add field value to object"
+    IfLCBFailGotoDone(
+        lcb_cmdsearch_callback(cmd, hotels_search_callback),
+        "Failed to set search command callback"
+    );
+    IfLCBFailGotoDone(
+        lcb_cmdsearch_payload(cmd, state->fts_json_payload_string, strlen(state->fts_json_payload_string)),
+        "Failed to set search payload"
+    );
+    IfLCBFailGotoDone(
+        lcb_cmdsearch_parent_span(cmd, tcblcb_reqctx_span(ctx)),
+        "Failed to set search parent span"
+    );
+    IfLCBFailGotoDone(
+        lcb_search(_tcblcb_lcb_instance, ctx, cmd),
+        "Failed to schedule search command"
+    );
+    tcblcb_reqctx_query_scheduled(ctx, METRICS_OP_SEARCH, METRICS_STATEMENT_HOTELS_SEARCH);
+    IfLCBFailLogWarningMsg(
+        lcb_cmdsearch_destroy(cmd),
+        "Failed to destroy search command statement"
     );
 
-    valid = true;
+    scheduled = true;
 
 done:
-    return valid ? fts_json_match_phrase : NULL;
+    return scheduled;
 }
 
-int tcblcb_api_hotels(struct http_request *req)
+// prepare the response early so hotels can be added (or streamed out) as they arrive.
+static void hotels_response_init(tcblcb_HotelsState *state)
 {
-    ProcessCORSAndExitIfPreflight(req);
-    
-    cJSON *fts_json_payload = NULL;
-    char *fts_json_payload_string = NULL;
-    size_t fts_json_payload_strlen = 0;
+    state->context_buf = kore_buf_alloc(BUFSIZ);
+    kore_buf_appendf(state->context_buf, "FTS search - scoped to: %s", state->fts_json_payload_string);
+
+    size_t context_strlen;
+    char *context_string = kore_buf_stringify(state->context_buf, &context_strlen);
+
+    LogDebug("Search Payload: (%s)", state->fts_json_payload_string);
+
+    raw_response_init(&state->response);
+    raw_response_add_context(&state->response, context_string);
+}
+
+// refresh a stale cached response in the background. the cache key holds the search payload.
+static void hotels_refresh_start(tcblcb_REQCTX *ctx, const char *cache_key)
+{
+    tcblcb_HotelsState *state = ctx->data;
+    state->failed = true;
+
+    state->cache_key = tcblcb_strdup(cache_key);
+    IfNULLGotoDone(state->cache_key, "Failed to copy hotels cache key");
+    state->fts_json_payload_string = tcblcb_strdup(cache_key + HOTELS_CACHE_PREFIX_STRLEN);
+    IfNULLGotoDone(state->fts_json_payload_string, "Failed to copy FTS payload");
+
+    LogDebug("Refreshing cached response: %s", cache_key);
+
+    hotels_response_init(state);
+    state->failed = !schedule_hotel_search(ctx);
+
+done:
+    // no clean up to do in this block
+    return;
+}
+
+// cache the response of a background refresh, or of a search whose request went away.
+static void hotels_refresh_done(tcblcb_REQCTX *ctx)
+{
+    tcblcb_HotelsState *state = ctx->data;
+
+    if (state->failed || !state->complete || state->lookups_failed) {
+        return;
+    }
+
+    if (state->batch != NULL) {
+        add_hotel_rows(state, true);
+    }
+
+    raw_response_cache(&state->response, _tcblcb_response_cache, state->cache_key, HOTELS_CACHE_SOFT_TTL_MS, HOTELS_CACHE_TTL_MS);
+    raw_response_store(&state->response);
+}
 
-    struct kore_buf *context_buf = NULL;
+static int hotels_state_search(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_create(req, sizeof(tcblcb_HotelsState), hotels_state_free);
+    if (ctx == NULL) {
+        send_response(req, 500, NULL, 0);
+        return (HTTP_STATE_COMPLETE);
+    }
 
-    cJSON *response_json = NULL;
-    char *response_string = NULL;
-    size_t response_strlen = 0;
+    tcblcb_HotelsState *state = ctx->data;
+    state->failed = true;
+    u_int64_t started = tcblcb_metrics_now();
+
+    size_t fts_json_payload_strlen = 0;
 
     // grab a copy of the path to tokenize the path parameters
     size_t path_strlen = strlen(req->path);
@@ -344,178 +572,163 @@ int tcblcb_api_hotels(struct http_request *req)
     );
     char *location_string_ref = path_segments[3];
 
+    http_populate_qs(req);
+    tcblcb_reqctx_phase(ctx, TIMING_PHASE_PARSE, started);
+
+    // don't include a location or description search if nothing was provided
+    bool search_location = location_string_ref[0] != '\0' && strcmp(location_string_ref, "*") != 0;
+    bool search_description = description_string_ref[0] != '\0' && strcmp(description_string_ref, "*") != 0;
+
     // create the Full Text Search payload
-	fts_json_payload = cJSON_CreateObject();
-    IfNULLGotoDone(
-        cJSON_AddStringToObject(fts_json_payload, "indexName", "hotels-index"),
-        "Failed to add limit number to FTS payload"
-    );
-    IfFalseGotoDone(
-        cJSON_AddNumberToObject(fts_json_payload, "limit", 100),
-        "Failed to add limit number to FTS payload"
-    );
-    cJSON *fts_json_query = cJSON_AddObjectToObject(fts_json_payload, "query");
-    IfNULLGotoDone(fts_json_query, "Failed to create query object");
-    cJSON *fts_json_conjuncts = cJSON_AddArrayToObject(fts_json_query, "conjuncts");
-    IfNULLGotoDone(fts_json_conjuncts, "Failed to create main conjuncts object");
-
-    // don't include a location search if nothing was provided
-    if (location_string_ref[0] != '\0' && strcmp(location_string_ref, "*") != 0) {
-        cJSON *fts_json_loc_disjuncts = cJSON_CreateObject();
-        IfNULLGotoDone(fts_json_loc_disjuncts, "Failed to create location disjuncts object");
-        IfFalseGotoDone(
-            cJSON_AddItemToArray(fts_json_conjuncts, fts_json_loc_disjuncts),
-            "Failed to add location disjuncts to conjuncts array"
-        );
-        cJSON *fts_json_loc_disjuncts_array = cJSON_AddArrayToObject(fts_json_loc_disjuncts, "disjuncts");
-        IfNULLGotoDone(fts_json_loc_disjuncts_array, "Failed to create location disjuncts array");
-        IfFalseGotoDone(
-            cJSON_AddItemToArray(
-                fts_json_loc_disjuncts_array,
-                create_match_phrase_json(location_string_ref, "country")
-            ),
-            "Failed to add location country match phrase"
-        );
-        IfFalseGotoDone(
-            cJSON_AddItemToArray(
-                fts_json_loc_disjuncts_array,
-                create_match_phrase_json(location_string_ref, "city")
-            ),
-            "Failed to add location city match phrase"
-        );
-        IfFalseGotoDone(
-            cJSON_AddItemToArray(
-                fts_json_loc_disjuncts_array,
-                create_match_phrase_json(location_string_ref, "state")
-            ),
-            "Failed to add location state match phrase"
-        );
-        IfFalseGotoDone(
-            cJSON_AddItemToArray(
-                fts_json_loc_disjuncts_array,
-                create_match_phrase_json(location_string_ref, "address")
-            ),
-            "Failed to add location address match phrase"
-        );
+    started = tcblcb_metrics_now();
+    tcblcb_JSONWriter writer;
+    json_writer_init(&writer, false);
+    json_writer_begin_object(&writer);
+    json_writer_key(&writer, "indexName");
+    json_writer_string(&writer, "hotels-index");
+    json_writer_key(&writer, "limit");
+    json_writer_number(&writer, HOTELS_SEARCH_LIMIT);
+    json_writer_key(&writer, "query");
+    json_writer_begin_object(&writer);
+    json_writer_key(&writer, "conjuncts");
+    json_writer_begin_array(&writer);
+
+    if (search_location) {
+        json_writer_begin_object(&writer);
+        json_writer_key(&writer, "disjuncts");
+        json_writer_begin_array(&writer);
+        write_match_phrase(&writer, location_string_ref, "country");
+        write_match_phrase(&writer, location_string_ref, "city");
+        write_match_phrase(&writer, location_string_ref, "state");
+        write_match_phrase(&writer, location_string_ref, "address");
+        json_writer_end_array(&writer);
+        json_writer_end_object(&writer);
     }
 
-    // don't include a description search if nothing was provided
-    if (description_string_ref[0] != '\0' && strcmp(description_string_ref, "*") != 0) {
-        cJSON *fts_json_desc_disjuncts = cJSON_CreateObject();
-        IfNULLGotoDone(fts_json_desc_disjuncts, "Failed to create description disjuncts object");
-        IfFalseGotoDone(
-            cJSON_AddItemToArray(fts_json_conjuncts, fts_json_desc_disjuncts),
-            "Failed to add description disjuncts to conjuncts array"
-        );
-        cJSON *fts_json_desc_disjuncts_array = cJSON_AddArrayToObject(fts_json_desc_disjuncts, "disjuncts");
-        IfNULLGotoDone(fts_json_desc_disjuncts_array, "Failed to create description disjuncts object");
-        IfFalseGotoDone(
-            cJSON_AddItemToArray(
-                fts_json_desc_disjuncts_array,
-                create_match_phrase_json(description_string_ref, "description")
-            ),
-            "Failed to add description string match phrase"
-        );
-        IfFalseGotoDone(
-            cJSON_AddItemToArray(
-                fts_json_desc_disjuncts_array,
-                create_match_phrase_json(description_string_ref, "name")
-            ),
-            "Failed to add description name match phrase"
-        );
+    if (search_description) {
+        json_writer_begin_object(&writer);
+        json_writer_key(&writer, "disjuncts");
+        json_writer_begin_array(&writer);
+        write_match_phrase(&writer, description_string_ref, "description");
+        write_match_phrase(&writer, description_string_ref, "name");
+        json_writer_end_array(&writer);
+        json_writer_end_object(&writer);
     }
 
     // if we don't have any search terms - then revert to a "match all" search
-    if (cJSON_GetArraySize(fts_json_conjuncts) == 0) {
-        cJSON *fts_json_match_all = cJSON_CreateObject();
-        IfNULLGotoDone(
-            fts_json_match_all,
-            "Failed to create match_all query object"
-        );
-        IfNULLGotoDone(
-            cJSON_AddObjectToObject(
-                fts_json_match_all,
-                "match_all"
-            ),
-            "Failed to add match_all query to conjuncts array"
-        );
-        IfFalseGotoDone(
-            cJSON_AddItemToArray(fts_json_conjuncts, fts_json_match_all),
-            "Failed to add match_all obejct to conjuncts array"
-        );
+    if (!search_location && !search_description) {
+        json_writer_begin_object(&writer);
+        json_writer_key(&writer, "match_all");
+        json_writer_begin_object(&writer);
+        json_writer_end_object(&writer);
+        json_writer_end_object(&writer);
     }
 
-    fts_json_payload_string = cJSON_PrintBuffered(fts_json_payload, BUFSIZ, false);
-    fts_json_payload_strlen = strlen(fts_json_payload_string);
-
-    context_buf = kore_buf_alloc(BUFSIZ);
-    kore_buf_appendf(context_buf, "FTS search - scoped to: %s", fts_json_payload_string);
-
-    size_t context_strlen;
-    char *context_string = kore_buf_stringify(context_buf, &context_strlen);
+    json_writer_end_array(&writer);
+    json_writer_end_object(&writer);
+    json_writer_end_object(&writer);
+
+    char *fts_json_payload_string = json_writer_finish(&writer, &fts_json_payload_strlen);
+    IfNULLGotoDone(fts_json_payload_string, "Failed to write FTS payload");
+
+    // keep a copy with the request since the writer buffer is shared
+    state->fts_json_payload_string = tcblcb_strdup(fts_json_payload_string);
+    IfNULLGotoDone(state->fts_json_payload_string, "Failed to copy FTS payload");
+    fts_json_payload_string = state->fts_json_payload_string;
+    tcblcb_reqctx_phase(ctx, TIMING_PHASE_BUILD, started);
+
+    // the payload holds every search param (normalized), so it keys the cached response
+    size_t cache_key_strlen = HOTELS_CACHE_PREFIX_STRLEN + fts_json_payload_strlen + 1;
+    state->cache_key = tcblcb_malloc(cache_key_strlen);
+    if (state->cache_key != NULL) {
+        snprintf(state->cache_key, cache_key_strlen, "%s%s", HOTELS_CACHE_PREFIX_STRING, fts_json_payload_string);
+
+        tcblcb_CACHE_RESULT cached = send_cached_response(req, _tcblcb_response_cache, state->cache_key, HOTELS_CACHE_CONTROL);
+        if (cached == CACHE_STALE) {
+            tcblcb_background_schedule(
+                hotels_refresh_start,
+                hotels_refresh_done,
+                sizeof(tcblcb_HotelsState),
+                hotels_state_free,
+                state->cache_key
+            );
+        }
+        if (cached != CACHE_MISS) {
+            return (HTTP_STATE_COMPLETE);
+        }
+    }
 
-    LogDebug("Search Payload: (%s)", fts_json_payload_string);
+    hotels_response_init(state);
+    if (stream_requested(req)) {
+        raw_response_stream(&state->response, req);
+    }
 
-    // prepare JSON response early so we can accumulate query results
-	response_json = cJSON_CreateObject();
-    cJSON *resp_json_data_array = cJSON_AddArrayToObject(response_json, "data");
-    IfNULLGotoDone(resp_json_data_array, "Failed to create response data array");
-    cJSON *resp_json_context_array = cJSON_AddArrayToObject(response_json, "context");
-    IfNULLGotoDone(resp_json_context_array, "Failed to create response context array");
-    IfFalseGotoDone(
-        cJSON_AddItemToArray(resp_json_context_array, cJSON_CreateStringReference(context_string)),
-        "Failed to add response context string to array"
-    );
+    // wait for an identical search already in flight instead of running another
+    if (state->cache_key != NULL
+        && tcblcb_flight_join(ctx, _tcblcb_response_cache, state->cache_key, &state->flight)) {
+        state->failed = false;
+        return tcblcb_reqctx_suspend(ctx, HOTELS_STATE_COALESCED);
+    }
 
-    // execute the Couchbase hotel search command and wait for results
-    lcb_CMDSEARCH *cmd;
-    IfLCBFailGotoDone(
-        lcb_cmdsearch_create(&cmd),
-        "Failed to create search command"
-    );
-    IfLCBFailGotoDone(
-        lcb_cmdsearch_callback(cmd, hotels_search_callback),
-        "Failed to set search command callback"
-    );
-    IfLCBFailGotoDone(
-        lcb_cmdsearch_payload(cmd, fts_json_payload_string, fts_json_payload_strlen),
-        "Failed to set search payload"
-    );
-    IfLCBFailGotoDone(
-        lcb_search(_tcblcb_lcb_instance, resp_json_data_array, cmd),
-        "Failed to schedule search command"
-    );
-    IfLCBFailLogWarningMsg(
-        lcb_cmdsearch_destroy(cmd),
-        "Failed to destroy search command statement"
-    );
-    IfLCBFailGotoDone(
-        lcb_wait(_tcblcb_lcb_instance, LCB_WAIT_DEFAULT),
-        "Failed while waiting for search operation to complete"
-    );
+    // the response is still cached for the waiters if this request goes away before it's complete
+    if (state->flight != NULL) {
+        tcblcb_reqctx_finish_detached(ctx, hotels_refresh_done);
+    }
 
-    // query results are complete so we can get the JSON response 
-    response_string = cJSON_PrintBuffered(response_json, BUFSIZ, FMT_RESPONSE);
-    response_strlen = strlen(response_string);
+    state->failed = !schedule_hotel_search(ctx);
 
 done:
-    http_response(req, 200, response_string, response_strlen);
+    return tcblcb_reqctx_suspend(ctx, HOTELS_STATE_RESPONSE);
+}
 
-    if (fts_json_payload_string != NULL) {
-        free(fts_json_payload_string);
-    }
+// the search this request waited for has landed, which usually left its response in the cache.
+static int hotels_state_coalesced(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    tcblcb_HotelsState *state = ctx->data;
 
-    if (fts_json_payload != NULL) {
-        cJSON_Delete(fts_json_payload);
+    if (send_cached_response(req, _tcblcb_response_cache, state->cache_key, HOTELS_CACHE_CONTROL) != CACHE_MISS) {
+        return (HTTP_STATE_COMPLETE);
     }
 
-    if (response_string != NULL) {
-        free(response_string);
+    // it failed or wasn't cacheable, so search without waiting again
+    state->failed = !schedule_hotel_search(ctx);
+
+    return tcblcb_reqctx_suspend(ctx, HOTELS_STATE_RESPONSE);
+}
+
+static int hotels_state_response(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    tcblcb_HotelsState *state = ctx->data;
+
+    // search results are complete so we can close the JSON response
+    if (!state->failed && state->batch != NULL) {
+        add_hotel_rows(state, true);
     }
 
-    if (response_json != NULL) {
-        cJSON_Delete(response_json);
+    // only complete results are shared with the other workers
+    if (state->complete && !state->lookups_failed) {
+        raw_response_cache(&state->response, _tcblcb_response_cache, state->cache_key, HOTELS_CACHE_SOFT_TTL_MS, HOTELS_CACHE_TTL_MS);
     }
 
-    return (KORE_RESULT_OK);
+    raw_response_cache_control(&state->response, HOTELS_CACHE_CONTROL);
+    raw_response_send(&state->response, req, state->failed);
+
+    // the response is cached (if it could be), so requests waiting on this search can use it
+    tcblcb_flight_land(state->flight);
+    state->flight = NULL;
+
+    return (HTTP_STATE_COMPLETE);
+}
+
+static struct http_state hotels_states[] = {
+    { "HOTELS_STATE_SEARCH",   hotels_state_search },
+    { "HOTELS_STATE_COALESCED", hotels_state_coalesced },
+    { "HOTELS_STATE_RESPONSE", hotels_state_response },
+};
+
+int tcblcb_api_hotels(struct http_request *req)
+{
+    return tcblcb_run_states(req, METRICS_ROUTE_HOTELS, hotels_states, http_state_amount(hotels_states));
 }
@@ -79,13 +79,24 @@ typedef struct tcblcb_UserPasswordResult {
     char *password;
 } tcblcb_UserPasswordResult;
 
+#define USER_AUTH_STATE_LCB       0
+#define USER_AUTH_STATE_RESPONSE  1
+
+typedef struct tcblcb_UserAuthState {
+    tcblcb_UserAuthParams *auth_params;
+    bool params_valid;
+    tcblcb_UserPasswordResult user_password_result;
+    lcb_STATUS insert_status;
+} tcblcb_UserAuthState;
+
 // get user params from the request.
 static tcblcb_UserAuthParams *get_user_params(struct http_request *req)
 {
-    tcblcb_UserAuthParams *auth_params = calloc(1, sizeof(tcblcb_UserAuthParams));
+    tcblcb_UserAuthParams *auth_params = tcblcb_calloc(1, sizeof(tcblcb_UserAuthParams));
 
     struct kore_buf *http_body_buf = NULL;
-    cJSON *request_body_json = NULL;
+    tcblcb_JSONDoc *request_body_doc = NULL;
+    u_int64_t started = tcblcb_metrics_now();
 
     // grab a copy of the path to tokenize the path parameters
     size_t path_strlen = strlen(req->path);
@@ -114,44 +125,56 @@ static tcblcb_UserAuthParams *get_user_params(struct http_request *req)
     char *tenant_string_ref = path_segments[2];
     to_lower_case(tenant_string_ref);
 
+    // the body is timed on its own
+    tcblcb_reqctx_phase(tcblcb_reqctx_get(req), TIMING_PHASE_PARSE, started);
+
     http_body_buf = get_http_body_buf(req);
     IfNULLGotoDone(
         http_body_buf,
         "Failed to read request body data"
     );
 
-    request_body_json = cJSON_Parse(kore_buf_stringify(http_body_buf, NULL));
+    started = tcblcb_metrics_now();
+
+    request_body_doc = json_doc_parse((const char *)http_body_buf->data, http_body_buf->offset);
     IfNULLGotoDone(
-        request_body_json,
+        request_body_doc,
         "Failed to parse request body JSON"
     );
+    const tcblcb_JSONValue *request_body_json = json_doc_root(request_body_doc);
 
-    char *user_param = cJSON_GetStringValue(cJSON_GetObjectItem(request_body_json, UNAME_KEY_STRING));
+    const char *user_param = json_get_string(json_object_get(request_body_json, UNAME_KEY_STRING));
     IfNULLGotoDone(
         user_param,
         "Failed to get 'user' param from request"
     );
-    to_lower_case(user_param);
 
-    char *pass_param = cJSON_GetStringValue(cJSON_GetObjectItem(request_body_json, PWORD_KEY_STRING));
+    const char *pass_param = json_get_string(json_object_get(request_body_json, PWORD_KEY_STRING));
     IfNULLGotoDone(
         pass_param,
         "Failed to get 'password' param from request"
     );
 
-    auth_params->tenant = strdup(tenant_string_ref);
-    auth_params->username = strdup(user_param);
-    auth_params->password = strdup(pass_param);
+    auth_params->tenant = tcblcb_strdup(tenant_string_ref);
+    auth_params->username = tcblcb_strdup(user_param);
+    auth_params->password = tcblcb_strdup(pass_param);
+
+    // the doc's strings are read only, so the username is lowered in its copy
+    if (auth_params->username != NULL) {
+        to_lower_case(auth_params->username);
+    }
 
     LogDebug("User Auth Params: tenant=%s user=%s", auth_params->tenant, auth_params->username);
 
+    tcblcb_reqctx_phase(tcblcb_reqctx_get(req), TIMING_PHASE_PARSE, started);
+
 done:
     if (http_body_buf != NULL) {
         kore_buf_free(http_body_buf);
     }
 
-    if (request_body_json != NULL) {
-        cJSON_Delete(request_body_json);
+    if (request_body_doc != NULL) {
+        json_doc_free(request_body_doc);
     }
 
     return auth_params;
@@ -160,35 +183,39 @@ done:
 static void delete_user_params(tcblcb_UserAuthParams *auth_params)
 {
     if (auth_params->tenant != NULL) {
-        free(auth_params->tenant);
+        tcblcb_free(auth_params->tenant);
     }
     if (auth_params->username != NULL) {
-        free(auth_params->username);
+        tcblcb_free(auth_params->username);
     }
     if (auth_params->password != NULL) {
-        free(auth_params->password);
+        tcblcb_free(auth_params->password);
     }
-    free(auth_params);
+    tcblcb_free(auth_params);
 }
 
 static char *gen_token(const char *username)
 {
     jwt_t *jwt = NULL;
-    cJSON *json_payload = NULL;
     char *jwt_token_string = NULL;
-    char *json_grants_string = NULL;
 
     IfBadErrnoGotoDone(
         jwt_new(&jwt),
         "Failed to create new JWT object"
     );
 
-    json_payload = cJSON_CreateObject();
+    tcblcb_JSONWriter writer;
+    json_writer_init(&writer, false);
+    json_writer_begin_object(&writer);
+    json_writer_key(&writer, UNAME_KEY_STRING);
+    json_writer_string(&writer, username);
+    json_writer_end_object(&writer);
+
+    char *json_grants_string = json_writer_finish(&writer, NULL);
     IfNULLGotoDone(
-        cJSON_AddStringToObject(json_payload, UNAME_KEY_STRING, username),
-        "Failed to add `user` to JWT payload"
+        json_grants_string,
+        "Failed to write JWT payload"
     );
-    json_grants_string = cJSON_PrintUnformatted(json_payload);
 
     IfBadErrnoGotoDone(
         jwt_add_grants_json(jwt, json_grants_string),
@@ -203,14 +230,6 @@ static char *gen_token(const char *username)
     jwt_token_string = jwt_encode_str(jwt);
 
 done:
-    if (json_grants_string != NULL) {
-        free(json_grants_string);
-    }
-
-    if (json_payload != NULL) {
-        cJSON_Delete(json_payload);
-    }
-
     if (jwt != NULL) {
         jwt_free(jwt);
     }
@@ -218,6 +237,27 @@ done:
     return jwt_token_string;
 }
 
+// write the `{"data":{"token":...},"context":[...]}` response for a login or signup. the
+// response is owned by the worker's JSON writer buffer.
+static char *write_token_response(const char *token, const char *context, size_t *len)
+{
+    tcblcb_JSONWriter writer;
+    json_writer_init(&writer, FMT_RESPONSE);
+    json_writer_begin_object(&writer);
+    json_writer_key(&writer, "data");
+    json_writer_begin_object(&writer);
+    json_writer_key(&writer, "token");
+    json_writer_string(&writer, token);
+    json_writer_end_object(&writer);
+    json_writer_key(&writer, "context");
+    json_writer_begin_array(&writer);
+    json_writer_string(&writer, context);
+    json_writer_end_array(&writer);
+    json_writer_end_object(&writer);
+
+    return json_writer_finish(&writer, len);
+}
+
 // called from a global callback and should not reference any other locals
 static void user_insert_callback(__unused lcb_INSTANCE *instance, void *cookie, const lcb_RESPSTORE *resp)
 {
@@ -234,26 +274,32 @@ done:
     return;
 }
 
-static lcb_STATUS insert_user(tcblcb_UserAuthParams *auth_params)
+// schedules the user insert, with the insert status set once it completes.
+static lcb_STATUS insert_user(tcblcb_REQCTX *ctx, tcblcb_UserAuthParams *auth_params, lcb_STATUS *insert_status)
 {
     lcb_STATUS rc = LCB_ERR_GENERIC;
     lcb_CMDSTORE *cmd = NULL;
     tcblcb_RESPDELEGATE *store_delegate = NULL;
     bool cmd_scheduled = false;
-
-    cJSON *user_json = NULL;
-    char *user_json_string = NULL;
-
-    user_json= cJSON_CreateObject();
+    u_int64_t started = tcblcb_metrics_now();
+
+    // the document is copied when the insert is scheduled, so it can stay in the writer buffer
+    tcblcb_JSONWriter writer;
+    json_writer_init(&writer, false);
+    json_writer_begin_object(&writer);
+    json_writer_key(&writer, UNAME_KEY_STRING);
+    json_writer_string(&writer, auth_params->username);
+    json_writer_key(&writer, PWORD_KEY_STRING);
+    json_writer_string(&writer, auth_params->password);
+    json_writer_end_object(&writer);
+
+    size_t user_json_strlen;
+    char *user_json_string = json_writer_finish(&writer, &user_json_strlen);
     IfNULLGotoDone(
-        cJSON_AddStringToObject(user_json, UNAME_KEY_STRING, auth_params->username),
-        "Failed to add `user` to JWT payload"
+        user_json_string,
+        "Failed to write user document"
     );
-    IfNULLGotoDone(
-        cJSON_AddStringToObject(user_json, PWORD_KEY_STRING, auth_params->password),
-        "Failed to add `password` to JWT payload"
-    );
-    user_json_string = cJSON_PrintUnformatted(user_json);
+    tcblcb_reqctx_phase(ctx, TIMING_PHASE_BUILD, started);
 
     // insert the user or indicate failure
     IfLCBFailGotoDone(
@@ -273,30 +319,33 @@ static lcb_STATUS insert_user(tcblcb_UserAuthParams *auth_params)
         "Failed to set store command user key"
     );
     IfLCBFailGotoDone(
-        lcb_cmdstore_value(cmd, user_json_string, strlen(user_json_string)),
+        lcb_cmdstore_value(cmd, user_json_string, user_json_strlen),
         "Failed to set store command user document"
     );
+    IfLCBFailGotoDone(
+        lcb_cmdstore_parent_span(cmd, tcblcb_reqctx_span(ctx)),
+        "Failed to set store command parent span"
+    );
 
     // receiver is responsible for freeing this memory if command is scheduled
-    store_delegate = malloc(sizeof(tcblcb_RESPDELEGATE));
-    store_delegate->cookie = (void**)&rc;
-    store_delegate->callback = (tcblcb_RESPDELEGATE_CALLBACK)user_insert_callback;
+    store_delegate = tcblcb_respdelegate_create(
+        ctx,
+        (void*)insert_status,
+        (tcblcb_RESPDELEGATE_CALLBACK)user_insert_callback
+    );
+    IfNULLGotoDone(
+        store_delegate,
+        "Failed to create store response delegate"
+    );
     IfLCBFailGotoDone(
-        lcb_store(_tcblcb_lcb_instance, store_delegate, cmd),
+        (rc = lcb_store(_tcblcb_lcb_instance, store_delegate, cmd)),
         "Failed to schedule user insert command"
     );
+    tcblcb_reqctx_op_scheduled(ctx);
 
     cmd_scheduled = true;
 
 done:
-    if (user_json_string != NULL) {
-        free(user_json_string);
-    }
-
-    if (user_json != NULL) {
-        cJSON_Delete(user_json);
-    }
-
     if (cmd != NULL) {
         IfLCBFailLogWarningMsg(
             lcb_cmdstore_destroy(cmd),
@@ -304,16 +353,9 @@ done:
         );
     }
 
-    if (cmd_scheduled) {
-        IfLCBFailGotoDone(
-            lcb_wait(_tcblcb_lcb_instance, LCB_WAIT_DEFAULT),
-            "Failed to complete insert command"
-        );
-    } else {
-        // free memory if command was not scheduled
-        if (store_delegate != NULL) {
-            free(store_delegate);
-        }
+    // free memory if command was not scheduled
+    if (!cmd_scheduled && store_delegate != NULL) {
+        tcblcb_free(store_delegate);
     }
 
     return rc;
@@ -344,12 +386,14 @@ done:
     return;
 }
 
-static tcblcb_UserPasswordResult get_user_password(lcb_INSTANCE *instance, tcblcb_UserAuthParams *auth_params)
+// schedules the user password lookup, with the result set once it completes.
+static lcb_STATUS get_user_password(
+    lcb_INSTANCE *instance,
+    tcblcb_REQCTX *ctx,
+    tcblcb_UserAuthParams *auth_params,
+    tcblcb_UserPasswordResult *user_password_result)
 {
-    tcblcb_UserPasswordResult user_password_result;
-    user_password_result.status = LCB_ERR_GENERIC;
-    user_password_result.password = NULL;
-
+    lcb_STATUS rc = LCB_ERR_GENERIC;
     lcb_CMDSUBDOC *cmd = NULL;
     lcb_SUBDOCSPECS *ops = NULL;
     tcblcb_RESPDELEGATE *subdoc_delegate = NULL;
@@ -370,6 +414,10 @@ static tcblcb_UserPasswordResult get_user_password(lcb_INSTANCE *instance, tcblc
         lcb_cmdsubdoc_key(cmd, auth_params->username, strlen(auth_params->username)),
         "Failed to set subdoc key"
     );
+    IfLCBFailGotoDone(
+        lcb_cmdsubdoc_parent_span(cmd, tcblcb_reqctx_span(ctx)),
+        "Failed to set subdoc parent span"
+    );
 
     IfLCBFailGotoDone(
         lcb_subdocspecs_create(&ops, 1),
@@ -388,13 +436,20 @@ static tcblcb_UserPasswordResult get_user_password(lcb_INSTANCE *instance, tcblc
     LogDebug("Get password via subdoc for username: %s", auth_params->username);
 
     // receiver is responsible for freeing this memory if command is scheduled
-    subdoc_delegate = malloc(sizeof(tcblcb_RESPDELEGATE));
-    subdoc_delegate->cookie = (void*)&user_password_result;
-    subdoc_delegate->callback = (tcblcb_RESPDELEGATE_CALLBACK)user_password_subdoc_callback;
+    subdoc_delegate = tcblcb_respdelegate_create(
+        ctx,
+        (void*)user_password_result,
+        (tcblcb_RESPDELEGATE_CALLBACK)user_password_subdoc_callback
+    );
+    IfNULLGotoDone(
+        subdoc_delegate,
+        "Failed to create subdoc response delegate"
+    );
     IfLCBFailGotoDone(
-        lcb_subdoc(instance, subdoc_delegate, cmd),
+        (rc = lcb_subdoc(instance, subdoc_delegate, cmd)),
         "Failed to schedule subdoc command"
     )
+    tcblcb_reqctx_op_scheduled(ctx);
 
     cmd_scheduled = true;
 
@@ -413,24 +468,79 @@ done:
         );
     }
 
-    if (cmd_scheduled) {
-        IfLCBFailLogWarningMsg(
-            lcb_wait(instance, LCB_WAIT_DEFAULT),
-            "Failed to complete subdoc command"
-        );
-    } else {
-        // free memory if command was not scheduled
-        if (subdoc_delegate != NULL) {
-            free(subdoc_delegate);
-        }
+    // free memory if command was not scheduled
+    if (!cmd_scheduled && subdoc_delegate != NULL) {
+        tcblcb_free(subdoc_delegate);
     }
 
-    return user_password_result;
+    return rc;
 }
 
-int tcblcb_api_user_login(struct http_request *req)
+static void user_auth_state_free(void *data)
+{
+    tcblcb_UserAuthState *state = data;
+
+    if (state->auth_params != NULL) {
+        delete_user_params(state->auth_params);
+    }
+
+    if (state->user_password_result.password != NULL) {
+        tcblcb_free(state->user_password_result.password);
+    }
+}
+
+static tcblcb_REQCTX *create_user_auth_ctx(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_create(req, sizeof(tcblcb_UserAuthState), user_auth_state_free);
+    IfNULLGotoDone(ctx, "Failed to create user auth request context");
+
+    tcblcb_UserAuthState *state = ctx->data;
+    state->user_password_result.status = LCB_ERR_GENERIC;
+    state->insert_status = LCB_ERR_GENERIC;
+
+    state->auth_params = get_user_params(req);
+    IfNULLGotoDone(
+        state->auth_params,
+        "Failed to get user auth params from request"
+    );
+
+    // the params are only partially populated if the request could not be parsed
+    state->params_valid = state->auth_params->tenant != NULL
+        && state->auth_params->username != NULL
+        && state->auth_params->password != NULL;
+
+done:
+    return ctx;
+}
+
+static int user_login_state_lookup(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = create_user_auth_ctx(req);
+    if (ctx == NULL) {
+        send_response(req, 500, RSPMSG_REQ_ERROR_STRING, RSPMSG_REQ_ERROR_STRLEN);
+        return (HTTP_STATE_COMPLETE);
+    }
+
+    tcblcb_UserAuthState *state = ctx->data;
+    IfFalseGotoDone(
+        state->params_valid,
+        "Failed to get user auth params from request"
+    );
+
+    IfLCBFailGotoDone(
+        get_user_password(_tcblcb_lcb_instance, ctx, state->auth_params, &state->user_password_result),
+        "Failed to schedule user password lookup"
+    );
+
+done:
+    return tcblcb_reqctx_suspend(ctx, USER_AUTH_STATE_RESPONSE);
+}
+
+static int user_login_state_response(struct http_request *req)
 {
-    ProcessCORSAndExitIfPreflight(req);
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    tcblcb_UserAuthState *state = ctx->data;
+    tcblcb_UserAuthParams *auth_params = state->auth_params;
 
     tcblcb_HTTPResponse hresp;
     hresp.status = 400;
@@ -440,21 +550,20 @@ int tcblcb_api_user_login(struct http_request *req)
     char *token_value_string = NULL;
     struct kore_buf *context_buf = NULL;
 
-    cJSON *response_json = NULL;
     char *response_string = NULL;
     size_t response_strlen = 0;
 
-    tcblcb_UserAuthParams *auth_params = get_user_params(req);
-    IfNULLGotoDone(
-        auth_params,
+    IfFalseGotoDone(
+        state->params_valid,
         "Failed to get user auth params from request"
     );
 
-    tcblcb_UserPasswordResult user_password_result = get_user_password(_tcblcb_lcb_instance, auth_params);
+    tcblcb_UserPasswordResult user_password_result = state->user_password_result;
     lcb_STATUS pword_status = user_password_result.status;
     LogDebug("User Password Loookup Status: (%d) %s", pword_status, lcb_strerror_long(pword_status));
     if (pword_status == LCB_SUCCESS) {
-        if (strcmp(user_password_result.password, auth_params->password) != 0) {
+        if (user_password_result.password == NULL
+            || strcmp(user_password_result.password, auth_params->password) != 0) {
             hresp.status = 401;
             hresp.string = RSPMSG_USR_BAD_PWD_STRING;
             hresp.strlen = RSPMSG_USR_BAD_PWD_STRLEN;
@@ -472,38 +581,21 @@ int tcblcb_api_user_login(struct http_request *req)
 
         size_t context_strlen;
         char *context_string = kore_buf_stringify(context_buf, &context_strlen);
+        u_int64_t started = tcblcb_metrics_now();
 
-        // create main response object
-        response_json = cJSON_CreateObject();
-        // add data to response object
-        cJSON *data_json = cJSON_AddObjectToObject(response_json, "data");
-        IfNULLGotoDone(
-            data_json,
-            "Failed to create response data object"
-        );
+        // the token is generated first because it uses a JSON writer of its own
         token_value_string = gen_token(auth_params->username);
         IfNULLGotoDone(
             token_value_string,
             "Failed to create token value string"
         );
-        IfFalseGotoDone(
-            cJSON_AddItemToObject(data_json, "token", cJSON_CreateStringReference(token_value_string)),
-            "Failed to create response token object"
-        );
-        // add context to response object
-        cJSON *context_array = cJSON_AddArrayToObject(response_json, "context");
-        IfNULLGotoDone(context_array, "Failed to create response context array");
-        IfFalseGotoDone(
-            cJSON_AddItemToArray(context_array, cJSON_CreateStringReference(context_string)),
-            "Failed to add response context string to array"
-        );
 
-        response_string = cJSON_PrintBuffered(response_json, BUFSIZ, FMT_RESPONSE);
-        response_strlen = strlen(response_string);
-        IfTrueGotoDone(
-            (response_string == NULL || response_strlen == 0),
+        response_string = write_token_response(token_value_string, context_string, &response_strlen);
+        IfNULLGotoDone(
+            response_string,
             "Unable to create response JSON string"
         );
+        tcblcb_reqctx_phase(ctx, TIMING_PHASE_SERIALIZE, started);
 
         hresp.status = 200;
         hresp.string = response_string;
@@ -519,11 +611,7 @@ int tcblcb_api_user_login(struct http_request *req)
     }
 
 done:
-    http_response(req, hresp.status, hresp.string, hresp.strlen);
-
-    if (auth_params != NULL) {
-        delete_user_params(auth_params);
-    }
+    send_response(req, hresp.status, hresp.string, hresp.strlen);
 
     if (token_value_string != NULL) {
         free(token_value_string);
@@ -533,20 +621,48 @@ done:
         kore_buf_free(context_buf);
     }
 
-    if (response_string != NULL) {
-        free(response_string);
-    }
-    
-    if (response_json != NULL) {
-        cJSON_Delete(response_json);
+    return (HTTP_STATE_COMPLETE);
+}
+
+static struct http_state user_login_states[] = {
+    { "USER_AUTH_STATE_LCB",      user_login_state_lookup },
+    { "USER_AUTH_STATE_RESPONSE", user_login_state_response },
+};
+
+int tcblcb_api_user_login(struct http_request *req)
+{
+    return tcblcb_run_states(req, METRICS_ROUTE_USER_LOGIN, user_login_states, http_state_amount(user_login_states));
+}
+
+static int user_signup_state_insert(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = create_user_auth_ctx(req);
+    if (ctx == NULL) {
+        send_response(req, 500, RSPMSG_REQ_ERROR_STRING, RSPMSG_REQ_ERROR_STRLEN);
+        return (HTTP_STATE_COMPLETE);
     }
 
-    return (KORE_RESULT_OK);
+    tcblcb_UserAuthState *state = ctx->data;
+    IfFalseGotoDone(
+        state->params_valid,
+        "Failed to get user auth params from request"
+    );
+
+    // prepare the user JSON document using the updated strings
+    IfLCBFailGotoDone(
+        insert_user(ctx, state->auth_params, &state->insert_status),
+        "Failed to schedule user insert"
+    );
+
+done:
+    return tcblcb_reqctx_suspend(ctx, USER_AUTH_STATE_RESPONSE);
 }
 
-int tcblcb_api_user_signup(struct http_request *req)
+static int user_signup_state_response(struct http_request *req)
 {
-    ProcessCORSAndExitIfPreflight(req);
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    tcblcb_UserAuthState *state = ctx->data;
+    tcblcb_UserAuthParams *auth_params = state->auth_params;
 
     tcblcb_HTTPResponse hresp;
     hresp.status = 500;
@@ -556,18 +672,15 @@ int tcblcb_api_user_signup(struct http_request *req)
     char *token_value_string = NULL;
     struct kore_buf *context_buf = NULL;
 
-    cJSON *response_json = NULL;
     char *response_string = NULL;
     size_t response_strlen = 0;
 
-    tcblcb_UserAuthParams *auth_params = get_user_params(req);
-    IfNULLGotoDone(
-        auth_params,
+    IfFalseGotoDone(
+        state->params_valid,
         "Failed to get user auth params from request"
     );
 
-    // prepare the user JSON document using the updated strings
-    lcb_STATUS insert_status = insert_user(auth_params);
+    lcb_STATUS insert_status = state->insert_status;
     LogDebug("User Signup Insert Status: (%d) %s", insert_status, lcb_strerror_long(insert_status));
     if (insert_status == LCB_SUCCESS) {
         // note that if we fail to prepare a JSON response we could have an edge case where
@@ -581,38 +694,21 @@ int tcblcb_api_user_signup(struct http_request *req)
 
         size_t context_strlen;
         char *context_string = kore_buf_stringify(context_buf, &context_strlen);
+        u_int64_t started = tcblcb_metrics_now();
 
-        // create main response object
-        response_json = cJSON_CreateObject();
-        // add data to response object
-        cJSON *data_json = cJSON_AddObjectToObject(response_json, "data");
-        IfNULLGotoDone(
-            data_json,
-            "Failed to create response data object"
-        );
+        // the token is generated first because it uses a JSON writer of its own
         token_value_string = gen_token(auth_params->username);
         IfNULLGotoDone(
             token_value_string,
             "Failed to create token value string"
         );
-        IfFalseGotoDone(
-            cJSON_AddItemToObject(data_json, "token", cJSON_CreateStringReference(token_value_string)),
-            "Failed to create response token object"
-        );
-        // add context to response object
-        cJSON *context_array = cJSON_AddArrayToObject(response_json, "context");
-        IfNULLGotoDone(context_array, "Failed to create response context array");
-        IfFalseGotoDone(
-            cJSON_AddItemToArray(context_array, cJSON_CreateStringReference(context_string)),
-            "Failed to add response context string to array"
-        );
 
-        response_string = cJSON_PrintBuffered(response_json, BUFSIZ, FMT_RESPONSE);
-        response_strlen = strlen(response_string);
-        IfTrueGotoDone(
-            (response_string == NULL || response_strlen == 0),
+        response_string = write_token_response(token_value_string, context_string, &response_strlen);
+        IfNULLGotoDone(
+            response_string,
             "Unable to create response JSON string"
         );
+        tcblcb_reqctx_phase(ctx, TIMING_PHASE_SERIALIZE, started);
 
         hresp.status = 201;
         hresp.string = response_string;
@@ -628,11 +724,7 @@ int tcblcb_api_user_signup(struct http_request *req)
     }
 
 done:
-    http_response(req, hresp.status, hresp.string, hresp.strlen);
-
-    if (auth_params != NULL) {
-        delete_user_params(auth_params);
-    }
+    send_response(req, hresp.status, hresp.string, hresp.strlen);
 
     if (token_value_string != NULL) {
         free(token_value_string);
@@ -642,13 +734,15 @@ done:
         kore_buf_free(context_buf);
     }
 
-    if (response_string != NULL) {
-        free(response_string);
-    }
-    
-    if (response_json != NULL) {
-        cJSON_Delete(response_json);
-    }
+    return (HTTP_STATE_COMPLETE);
+}
 
-    return (KORE_RESULT_OK);
+static struct http_state user_signup_states[] = {
+    { "USER_AUTH_STATE_LCB",      user_signup_state_insert },
+    { "USER_AUTH_STATE_RESPONSE", user_signup_state_response },
+};
+
+int tcblcb_api_user_signup(struct http_request *req)
+{
+    return tcblcb_run_states(req, METRICS_ROUTE_USER_SIGNUP, user_signup_states, http_state_amount(user_signup_states));
 }
@@ -67,15 +67,36 @@ typedef struct tcblcb_UserFlightsParams {
 } tcblcb_UserFlightsParams;
 
 typedef struct tcblcb_UserBookingDelegateParams {
+    tcblcb_REQCTX *ctx;
     lcb_STATUS status;
     const char *tenant;
-    cJSON *json;
+    tcblcb_BATCH *batch;
 } tcblcb_UserBookingDelegateParams;
 
+#define USER_FLIGHTS_STATE_AUTH          0
+#define USER_FLIGHTS_STATE_PUT_UPSERT    1
+#define USER_FLIGHTS_STATE_PUT_APPEND    2
+#define USER_FLIGHTS_STATE_PUT_RESPONSE  3
+#define USER_FLIGHTS_STATE_GET_BOOKINGS  4
+#define USER_FLIGHTS_STATE_GET_RESPONSE  5
+
+typedef struct tcblcb_UserFlightsState {
+    tcblcb_UserFlightsParams *user_params;
+    // PUT
+    struct kore_buf *http_body_buf;
+    tcblcb_JSONDoc *request_body_doc;
+    char *flight_string;
+    char *flight_uuid_string;
+    lcb_STATUS upsert_status;
+    lcb_STATUS append_status;
+    // GET
+    tcblcb_UserBookingDelegateParams bparams;
+} tcblcb_UserFlightsState;
+
 // get user params from the request.
 static tcblcb_UserFlightsParams *get_user_params(struct http_request *req)
 {
-    tcblcb_UserFlightsParams *user_params = calloc(1, sizeof(tcblcb_UserFlightsParams));
+    tcblcb_UserFlightsParams *user_params = tcblcb_calloc(1, sizeof(tcblcb_UserFlightsParams));
 
     // grab a copy of the path to tokenize the path parameters
     size_t path_strlen = strlen(req->path);
@@ -108,8 +129,8 @@ static tcblcb_UserFlightsParams *get_user_params(struct http_request *req)
     char *username_string_ref = path_segments[4];
     to_lower_case(username_string_ref);
 
-    user_params->tenant = strdup(tenant_string_ref);
-    user_params->username = strdup(username_string_ref);
+    user_params->tenant = tcblcb_strdup(tenant_string_ref);
+    user_params->username = tcblcb_strdup(username_string_ref);
 
     LogDebug("User Flight Params: tenant=%s user=%s", user_params->tenant, user_params->username);
 
@@ -120,12 +141,12 @@ done:
 static void delete_user_params(tcblcb_UserFlightsParams *user_params)
 {
     if (user_params->tenant != NULL) {
-        free(user_params->tenant);
+        tcblcb_free(user_params->tenant);
     }
     if (user_params->username != NULL) {
-        free(user_params->username);
+        tcblcb_free(user_params->username);
     }
-    free(user_params);
+    tcblcb_free(user_params);
 }
 
 // called from a global callback and should not reference any other locals
@@ -145,7 +166,13 @@ done:
     return;
 }
 
-static lcb_STATUS upsert_new_flight(const char *tenant, const char *flight_uuid_string, const char *flight_string)
+// schedules the flight upsert, with the upsert status set once it completes.
+static lcb_STATUS upsert_new_flight(
+    tcblcb_REQCTX *ctx,
+    const char *tenant,
+    const char *flight_uuid_string,
+    const char *flight_string,
+    lcb_STATUS *upsert_status)
 {
     lcb_STATUS rc = LCB_ERR_GENERIC;
     lcb_CMDSTORE *cmd = NULL;
@@ -173,17 +200,28 @@ static lcb_STATUS upsert_new_flight(const char *tenant, const char *flight_uuid_
         lcb_cmdstore_value(cmd, flight_string, strlen(flight_string)),
         "Failed to set store insert flight document"
     );
+    IfLCBFailGotoDone(
+        lcb_cmdstore_parent_span(cmd, tcblcb_reqctx_span(ctx)),
+        "Failed to set store command parent span"
+    );
 
     LogDebug("Add new flight booking: (%s) %s", flight_uuid_string, flight_string);
 
     // receiver is responsible for freeing this memory if command is scheduled
-    store_delegate = malloc(sizeof(tcblcb_RESPDELEGATE));
-    store_delegate->cookie = (void**)&rc;
-    store_delegate->callback = (tcblcb_RESPDELEGATE_CALLBACK)flight_upsert_callback;
+    store_delegate = tcblcb_respdelegate_create(
+        ctx,
+        (void*)upsert_status,
+        (tcblcb_RESPDELEGATE_CALLBACK)flight_upsert_callback
+    );
+    IfNULLGotoDone(
+        store_delegate,
+        "Failed to create store response delegate"
+    );
     IfLCBFailGotoDone(
-        lcb_store(_tcblcb_lcb_instance, store_delegate, cmd),
+        (rc = lcb_store(_tcblcb_lcb_instance, store_delegate, cmd)),
         "Failed to schedule user insert command"
     );
+    tcblcb_reqctx_op_scheduled(ctx);
 
     cmd_scheduled = true;
 
@@ -195,16 +233,9 @@ done:
         );
     }
 
-    if (cmd_scheduled) {
-        IfLCBFailGotoDone(
-            lcb_wait(_tcblcb_lcb_instance, LCB_WAIT_DEFAULT),
-            "Failed to complete insert command"
-        );
-    } else {
-        // free memory if command was not scheduled
-        if (store_delegate != NULL) {
-            free(store_delegate);
-        }
+    // free memory if command was not scheduled
+    if (!cmd_scheduled && store_delegate != NULL) {
+        tcblcb_free(store_delegate);
     }
 
     return rc;
@@ -227,7 +258,12 @@ done:
     return;
 }
 
-static lcb_STATUS add_user_booking(tcblcb_UserFlightsParams *user_params, const char *flight_uuid_string)
+// schedules the user booking append, with the append status set once it completes.
+static lcb_STATUS add_user_booking(
+    tcblcb_REQCTX *ctx,
+    tcblcb_UserFlightsParams *user_params,
+    const char *flight_uuid_string,
+    lcb_STATUS *append_status)
 {
     lcb_STATUS rc = LCB_ERR_GENERIC;
     lcb_CMDSUBDOC *cmd = NULL;
@@ -251,6 +287,10 @@ static lcb_STATUS add_user_booking(tcblcb_UserFlightsParams *user_params, const
         lcb_cmdsubdoc_key(cmd, user_params->username, strlen(user_params->username)),
         "Failed to set subdoc key"
     );
+    IfLCBFailGotoDone(
+        lcb_cmdsubdoc_parent_span(cmd, tcblcb_reqctx_span(ctx)),
+        "Failed to set subdoc parent span"
+    );
 
     IfLCBFailGotoDone(
         lcb_subdocspecs_create(&ops, 1),
@@ -280,19 +320,26 @@ static lcb_STATUS add_user_booking(tcblcb_UserFlightsParams *user_params, const
     LogDebug("Add User Booking: (%s) %s", user_params->username, flight_uuid_json_string);
 
     // receiver is responsible for freeing this memory if command is scheduled
-    subdoc_delegate = malloc(sizeof(tcblcb_RESPDELEGATE));
-    subdoc_delegate->cookie = (void**)&rc;
-    subdoc_delegate->callback = (tcblcb_RESPDELEGATE_CALLBACK)booking_subdoc_callback;
+    subdoc_delegate = tcblcb_respdelegate_create(
+        ctx,
+        (void*)append_status,
+        (tcblcb_RESPDELEGATE_CALLBACK)booking_subdoc_callback
+    );
+    IfNULLGotoDone(
+        subdoc_delegate,
+        "Failed to create subdoc response delegate"
+    );
     IfLCBFailGotoDone(
-        lcb_subdoc(_tcblcb_lcb_instance, subdoc_delegate, cmd),
+        (rc = lcb_subdoc(_tcblcb_lcb_instance, subdoc_delegate, cmd)),
         "Failed to schedule subdoc command"
     )
+    tcblcb_reqctx_op_scheduled(ctx);
 
     cmd_scheduled = true;
 
 done:
     if (flight_uuid_json_string != NULL) {
-        free(flight_uuid_json_string);
+        tcblcb_free(flight_uuid_json_string);
     }
     
     if (ops != NULL) {
@@ -309,86 +356,90 @@ done:
         );
     }
 
-    if (cmd_scheduled) {
-        IfLCBFailLogWarningMsg(
-            lcb_wait(_tcblcb_lcb_instance, LCB_WAIT_DEFAULT),
-            "Failed to complete subdoc command"
-        );
-    } else {
-        // free memory if command was not scheduled
-        if (subdoc_delegate != NULL) {
-            free(subdoc_delegate);
-        }
+    // free memory if command was not scheduled
+    if (!cmd_scheduled && subdoc_delegate != NULL) {
+        tcblcb_free(subdoc_delegate);
     }
 
     return rc;
 }
 
-static void tcblcb_api_user_flights_put(struct http_request *req, tcblcb_UserFlightsParams *user_params)
+static int user_flights_state_put_upsert(struct http_request *req)
 {
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    tcblcb_UserFlightsState *state = ctx->data;
+    tcblcb_UserFlightsParams *user_params = state->user_params;
+
     tcblcb_HTTPResponse hresp;
     hresp.status = 500;
     hresp.string = RSPMSG_REQ_ERROR_STRING;
     hresp.strlen = RSPMSG_REQ_ERROR_STRLEN;
 
-    struct kore_buf *http_body_buf = NULL;
-    cJSON *request_body_json = NULL;
-
-    char *flight_string = NULL;
-    char *flight_uuid_string = NULL;
-
-    struct kore_buf *context_buf = NULL;
-
-    cJSON *response_json = NULL;
-    char *response_string = NULL;
-    size_t response_strlen = 0;
-
-    context_buf = kore_buf_alloc(BUFSIZ);
-    kore_buf_appendf(context_buf, "KV update - scoped to %s.user: for bookings field in document %s", user_params->tenant, user_params->username);
-
-    size_t context_strlen;
-    char *context_string = kore_buf_stringify(context_buf, &context_strlen);
-
-    http_body_buf = get_http_body_buf(req);
+    state->http_body_buf = get_http_body_buf(req);
     IfNULLGotoDone(
-        http_body_buf,
+        state->http_body_buf,
         "Failed to read request body data"
     );
 
-    request_body_json = cJSON_Parse(kore_buf_stringify(http_body_buf, NULL));
+    u_int64_t started = tcblcb_metrics_now();
+    state->request_body_doc = json_doc_parse((const char *)state->http_body_buf->data, state->http_body_buf->offset);
     IfNULLGotoDone(
-        request_body_json,
+        state->request_body_doc,
         "Failed to parse request body JSON"
     );
 
-    cJSON *flights_json_array = cJSON_GetObjectItem(request_body_json, "flights");
+    const tcblcb_JSONValue *flights_json_array = json_object_get(json_doc_root(state->request_body_doc), "flights");
     IfNULLGotoDone(
         flights_json_array,
         "Failed to get flights param from request"
     );
     IfFalseGotoDone(
-        cJSON_IsArray(flights_json_array),
+        json_is_array(flights_json_array),
         "Flights param was not an array"
     );
+    tcblcb_reqctx_phase(ctx, TIMING_PHASE_PARSE, started);
+
+    started = tcblcb_metrics_now();
 
-    cJSON *flight_json = cJSON_GetArrayItem(flights_json_array, 0);
-    flight_string = cJSON_PrintBuffered(flight_json, BUFSIZ, false);
+    state->flight_string = json_value_write(json_array_first(flights_json_array), NULL);
     IfNULLGotoDone(
-        flight_string,
+        state->flight_string,
         "Failed to get flight JSON as string"
     );
 
-    flight_uuid_string = create_uuid_string();
+    state->flight_uuid_string = create_uuid_string();
     IfNULLGotoDone(
-        flight_uuid_string,
+        state->flight_uuid_string,
         "Failed to get flight UUID as string"
     );
+    tcblcb_reqctx_phase(ctx, TIMING_PHASE_BUILD, started);
 
     hresp.status = 500;
     hresp.string = RSPMSG_UPSERT_FAILED_STRING;
     hresp.strlen = RSPMSG_UPSERT_FAILED_STRLEN;
     IfLCBFailGotoDone(
-        upsert_new_flight(user_params->tenant, flight_uuid_string, flight_string),
+        upsert_new_flight(ctx, user_params->tenant, state->flight_uuid_string, state->flight_string, &state->upsert_status),
+        "Failed to add new flight to bookings collection"
+    );
+
+    return tcblcb_reqctx_suspend(ctx, USER_FLIGHTS_STATE_PUT_APPEND);
+
+done:
+    send_response(req, hresp.status, hresp.string, hresp.strlen);
+    return (HTTP_STATE_COMPLETE);
+}
+
+static int user_flights_state_put_append(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    tcblcb_UserFlightsState *state = ctx->data;
+
+    tcblcb_HTTPResponse hresp;
+    hresp.status = 500;
+    hresp.string = RSPMSG_UPSERT_FAILED_STRING;
+    hresp.strlen = RSPMSG_UPSERT_FAILED_STRLEN;
+    IfLCBFailGotoDone(
+        state->upsert_status,
         "Failed to add new flight to bookings collection"
     );
 
@@ -396,7 +447,35 @@ static void tcblcb_api_user_flights_put(struct http_request *req, tcblcb_UserFli
     hresp.string = RSPMSG_APPEND_FAILED_STRING;
     hresp.strlen = RSPMSG_APPEND_FAILED_STRLEN;
     IfLCBFailGotoDone(
-        add_user_booking(user_params, flight_uuid_string),
+        add_user_booking(ctx, state->user_params, state->flight_uuid_string, &state->append_status),
+        "Failed to add new flight to user bookings"
+    );
+
+    return tcblcb_reqctx_suspend(ctx, USER_FLIGHTS_STATE_PUT_RESPONSE);
+
+done:
+    send_response(req, hresp.status, hresp.string, hresp.strlen);
+    return (HTTP_STATE_COMPLETE);
+}
+
+static int user_flights_state_put_response(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    tcblcb_UserFlightsState *state = ctx->data;
+    tcblcb_UserFlightsParams *user_params = state->user_params;
+
+    tcblcb_HTTPResponse hresp;
+    hresp.status = 500;
+    hresp.string = RSPMSG_APPEND_FAILED_STRING;
+    hresp.strlen = RSPMSG_APPEND_FAILED_STRLEN;
+
+    struct kore_buf *context_buf = NULL;
+
+    char *response_string = NULL;
+    size_t response_strlen = 0;
+
+    IfLCBFailGotoDone(
+        state->append_status,
         "Failed to add new flight to user bookings"
     );
 
@@ -405,81 +484,55 @@ static void tcblcb_api_user_flights_put(struct http_request *req, tcblcb_UserFli
     hresp.string = RSPMSG_RESP_JSON_BAD_STRING;
     hresp.strlen = RSPMSG_RESP_JSON_BAD_STRLEN;
 
-    // create main response object
-    response_json = cJSON_CreateObject();
-    // add 'data' object to response object
-    cJSON *data_json = cJSON_AddObjectToObject(response_json, "data");
-    IfNULLGotoDone(
-        data_json,
-        "Failed to create response 'data' object"
-    );
-    // add 'added' array to the 'data' object
-    cJSON *added_array = cJSON_AddArrayToObject(data_json, "added");
-    IfNULLGotoDone(added_array, "Failed to create response 'added'' array");
-    IfFalseGotoDone(
-        cJSON_AddItemReferenceToArray(added_array, flight_json),
-        "Failed to add response flight JSON to 'added' array"
-    );
-    // add 'context' object to response object
-    cJSON *context_array = cJSON_AddArrayToObject(response_json, "context");
-    IfNULLGotoDone(context_array, "Failed to create response 'context' array");
-    IfFalseGotoDone(
-        cJSON_AddItemToArray(context_array, cJSON_CreateStringReference(context_string)),
-        "Failed to add response context string to array"
-    );
+    context_buf = kore_buf_alloc(BUFSIZ);
+    kore_buf_appendf(context_buf, "KV update - scoped to %s.user: for bookings field in document %s", user_params->tenant, user_params->username);
 
-    response_string = cJSON_PrintBuffered(response_json, BUFSIZ, FMT_RESPONSE);
-    response_strlen = strlen(response_string);
-    IfTrueGotoDone(
-        (response_string == NULL || response_strlen == 0),
+    size_t context_strlen;
+    char *context_string = kore_buf_stringify(context_buf, &context_strlen);
+    u_int64_t started = tcblcb_metrics_now();
+
+    // the added flight is the JSON already printed for the booking document
+    tcblcb_JSONWriter writer;
+    json_writer_init(&writer, FMT_RESPONSE);
+    json_writer_begin_object(&writer);
+    json_writer_key(&writer, "data");
+    json_writer_begin_object(&writer);
+    json_writer_key(&writer, "added");
+    json_writer_begin_array(&writer);
+    json_writer_raw(&writer, state->flight_string, strlen(state->flight_string));
+    json_writer_end_array(&writer);
+    json_writer_end_object(&writer);
+    json_writer_key(&writer, "context");
+    json_writer_begin_array(&writer);
+    json_writer_string(&writer, context_string);
+    json_writer_end_array(&writer);
+    json_writer_end_object(&writer);
+
+    response_string = json_writer_finish(&writer, &response_strlen);
+    IfNULLGotoDone(
+        response_string,
         "Unable to create response JSON string"
     );
+    tcblcb_reqctx_phase(ctx, TIMING_PHASE_SERIALIZE, started);
 
     hresp.status = 200;
     hresp.string = response_string;
     hresp.strlen = response_strlen;
 
 done:
-    http_response(req, hresp.status, hresp.string, hresp.strlen);
-
-    if (flight_uuid_string != NULL) {
-        free(flight_uuid_string);
-    }
-    
-    if (flight_string != NULL) {
-        free(flight_string);
-    }
-
-    if (http_body_buf != NULL) {
-        kore_buf_free(http_body_buf);
-    }
-
-    if (request_body_json != NULL) {
-        cJSON_Delete(request_body_json);
-    }
+    send_response(req, hresp.status, hresp.string, hresp.strlen);
 
     if (context_buf != NULL) {
         kore_buf_free(context_buf);
     }
 
-    if (response_string != NULL) {
-        free(response_string);
-    }
-    
-    if (response_json != NULL) {
-        cJSON_Delete(response_json);
-    }
+    return (HTTP_STATE_COMPLETE);
 }
 
 // called from a global callback and should not reference any other locals
-static void get_flight_booking_callback(__unused lcb_INSTANCE *instance, void *cookie, const lcb_RESPGET *resp)
+static void get_flight_booking_callback(__unused lcb_INSTANCE *instance, tcblcb_BATCH *batch, size_t index, const lcb_RESPGET *resp)
 {
     lcb_STATUS rc = LCB_ERR_GENERIC;
-    cJSON *booking_json_array = (cJSON *)cookie;
-    IfNULLGotoDone(
-        booking_json_array,
-        "Booking JSON array cookie was NULL"
-    );
 
     IfLCBFailGotoDone(
         (rc = lcb_respget_status(resp)),
@@ -502,9 +555,10 @@ static void get_flight_booking_callback(__unused lcb_INSTANCE *instance, void *c
 
     LogDebug("Received get flight booking response: [%.*s] %.*s", (int)nkey, key, (int)nvalue, value);
 
-    // accumulate the responses in the JSON array as they arrive
-    if (!cJSON_AddItemToArray(booking_json_array, cJSON_ParseWithLength(value, nvalue))) {
-        kore_log(LOG_WARNING, "Failed to add booking json to array for: %.*s", (int)nkey, key);
+    // keep the responses in booking order regardless of which arrives first
+    batch->results[index] = json_doc_parse(value, nvalue);
+    if (batch->results[index] == NULL) {
+        kore_log(LOG_WARNING, "Failed to parse booking json for: %.*s", (int)nkey, key);
     }
 
 done:
@@ -512,13 +566,11 @@ done:
     return;
 }
 
-// called from a global callback and should not reference any other locals
-static lcb_STATUS get_flight_booking(lcb_INSTANCE *instance, const char *tenant, const char *flight_booking_id, cJSON *booking_json_array)
+// queues the get for a flight booking, with the booking JSON stored at `index` once it completes.
+static lcb_STATUS queue_flight_booking(tcblcb_BATCH *batch, size_t index, const char *tenant, const char *flight_booking_id)
 {
     lcb_STATUS rc = LCB_ERR_GENERIC;
-    lcb_CMDGET *cmd;
-    tcblcb_RESPDELEGATE *get_delegate = NULL;
-    bool cmd_scheduled = false;
+    lcb_CMDGET *cmd = NULL;
 
     IfLCBFailGotoDone(
         (rc = lcb_cmdget_create(&cmd)),
@@ -535,20 +587,18 @@ static lcb_STATUS get_flight_booking(lcb_INSTANCE *instance, const char *tenant,
         (rc = lcb_cmdget_key(cmd, flight_booking_id, strlen(flight_booking_id))),
         "Failed to set key for get command"
     );
+    IfLCBFailGotoDone(
+        (rc = lcb_cmdget_parent_span(cmd, tcblcb_reqctx_span(batch->ctx))),
+        "Failed to set parent span for get command"
+    );
     
     LogDebug("Get flight booking for: %s", flight_booking_id);
 
-    // receiver is responsible for freeing this memory if command is scheduled
-    get_delegate = malloc(sizeof(tcblcb_RESPDELEGATE));
-    get_delegate->cookie = (void*)booking_json_array;
-    get_delegate->callback = (tcblcb_RESPDELEGATE_CALLBACK)get_flight_booking_callback;
     IfLCBFailGotoDone(
-        (rc = lcb_get(instance, get_delegate, cmd)),
-        "Failed to schedule subdoc command"
+        (rc = tcblcb_batch_get(batch, index, cmd)),
+        "Failed to queue get command"
     )
 
-    cmd_scheduled = true;
-
 done:
     if (cmd != NULL) {
         IfLCBFailLogWarningMsg(
@@ -557,18 +607,6 @@ done:
         );
     }
 
-    if (cmd_scheduled) {
-        IfLCBFailLogWarningMsg(
-            (rc = lcb_wait(instance, LCB_WAIT_DEFAULT)),
-            "Failed to complete get command"
-        );
-    } else {
-        // free memory if command was not scheduled
-        if (get_delegate != NULL) {
-            free(get_delegate);
-        }
-    }
-
     return rc;
 }
 
@@ -576,7 +614,7 @@ done:
 static void user_bookings_subdoc_callback(lcb_INSTANCE *instance, void *cookie, const lcb_RESPSUBDOC *resp)
 {
     lcb_STATUS rc = LCB_ERR_GENERIC;
-    cJSON *booking_ids_json = NULL;
+    tcblcb_JSONDoc *booking_ids_doc = NULL;
 
     tcblcb_UserBookingDelegateParams *bparams = (tcblcb_UserBookingDelegateParams *)cookie;
     IfNULLGotoDone(
@@ -584,8 +622,6 @@ static void user_bookings_subdoc_callback(lcb_INSTANCE *instance, void *cookie,
         "Booking delegate params cookie was NULL"
     );
 
-    bparams->json = cJSON_CreateArray();
-
     IfLCBFailGotoDone(
         (rc = lcb_respsubdoc_status(resp)),
         "Subdoc operation failed"
@@ -593,36 +629,64 @@ static void user_bookings_subdoc_callback(lcb_INSTANCE *instance, void *cookie,
 
     if (lcb_respsubdoc_result_size(resp) > 0) {
         IfLCBFailGotoDone(
-            (rc = get_json_doc_from_subdoc_resp(resp, 0, &booking_ids_json)),
+            (rc = get_json_doc_from_subdoc_resp(resp, 0, &booking_ids_doc)),
             "Failed to get JSON doc from subdoc response"
         );
+        IfNULLGotoDone(
+            booking_ids_doc,
+            "Failed to parse subdoc array"
+        );
+
+        const tcblcb_JSONValue *booking_ids_json = json_doc_root(booking_ids_doc);
         IfFalseGotoDone(
-            cJSON_IsArray(booking_ids_json),
+            json_is_array(booking_ids_json),
             "Unexpected JSON type for subdoc array"
         );
         
-        const cJSON *booking_id = NULL;
-        cJSON_ArrayForEach(booking_id, booking_ids_json) {
-            const char *booking_id_string = cJSON_GetStringValue(booking_id);
+        // the gets are counted against the request before this subdoc completes so
+        // the request is only woken once every booking has arrived
+        bparams->batch = tcblcb_batch_create(
+            instance,
+            bparams->ctx,
+            json_array_size(booking_ids_json),
+            (tcblcb_BATCH_CALLBACK)get_flight_booking_callback,
+            NULL,
+            (tcblcb_BATCH_RESULT_FREE)json_doc_free
+        );
+        IfNULLGotoDone(
+            bparams->batch,
+            "Failed to create flight booking batch"
+        );
+
+        tcblcb_batch_begin(bparams->batch);
+
+        size_t index = 0;
+        const tcblcb_JSONValue *booking_id = NULL;
+        json_array_for_each(booking_id, booking_ids_json) {
+            const char *booking_id_string = json_get_string(booking_id);
             IfLCBFailLogWarningMsgRef(
-                get_flight_booking(instance, bparams->tenant, booking_id_string, bparams->json),
+                queue_flight_booking(bparams->batch, index, bparams->tenant, booking_id_string),
                 "Failed to get flight booking JSON",
                 booking_id_string
             );
+            index++;
         }
+
+        tcblcb_batch_end(bparams->batch);
     } else {
         LogDebug("%s", "User bookings subdoc result was EMPTY");
     }
 
 done:
-    if (booking_ids_json != NULL) {
-        cJSON_Delete(booking_ids_json);
+    if (booking_ids_doc != NULL) {
+        json_doc_free(booking_ids_doc);
     }
 
     bparams->status = rc;
 }
 
-static lcb_STATUS get_user_bookings(tcblcb_UserFlightsParams *user_params, cJSON **json_array)
+// schedules the user bookings lookup, which in turn schedules a get for each booking.
+static lcb_STATUS get_user_bookings(tcblcb_REQCTX *ctx, tcblcb_UserFlightsParams *user_params, tcblcb_UserBookingDelegateParams *bparams)
 {
     lcb_STATUS rc = LCB_ERR_GENERIC;
     lcb_CMDSUBDOC *cmd = NULL;
@@ -645,6 +709,10 @@ static lcb_STATUS get_user_bookings(tcblcb_UserFlightsParams *user_params, cJSON
         (rc = lcb_cmdsubdoc_key(cmd, user_params->username, strlen(user_params->username))),
         "Failed to set subdoc key"
     );
+    IfLCBFailGotoDone(
+        (rc = lcb_cmdsubdoc_parent_span(cmd, tcblcb_reqctx_span(ctx))),
+        "Failed to set subdoc parent span"
+    );
 
     IfLCBFailGotoDone(
         (rc = lcb_subdocspecs_create(&ops, 1)),
@@ -662,17 +730,25 @@ static lcb_STATUS get_user_bookings(tcblcb_UserFlightsParams *user_params, cJSON
 
     LogDebug("Get user bookings via subdoc for user: %s", user_params->username);
 
-    tcblcb_UserBookingDelegateParams bparams;
-    bparams.tenant = user_params->tenant;
+    bparams->ctx = ctx;
+    bparams->status = LCB_ERR_GENERIC;
+    bparams->tenant = user_params->tenant;
 
     // receiver is responsible for freeing this memory if command is scheduled
-    subdoc_delegate = malloc(sizeof(tcblcb_RESPDELEGATE));
-    subdoc_delegate->cookie = (void*)&bparams;
-    subdoc_delegate->callback = (tcblcb_RESPDELEGATE_CALLBACK)user_bookings_subdoc_callback;
+    subdoc_delegate = tcblcb_respdelegate_create(
+        ctx,
+        (void*)bparams,
+        (tcblcb_RESPDELEGATE_CALLBACK)user_bookings_subdoc_callback
+    );
+    IfNULLGotoDone(
+        subdoc_delegate,
+        "Failed to create subdoc response delegate"
+    );
     IfLCBFailGotoDone(
         (rc = lcb_subdoc(_tcblcb_lcb_instance, subdoc_delegate, cmd)),
         "Failed to schedule subdoc command"
     )
+    tcblcb_reqctx_op_scheduled(ctx);
 
     cmd_scheduled = true;
 
@@ -691,27 +767,34 @@ done:
         );
     }
 
-    if (cmd_scheduled) {
-        IfLCBFailLogWarningMsg(
-            (rc = lcb_wait(_tcblcb_lcb_instance, LCB_WAIT_DEFAULT)),
-            "Failed to complete subdoc command"
-        );
-        if (rc == LCB_SUCCESS) {
-            rc = bparams.status;
-            *json_array = bparams.json;
-        }
-    } else {
-        // free memory if command was not scheduled
-        if (subdoc_delegate != NULL) {
-            free(subdoc_delegate);
-        }
+    // free memory if command was not scheduled
+    if (!cmd_scheduled && subdoc_delegate != NULL) {
+        tcblcb_free(subdoc_delegate);
     }
 
     return rc;
 }
 
-static void tcblcb_api_user_flights_get(struct http_request *req, tcblcb_UserFlightsParams *user_params)
+static int user_flights_state_get_bookings(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    tcblcb_UserFlightsState *state = ctx->data;
+
+    IfLCBFailGotoDone(
+        get_user_bookings(ctx, state->user_params, &state->bparams),
+        "Failed to schedule user bookings lookup"
+    );
+
+done:
+    return tcblcb_reqctx_suspend(ctx, USER_FLIGHTS_STATE_GET_RESPONSE);
+}
+
+static int user_flights_state_get_response(struct http_request *req)
 {
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    tcblcb_UserFlightsState *state = ctx->data;
+    tcblcb_UserFlightsParams *user_params = state->user_params;
+
     tcblcb_HTTPResponse hresp;
     hresp.status = 500;
     hresp.string = RSPMSG_USR_BOOKING_ERROR_STRING;
@@ -719,12 +802,10 @@ static void tcblcb_api_user_flights_get(struct http_request *req, tcblcb_UserFli
 
     struct kore_buf *context_buf = NULL;
 
-    cJSON *response_json = NULL;
     char *response_string = NULL;
     size_t response_strlen = 0;
 
-    cJSON *bookings_json_array = NULL;
-    lcb_STATUS bookings_status = get_user_bookings(user_params, &bookings_json_array);
+    lcb_STATUS bookings_status = state->bparams.status;
 
     if (bookings_status == LCB_SUCCESS || bookings_status == LCB_ERR_SUBDOC_PATH_NOT_FOUND) {
         context_buf = kore_buf_alloc(BUFSIZ);
@@ -732,28 +813,33 @@ static void tcblcb_api_user_flights_get(struct http_request *req, tcblcb_UserFli
 
         size_t context_strlen;
         char *context_string = kore_buf_stringify(context_buf, &context_strlen);
-
-        // create main response object
-        response_json = cJSON_CreateObject();
-        // add data to response object
-        IfFalseGotoDone(
-            cJSON_AddItemToObject(response_json, "data", bookings_json_array),
-            "Failed to add data array to response"
-        );
-        // add context to response object
-        cJSON *context_array = cJSON_AddArrayToObject(response_json, "context");
-        IfNULLGotoDone(context_array, "Failed to create response context array");
-        IfFalseGotoDone(
-            cJSON_AddItemToArray(context_array, cJSON_CreateStringReference(context_string)),
-            "Failed to add response context string to array"
-        );
-
-        response_string = cJSON_PrintBuffered(response_json, BUFSIZ, FMT_RESPONSE);
-        response_strlen = strlen(response_string);
-        IfTrueGotoDone(
-            (response_string == NULL || response_strlen == 0),
+        u_int64_t started = tcblcb_metrics_now();
+
+        tcblcb_JSONWriter writer;
+        json_writer_init(&writer, FMT_RESPONSE);
+        json_writer_begin_object(&writer);
+        json_writer_key(&writer, "data");
+        json_writer_begin_array(&writer);
+        // bookings are written in booking order, skipping any that failed
+        tcblcb_BATCH *batch = state->bparams.batch;
+        for (size_t i = 0; batch != NULL && i < batch->nitems; i++) {
+            if (batch->results[i] != NULL) {
+                json_writer_json(&writer, json_doc_root(batch->results[i]));
+            }
+        }
+        json_writer_end_array(&writer);
+        json_writer_key(&writer, "context");
+        json_writer_begin_array(&writer);
+        json_writer_string(&writer, context_string);
+        json_writer_end_array(&writer);
+        json_writer_end_object(&writer);
+
+        response_string = json_writer_finish(&writer, &response_strlen);
+        IfNULLGotoDone(
+            response_string,
             "Unable to create response JSON string"
         );
+        tcblcb_reqctx_phase(ctx, TIMING_PHASE_SERIALIZE, started);
 
         hresp.status = 200;
         hresp.string = response_string;
@@ -761,31 +847,54 @@ static void tcblcb_api_user_flights_get(struct http_request *req, tcblcb_UserFli
     }
 
 done:
-    http_response(req, hresp.status, hresp.string, hresp.strlen);
+    send_response(req, hresp.status, hresp.string, hresp.strlen);
 
     if (context_buf != NULL) {
         kore_buf_free(context_buf);
     }
 
-    if (response_string != NULL) {
-        free(response_string);
+    return (HTTP_STATE_COMPLETE);
+}
+
+static void user_flights_state_free(void *data)
+{
+    tcblcb_UserFlightsState *state = data;
+
+    if (state->user_params != NULL) {
+        delete_user_params(state->user_params);
+    }
+
+    if (state->flight_uuid_string != NULL) {
+        tcblcb_free(state->flight_uuid_string);
     }
     
-    if (response_json != NULL) {
-        cJSON_Delete(response_json);
+    if (state->flight_string != NULL) {
+        tcblcb_free(state->flight_string);
+    }
+
+    if (state->http_body_buf != NULL) {
+        kore_buf_free(state->http_body_buf);
+    }
+
+    if (state->request_body_doc != NULL) {
+        json_doc_free(state->request_body_doc);
+    }
+
+    if (state->bparams.batch != NULL) {
+        tcblcb_batch_free(state->bparams.batch);
     }
 }
 
-int tcblcb_api_user_flights(struct http_request *req)
+static int user_flights_state_auth(struct http_request *req)
 {
-    ProcessCORSAndExitIfPreflight(req);
-    
     bool user_authorized = false;
+    int next_state = -1;
     jwt_t *jwt = NULL;
     char *jwt_user_json = NULL;
     char *jwt_user_string = NULL;
     char *authorization_string = NULL;
     tcblcb_UserFlightsParams *user_params = NULL;
+    u_int64_t started = tcblcb_metrics_now();
 
     tcblcb_HTTPResponse hresp;
     hresp.status = 401;
@@ -854,19 +963,36 @@ int tcblcb_api_user_flights(struct http_request *req)
         "Path param username does not match JWT username"
     );
 
+    hresp.status = 500;
+    hresp.string = RSPMSG_REQ_ERROR_STRING;
+    hresp.strlen = RSPMSG_REQ_ERROR_STRLEN;
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_create(req, sizeof(tcblcb_UserFlightsState), user_flights_state_free);
+    IfNULLGotoDone(ctx, "Failed to create user flights request context");
+
+    // the request context now owns the params
+    tcblcb_UserFlightsState *state = ctx->data;
+    state->user_params = user_params;
+    state->upsert_status = LCB_ERR_GENERIC;
+    state->append_status = LCB_ERR_GENERIC;
+    state->bparams.status = LCB_ERR_GENERIC;
+    user_params = NULL;
+
+    // the token and path are parsed before there's a context to time them in
+    tcblcb_reqctx_phase(ctx, TIMING_PHASE_PARSE, started);
+
     user_authorized = true;
 
-    // these functions are now responsible for sending the response
+    // the following states are now responsible for sending the response
     if (req->method == HTTP_METHOD_PUT) {
-        tcblcb_api_user_flights_put(req, user_params);
+        next_state = USER_FLIGHTS_STATE_PUT_UPSERT;
     } else if (req->method == HTTP_METHOD_GET) {
-        tcblcb_api_user_flights_get(req, user_params);
+        next_state = USER_FLIGHTS_STATE_GET_BOOKINGS;
     }
 
 done:
-    // only send common user auth failure responses from this function
+    // only send common user auth failure responses from this state
     if (!user_authorized) {
-        http_response(req, hresp.status, hresp.string, hresp.strlen);
+        send_response(req, hresp.status, hresp.string, hresp.strlen);
     }
 
     if (user_params != NULL) {
@@ -874,7 +1000,7 @@ done:
     }
 
     if (jwt_user_string != NULL) {
-        free(jwt_user_string);
+        tcblcb_free(jwt_user_string);
     }
 
     if (jwt_user_json != NULL) {
@@ -888,6 +1014,25 @@ done:
     if (authorization_string != NULL) {
         free(authorization_string);
     }
-    
-    return (KORE_RESULT_OK);
+
+    if (next_state < 0) {
+        return (HTTP_STATE_COMPLETE);
+    }
+
+    req->fsm_state = next_state;
+    return (HTTP_STATE_CONTINUE);
+}
+
+static struct http_state user_flights_states[] = {
+    { "USER_FLIGHTS_STATE_AUTH",         user_flights_state_auth },
+    { "USER_FLIGHTS_STATE_PUT_UPSERT",   user_flights_state_put_upsert },
+    { "USER_FLIGHTS_STATE_PUT_APPEND",   user_flights_state_put_append },
+    { "USER_FLIGHTS_STATE_PUT_RESPONSE", user_flights_state_put_response },
+    { "USER_FLIGHTS_STATE_GET_BOOKINGS", user_flights_state_get_bookings },
+    { "USER_FLIGHTS_STATE_GET_RESPONSE", user_flights_state_get_response },
+};
+
+int tcblcb_api_user_flights(struct http_request *req)
+{
+    return tcblcb_run_states(req, METRICS_ROUTE_USER_FLIGHTS, user_flights_states, http_state_amount(user_flights_states));
 }
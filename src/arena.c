@@ -0,0 +1,249 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cjson/cJSON.h>
+
+#include "arena.h"
+
+// the arena is a list of chunks with the one being bumped at the head. allocations too large to
+// share a chunk get one of their own, linked in behind the head so the space left in it is kept.
+// every allocation is preceded by a header and rounded up so the next one stays aligned.
+
+#define ARENA_ALIGNMENT 16
+#define ArenaAlign(size) (((size) + (ARENA_ALIGNMENT - 1)) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+typedef struct tcblcb_ARENACHUNK {
+    struct tcblcb_ARENACHUNK *next;
+    size_t size;
+    size_t used;
+} tcblcb_ARENACHUNK;
+
+#define ARENA_CHUNK_HEADER_SIZE ArenaAlign(sizeof(tcblcb_ARENACHUNK))
+#define ArenaChunkData(chunk) ((u_int8_t *)(chunk) + ARENA_CHUNK_HEADER_SIZE)
+
+typedef struct tcblcb_ARENAALLOC {
+    tcblcb_ARENA *arena;    // NULL for heap allocations
+    size_t size;            // bytes taken from the chunk, including this header
+} tcblcb_ARENAALLOC;
+
+#define ARENA_ALLOC_HEADER_SIZE ArenaAlign(sizeof(tcblcb_ARENAALLOC))
+
+struct tcblcb_ARENA {
+    tcblcb_ARENACHUNK *chunks;
+    size_t chunk_size;
+    size_t used;
+};
+
+// the arena of the request currently being handled (if any)
+static _Thread_local tcblcb_ARENA *_current_arena = NULL;
+
+static tcblcb_ARENACHUNK *arena_chunk_create(size_t size)
+{
+    tcblcb_ARENACHUNK *chunk = malloc(ARENA_CHUNK_HEADER_SIZE + size);
+    if (chunk != NULL) {
+        chunk->next = NULL;
+        chunk->size = size;
+        chunk->used = 0;
+    }
+    return chunk;
+}
+
+static void arena_chunks_free(tcblcb_ARENACHUNK *chunk)
+{
+    while (chunk != NULL) {
+        tcblcb_ARENACHUNK *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+tcblcb_ARENA *tcblcb_arena_create(size_t chunk_size)
+{
+    tcblcb_ARENA *arena = calloc(1, sizeof(tcblcb_ARENA));
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    arena->chunk_size = ArenaAlign(chunk_size);
+    arena->chunks = arena_chunk_create(arena->chunk_size);
+    if (arena->chunks == NULL) {
+        free(arena);
+        return NULL;
+    }
+
+    return arena;
+}
+
+void tcblcb_arena_destroy(tcblcb_ARENA *arena)
+{
+    if (arena == NULL) {
+        return;
+    }
+
+    if (_current_arena == arena) {
+        _current_arena = NULL;
+    }
+
+    arena_chunks_free(arena->chunks);
+    free(arena);
+}
+
+void tcblcb_arena_reset(tcblcb_ARENA *arena)
+{
+    // the head is always a regular chunk, since large allocations are linked in behind it
+    arena_chunks_free(arena->chunks->next);
+    arena->chunks->next = NULL;
+    arena->chunks->used = 0;
+    arena->used = 0;
+}
+
+size_t tcblcb_arena_used(const tcblcb_ARENA *arena)
+{
+    return arena->used;
+}
+
+tcblcb_ARENA *tcblcb_arena_enter(tcblcb_ARENA *arena)
+{
+    tcblcb_ARENA *previous = _current_arena;
+    _current_arena = arena;
+    return previous;
+}
+
+void tcblcb_arena_leave(tcblcb_ARENA *previous)
+{
+    _current_arena = previous;
+}
+
+static void *arena_alloc(tcblcb_ARENA *arena, size_t size)
+{
+    if (size > SIZE_MAX - ARENA_ALLOC_HEADER_SIZE - ARENA_ALIGNMENT) {
+        return NULL;
+    }
+    size_t needed = ARENA_ALLOC_HEADER_SIZE + ArenaAlign(size);
+
+    tcblcb_ARENACHUNK *chunk = arena->chunks;
+    if (needed > chunk->size - chunk->used) {
+        if (needed > arena->chunk_size / 4) {
+            tcblcb_ARENACHUNK *large_chunk = arena_chunk_create(needed);
+            if (large_chunk == NULL) {
+                return NULL;
+            }
+            large_chunk->next = chunk->next;
+            chunk->next = large_chunk;
+            chunk = large_chunk;
+        } else {
+            tcblcb_ARENACHUNK *new_chunk = arena_chunk_create(arena->chunk_size);
+            if (new_chunk == NULL) {
+                return NULL;
+            }
+            new_chunk->next = chunk;
+            arena->chunks = new_chunk;
+            chunk = new_chunk;
+        }
+    }
+
+    tcblcb_ARENAALLOC *alloc = (tcblcb_ARENAALLOC *)(ArenaChunkData(chunk) + chunk->used);
+    alloc->arena = arena;
+    alloc->size = needed;
+    chunk->used += needed;
+    arena->used += needed;
+
+    return (u_int8_t *)alloc + ARENA_ALLOC_HEADER_SIZE;
+}
+
+void *tcblcb_malloc(size_t size)
+{
+    if (_current_arena != NULL) {
+        return arena_alloc(_current_arena, size);
+    }
+
+    if (size > SIZE_MAX - ARENA_ALLOC_HEADER_SIZE) {
+        return NULL;
+    }
+
+    tcblcb_ARENAALLOC *alloc = malloc(ARENA_ALLOC_HEADER_SIZE + size);
+    if (alloc == NULL) {
+        return NULL;
+    }
+    alloc->arena = NULL;
+    alloc->size = 0;
+
+    return (u_int8_t *)alloc + ARENA_ALLOC_HEADER_SIZE;
+}
+
+void *tcblcb_calloc(size_t count, size_t size)
+{
+    if (size != 0 && count > SIZE_MAX / size) {
+        return NULL;
+    }
+
+    void *ptr = tcblcb_malloc(count * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+char *tcblcb_strdup(const char *str)
+{
+    size_t size = strlen(str) + 1;
+    char *copy = tcblcb_malloc(size);
+    if (copy != NULL) {
+        memcpy(copy, str, size);
+    }
+    return copy;
+}
+
+void tcblcb_free(void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    tcblcb_ARENAALLOC *alloc = (tcblcb_ARENAALLOC *)((u_int8_t *)ptr - ARENA_ALLOC_HEADER_SIZE);
+    if (alloc->arena == NULL) {
+        free(alloc);
+        return;
+    }
+
+    // hand back the space if this was the last allocation (e.g., a print buffer that was just
+    // copied into a larger one), otherwise it goes when the arena does
+    tcblcb_ARENA *arena = alloc->arena;
+    tcblcb_ARENACHUNK *chunk = arena->chunks;
+    if ((u_int8_t *)alloc + alloc->size == ArenaChunkData(chunk) + chunk->used) {
+        chunk->used -= alloc->size;
+        arena->used -= alloc->size;
+    }
+}
+
+void tcblcb_arena_init_json_hooks(void)
+{
+    cJSON_Hooks hooks = {
+        .malloc_fn = tcblcb_malloc,
+        .free_fn = tcblcb_free
+    };
+    cJSON_InitHooks(&hooks);
+}
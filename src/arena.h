@@ -0,0 +1,75 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef tcblcb_ARENA_HEADER_SEEN
+#define tcblcb_ARENA_HEADER_SEEN
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// bump allocator owned by a request context. everything allocated for a request (cJSON nodes,
+// printed strings, helper copies, delegates) comes out of its arena while it's current, and the
+// whole lot is released at once when the request context goes away.
+//
+// every allocation made through `tcblcb_malloc` carries a small header recording where it came
+// from, so `tcblcb_free` works on any of them: heap allocations (made when no arena is current)
+// are freed and arena allocations are left for the arena, unless they were the last allocation
+// made, in which case the space is handed back straight away.
+typedef struct tcblcb_ARENA tcblcb_ARENA;
+
+// create an arena that grows in chunks of `chunk_size` bytes.
+tcblcb_ARENA *tcblcb_arena_create(size_t chunk_size);
+
+// free the arena along with everything allocated from it.
+void tcblcb_arena_destroy(tcblcb_ARENA *arena);
+
+// release everything allocated from the arena, keeping its first chunk for reuse.
+void tcblcb_arena_reset(tcblcb_ARENA *arena);
+
+// bytes handed out by the arena since it was created or last reset.
+size_t tcblcb_arena_used(const tcblcb_ARENA *arena);
+
+// make `arena` the current arena for this worker and return the one it replaces, which should
+// be passed to `tcblcb_arena_leave` once done.
+tcblcb_ARENA *tcblcb_arena_enter(tcblcb_ARENA *arena);
+
+// restore the arena that was current before `tcblcb_arena_enter`.
+void tcblcb_arena_leave(tcblcb_ARENA *previous);
+
+// allocate from the current arena (or the heap if there is none). release with `tcblcb_free`.
+void *tcblcb_malloc(size_t size);
+
+// allocate zeroed memory from the current arena (or the heap if there is none).
+void *tcblcb_calloc(size_t count, size_t size);
+
+// copy a string into memory from `tcblcb_malloc`.
+char *tcblcb_strdup(const char *str);
+
+// release memory from `tcblcb_malloc` (a no-op for most arena allocations).
+void tcblcb_free(void *ptr);
+
+// route cJSON allocations through `tcblcb_malloc` and `tcblcb_free`. anything cJSON allocates
+// (e.g., printed strings) must then be released with `tcblcb_free` or `cJSON_free`.
+void tcblcb_arena_init_json_hooks(void);
+
+#endif /* !tcblcb_ARENA_HEADER_SEEN */
@@ -0,0 +1,280 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+#include <sys/queue.h>
+#include <kore/kore.h>
+
+#include "cache.h"
+#include "util.h"
+
+// entries are chained off a power of two bucket array sized for `max_entries` and also kept on
+// an LRU list (most recently used at the head) so the oldest can be evicted in constant time.
+// expired entries are dropped lazily when they're next looked up or reach the tail.
+//
+// each entry is charged for its struct plus the key and value copies (with terminators), which
+// is close enough to the real allocation size to keep the cache within its memory budget.
+
+typedef struct tcblcb_CACHEENTRY {
+    struct tcblcb_CACHEENTRY *next;
+    TAILQ_ENTRY(tcblcb_CACHEENTRY) lru;
+    u_int64_t hash;
+    u_int64_t stale;            // soft expiry
+    u_int64_t expires;
+    char *key;
+    size_t key_len;
+    char *value;        // NULL for negative entries
+    size_t value_len;
+    size_t bytes;
+} tcblcb_CACHEENTRY;
+
+struct tcblcb_CACHE {
+    char *name;
+    tcblcb_CACHEENTRY **buckets;
+    size_t num_buckets;
+    size_t num_entries;
+    size_t max_entries;
+    size_t bytes;
+    size_t max_bytes;
+    TAILQ_HEAD(tcblcb_CACHELRU, tcblcb_CACHEENTRY) lru;
+};
+
+// FNV-1a
+static u_int64_t cache_hash(const char *key, size_t key_len)
+{
+    u_int64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < key_len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static tcblcb_CACHEENTRY **cache_find_slot(tcblcb_CACHE *cache, u_int64_t hash, const char *key, size_t key_len)
+{
+    tcblcb_CACHEENTRY **slot = &cache->buckets[hash & (cache->num_buckets - 1)];
+    while (*slot != NULL) {
+        tcblcb_CACHEENTRY *entry = *slot;
+        if (entry->hash == hash && entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0) {
+            break;
+        }
+        slot = &entry->next;
+    }
+    return slot;
+}
+
+static void cache_entry_free(tcblcb_CACHEENTRY *entry)
+{
+    if (entry->value != NULL) {
+        free(entry->value);
+    }
+    free(entry->key);
+    free(entry);
+}
+
+static void cache_remove_slot(tcblcb_CACHE *cache, tcblcb_CACHEENTRY **slot)
+{
+    tcblcb_CACHEENTRY *entry = *slot;
+    *slot = entry->next;
+    TAILQ_REMOVE(&cache->lru, entry, lru);
+    cache->num_entries--;
+    cache->bytes -= entry->bytes;
+    cache_entry_free(entry);
+}
+
+static void cache_evict_oldest(tcblcb_CACHE *cache)
+{
+    tcblcb_CACHEENTRY *oldest = TAILQ_LAST(&cache->lru, tcblcb_CACHELRU);
+    if (oldest == NULL) {
+        return;
+    }
+
+    LogDebug("Cache %s evicting: %.*s", cache->name, (int)oldest->key_len, oldest->key);
+    cache_remove_slot(cache, cache_find_slot(cache, oldest->hash, oldest->key, oldest->key_len));
+}
+
+tcblcb_CACHE *tcblcb_cache_create(const char *name, size_t max_entries, size_t max_bytes)
+{
+    bool valid = false;
+
+    tcblcb_CACHE *cache = calloc(1, sizeof(tcblcb_CACHE));
+    IfNULLGotoDone(cache, "Failed to allocate cache");
+
+    TAILQ_INIT(&cache->lru);
+    cache->max_entries = max_entries > 0 ? max_entries : 1;
+    cache->max_bytes = max_bytes;
+
+    // keep the chains short by having at least as many buckets as entries
+    cache->num_buckets = 16;
+    while (cache->num_buckets < cache->max_entries) {
+        cache->num_buckets *= 2;
+    }
+
+    cache->buckets = calloc(cache->num_buckets, sizeof(tcblcb_CACHEENTRY *));
+    IfNULLGotoDone(cache->buckets, "Failed to allocate cache buckets");
+
+    cache->name = strdup(name);
+    IfNULLGotoDone(cache->name, "Failed to allocate cache name");
+
+    valid = true;
+
+done:
+    if (!valid && cache != NULL) {
+        tcblcb_cache_destroy(cache);
+        cache = NULL;
+    }
+
+    return cache;
+}
+
+void tcblcb_cache_destroy(tcblcb_CACHE *cache)
+{
+    tcblcb_CACHEENTRY *entry = NULL;
+    while ((entry = TAILQ_FIRST(&cache->lru)) != NULL) {
+        TAILQ_REMOVE(&cache->lru, entry, lru);
+        cache_entry_free(entry);
+    }
+
+    if (cache->buckets != NULL) {
+        free(cache->buckets);
+    }
+
+    if (cache->name != NULL) {
+        free(cache->name);
+    }
+
+    free(cache);
+}
+
+tcblcb_CACHE_RESULT tcblcb_cache_get(tcblcb_CACHE *cache, const char *key, size_t key_len, const char **value, size_t *value_len)
+{
+    u_int64_t hash = cache_hash(key, key_len);
+    tcblcb_CACHEENTRY **slot = cache_find_slot(cache, hash, key, key_len);
+    tcblcb_CACHEENTRY *entry = *slot;
+    if (entry == NULL) {
+        return CACHE_MISS;
+    }
+
+    u_int64_t now = kore_time_ms();
+    if (entry->expires <= now) {
+        cache_remove_slot(cache, slot);
+        return CACHE_MISS;
+    }
+
+    // most recently used moves to the head
+    TAILQ_REMOVE(&cache->lru, entry, lru);
+    TAILQ_INSERT_HEAD(&cache->lru, entry, lru);
+
+    if (entry->value == NULL) {
+        return CACHE_NEGATIVE;
+    }
+
+    *value = entry->value;
+    *value_len = entry->value_len;
+
+    // only this lookup is asked to refresh the entry
+    if (entry->stale <= now) {
+        entry->stale = now + CACHE_REFRESH_RETRY_MS;
+        return CACHE_STALE;
+    }
+
+    return CACHE_HIT;
+}
+
+bool tcblcb_cache_put(tcblcb_CACHE *cache, const char *key, size_t key_len, const char *value, size_t value_len, u_int64_t soft_ttl_ms, u_int64_t ttl_ms)
+{
+    bool valid = false;
+
+    tcblcb_CACHEENTRY *entry = NULL;
+
+    u_int64_t hash = cache_hash(key, key_len);
+    tcblcb_CACHEENTRY **slot = cache_find_slot(cache, hash, key, key_len);
+    if (*slot != NULL) {
+        cache_remove_slot(cache, slot);
+    }
+
+    size_t entry_bytes = sizeof(tcblcb_CACHEENTRY) + key_len + 1 + (value != NULL ? value_len + 1 : 0);
+    IfTrueGotoDone(
+        (entry_bytes > cache->max_bytes),
+        "Entry is larger than the cache"
+    );
+
+    entry = calloc(1, sizeof(tcblcb_CACHEENTRY));
+    IfNULLGotoDone(entry, "Failed to allocate cache entry");
+
+    u_int64_t now = kore_time_ms();
+    entry->hash = hash;
+    entry->stale = now + (value != NULL ? soft_ttl_ms : ttl_ms);
+    entry->expires = now + ttl_ms;
+
+    entry->key = malloc(key_len + 1);
+    IfNULLGotoDone(entry->key, "Failed to allocate cache entry key");
+    memcpy(entry->key, key, key_len);
+    entry->key[key_len] = '\0';
+    entry->key_len = key_len;
+
+    if (value != NULL) {
+        // values are kept NUL terminated so string values can be used in place
+        entry->value = malloc(value_len + 1);
+        IfNULLGotoDone(entry->value, "Failed to allocate cache entry value");
+        memcpy(entry->value, value, value_len);
+        entry->value[value_len] = '\0';
+        entry->value_len = value_len;
+    }
+
+    entry->bytes = entry_bytes;
+
+    while (cache->num_entries > 0
+           && (cache->num_entries >= cache->max_entries || cache->bytes + entry_bytes > cache->max_bytes)) {
+        cache_evict_oldest(cache);
+    }
+
+    // the slot may have moved if the evicted entry shared this bucket
+    slot = &cache->buckets[hash & (cache->num_buckets - 1)];
+    entry->next = *slot;
+    *slot = entry;
+    TAILQ_INSERT_HEAD(&cache->lru, entry, lru);
+    cache->num_entries++;
+    cache->bytes += entry_bytes;
+
+    valid = true;
+
+done:
+    if (!valid && entry != NULL) {
+        if (entry->key != NULL) {
+            free(entry->key);
+        }
+        free(entry);
+    }
+
+    return valid;
+}
+
+size_t tcblcb_cache_bytes(const tcblcb_CACHE *cache)
+{
+    return cache->bytes;
+}
+
+size_t tcblcb_cache_entries(const tcblcb_CACHE *cache)
+{
+    return cache->num_entries;
+}
@@ -0,0 +1,71 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef tcblcb_CACHE_HEADER_SEEN
+#define tcblcb_CACHE_HEADER_SEEN
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// small per-worker key/value cache with a TTL per entry. entries can also be negative, which
+// remembers that a lookup found nothing. the cache is bounded by both entry count and memory
+// (keys, values and per-entry overhead) and evicts the least recently used entries to fit.
+//
+// entries also have a soft TTL (stale-while-revalidate): past it they are still returned, but
+// the first lookup to see that gets CACHE_STALE and should refresh the entry in the background.
+// the lookups after it get CACHE_HIT until the entry is replaced, or for CACHE_REFRESH_RETRY_MS
+// if the refresh never lands, so a hot key is only refreshed once.
+typedef struct tcblcb_CACHE tcblcb_CACHE;
+
+typedef enum {
+    CACHE_MISS,         // nothing cached (or it expired)
+    CACHE_HIT,          // value returned
+    CACHE_NEGATIVE,     // the lookup is known to have no value
+    CACHE_STALE         // value returned, but past its soft TTL so the caller should refresh it
+} tcblcb_CACHE_RESULT;
+
+// how long a stale entry waits for its refresh before the next lookup is asked for another
+#define CACHE_REFRESH_RETRY_MS  (10 * 1000)
+
+// create a cache holding at most `max_entries` entries using at most `max_bytes` of memory.
+tcblcb_CACHE *tcblcb_cache_create(const char *name, size_t max_entries, size_t max_bytes);
+
+// free the cache and every entry in it.
+void tcblcb_cache_destroy(tcblcb_CACHE *cache);
+
+// look up `key`. on a hit `value` and `value_len` refer to the cached bytes, which are only
+// valid until the cache is next modified, so copy anything that needs to be kept.
+tcblcb_CACHE_RESULT tcblcb_cache_get(tcblcb_CACHE *cache, const char *key, size_t key_len, const char **value, size_t *value_len);
+
+// store a copy of `value` for `ttl_ms` (stale after `soft_ttl_ms`), replacing any existing entry.
+// a NULL value stores a negative entry, which is never stale. returns false if the entry could
+// not be stored (e.g., it's larger than the cache).
+bool tcblcb_cache_put(tcblcb_CACHE *cache, const char *key, size_t key_len, const char *value, size_t value_len, u_int64_t soft_ttl_ms, u_int64_t ttl_ms);
+
+// memory currently accounted to the cache entries.
+size_t tcblcb_cache_bytes(const tcblcb_CACHE *cache);
+
+// number of entries currently in the cache (including any that have expired but not been dropped).
+size_t tcblcb_cache_entries(const tcblcb_CACHE *cache);
+
+#endif /* !tcblcb_CACHE_HEADER_SEEN */
@@ -58,6 +58,12 @@
 
 #include "cJSON.h"
 
+/* vectorised scanning for string escapes (SSE2 is always available on x86-64) */
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define CJSON_ESCAPE_SIMD
+#include <immintrin.h>
+#endif
+
 /* define our own boolean type */
 #ifdef true
 #undef true
@@ -256,7 +262,7 @@ CJSON_PUBLIC(void) cJSON_Delete(cJSON *item)
         {
             cJSON_Delete(item->child);
         }
-        if (!(item->type & cJSON_IsReference) && (item->valuestring != NULL))
+        if (!(item->type & (cJSON_IsReference | cJSON_ValueStringIsConst)) && (item->valuestring != NULL))
         {
             global_hooks.deallocate(item->valuestring);
         }
@@ -264,6 +270,10 @@ CJSON_PUBLIC(void) cJSON_Delete(cJSON *item)
         {
             global_hooks.deallocate(item->string);
         }
+        if (item->object_index != NULL)
+        {
+            global_hooks.deallocate(item->object_index);
+        }
         global_hooks.deallocate(item);
         item = next;
     }
@@ -287,6 +297,7 @@ typedef struct
     size_t offset;
     size_t depth; /* How deeply nested (in arrays/objects) is the input at the current offset. */
     internal_hooks hooks;
+    cJSON_bool in_situ; /* decode strings in place and point into the content instead of copying them */
 } parse_buffer;
 
 /* check if the given size is left to read in a given parse buffer (starting with 1) */
@@ -297,6 +308,129 @@ typedef struct
 /* get a pointer to the buffer at the position */
 #define buffer_at_offset(buffer) ((buffer)->content + (buffer)->offset)
 
+/* powers of ten that are exactly representable as a double */
+static const double exact_powers_of_ten[] =
+{
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Parse the common number shapes (-?digits(.digits)?([eE][+-]?digits)?) without copying them or
+ * calling strtod. With at most 19 significant digits w, a value w * 10^e where w <= 2^53 and
+ * |e| <= 22 is a single multiplication or division of two exact doubles, which IEEE rounds
+ * correctly, so the result is exactly what strtod returns. This also doesn't depend on the locale.
+ * Returns the number of characters consumed, or 0 if the number has to go through strtod. */
+static size_t parse_simple_number(const unsigned char * const input, const size_t length, double * const number)
+{
+    unsigned long long mantissa = 0;
+    int significant_digits = 0;
+    int fraction_digits = 0;
+    int exponent = 0;
+    int exponent_sign = 1;
+    int exponent_digits = 0;
+    cJSON_bool negative = false;
+    size_t i = 0;
+    double value = 0.0;
+
+    if ((i < length) && (input[i] == '-'))
+    {
+        negative = true;
+        i++;
+    }
+
+    if ((i >= length) || (input[i] < '0') || (input[i] > '9'))
+    {
+        return 0;
+    }
+    for (; (i < length) && (input[i] >= '0') && (input[i] <= '9'); i++)
+    {
+        if ((mantissa != 0) || (input[i] != '0'))
+        {
+            significant_digits++;
+        }
+        mantissa = (mantissa * 10) + (unsigned long long)(input[i] - '0');
+        if (significant_digits > 19)
+        {
+            return 0;
+        }
+    }
+
+    if ((i < length) && (input[i] == '.'))
+    {
+        i++;
+        if ((i >= length) || (input[i] < '0') || (input[i] > '9'))
+        {
+            return 0;
+        }
+        for (; (i < length) && (input[i] >= '0') && (input[i] <= '9'); i++)
+        {
+            if ((mantissa != 0) || (input[i] != '0'))
+            {
+                significant_digits++;
+            }
+            mantissa = (mantissa * 10) + (unsigned long long)(input[i] - '0');
+            fraction_digits++;
+            if ((significant_digits > 19) || (fraction_digits > 400))
+            {
+                return 0;
+            }
+        }
+    }
+
+    if ((i < length) && ((input[i] == 'e') || (input[i] == 'E')))
+    {
+        i++;
+        if ((i < length) && ((input[i] == '+') || (input[i] == '-')))
+        {
+            exponent_sign = (input[i] == '-') ? -1 : 1;
+            i++;
+        }
+        for (; (i < length) && (input[i] >= '0') && (input[i] <= '9'); i++)
+        {
+            exponent = (exponent * 10) + (input[i] - '0');
+            if (++exponent_digits > 4)
+            {
+                return 0;
+            }
+        }
+        if (exponent_digits == 0)
+        {
+            return 0;
+        }
+    }
+
+    /* anything strtod might read further (e.g. "1.e5" or "1e") is left to strtod */
+    if ((i < length) && (((input[i] >= '0') && (input[i] <= '9')) || (input[i] == '.') || (input[i] == 'e') || (input[i] == 'E') || (input[i] == '+') || (input[i] == '-')))
+    {
+        return 0;
+    }
+
+    exponent = (exponent_sign * exponent) - fraction_digits;
+    if (mantissa == 0)
+    {
+        value = 0.0;
+    }
+    else if ((mantissa <= (1ULL << 53)) && (exponent >= -22) && (exponent <= 22))
+    {
+        value = (double)mantissa;
+        if (exponent < 0)
+        {
+            value /= exact_powers_of_ten[-exponent];
+        }
+        else
+        {
+            value *= exact_powers_of_ten[exponent];
+        }
+    }
+    else
+    {
+        return 0;
+    }
+
+    *number = negative ? -value : value;
+    return i;
+}
+
 /* Parse the input text to generate a number, and populate the result into item. */
 static cJSON_bool parse_number(cJSON * const item, parse_buffer * const input_buffer)
 {
@@ -304,6 +438,7 @@ static cJSON_bool parse_number(cJSON * const item, parse_buffer * const input_bu
     unsigned char *after_end = NULL;
     unsigned char number_c_string[64];
     unsigned char decimal_point = get_decimal_point();
+    size_t length = 0;
     size_t i = 0;
 
     if ((input_buffer == NULL) || (input_buffer->content == NULL))
@@ -311,6 +446,19 @@ static cJSON_bool parse_number(cJSON * const item, parse_buffer * const input_bu
         return false;
     }
 
+    /* read no further than the copy for strtod below, so long numbers are cut off in the same place */
+    length = input_buffer->length - input_buffer->offset;
+    if (length > (sizeof(number_c_string) - 1))
+    {
+        length = sizeof(number_c_string) - 1;
+    }
+    i = parse_simple_number(buffer_at_offset(input_buffer), length, &number);
+    if (i > 0)
+    {
+        input_buffer->offset += i;
+        goto number_parsed;
+    }
+
     /* copy the number into a temporary buffer and replace '.' with the decimal point
      * of the current locale (for strtod)
      * This also takes care of '\0' not necessarily being available for marking the end of the input */
@@ -351,7 +499,9 @@ loop_end:
     {
         return false; /* parse_error */
     }
+    input_buffer->offset += (size_t)(after_end - number_c_string);
 
+number_parsed:
     item->valuedouble = number;
 
     /* use saturation in case of overflow */
@@ -370,7 +520,6 @@ loop_end:
 
     item->type = cJSON_Number;
 
-    input_buffer->offset += (size_t)(after_end - number_c_string);
     return true;
 }
 
@@ -411,11 +560,12 @@ CJSON_PUBLIC(char*) cJSON_SetValuestring(cJSON *object, const char *valuestring)
     {
         return NULL;
     }
-    if (object->valuestring != NULL)
+    if ((object->valuestring != NULL) && !(object->type & cJSON_ValueStringIsConst))
     {
         cJSON_free(object->valuestring);
     }
     object->valuestring = copy;
+    object->type &= ~cJSON_ValueStringIsConst;
 
     return copy;
 }
@@ -539,6 +689,93 @@ static cJSON_bool compare_double(double a, double b)
     return (fabs(a - b) <= maxVal * DBL_EPSILON);
 }
 
+/* Print numbers that are exactly a decimal of at most 15 significant digits without going through
+ * sprintf/sscanf. The shortest decimal n / 10^k is found by checking that n / 10^k == d, which is
+ * exact because both operands are exact and IEEE division rounds correctly, the same way strtod
+ * rounds the decimal. This covers integers and values such as prices, and prints exactly what
+ * "%1.15g" would (fixed notation is only used between 1e-4 and 1e15). Returns the length, or 0 if
+ * the number has to take the slow path. */
+static int print_short_decimal(double d, unsigned char * const number_buffer)
+{
+    double magnitude = fabs(d);
+    double scaled = 0.0;
+    double candidate = 0.0;
+    unsigned char digits[16];
+    unsigned long long n = 0;
+    int num_digits = 0;
+    int length = 0;
+    int k = 0;
+    int i = 0;
+
+    if (d == 0)
+    {
+        /* keep the sign of negative zero like "%g" does */
+        if (signbit(d))
+        {
+            number_buffer[length++] = '-';
+        }
+        number_buffer[length++] = '0';
+        number_buffer[length] = '\0';
+        return length;
+    }
+
+    if (!((magnitude >= 1e-4) && (magnitude < 1e15)))
+    {
+        return 0;
+    }
+
+    for (k = 0; k < (int)(sizeof(exact_powers_of_ten) / sizeof(exact_powers_of_ten[0])); k++)
+    {
+        scaled = magnitude * exact_powers_of_ten[k];
+        if (scaled >= 1e15)
+        {
+            /* needs more than 15 significant digits */
+            return 0;
+        }
+
+        candidate = floor(scaled + 0.5);
+        if ((candidate / exact_powers_of_ten[k]) == magnitude)
+        {
+            break;
+        }
+    }
+    if (k == (int)(sizeof(exact_powers_of_ten) / sizeof(exact_powers_of_ten[0])))
+    {
+        return 0;
+    }
+
+    for (n = (unsigned long long)candidate; n > 0; n /= 10)
+    {
+        digits[num_digits++] = (unsigned char)('0' + (n % 10));
+    }
+
+    if (d < 0)
+    {
+        number_buffer[length++] = '-';
+    }
+    if (num_digits <= k)
+    {
+        /* 0.000ddd */
+        number_buffer[length++] = '0';
+        number_buffer[length++] = '.';
+        for (i = num_digits; i < k; i++)
+        {
+            number_buffer[length++] = '0';
+        }
+    }
+    for (i = num_digits - 1; i >= 0; i--)
+    {
+        number_buffer[length++] = digits[i];
+        if ((i == k) && (k > 0))
+        {
+            number_buffer[length++] = '.';
+        }
+    }
+    number_buffer[length] = '\0';
+
+    return length;
+}
+
 /* Render the number nicely from the given item into a string. */
 static cJSON_bool print_number(const cJSON * const item, printbuffer * const output_buffer)
 {
@@ -560,6 +797,10 @@ static cJSON_bool print_number(const cJSON * const item, printbuffer * const out
     {
         length = sprintf((char*)number_buffer, "null");
     }
+    else if ((length = print_short_decimal(d, number_buffer)) > 0)
+    {
+        /* printed without a round trip through sprintf/sscanf */
+    }
     else
     {
         /* Try 15 decimal places of precision to avoid nonsignificant nonzero digits */
@@ -763,6 +1004,21 @@ fail:
     return 0;
 }
 
+#if defined(__clang__) || (defined(__GNUC__)  && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ > 5))))
+    #pragma GCC diagnostic push
+#endif
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wcast-qual"
+#endif
+/* helper function to cast away const */
+static void* cast_away_const(const void* string)
+{
+    return (void*)string;
+}
+#if defined(__clang__) || (defined(__GNUC__)  && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ > 5))))
+    #pragma GCC diagnostic pop
+#endif
+
 /* Parse the input text into an unescaped cinput, and populate item. */
 static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_buffer)
 {
@@ -771,8 +1027,8 @@ static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_bu
     unsigned char *output_pointer = NULL;
     unsigned char *output = NULL;
 
-    /* not a string */
-    if (buffer_at_offset(input_buffer)[0] != '\"')
+    /* not a string (or the input ended right after a ',' or '{') */
+    if (cannot_access_at_index(input_buffer, 0) || (buffer_at_offset(input_buffer)[0] != '\"'))
     {
         goto fail;
     }
@@ -801,12 +1057,26 @@ static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_bu
             goto fail; /* string ended unexpectedly */
         }
 
-        /* This is at most how much we need for the output */
-        allocation_length = (size_t) (input_end - buffer_at_offset(input_buffer)) - skipped_bytes;
-        output = (unsigned char*)input_buffer->hooks.allocate(allocation_length + sizeof(""));
-        if (output == NULL)
+        if (input_buffer->in_situ)
         {
-            goto fail; /* allocation failure */
+            /* the unescaped string is never longer than the literal, so it can be written over it
+             * and terminated where the closing quote was */
+            output = (unsigned char*)cast_away_const(input_pointer);
+            if (skipped_bytes == 0)
+            {
+                output_pointer = output + (input_end - input_pointer);
+                goto terminate;
+            }
+        }
+        else
+        {
+            /* This is at most how much we need for the output */
+            allocation_length = (size_t) (input_end - buffer_at_offset(input_buffer)) - skipped_bytes;
+            output = (unsigned char*)input_buffer->hooks.allocate(allocation_length + sizeof(""));
+            if (output == NULL)
+            {
+                goto fail; /* allocation failure */
+            }
         }
     }
 
@@ -867,10 +1137,11 @@ static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_bu
         }
     }
 
+terminate:
     /* zero terminate the output */
     *output_pointer = '\0';
 
-    item->type = cJSON_String;
+    item->type = input_buffer->in_situ ? (cJSON_String | cJSON_ValueStringIsConst) : cJSON_String;
     item->valuestring = (char*)output;
 
     input_buffer->offset = (size_t) (input_end - input_buffer->content);
@@ -879,7 +1150,7 @@ static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_bu
     return true;
 
 fail:
-    if (output != NULL)
+    if ((output != NULL) && !input_buffer->in_situ)
     {
         input_buffer->hooks.deallocate(output);
     }
@@ -892,13 +1163,60 @@ fail:
     return false;
 }
 
+/* true for the characters that have to be escaped in a JSON string */
+#define needs_escape(c) (((c) < 32) || ((c) == '\"') || ((c) == '\\'))
+
+static size_t find_escape_scalar(const unsigned char * const input, const size_t length)
+{
+    size_t position = 0;
+    while ((position < length) && !needs_escape(input[position]))
+    {
+        position++;
+    }
+    return position;
+}
+
+#ifdef CJSON_ESCAPE_SIMD
+/* a byte needs escaping if it's <= 0x1f (unsigned max with 0x1f is 0x1f), '"' or '\' */
+static size_t find_escape_sse2(const unsigned char * const input, const size_t length)
+{
+    const __m128i control = _mm_set1_epi8(0x1f);
+    const __m128i quote = _mm_set1_epi8('\"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    size_t position = 0;
+
+    for (; (position + 16) <= length; position += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(const void *)(input + position));
+        __m128i escapes = _mm_or_si128(
+            _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+        int mask = _mm_movemask_epi8(escapes);
+        if (mask != 0)
+        {
+            return position + (size_t)__builtin_ctz((unsigned int)mask);
+        }
+    }
+
+    return position + find_escape_scalar(input + position, length - position);
+}
+
+/* length of the run at the start of input that can be copied as is */
+#define find_escape(input, length) find_escape_sse2((input), (length))
+#else
+#define find_escape(input, length) find_escape_scalar((input), (length))
+#endif
+
 /* Render the cstring provided to an escaped version that can be printed. */
 static cJSON_bool print_string_ptr(const unsigned char * const input, printbuffer * const output_buffer)
 {
     const unsigned char *input_pointer = NULL;
     unsigned char *output = NULL;
     unsigned char *output_pointer = NULL;
+    size_t input_length = 0;
     size_t output_length = 0;
+    size_t position = 0;
+    size_t run_length = 0;
     /* numbers of additional characters needed for escaping */
     size_t escape_characters = 0;
 
@@ -920,10 +1238,12 @@ static cJSON_bool print_string_ptr(const unsigned char * const input, printbuffe
         return true;
     }
 
-    /* set "flag" to 1 if something needs to be escaped */
-    for (input_pointer = input; *input_pointer; input_pointer++)
+    /* count the additional characters, skipping over the runs that don't need escaping */
+    input_length = strlen((const char*)input);
+    position = find_escape(input, input_length);
+    while (position < input_length)
     {
-        switch (*input_pointer)
+        switch (input[position])
         {
             case '\"':
             case '\\':
@@ -936,15 +1256,14 @@ static cJSON_bool print_string_ptr(const unsigned char * const input, printbuffe
                 escape_characters++;
                 break;
             default:
-                if (*input_pointer < 32)
-                {
-                    /* UTF-16 escape sequence uXXXX */
-                    escape_characters += 5;
-                }
+                /* UTF-16 escape sequence uXXXX */
+                escape_characters += 5;
                 break;
         }
+        position++;
+        position += find_escape(input + position, input_length - position);
     }
-    output_length = (size_t)(input_pointer - input) + escape_characters;
+    output_length = input_length + escape_characters;
 
     output = ensure(output_buffer, output_length + sizeof("\"\""));
     if (output == NULL)
@@ -965,47 +1284,48 @@ static cJSON_bool print_string_ptr(const unsigned char * const input, printbuffe
 
     output[0] = '\"';
     output_pointer = output + 1;
-    /* copy the string */
-    for (input_pointer = input; *input_pointer != '\0'; (void)input_pointer++, output_pointer++)
+    /* copy the string a clean run at a time */
+    for (input_pointer = input; input_pointer < input + input_length; (void)input_pointer++, output_pointer++)
     {
-        if ((*input_pointer > 31) && (*input_pointer != '\"') && (*input_pointer != '\\'))
+        run_length = find_escape(input_pointer, input_length - (size_t)(input_pointer - input));
+        memcpy(output_pointer, input_pointer, run_length);
+        input_pointer += run_length;
+        output_pointer += run_length;
+        if (input_pointer == input + input_length)
         {
-            /* normal character, copy */
-            *output_pointer = *input_pointer;
+            break;
         }
-        else
+
+        /* character needs to be escaped */
+        *output_pointer++ = '\\';
+        switch (*input_pointer)
         {
-            /* character needs to be escaped */
-            *output_pointer++ = '\\';
-            switch (*input_pointer)
-            {
-                case '\\':
-                    *output_pointer = '\\';
-                    break;
-                case '\"':
-                    *output_pointer = '\"';
-                    break;
-                case '\b':
-                    *output_pointer = 'b';
-                    break;
-                case '\f':
-                    *output_pointer = 'f';
-                    break;
-                case '\n':
-                    *output_pointer = 'n';
-                    break;
-                case '\r':
-                    *output_pointer = 'r';
-                    break;
-                case '\t':
-                    *output_pointer = 't';
-                    break;
-                default:
-                    /* escape and print as unicode codepoint */
-                    sprintf((char*)output_pointer, "u%04x", *input_pointer);
-                    output_pointer += 4;
-                    break;
-            }
+            case '\\':
+                *output_pointer = '\\';
+                break;
+            case '\"':
+                *output_pointer = '\"';
+                break;
+            case '\b':
+                *output_pointer = 'b';
+                break;
+            case '\f':
+                *output_pointer = 'f';
+                break;
+            case '\n':
+                *output_pointer = 'n';
+                break;
+            case '\r':
+                *output_pointer = 'r';
+                break;
+            case '\t':
+                *output_pointer = 't';
+                break;
+            default:
+                /* escape and print as unicode codepoint */
+                sprintf((char*)output_pointer, "u%04x", *input_pointer);
+                output_pointer += 4;
+                break;
         }
     }
     output[output_length + 1] = '\"';
@@ -1086,9 +1406,9 @@ CJSON_PUBLIC(cJSON *) cJSON_ParseWithOpts(const char *value, const char **return
 }
 
 /* Parse an object - create a new root, and populate. */
-CJSON_PUBLIC(cJSON *) cJSON_ParseWithLengthOpts(const char *value, size_t buffer_length, const char **return_parse_end, cJSON_bool require_null_terminated)
+static cJSON *parse_with_length(const char *value, size_t buffer_length, const char **return_parse_end, cJSON_bool require_null_terminated, cJSON_bool in_situ)
 {
-    parse_buffer buffer = { 0, 0, 0, 0, { 0, 0, 0 } };
+    parse_buffer buffer = { 0, 0, 0, 0, { 0, 0, 0 }, 0 };
     cJSON *item = NULL;
 
     /* reset error position */
@@ -1104,6 +1424,7 @@ CJSON_PUBLIC(cJSON *) cJSON_ParseWithLengthOpts(const char *value, size_t buffer
     buffer.length = buffer_length; 
     buffer.offset = 0;
     buffer.hooks = global_hooks;
+    buffer.in_situ = in_situ;
 
     item = cJSON_New_Item(&global_hooks);
     if (item == NULL) /* memory fail */
@@ -1176,6 +1497,16 @@ CJSON_PUBLIC(cJSON *) cJSON_ParseWithLength(const char *value, size_t buffer_len
     return cJSON_ParseWithLengthOpts(value, buffer_length, 0, 0);
 }
 
+CJSON_PUBLIC(cJSON *) cJSON_ParseWithLengthOpts(const char *value, size_t buffer_length, const char **return_parse_end, cJSON_bool require_null_terminated)
+{
+    return parse_with_length(value, buffer_length, return_parse_end, require_null_terminated, false);
+}
+
+CJSON_PUBLIC(cJSON *) cJSON_ParseInSitu(char *value, size_t buffer_length)
+{
+    return parse_with_length(value, buffer_length, 0, 0, true);
+}
+
 #define cjson_min(a, b) (((a) < (b)) ? (a) : (b))
 
 static unsigned char *print(const cJSON * const item, cJSON_bool format, const internal_hooks * const hooks)
@@ -1660,6 +1991,11 @@ static cJSON_bool parse_object(cJSON * const item, parse_buffer * const input_bu
         /* swap valuestring and string, because we parsed the name */
         current_item->string = current_item->valuestring;
         current_item->valuestring = NULL;
+        if (input_buffer->in_situ)
+        {
+            /* an in situ name belongs to the buffer, including if parsing the value fails */
+            current_item->type = cJSON_StringIsConst;
+        }
 
         if (cannot_access_at_index(input_buffer, 0) || (buffer_at_offset(input_buffer)[0] != ':'))
         {
@@ -1673,6 +2009,10 @@ static cJSON_bool parse_object(cJSON * const item, parse_buffer * const input_bu
         {
             goto fail; /* failed to parse value */
         }
+        if (input_buffer->in_situ)
+        {
+            current_item->type |= cJSON_StringIsConst;
+        }
         buffer_skip_whitespace(input_buffer);
     }
     while (can_access_at_index(input_buffer, 0) && (buffer_at_offset(input_buffer)[0] == ','));
@@ -1871,15 +2211,140 @@ CJSON_PUBLIC(cJSON *) cJSON_GetArrayItem(const cJSON *array, int index)
     return get_array_item(array, (size_t)index);
 }
 
+/* Objects with at least this many members get a hash index on their first case sensitive lookup. */
+#define OBJECT_INDEX_THRESHOLD 16
+
+/* Open addressing table of an object's members keyed by name. Rebuilt lazily after any change to the members. */
+struct cJSON_ObjectIndex
+{
+    size_t mask;
+    cJSON **slots;
+};
+
+/* FNV-1a */
+static size_t hash_object_key(const unsigned char *key)
+{
+    unsigned long hash = 2166136261UL;
+    while (*key != '\0')
+    {
+        hash ^= *key++;
+        hash = (hash * 16777619UL) & 0xffffffffUL;
+    }
+
+    return (size_t)hash;
+}
+
+static void invalidate_object_index(cJSON * const object)
+{
+    if (object->object_index != NULL)
+    {
+        global_hooks.deallocate(object->object_index);
+        object->object_index = NULL;
+    }
+}
+
+static struct cJSON_ObjectIndex *build_object_index(const cJSON * const object)
+{
+    struct cJSON_ObjectIndex *index = NULL;
+    cJSON *current_element = NULL;
+    size_t count = 0;
+    size_t capacity = 1;
+    size_t slot = 0;
+
+    /* a reference shares its members with the object it refers to, which can change them without
+       dropping the reference's index, so lookups through a reference stay linear */
+    if (!cJSON_IsObject(object) || (object->type & cJSON_IsReference))
+    {
+        return NULL;
+    }
+
+    /* unnamed members would stop a linear lookup early, so leave those objects alone */
+    for (current_element = object->child; current_element != NULL; current_element = current_element->next)
+    {
+        if (current_element->string == NULL)
+        {
+            return NULL;
+        }
+        count++;
+    }
+    if (count < OBJECT_INDEX_THRESHOLD)
+    {
+        return NULL;
+    }
+
+    /* keep the table at most half full */
+    while (capacity < (count * 2))
+    {
+        capacity <<= 1;
+    }
+
+    index = (struct cJSON_ObjectIndex*)global_hooks.allocate(sizeof(struct cJSON_ObjectIndex) + (capacity * sizeof(cJSON*)));
+    if (index == NULL)
+    {
+        return NULL;
+    }
+    index->mask = capacity - 1;
+    index->slots = (cJSON**)(index + 1);
+    memset(index->slots, '\0', capacity * sizeof(cJSON*));
+
+    for (current_element = object->child; current_element != NULL; current_element = current_element->next)
+    {
+        slot = hash_object_key((const unsigned char*)current_element->string) & index->mask;
+        while ((index->slots[slot] != NULL) && (strcmp(index->slots[slot]->string, current_element->string) != 0))
+        {
+            slot = (slot + 1) & index->mask;
+        }
+        /* the first of any duplicate names wins, as it does for a linear lookup */
+        if (index->slots[slot] == NULL)
+        {
+            index->slots[slot] = current_element;
+        }
+    }
+
+    /* the index is a cache, so attaching it doesn't really modify the object */
+    ((cJSON*)object)->object_index = index;
+
+    return index;
+}
+
+static cJSON *find_indexed_object_item(const struct cJSON_ObjectIndex * const index, const char * const name)
+{
+    size_t slot = hash_object_key((const unsigned char*)name) & index->mask;
+    while (index->slots[slot] != NULL)
+    {
+        if (strcmp(index->slots[slot]->string, name) == 0)
+        {
+            return index->slots[slot];
+        }
+        slot = (slot + 1) & index->mask;
+    }
+
+    return NULL;
+}
+
 static cJSON *get_object_item(const cJSON * const object, const char * const name, const cJSON_bool case_sensitive)
 {
     cJSON *current_element = NULL;
+    struct cJSON_ObjectIndex *index = NULL;
 
     if ((object == NULL) || (name == NULL))
     {
         return NULL;
     }
 
+    if (case_sensitive)
+    {
+        index = object->object_index;
+        if (index == NULL)
+        {
+            index = build_object_index(object);
+        }
+        if (index != NULL)
+        {
+            return find_indexed_object_item(index, name);
+        }
+    }
+
     current_element = object->child;
     if (case_sensitive)
     {
@@ -1942,6 +2407,7 @@ static cJSON *create_reference(const cJSON *item, const internal_hooks * const h
 
     memcpy(reference, item, sizeof(cJSON));
     reference->string = NULL;
+    reference->object_index = NULL;
     reference->type |= cJSON_IsReference;
     reference->next = reference->prev = NULL;
     return reference;
@@ -1956,6 +2422,8 @@ static cJSON_bool add_item_to_array(cJSON *array, cJSON *item)
         return false;
     }
 
+    invalidate_object_index(array);
+
     child = array->child;
     /*
      * To find the last item in array quickly, we use prev in array
@@ -1986,21 +2454,6 @@ CJSON_PUBLIC(cJSON_bool) cJSON_AddItemToArray(cJSON *array, cJSON *item)
     return add_item_to_array(array, item);
 }
 
-#if defined(__clang__) || (defined(__GNUC__)  && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ > 5))))
-    #pragma GCC diagnostic push
-#endif
-#ifdef __GNUC__
-#pragma GCC diagnostic ignored "-Wcast-qual"
-#endif
-/* helper function to cast away const */
-static void* cast_away_const(const void* string)
-{
-    return (void*)string;
-}
-#if defined(__clang__) || (defined(__GNUC__)  && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ > 5))))
-    #pragma GCC diagnostic pop
-#endif
-
 
 static cJSON_bool add_item_to_object(cJSON * const object, const char * const string, cJSON * const item, const internal_hooks * const hooks, const cJSON_bool constant_key)
 {
@@ -2185,6 +2638,8 @@ CJSON_PUBLIC(cJSON *) cJSON_DetachItemViaPointer(cJSON *parent, cJSON * const it
         return NULL;
     }
 
+    invalidate_object_index(parent);
+
     if (item != parent->child)
     {
         /* not the first element */
@@ -2269,6 +2724,8 @@ CJSON_PUBLIC(cJSON_bool) cJSON_InsertItemInArray(cJSON *array, int which, cJSON
         return add_item_to_array(array, newitem);
     }
 
+    invalidate_object_index(array);
+
     newitem->next = after_inserted;
     newitem->prev = after_inserted->prev;
     after_inserted->prev = newitem;
@@ -2295,6 +2752,8 @@ CJSON_PUBLIC(cJSON_bool) cJSON_ReplaceItemViaPointer(cJSON * const parent, cJSON
         return true;
     }
 
+    invalidate_object_index(parent);
+
     replacement->next = item->next;
     replacement->prev = item->prev;
 
@@ -2698,7 +3157,7 @@ CJSON_PUBLIC(cJSON *) cJSON_Duplicate(const cJSON *item, cJSON_bool recurse)
         goto fail;
     }
     /* Copy over all vars */
-    newitem->type = item->type & (~cJSON_IsReference);
+    newitem->type = item->type & (~(cJSON_IsReference | cJSON_ValueStringIsConst));
     newitem->valueint = item->valueint;
     newitem->valuedouble = item->valuedouble;
     if (item->valuestring)
@@ -0,0 +1,455 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+#include <poll.h>
+#include <sys/queue.h>
+#include <kore/kore.h>
+
+#include "lcb-iops.h"
+#include "util.h"
+
+// libcouchbase uses the "event" IO model here: it asks to be told when a socket is readable or
+// writable and then does its own non-blocking reads/writes until EAGAIN. sockets are registered
+// with Kore's edge triggered event loop, so readiness reported while libcouchbase isn't watching
+// is remembered and delivered as soon as it is watched again.
+//
+// `lcb_wait()` still works (e.g., during `kore_worker_configure`) by running a private poll(2)
+// loop over the same sockets and timers until libcouchbase stops it.
+//
+// a socket stays in Kore's epoll set for as long as an event is bound to it. destroying the event
+// (pooled sockets outlive their events) or closing the socket takes it out again, otherwise the
+// next edge would be dispatched to an event that has already been freed.
+
+typedef struct tcblcb_IOEVENT {
+    // must be first so Kore can dispatch to `handle`
+    struct kore_event evt;
+    TAILQ_ENTRY(tcblcb_IOEVENT) list;
+    struct tcblcb_IOLOOP *loop;
+    lcb_socket_t fd;
+    short watched;
+    short ready;
+    bool dead;
+    void *uarg;
+    lcb_ioE_callback callback;
+} tcblcb_IOEVENT;
+
+typedef struct tcblcb_IOTIMER {
+    TAILQ_ENTRY(tcblcb_IOTIMER) list;
+    struct tcblcb_IOLOOP *loop;
+    struct kore_timer *ktimer;
+    u_int64_t deadline;
+    void *uarg;
+    lcb_ioE_callback callback;
+} tcblcb_IOTIMER;
+
+typedef struct tcblcb_IOLOOP {
+    TAILQ_HEAD(, tcblcb_IOEVENT) events;
+    TAILQ_HEAD(, tcblcb_IOEVENT) dead_events;
+    TAILQ_HEAD(, tcblcb_IOTIMER) timers;
+    // one-shot Kore timer used to deliver remembered readiness and reap destroyed events
+    struct kore_timer *pending;
+    bool running;
+} tcblcb_IOLOOP;
+
+#define IOLOOP(iops) ((tcblcb_IOLOOP *)(iops)->v.v3.cookie)
+
+// the plain BSD close, wrapped so sockets leave the epoll set before their descriptor is reused
+static void (*bsd_close)(lcb_io_opt_t, lcb_socket_t);
+
+static void iops_event_unbind(tcblcb_IOEVENT *ev)
+{
+    if (ev->fd != -1) {
+        kore_platform_disable_read(ev->fd);
+        ev->fd = -1;
+        ev->ready = 0;
+        ev->watched = 0;
+        ev->evt.flags = 0;
+    }
+}
+
+static void iops_event_deliver(tcblcb_IOEVENT *ev)
+{
+    short which = ev->ready & ev->watched;
+    if (ev->dead || ev->callback == NULL || which == 0) {
+        return;
+    }
+
+    ev->ready &= ~which;
+    ev->callback(ev->fd, which, ev->uarg);
+}
+
+static void iops_pending_run(void *arg, __unused u_int64_t now)
+{
+    tcblcb_IOLOOP *loop = arg;
+    tcblcb_IOEVENT *ev = NULL;
+    tcblcb_IOEVENT *next = NULL;
+
+    // Kore frees one-shot timers after this returns
+    loop->pending = NULL;
+
+    for (ev = TAILQ_FIRST(&loop->events); ev != NULL; ev = next) {
+        next = TAILQ_NEXT(ev, list);
+        iops_event_deliver(ev);
+    }
+
+    // events are only freed here because Kore may still hold them in the current epoll batch
+    while ((ev = TAILQ_FIRST(&loop->dead_events)) != NULL) {
+        TAILQ_REMOVE(&loop->dead_events, ev, list);
+        free(ev);
+    }
+}
+
+static void iops_pending_schedule(tcblcb_IOLOOP *loop)
+{
+    if (loop->pending == NULL) {
+        loop->pending = kore_timer_add(iops_pending_run, 0, loop, KORE_TIMER_ONESHOT);
+    }
+}
+
+// called by Kore when an edge is reported for the socket
+static void iops_event_handle(void *arg, int error)
+{
+    tcblcb_IOEVENT *ev = arg;
+
+    if (ev->evt.flags & KORE_EVENT_READ) {
+        ev->ready |= LCB_READ_EVENT;
+    }
+    if (ev->evt.flags & KORE_EVENT_WRITE) {
+        ev->ready |= LCB_WRITE_EVENT;
+    }
+    // let libcouchbase discover the actual error from the socket
+    if (error) {
+        ev->ready |= LCB_RW_EVENT;
+    }
+    ev->evt.flags = 0;
+
+    iops_event_deliver(ev);
+}
+
+static void *iops_event_create(lcb_io_opt_t iops)
+{
+    tcblcb_IOEVENT *ev = calloc(1, sizeof(tcblcb_IOEVENT));
+    if (ev != NULL) {
+        ev->evt.handle = iops_event_handle;
+        ev->loop = IOLOOP(iops);
+        ev->fd = -1;
+        TAILQ_INSERT_TAIL(&ev->loop->events, ev, list);
+    }
+    return ev;
+}
+
+static void iops_event_destroy(__unused lcb_io_opt_t iops, void *event)
+{
+    tcblcb_IOEVENT *ev = event;
+    iops_event_unbind(ev);
+    ev->dead = true;
+    ev->callback = NULL;
+    TAILQ_REMOVE(&ev->loop->events, ev, list);
+    TAILQ_INSERT_TAIL(&ev->loop->dead_events, ev, list);
+    iops_pending_schedule(ev->loop);
+}
+
+static void iops_event_cancel(__unused lcb_io_opt_t iops, __unused lcb_socket_t sock, void *event)
+{
+    // the socket stays registered with Kore until the event is destroyed or the socket closed,
+    // so an edge that arrives in between is remembered for the next watch
+    tcblcb_IOEVENT *ev = event;
+    ev->watched = 0;
+}
+
+static int iops_event_watch(
+    __unused lcb_io_opt_t iops, lcb_socket_t sock, void *event,
+    short evflags, void *uarg, lcb_ioE_callback callback)
+{
+    tcblcb_IOEVENT *ev = event;
+
+    if (ev->fd != sock) {
+        iops_event_unbind(ev);
+        ev->fd = sock;
+        ev->ready = 0;
+        ev->evt.flags = 0;
+        kore_platform_event_all(sock, ev);
+    }
+
+    ev->watched = evflags & LCB_RW_EVENT;
+    ev->uarg = uarg;
+    ev->callback = callback;
+
+    // never call back into libcouchbase from inside its own watch request
+    if (ev->ready & ev->watched) {
+        iops_pending_schedule(ev->loop);
+    }
+
+    return 0;
+}
+
+static void iops_close(lcb_io_opt_t iops, lcb_socket_t sock)
+{
+    tcblcb_IOEVENT *ev = NULL;
+    TAILQ_FOREACH(ev, &IOLOOP(iops)->events, list) {
+        if (ev->fd == sock) {
+            iops_event_unbind(ev);
+        }
+    }
+    bsd_close(iops, sock);
+}
+
+static void iops_timer_cancel(__unused lcb_io_opt_t iops, void *timer)
+{
+    tcblcb_IOTIMER *t = timer;
+    if (t->ktimer != NULL) {
+        kore_timer_remove(t->ktimer);
+        t->ktimer = NULL;
+    }
+}
+
+static void iops_timer_fire(tcblcb_IOTIMER *t)
+{
+    t->callback(-1, 0, t->uarg);
+}
+
+static void iops_timer_run(void *arg, __unused u_int64_t now)
+{
+    tcblcb_IOTIMER *t = arg;
+
+    // Kore frees one-shot timers after this returns
+    t->ktimer = NULL;
+    iops_timer_fire(t);
+}
+
+static void *iops_timer_create(lcb_io_opt_t iops)
+{
+    tcblcb_IOTIMER *t = calloc(1, sizeof(tcblcb_IOTIMER));
+    if (t != NULL) {
+        t->loop = IOLOOP(iops);
+        TAILQ_INSERT_TAIL(&t->loop->timers, t, list);
+    }
+    return t;
+}
+
+static void iops_timer_destroy(lcb_io_opt_t iops, void *timer)
+{
+    tcblcb_IOTIMER *t = timer;
+    iops_timer_cancel(iops, t);
+    TAILQ_REMOVE(&t->loop->timers, t, list);
+    free(t);
+}
+
+static int iops_timer_schedule(lcb_io_opt_t iops, void *timer, lcb_U32 usecs, void *uarg, lcb_ioE_callback callback)
+{
+    tcblcb_IOTIMER *t = timer;
+    iops_timer_cancel(iops, t);
+
+    // Kore timers have millisecond resolution, so round up
+    u_int64_t msecs = (usecs + 999) / 1000;
+    t->deadline = kore_time_ms() + msecs;
+    t->uarg = uarg;
+    t->callback = callback;
+    t->ktimer = kore_timer_add(iops_timer_run, msecs, t, KORE_TIMER_ONESHOT);
+
+    return 0;
+}
+
+// run one iteration of the private loop used by `lcb_wait()`
+static void iops_loop_once(tcblcb_IOLOOP *loop, bool block)
+{
+    tcblcb_IOEVENT *ev = NULL;
+    tcblcb_IOTIMER *t = NULL;
+
+    nfds_t nfds = 0;
+    TAILQ_FOREACH(ev, &loop->events, list) {
+        if (ev->fd != -1 && ev->watched != 0) {
+            nfds++;
+        }
+    }
+
+    int timeout = -1;
+    u_int64_t now = kore_time_ms();
+    TAILQ_FOREACH(t, &loop->timers, list) {
+        if (t->ktimer != NULL) {
+            int remaining = t->deadline > now ? (int)(t->deadline - now) : 0;
+            if (timeout == -1 || remaining < timeout) {
+                timeout = remaining;
+            }
+        }
+    }
+
+    if (!block) {
+        timeout = 0;
+    } else if (nfds == 0 && timeout == -1) {
+        // nothing could ever wake us up
+        loop->running = false;
+        return;
+    }
+
+    struct pollfd pfds[nfds > 0 ? nfds : 1];
+    tcblcb_IOEVENT *pevs[nfds > 0 ? nfds : 1];
+    nfds_t i = 0;
+    TAILQ_FOREACH(ev, &loop->events, list) {
+        if (ev->fd != -1 && ev->watched != 0) {
+            pfds[i].fd = ev->fd;
+            pfds[i].events = 0;
+            pfds[i].revents = 0;
+            if (ev->watched & LCB_READ_EVENT) {
+                pfds[i].events |= POLLIN;
+            }
+            if (ev->watched & LCB_WRITE_EVENT) {
+                pfds[i].events |= POLLOUT;
+            }
+            pevs[i++] = ev;
+        }
+    }
+
+    int nready = poll(pfds, nfds, timeout);
+    if (nready == -1 && errno != EINTR) {
+        kore_log(LOG_ERR, "<%s:%s:%d> poll failed (%s)", __FILENAME__, __func__, __LINE__, strerror(errno));
+        loop->running = false;
+        return;
+    }
+
+    for (i = 0; nready > 0 && i < nfds; i++) {
+        // earlier callbacks may have destroyed this event (it is only reaped later)
+        ev = pevs[i];
+        if (pfds[i].revents == 0 || ev->dead) {
+            continue;
+        }
+        if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ev->ready |= LCB_READ_EVENT;
+        }
+        if (pfds[i].revents & (POLLOUT | POLLHUP | POLLERR)) {
+            ev->ready |= LCB_WRITE_EVENT;
+        }
+        iops_event_deliver(ev);
+    }
+
+    // timers may be destroyed by other timer callbacks so rescan after each one fires
+    bool fired = true;
+    while (fired) {
+        fired = false;
+        now = kore_time_ms();
+        TAILQ_FOREACH(t, &loop->timers, list) {
+            if (t->ktimer != NULL && t->deadline <= now) {
+                kore_timer_remove(t->ktimer);
+                t->ktimer = NULL;
+                iops_timer_fire(t);
+                fired = true;
+                break;
+            }
+        }
+    }
+}
+
+static void iops_loop_start(lcb_io_opt_t iops)
+{
+    tcblcb_IOLOOP *loop = IOLOOP(iops);
+    loop->running = true;
+    while (loop->running) {
+        iops_loop_once(loop, true);
+    }
+}
+
+static void iops_loop_stop(lcb_io_opt_t iops)
+{
+    IOLOOP(iops)->running = false;
+}
+
+static void iops_loop_tick(lcb_io_opt_t iops)
+{
+    iops_loop_once(IOLOOP(iops), false);
+}
+
+static void iops_get_procs(
+    int version,
+    lcb_loop_procs *loop_procs,
+    lcb_timer_procs *timer_procs,
+    lcb_bsd_procs *bsd_procs,
+    lcb_ev_procs *ev_procs,
+    __unused lcb_completion_procs *completion_procs,
+    lcb_iomodel_t *iomodel)
+{
+    *iomodel = LCB_IOMODEL_EVENT;
+
+    loop_procs->start = iops_loop_start;
+    loop_procs->stop = iops_loop_stop;
+    loop_procs->tick = iops_loop_tick;
+
+    timer_procs->create = iops_timer_create;
+    timer_procs->destroy = iops_timer_destroy;
+    timer_procs->cancel = iops_timer_cancel;
+    timer_procs->schedule = iops_timer_schedule;
+
+    ev_procs->create = iops_event_create;
+    ev_procs->destroy = iops_event_destroy;
+    ev_procs->cancel = iops_event_cancel;
+    ev_procs->watch = iops_event_watch;
+
+    // plain non-blocking BSD sockets are all we need
+    lcb_iops_wire_bsd_impl2(bsd_procs, version);
+    bsd_close = bsd_procs->close;
+    bsd_procs->close = iops_close;
+}
+
+lcb_io_opt_t tcblcb_iops_create()
+{
+    lcb_io_opt_t io = calloc(1, sizeof(struct lcb_io_opt_st));
+    tcblcb_IOLOOP *loop = calloc(1, sizeof(tcblcb_IOLOOP));
+    if (io == NULL || loop == NULL) {
+        free(io);
+        free(loop);
+        return NULL;
+    }
+
+    TAILQ_INIT(&loop->events);
+    TAILQ_INIT(&loop->dead_events);
+    TAILQ_INIT(&loop->timers);
+
+    // we own these IO options, so libcouchbase should not clean them up
+    io->version = 3;
+    io->v.v3.cookie = loop;
+    io->v.v3.need_cleanup = 0;
+    io->v.v3.get_procs = iops_get_procs;
+
+    return io;
+}
+
+void tcblcb_iops_destroy(lcb_io_opt_t io)
+{
+    if (io == NULL) {
+        return;
+    }
+
+    tcblcb_IOLOOP *loop = IOLOOP(io);
+    if (loop != NULL) {
+        tcblcb_IOEVENT *ev = NULL;
+        while ((ev = TAILQ_FIRST(&loop->dead_events)) != NULL) {
+            TAILQ_REMOVE(&loop->dead_events, ev, list);
+            free(ev);
+        }
+        if (loop->pending != NULL) {
+            kore_timer_remove(loop->pending);
+        }
+        free(loop);
+    }
+
+    free(io);
+}
@@ -0,0 +1,37 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef tcblcb_IOPS_HEADER_SEEN
+#define tcblcb_IOPS_HEADER_SEEN
+
+#include <libcouchbase/couchbase.h>
+#include <libcouchbase/iops.h>
+
+// create libcouchbase IO options that run sockets and timers on the Kore worker event loop.
+// caller must free with `tcblcb_iops_destroy` after the instance using them has been destroyed.
+lcb_io_opt_t tcblcb_iops_create();
+
+// free IO options created with `tcblcb_iops_create`.
+void tcblcb_iops_destroy(lcb_io_opt_t io);
+
+#endif /* !tcblcb_IOPS_HEADER_SEEN */
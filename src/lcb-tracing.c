@@ -0,0 +1,469 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <kore/kore.h>
+
+#include "lcb-tracing.h"
+#include "util.h"
+
+// lcb ends the dispatch span of an operation when its response arrives, and the operation span
+// once its callback has run (or it failed, e.g. timed out). a dispatch span that ends after its
+// operation is an orphaned response. spans are reference counted by their children so the
+// operation (and request) they belong to can still be reported by then.
+
+#define TRACING_NAME_MAX 32
+#define TRACING_ID_MAX 64
+#define TRACING_PEER_MAX 80
+
+static const char TRACING_REQUEST_SPAN_STRING[]  = "http_request";
+static const char TRACING_DISPATCH_SPAN_STRING[] = "dispatch_to_server";
+static const char TRACING_SERVER_DURATION_TAG[]  = "db.couchbase.server_duration";
+static const char TRACING_OPERATION_ID_TAG[]     = "db.couchbase.operation_id";
+static const char TRACING_LOCAL_ID_TAG[]         = "db.couchbase.local_id";
+static const char TRACING_PEER_NAME_TAG[]        = "net.peer.name";
+static const char TRACING_PEER_PORT_TAG[]        = "net.peer.port";
+static const char METER_SERVICE_TAG[]            = "db.couchbase.service";
+static const char METER_OPERATION_TAG[]          = "db.operation";
+
+// lcb operation (and service) names for the operation types we record
+static const struct {
+    const char *name;
+    tcblcb_METRICS_OP op;
+} TRACING_OPS[] = {
+    { "get", METRICS_OP_GET },
+    { "upsert", METRICS_OP_STORE },
+    { "insert", METRICS_OP_STORE },
+    { "replace", METRICS_OP_STORE },
+    { "lookup_in", METRICS_OP_SUBDOC },
+    { "mutate_in", METRICS_OP_SUBDOC },
+    { "query", METRICS_OP_QUERY },
+    { "search", METRICS_OP_SEARCH },
+};
+#define TRACING_NUM_OPS (sizeof(TRACING_OPS) / sizeof(TRACING_OPS[0]))
+
+// same defaults as lcb's own threshold logging tracer
+static u_int64_t _tracing_threshold_us[METRICS_NUM_OPS] = {
+    [METRICS_OP_QUERY] = 1000000,
+    [METRICS_OP_SEARCH] = 1000000,
+    [METRICS_OP_GET] = 500000,
+    [METRICS_OP_STORE] = 500000,
+    [METRICS_OP_SUBDOC] = 500000,
+};
+
+struct tcblcb_SPAN {
+    struct tcblcb_SPAN *parent;
+    unsigned int refs;          // lcb's (ours for a request span) plus one per child span
+    bool request;               // HTTP request span, which lcb only wraps
+    bool ended;
+    bool recorded;              // an operation of a type we record (in `op`)
+    tcblcb_METRICS_OP op;
+    u_int64_t started;
+    u_int64_t ended_at;
+    u_int64_t dispatch_us;      // dispatch to server until the response (all attempts)
+    u_int64_t server_us;        // reported by the server
+    lcbtrace_SPAN *wrapper;     // lcb span wrapping a request span
+    char name[TRACING_NAME_MAX];
+    char id[TRACING_ID_MAX];    // request ID for a request span, otherwise the operation ID
+    char local_id[TRACING_ID_MAX];
+    char peer[TRACING_PEER_MAX];
+};
+
+static _Thread_local lcbtrace_TRACER *_tcblcb_tracer = NULL;
+static _Thread_local lcbmetrics_METER *_tcblcb_meter = NULL;
+
+// one value recorder per operation type, plus one for anything else (which isn't recorded)
+static _Thread_local lcbmetrics_VALUERECORDER *_tcblcb_recorders[METRICS_NUM_OPS + 1] = { 0 };
+
+static bool tracing_op(const char *name, tcblcb_METRICS_OP *op)
+{
+    if (name == NULL) {
+        return false;
+    }
+
+    for (size_t i = 0; i < TRACING_NUM_OPS; i++) {
+        if (strcmp(name, TRACING_OPS[i].name) == 0) {
+            *op = TRACING_OPS[i].op;
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char *span_request_id(const tcblcb_SPAN *span)
+{
+    return span->parent != NULL && span->parent->request ? span->parent->id : "-";
+}
+
+static void span_release(tcblcb_SPAN *span)
+{
+    while (span != NULL && --span->refs == 0) {
+        tcblcb_SPAN *parent = span->parent;
+        free(span);
+        span = parent;
+    }
+}
+
+static void *tracer_start_span(__unused lcbtrace_TRACER *tracer, const char *name, void *parent)
+{
+    tcblcb_SPAN *span = calloc(1, sizeof(tcblcb_SPAN));
+    if (span == NULL) {
+        return NULL;
+    }
+
+    span->refs = 1;
+    span->started = tcblcb_metrics_now();
+    snprintf(span->name, sizeof(span->name), "%s", name);
+
+    span->parent = parent;
+    if (span->parent != NULL) {
+        span->parent->refs++;
+    }
+
+    // operations are the spans lcb starts at the top (or under a request)
+    if (span->parent == NULL || span->parent->request) {
+        span->recorded = tracing_op(name, &span->op);
+    }
+
+    return span;
+}
+
+// a child of an operation has ended (encoding the request, or dispatching it to the server).
+static void span_child_end(tcblcb_SPAN *span, u_int64_t us)
+{
+    tcblcb_SPAN *op_span = span->parent;
+    if (strcmp(span->name, TRACING_DISPATCH_SPAN_STRING) != 0) {
+        return;
+    }
+
+    // the ids and peer are tagged on the dispatch span
+    if (span->id[0] != '\0') {
+        memcpy(op_span->id, span->id, sizeof(op_span->id));
+    }
+    if (span->local_id[0] != '\0') {
+        memcpy(op_span->local_id, span->local_id, sizeof(op_span->local_id));
+    }
+    if (span->peer[0] != '\0') {
+        memcpy(op_span->peer, span->peer, sizeof(op_span->peer));
+    }
+
+    if (!op_span->ended) {
+        op_span->dispatch_us += us;
+        op_span->server_us = span->server_us;
+        return;
+    }
+
+    if (op_span->recorded) {
+        tcblcb_metrics_sdk_orphan(op_span->op);
+    }
+    kore_log(LOG_WARNING,
+        "Orphaned Couchbase %s response for request %s: arrived %llu us after the operation completed, "
+        "%llu us dispatch, %llu us server (operation_id %s, local_id %s, peer %s)",
+        op_span->name, span_request_id(op_span),
+        (unsigned long long)(tcblcb_metrics_now() - op_span->ended_at),
+        (unsigned long long)us, (unsigned long long)span->server_us,
+        op_span->id[0] != '\0' ? op_span->id : "-",
+        op_span->local_id[0] != '\0' ? op_span->local_id : "-",
+        op_span->peer[0] != '\0' ? op_span->peer : "-");
+}
+
+static void tracer_end_span(void *external_span)
+{
+    tcblcb_SPAN *span = external_span;
+    if (span == NULL || span->request || span->ended) {
+        return;
+    }
+
+    span->ended = true;
+    span->ended_at = tcblcb_metrics_now();
+    u_int64_t us = span->ended_at - span->started;
+
+    if (span->parent != NULL && !span->parent->request) {
+        span_child_end(span, us);
+        return;
+    }
+
+    if (!span->recorded) {
+        return;
+    }
+
+    bool slow = us > _tracing_threshold_us[span->op];
+    tcblcb_metrics_sdk_span(span->op, span->dispatch_us, span->server_us, slow);
+    if (slow) {
+        kore_log(LOG_WARNING,
+            "Slow Couchbase %s for request %s: %llu us total, %llu us dispatch, %llu us server "
+            "(operation_id %s, local_id %s, peer %s)",
+            span->name, span_request_id(span),
+            (unsigned long long)us, (unsigned long long)span->dispatch_us, (unsigned long long)span->server_us,
+            span->id[0] != '\0' ? span->id : "-",
+            span->local_id[0] != '\0' ? span->local_id : "-",
+            span->peer[0] != '\0' ? span->peer : "-");
+    }
+}
+
+static void tracer_destroy_span(void *external_span)
+{
+    tcblcb_SPAN *span = external_span;
+    if (span != NULL && !span->request) {
+        span_release(span);
+    }
+}
+
+static void span_peer_port(tcblcb_SPAN *span, const char *port, size_t port_len)
+{
+    size_t len = strlen(span->peer);
+    snprintf(span->peer + len, sizeof(span->peer) - len, ":%.*s", (int)port_len, port);
+}
+
+static void tracer_add_tag_string(void *external_span, const char *name, const char *value, size_t value_len)
+{
+    tcblcb_SPAN *span = external_span;
+    if (span == NULL || span->request) {
+        return;
+    }
+
+    if (strcmp(name, TRACING_OPERATION_ID_TAG) == 0) {
+        snprintf(span->id, sizeof(span->id), "%.*s", (int)value_len, value);
+    } else if (strcmp(name, TRACING_LOCAL_ID_TAG) == 0) {
+        snprintf(span->local_id, sizeof(span->local_id), "%.*s", (int)value_len, value);
+    } else if (strcmp(name, TRACING_PEER_NAME_TAG) == 0) {
+        snprintf(span->peer, sizeof(span->peer), "%.*s", (int)value_len, value);
+    } else if (strcmp(name, TRACING_PEER_PORT_TAG) == 0) {
+        span_peer_port(span, value, value_len);
+    }
+}
+
+static void tracer_add_tag_uint64(void *external_span, const char *name, uint64_t value)
+{
+    tcblcb_SPAN *span = external_span;
+    if (span == NULL || span->request) {
+        return;
+    }
+
+    if (strcmp(name, TRACING_SERVER_DURATION_TAG) == 0) {
+        span->server_us = value;
+    } else if (strcmp(name, TRACING_OPERATION_ID_TAG) == 0) {
+        snprintf(span->id, sizeof(span->id), "0x%llx", (unsigned long long)value);
+    } else if (strcmp(name, TRACING_PEER_PORT_TAG) == 0) {
+        char port[24];
+        int port_len = snprintf(port, sizeof(port), "%llu", (unsigned long long)value);
+        span_peer_port(span, port, (size_t)port_len);
+    }
+}
+
+static void meter_record_value(const lcbmetrics_VALUERECORDER *recorder, uint64_t value)
+{
+    void *cookie = NULL;
+    lcbmetrics_valuerecorder_cookie(recorder, &cookie);
+
+    // the cookie is the operation type + 1 (0 for operations that aren't recorded)
+    uintptr_t op = (uintptr_t)cookie;
+    if (op > 0) {
+        tcblcb_metrics_sdk_op((tcblcb_METRICS_OP)(op - 1), value);
+    }
+}
+
+static const lcbmetrics_VALUERECORDER *meter_value_recorder(
+    __unused const lcbmetrics_METER *meter,
+    __unused const char *name,
+    const lcbmetrics_TAG *tags,
+    size_t ntags)
+{
+    const char *service = NULL;
+    const char *operation = NULL;
+    for (size_t i = 0; i < ntags; i++) {
+        if (strcmp(tags[i].key, METER_SERVICE_TAG) == 0) {
+            service = tags[i].value;
+        } else if (strcmp(tags[i].key, METER_OPERATION_TAG) == 0) {
+            operation = tags[i].value;
+        }
+    }
+
+    tcblcb_METRICS_OP op;
+    if (tracing_op(operation, &op) || tracing_op(service, &op)) {
+        return _tcblcb_recorders[op];
+    }
+    return _tcblcb_recorders[METRICS_NUM_OPS];
+}
+
+static bool meter_create(void)
+{
+    bool valid = false;
+
+    IfLCBFailGotoDone(
+        lcbmetrics_meter_create(&_tcblcb_meter, NULL),
+        "Failed to create libcouchbase meter"
+    );
+    IfLCBFailGotoDone(
+        lcbmetrics_meter_value_recorder_callback(_tcblcb_meter, meter_value_recorder),
+        "Failed to set libcouchbase meter value recorder callback"
+    );
+
+    for (size_t i = 0; i <= METRICS_NUM_OPS; i++) {
+        void *cookie = (void *)(uintptr_t)(i < METRICS_NUM_OPS ? i + 1 : 0);
+        IfLCBFailGotoDone(
+            lcbmetrics_valuerecorder_create(&_tcblcb_recorders[i], cookie),
+            "Failed to create libcouchbase value recorder"
+        );
+        IfLCBFailGotoDone(
+            lcbmetrics_valuerecorder_record_value_callback(_tcblcb_recorders[i], meter_record_value),
+            "Failed to set libcouchbase value recorder callback"
+        );
+    }
+
+    valid = true;
+
+done:
+    return valid;
+}
+
+static void meter_destroy(void)
+{
+    if (_tcblcb_meter != NULL) {
+        lcbmetrics_meter_destroy(_tcblcb_meter);
+        _tcblcb_meter = NULL;
+    }
+
+    for (size_t i = 0; i <= METRICS_NUM_OPS; i++) {
+        if (_tcblcb_recorders[i] != NULL) {
+            lcbmetrics_valuerecorder_destroy(_tcblcb_recorders[i]);
+            _tcblcb_recorders[i] = NULL;
+        }
+    }
+}
+
+void tcblcb_tracing_set_threshold(tcblcb_METRICS_OP op, u_int64_t us)
+{
+    _tracing_threshold_us[op] = us;
+}
+
+void tcblcb_tracing_destroy(void)
+{
+    if (_tcblcb_tracer != NULL) {
+        lcbtrace_destroy(_tcblcb_tracer);
+        _tcblcb_tracer = NULL;
+    }
+
+    meter_destroy();
+}
+
+bool tcblcb_tracing_init(lcb_CREATEOPTS *options)
+{
+    bool valid = false;
+
+    _tcblcb_tracer = lcbtrace_new(NULL, LCBTRACE_F_EXTERNAL);
+    IfNULLGotoDone(
+        _tcblcb_tracer,
+        "Failed to create libcouchbase tracer"
+    );
+    _tcblcb_tracer->version = 1;
+    _tcblcb_tracer->v.v1.start_span = tracer_start_span;
+    _tcblcb_tracer->v.v1.end_span = tracer_end_span;
+    _tcblcb_tracer->v.v1.destroy_span = tracer_destroy_span;
+    _tcblcb_tracer->v.v1.add_tag_string = tracer_add_tag_string;
+    _tcblcb_tracer->v.v1.add_tag_uint64 = tracer_add_tag_uint64;
+
+    IfFalseGotoDone(
+        meter_create(),
+        "Failed to create libcouchbase meter"
+    );
+
+    IfLCBFailGotoDone(
+        lcb_createopts_tracer(options, _tcblcb_tracer),
+        "Failed to set libcouchbase tracer"
+    );
+    IfLCBFailGotoDone(
+        lcb_createopts_meter(options, _tcblcb_meter),
+        "Failed to set libcouchbase meter"
+    );
+
+    valid = true;
+
+done:
+    if (!valid) {
+        tcblcb_tracing_destroy();
+    }
+
+    return valid;
+}
+
+void tcblcb_tracing_start(lcb_INSTANCE *instance)
+{
+    if (_tcblcb_meter == NULL) {
+        return;
+    }
+
+    IfLCBFailLogWarningMsg(
+        lcb_cntl_string(instance, "enable_operation_metrics", "true"),
+        "Failed to enable libcouchbase operation metrics"
+    );
+}
+
+tcblcb_SPAN *tcblcb_tracing_request_start(const char *request_id)
+{
+    if (_tcblcb_tracer == NULL) {
+        return NULL;
+    }
+
+    tcblcb_SPAN *span = calloc(1, sizeof(tcblcb_SPAN));
+    if (span == NULL) {
+        return NULL;
+    }
+
+    span->refs = 1;
+    span->request = true;
+    span->started = tcblcb_metrics_now();
+    snprintf(span->name, sizeof(span->name), "%s", TRACING_REQUEST_SPAN_STRING);
+    snprintf(span->id, sizeof(span->id), "%s", request_id);
+
+    // lcb passes the span it wraps to the tracer as the parent of the operation spans
+    if (lcbtrace_span_wrap(_tcblcb_tracer, TRACING_REQUEST_SPAN_STRING, LCBTRACE_NOW, span, &span->wrapper) != LCB_SUCCESS) {
+        kore_log(LOG_WARNING, "Failed to wrap span for request: %s", request_id);
+        free(span);
+        span = NULL;
+    }
+
+    return span;
+}
+
+lcbtrace_SPAN *tcblcb_tracing_parent(tcblcb_SPAN *span)
+{
+    return span == NULL ? NULL : span->wrapper;
+}
+
+void tcblcb_tracing_request_end(tcblcb_SPAN *span)
+{
+    if (span == NULL) {
+        return;
+    }
+
+    if (span->wrapper != NULL) {
+        lcbtrace_span_finish(span->wrapper, LCBTRACE_NOW);
+        span->wrapper = NULL;
+    }
+    span->ended = true;
+    span_release(span);
+}
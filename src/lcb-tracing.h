@@ -0,0 +1,71 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef tcblcb_TRACING_HEADER_SEEN
+#define tcblcb_TRACING_HEADER_SEEN
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <libcouchbase/couchbase.h>
+#include <libcouchbase/tracing.h>
+#include <libcouchbase/metrics.h>
+
+#include "metrics.h"
+
+// libcouchbase tracing and operation metrics.
+//
+// each worker gives its instance an external tracer, so lcb hands us a span for every operation
+// (with child spans for dispatching it to the server, tagged with the server duration), and a
+// meter, so lcb reports the latency it measures for every operation. both feed the `/metrics`
+// histograms. operations over a threshold are logged with their dispatch and server durations,
+// as are responses that arrive after their operation has already completed (e.g., timed out),
+// along with the ID of the HTTP request they were made for.
+
+// the span of an HTTP request, which the spans of the operations it schedules are children of
+typedef struct tcblcb_SPAN tcblcb_SPAN;
+
+// set the duration (in microseconds) over which operations of type `op` are logged. call from the
+// parent, before the workers are forked.
+void tcblcb_tracing_set_threshold(tcblcb_METRICS_OP op, u_int64_t us);
+
+// create the worker's tracer and meter and set them in the options for the instance about to be
+// created. returns false if they could not be created, in which case the instance runs without.
+bool tcblcb_tracing_init(lcb_CREATEOPTS *options);
+
+// enable operation metrics on the instance created with the options from `tcblcb_tracing_init`.
+void tcblcb_tracing_start(lcb_INSTANCE *instance);
+
+// free the worker's tracer and meter (after the instance using them has been destroyed).
+void tcblcb_tracing_destroy(void);
+
+// start the span of an HTTP request with `request_id` (NULL if tracing is not available).
+tcblcb_SPAN *tcblcb_tracing_request_start(const char *request_id);
+
+// the lcb span to set as the parent span of a request's commands (NULL if `span` is NULL).
+lcbtrace_SPAN *tcblcb_tracing_parent(tcblcb_SPAN *span);
+
+// end the span of an HTTP request. the span lives on until the spans of its operations are
+// destroyed, so responses that arrive later are still reported with the request ID.
+void tcblcb_tracing_request_end(tcblcb_SPAN *span);
+
+#endif /* !tcblcb_TRACING_HEADER_SEEN */
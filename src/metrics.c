@@ -0,0 +1,702 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+// MAP_ANONYMOUS isn't part of POSIX
+#define _DEFAULT_SOURCE
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <kore/kore.h>
+#include <kore/http.h>
+
+#include "metrics.h"
+#include "util.h"
+
+// one slot per worker, indexed by its id (workers beyond this share slots, which still adds up
+// since the counters are atomic)
+#define METRICS_MAX_WORKERS 64
+
+// histogram buckets: [0, 2^METRICS_HIST_MIN_SHIFT) microseconds, then METRICS_HIST_SUB_BUCKETS
+// linear buckets for each of METRICS_HIST_MAGNITUDES powers of two (128us up to ~33.5s), then
+// the overflow bucket
+#define METRICS_HIST_MIN_SHIFT 7
+#define METRICS_HIST_MIN_US (1ULL << METRICS_HIST_MIN_SHIFT)
+#define METRICS_HIST_SUB_SHIFT 2
+#define METRICS_HIST_SUB_BUCKETS (1 << METRICS_HIST_SUB_SHIFT)
+#define METRICS_HIST_MAGNITUDES 18
+#define METRICS_HIST_BUCKETS (1 + METRICS_HIST_MAGNITUDES * METRICS_HIST_SUB_BUCKETS + 1)
+
+// status codes counted separately, anything else counts as "other". 499 is used (like nginx
+// does) for requests the client went away from before a response was sent
+static const int METRICS_STATUS_CODES[] = { 200, 201, 204, 304, 400, 401, 403, 404, 409, 499, 500, 503 };
+#define METRICS_NUM_STATUS_CODES (sizeof(METRICS_STATUS_CODES) / sizeof(METRICS_STATUS_CODES[0]))
+
+static const char *METRICS_ROUTE_NAMES[METRICS_NUM_ROUTES] = {
+    [METRICS_ROUTE_INDEX] = "/",
+    [METRICS_ROUTE_AIRPORTS] = "/api/airports",
+    [METRICS_ROUTE_FPATHS] = "/api/flightPaths/{fromloc}/{toloc}",
+    [METRICS_ROUTE_HOTELS] = "/api/hotels/{description}/{location}/",
+    [METRICS_ROUTE_USER_LOGIN] = "/api/tenants/{tenant}/user/login",
+    [METRICS_ROUTE_USER_SIGNUP] = "/api/tenants/{tenant}/user/signup",
+    [METRICS_ROUTE_USER_FLIGHTS] = "/api/tenants/{tenant}/user/{username}/flights",
+    [METRICS_ROUTE_METRICS] = "/metrics",
+};
+
+static const char *METRICS_OP_NAMES[METRICS_NUM_OPS] = {
+    [METRICS_OP_QUERY] = "query",
+    [METRICS_OP_SEARCH] = "search",
+    [METRICS_OP_GET] = "get",
+    [METRICS_OP_STORE] = "store",
+    [METRICS_OP_SUBDOC] = "subdoc",
+};
+
+static const char *METRICS_CACHE_NAMES[METRICS_NUM_CACHES] = {
+    [METRICS_CACHE_AIRPORT_FAA] = "airport-faa",
+};
+
+static const char *METRICS_STATEMENT_NAMES[METRICS_NUM_STATEMENTS] = {
+    [METRICS_STATEMENT_AIRPORTS_FAA] = "airports_faa",
+    [METRICS_STATEMENT_AIRPORTS_ICAO] = "airports_icao",
+    [METRICS_STATEMENT_AIRPORTS_NAME] = "airports_name",
+    [METRICS_STATEMENT_FPATHS_AIRPORTS] = "flight_paths_airports",
+    [METRICS_STATEMENT_FPATHS_ROUTES] = "flight_paths_routes",
+    [METRICS_STATEMENT_HOTELS_SEARCH] = "hotels_search",
+};
+
+static const char METRICS_CONTENT_TYPE_STRING[] = "text/plain; version=0.0.4; charset=utf-8";
+
+typedef struct tcblcb_METRICS_HIST {
+    _Atomic u_int64_t buckets[METRICS_HIST_BUCKETS];
+    _Atomic u_int64_t sum_us;
+} tcblcb_METRICS_HIST;
+
+typedef struct tcblcb_METRICS_ROUTE_STATS {
+    _Atomic u_int64_t requests[METRICS_NUM_STATUS_CODES + 1];
+    _Atomic int64_t in_flight;
+    _Atomic u_int64_t response_bytes;
+    tcblcb_METRICS_HIST duration;
+} tcblcb_METRICS_ROUTE_STATS;
+
+typedef struct tcblcb_METRICS_OP_STATS {
+    // counted apart from the histogram, which a scrape can catch between updates
+    _Atomic u_int64_t ok;
+    _Atomic u_int64_t errors;
+    _Atomic u_int64_t slow;         // over the lcb tracing threshold
+    _Atomic u_int64_t orphans;      // responses that arrived after the operation completed
+    tcblcb_METRICS_HIST duration;
+    tcblcb_METRICS_HIST sdk;        // measured by lcb (from its meter)
+    tcblcb_METRICS_HIST dispatch;   // dispatch to server until the response (from lcb spans)
+    tcblcb_METRICS_HIST server;     // reported by the server (KV only)
+} tcblcb_METRICS_OP_STATS;
+
+typedef struct tcblcb_METRICS_STATEMENT_STATS {
+    _Atomic u_int64_t results;
+    tcblcb_METRICS_HIST duration;   // client side, scheduled to final row
+    tcblcb_METRICS_HIST service;    // N1QL elapsedTime or FTS took
+    tcblcb_METRICS_HIST execution;  // N1QL executionTime
+} tcblcb_METRICS_STATEMENT_STATS;
+
+typedef struct tcblcb_METRICS_CACHE_STATS {
+    _Atomic u_int64_t entries;
+    _Atomic u_int64_t bytes;
+} tcblcb_METRICS_CACHE_STATS;
+
+// slots are cache line aligned so workers don't write to the same lines
+typedef struct tcblcb_METRICS_SLOT {
+    _Alignas(64) tcblcb_METRICS_ROUTE_STATS routes[METRICS_NUM_ROUTES];
+    tcblcb_METRICS_OP_STATS ops[METRICS_NUM_OPS];
+    tcblcb_METRICS_STATEMENT_STATS statements[METRICS_NUM_STATEMENTS];
+    tcblcb_METRICS_CACHE_STATS caches[METRICS_NUM_CACHES];
+} tcblcb_METRICS_SLOT;
+
+typedef struct tcblcb_METRICS {
+    tcblcb_METRICS_SLOT slots[METRICS_MAX_WORKERS];
+} tcblcb_METRICS;
+
+// mapped by the parent before the workers are forked, so they all share it
+static tcblcb_METRICS *_tcblcb_metrics = NULL;
+
+// totals for one series, added up from every slot
+typedef struct tcblcb_METRICS_HIST_TOTAL {
+    u_int64_t buckets[METRICS_HIST_BUCKETS];
+    u_int64_t count;
+    u_int64_t sum_us;
+} tcblcb_METRICS_HIST_TOTAL;
+
+static void counter_add(_Atomic u_int64_t *counter, u_int64_t value)
+{
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static u_int64_t counter_load(_Atomic u_int64_t *counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static tcblcb_METRICS_SLOT *metrics_slot()
+{
+    if (_tcblcb_metrics == NULL) {
+        return NULL;
+    }
+
+    return &_tcblcb_metrics->slots[worker == NULL ? 0 : worker->id % METRICS_MAX_WORKERS];
+}
+
+static size_t hist_bucket(u_int64_t us)
+{
+    if (us < METRICS_HIST_MIN_US) {
+        return 0;
+    }
+
+    int msb = 63 - __builtin_clzll(us);
+    int magnitude = msb - METRICS_HIST_MIN_SHIFT;
+    if (magnitude >= METRICS_HIST_MAGNITUDES) {
+        return METRICS_HIST_BUCKETS - 1;
+    }
+
+    // the bits right below the top one pick the linear sub-bucket
+    size_t sub = (us >> (msb - METRICS_HIST_SUB_SHIFT)) & (METRICS_HIST_SUB_BUCKETS - 1);
+    return 1 + (size_t)magnitude * METRICS_HIST_SUB_BUCKETS + sub;
+}
+
+// exclusive upper bound (in microseconds) of a bucket below the overflow bucket
+static u_int64_t hist_bucket_bound(size_t bucket)
+{
+    if (bucket == 0) {
+        return METRICS_HIST_MIN_US;
+    }
+
+    size_t magnitude = (bucket - 1) / METRICS_HIST_SUB_BUCKETS;
+    size_t sub = (bucket - 1) % METRICS_HIST_SUB_BUCKETS;
+    return (u_int64_t)(METRICS_HIST_SUB_BUCKETS + sub + 1) << (magnitude + METRICS_HIST_MIN_SHIFT - METRICS_HIST_SUB_SHIFT);
+}
+
+static void hist_record_us(tcblcb_METRICS_HIST *hist, u_int64_t us)
+{
+    counter_add(&hist->buckets[hist_bucket(us)], 1);
+    counter_add(&hist->sum_us, us);
+}
+
+static void hist_record(tcblcb_METRICS_HIST *hist, u_int64_t started)
+{
+    u_int64_t now = tcblcb_metrics_now();
+    hist_record_us(hist, now > started ? now - started : 0);
+}
+
+static void hist_total(tcblcb_METRICS_HIST_TOTAL *total, tcblcb_METRICS_HIST *hist)
+{
+    for (size_t i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        u_int64_t count = counter_load(&hist->buckets[i]);
+        total->buckets[i] += count;
+        total->count += count;
+    }
+    total->sum_us += counter_load(&hist->sum_us);
+}
+
+static size_t status_index(int status)
+{
+    // nothing was sent if the client went away first
+    if (status == 0) {
+        status = 499;
+    }
+
+    for (size_t i = 0; i < METRICS_NUM_STATUS_CODES; i++) {
+        if (METRICS_STATUS_CODES[i] == status) {
+            return i;
+        }
+    }
+    return METRICS_NUM_STATUS_CODES;
+}
+
+bool tcblcb_metrics_init(void)
+{
+    // anonymous shared memory is zeroed and inherited by the forked workers
+    void *map = mmap(NULL, sizeof(tcblcb_METRICS), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        kore_log(LOG_WARNING, "Failed to map shared metrics memory");
+        return false;
+    }
+
+    _tcblcb_metrics = map;
+    kore_log(LOG_INFO, "Shared metrics: %zu bytes for %d workers", sizeof(tcblcb_METRICS), METRICS_MAX_WORKERS);
+    return true;
+}
+
+void tcblcb_metrics_destroy(void)
+{
+    if (_tcblcb_metrics != NULL) {
+        munmap(_tcblcb_metrics, sizeof(tcblcb_METRICS));
+        _tcblcb_metrics = NULL;
+    }
+}
+
+u_int64_t tcblcb_metrics_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t)ts.tv_sec * 1000000 + (u_int64_t)ts.tv_nsec / 1000;
+}
+
+const char *tcblcb_metrics_route_name(tcblcb_METRICS_ROUTE route)
+{
+    return METRICS_ROUTE_NAMES[route];
+}
+
+void tcblcb_metrics_request_start(tcblcb_METRICS_ROUTE route)
+{
+    tcblcb_METRICS_SLOT *slot = metrics_slot();
+    if (slot == NULL) {
+        return;
+    }
+
+    atomic_fetch_add_explicit(&slot->routes[route].in_flight, 1, memory_order_relaxed);
+}
+
+void tcblcb_metrics_request_end(tcblcb_METRICS_ROUTE route, int status, size_t response_bytes, u_int64_t started)
+{
+    tcblcb_METRICS_SLOT *slot = metrics_slot();
+    if (slot == NULL) {
+        return;
+    }
+
+    tcblcb_METRICS_ROUTE_STATS *stats = &slot->routes[route];
+    atomic_fetch_sub_explicit(&stats->in_flight, 1, memory_order_relaxed);
+    counter_add(&stats->requests[status_index(status)], 1);
+    counter_add(&stats->response_bytes, response_bytes);
+    hist_record(&stats->duration, started);
+}
+
+void tcblcb_metrics_backend_op(tcblcb_METRICS_OP op, bool ok, u_int64_t started)
+{
+    tcblcb_METRICS_SLOT *slot = metrics_slot();
+    if (slot == NULL) {
+        return;
+    }
+
+    tcblcb_METRICS_OP_STATS *stats = &slot->ops[op];
+    counter_add(ok ? &stats->ok : &stats->errors, 1);
+    hist_record(&stats->duration, started);
+}
+
+void tcblcb_metrics_sdk_op(tcblcb_METRICS_OP op, u_int64_t us)
+{
+    tcblcb_METRICS_SLOT *slot = metrics_slot();
+    if (slot == NULL) {
+        return;
+    }
+
+    hist_record_us(&slot->ops[op].sdk, us);
+}
+
+void tcblcb_metrics_sdk_span(tcblcb_METRICS_OP op, u_int64_t dispatch_us, u_int64_t server_us, bool slow)
+{
+    tcblcb_METRICS_SLOT *slot = metrics_slot();
+    if (slot == NULL) {
+        return;
+    }
+
+    tcblcb_METRICS_OP_STATS *stats = &slot->ops[op];
+    if (dispatch_us > 0) {
+        hist_record_us(&stats->dispatch, dispatch_us);
+    }
+    if (server_us > 0) {
+        hist_record_us(&stats->server, server_us);
+    }
+    if (slow) {
+        counter_add(&stats->slow, 1);
+    }
+}
+
+void tcblcb_metrics_sdk_orphan(tcblcb_METRICS_OP op)
+{
+    tcblcb_METRICS_SLOT *slot = metrics_slot();
+    if (slot == NULL) {
+        return;
+    }
+
+    counter_add(&slot->ops[op].orphans, 1);
+}
+
+void tcblcb_metrics_statement(tcblcb_METRICS_STATEMENT statement, u_int64_t started)
+{
+    tcblcb_METRICS_SLOT *slot = metrics_slot();
+    if (slot == NULL) {
+        return;
+    }
+
+    hist_record(&slot->statements[statement].duration, started);
+}
+
+u_int64_t tcblcb_metrics_statement_meta(tcblcb_METRICS_STATEMENT statement, const char *meta, size_t nmeta)
+{
+    u_int64_t results = 0;
+    tcblcb_METRICS_SLOT *slot = metrics_slot();
+    if (slot == NULL) {
+        return 0;
+    }
+
+    tcblcb_METRICS_STATEMENT_STATS *stats = &slot->statements[statement];
+
+    tcblcb_JSONDoc *doc = json_doc_parse(meta, nmeta);
+    IfNULLGotoDone(doc, "Failed to parse statement metadata");
+
+    const tcblcb_JSONValue *root = json_doc_root(doc);
+    const tcblcb_JSONValue *query_metrics = json_object_get(root, "metrics");
+    double seconds;
+    double number;
+
+    if (query_metrics != NULL) {
+        // N1QL reports durations as strings
+        if (parse_duration_string(json_get_string(json_object_get(query_metrics, "elapsedTime")), &seconds)) {
+            hist_record_us(&stats->service, (u_int64_t)(seconds * 1e6));
+        }
+        if (parse_duration_string(json_get_string(json_object_get(query_metrics, "executionTime")), &seconds)) {
+            hist_record_us(&stats->execution, (u_int64_t)(seconds * 1e6));
+        }
+        if (json_get_number(json_object_get(query_metrics, "resultCount"), &number)) {
+            results = (u_int64_t)number;
+        }
+    } else {
+        // FTS reports `took` in nanoseconds
+        if (json_get_number(json_object_get(root, "took"), &number)) {
+            hist_record_us(&stats->service, (u_int64_t)(number / 1e3));
+        }
+        if (json_get_number(json_object_get(root, "total_hits"), &number)) {
+            results = (u_int64_t)number;
+        }
+    }
+    counter_add(&stats->results, results);
+
+done:
+    if (doc != NULL) {
+        json_doc_free(doc);
+    }
+
+    return results;
+}
+
+void tcblcb_metrics_cache_size(tcblcb_METRICS_CACHE cache, size_t entries, size_t bytes)
+{
+    tcblcb_METRICS_SLOT *slot = metrics_slot();
+    if (slot == NULL) {
+        return;
+    }
+
+    // gauges, so they are set rather than added to
+    atomic_store_explicit(&slot->caches[cache].entries, entries, memory_order_relaxed);
+    atomic_store_explicit(&slot->caches[cache].bytes, bytes, memory_order_relaxed);
+}
+
+static void append_hist(struct kore_buf *buf, const char *name, const char *label, const char *value, const tcblcb_METRICS_HIST_TOTAL *total)
+{
+    u_int64_t cumulative = 0;
+    for (size_t i = 0; i + 1 < METRICS_HIST_BUCKETS; i++) {
+        cumulative += total->buckets[i];
+        u_int64_t bound = hist_bucket_bound(i);
+        kore_buf_appendf(buf, "%s_bucket{%s=\"%s\",le=\"%llu.%06llu\"} %llu\n",
+            name, label, value,
+            (unsigned long long)(bound / 1000000), (unsigned long long)(bound % 1000000),
+            (unsigned long long)cumulative);
+    }
+    kore_buf_appendf(buf, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", name, label, value, (unsigned long long)total->count);
+    kore_buf_appendf(buf, "%s_sum{%s=\"%s\"} %llu.%06llu\n",
+        name, label, value,
+        (unsigned long long)(total->sum_us / 1000000), (unsigned long long)(total->sum_us % 1000000));
+    kore_buf_appendf(buf, "%s_count{%s=\"%s\"} %llu\n", name, label, value, (unsigned long long)total->count);
+}
+
+static void append_route_metrics(struct kore_buf *buf)
+{
+    u_int64_t requests[METRICS_NUM_ROUTES][METRICS_NUM_STATUS_CODES + 1] = { 0 };
+    int64_t in_flight[METRICS_NUM_ROUTES] = { 0 };
+    u_int64_t response_bytes[METRICS_NUM_ROUTES] = { 0 };
+    tcblcb_METRICS_HIST_TOTAL duration[METRICS_NUM_ROUTES] = { 0 };
+
+    for (size_t w = 0; w < METRICS_MAX_WORKERS; w++) {
+        tcblcb_METRICS_SLOT *slot = &_tcblcb_metrics->slots[w];
+        for (size_t r = 0; r < METRICS_NUM_ROUTES; r++) {
+            tcblcb_METRICS_ROUTE_STATS *stats = &slot->routes[r];
+            for (size_t s = 0; s <= METRICS_NUM_STATUS_CODES; s++) {
+                requests[r][s] += counter_load(&stats->requests[s]);
+            }
+            in_flight[r] += atomic_load_explicit(&stats->in_flight, memory_order_relaxed);
+            response_bytes[r] += counter_load(&stats->response_bytes);
+            hist_total(&duration[r], &stats->duration);
+        }
+    }
+
+    // series only appear once a route has been requested
+    kore_buf_appendf(buf,
+        "# HELP tcblcb_http_requests_total Completed HTTP requests by route and status code.\n"
+        "# TYPE tcblcb_http_requests_total counter\n");
+    for (size_t r = 0; r < METRICS_NUM_ROUTES; r++) {
+        for (size_t s = 0; s <= METRICS_NUM_STATUS_CODES; s++) {
+            if (requests[r][s] == 0) {
+                continue;
+            }
+            if (s < METRICS_NUM_STATUS_CODES) {
+                kore_buf_appendf(buf, "tcblcb_http_requests_total{route=\"%s\",code=\"%d\"} %llu\n",
+                    METRICS_ROUTE_NAMES[r], METRICS_STATUS_CODES[s], (unsigned long long)requests[r][s]);
+            } else {
+                kore_buf_appendf(buf, "tcblcb_http_requests_total{route=\"%s\",code=\"other\"} %llu\n",
+                    METRICS_ROUTE_NAMES[r], (unsigned long long)requests[r][s]);
+            }
+        }
+    }
+
+    kore_buf_appendf(buf,
+        "# HELP tcblcb_http_requests_in_flight HTTP requests being handled by route.\n"
+        "# TYPE tcblcb_http_requests_in_flight gauge\n");
+    for (size_t r = 0; r < METRICS_NUM_ROUTES; r++) {
+        if (in_flight[r] != 0 || duration[r].count > 0) {
+            kore_buf_appendf(buf, "tcblcb_http_requests_in_flight{route=\"%s\"} %lld\n",
+                METRICS_ROUTE_NAMES[r], (long long)in_flight[r]);
+        }
+    }
+
+    kore_buf_appendf(buf,
+        "# HELP tcblcb_http_response_bytes_total HTTP response body bytes sent by route.\n"
+        "# TYPE tcblcb_http_response_bytes_total counter\n");
+    for (size_t r = 0; r < METRICS_NUM_ROUTES; r++) {
+        if (duration[r].count > 0) {
+            kore_buf_appendf(buf, "tcblcb_http_response_bytes_total{route=\"%s\"} %llu\n",
+                METRICS_ROUTE_NAMES[r], (unsigned long long)response_bytes[r]);
+        }
+    }
+
+    kore_buf_appendf(buf,
+        "# HELP tcblcb_http_request_duration_seconds HTTP request latency by route.\n"
+        "# TYPE tcblcb_http_request_duration_seconds histogram\n");
+    for (size_t r = 0; r < METRICS_NUM_ROUTES; r++) {
+        if (duration[r].count > 0) {
+            append_hist(buf, "tcblcb_http_request_duration_seconds", "route", METRICS_ROUTE_NAMES[r], &duration[r]);
+        }
+    }
+}
+
+static void append_op_metrics(struct kore_buf *buf)
+{
+    u_int64_t ok[METRICS_NUM_OPS] = { 0 };
+    u_int64_t errors[METRICS_NUM_OPS] = { 0 };
+    u_int64_t slow[METRICS_NUM_OPS] = { 0 };
+    u_int64_t orphans[METRICS_NUM_OPS] = { 0 };
+    tcblcb_METRICS_HIST_TOTAL duration[METRICS_NUM_OPS] = { 0 };
+    tcblcb_METRICS_HIST_TOTAL sdk[METRICS_NUM_OPS] = { 0 };
+    tcblcb_METRICS_HIST_TOTAL dispatch[METRICS_NUM_OPS] = { 0 };
+    tcblcb_METRICS_HIST_TOTAL server[METRICS_NUM_OPS] = { 0 };
+
+    for (size_t w = 0; w < METRICS_MAX_WORKERS; w++) {
+        tcblcb_METRICS_SLOT *slot = &_tcblcb_metrics->slots[w];
+        for (size_t o = 0; o < METRICS_NUM_OPS; o++) {
+            ok[o] += counter_load(&slot->ops[o].ok);
+            errors[o] += counter_load(&slot->ops[o].errors);
+            slow[o] += counter_load(&slot->ops[o].slow);
+            orphans[o] += counter_load(&slot->ops[o].orphans);
+            hist_total(&duration[o], &slot->ops[o].duration);
+            hist_total(&sdk[o], &slot->ops[o].sdk);
+            hist_total(&dispatch[o], &slot->ops[o].dispatch);
+            hist_total(&server[o], &slot->ops[o].server);
+        }
+    }
+
+    kore_buf_appendf(buf,
+        "# HELP tcblcb_backend_operations_total Completed Couchbase operations by type and result.\n"
+        "# TYPE tcblcb_backend_operations_total counter\n");
+    for (size_t o = 0; o < METRICS_NUM_OPS; o++) {
+        if (ok[o] + errors[o] > 0) {
+            kore_buf_appendf(buf, "tcblcb_backend_operations_total{op=\"%s\",result=\"ok\"} %llu\n",
+                METRICS_OP_NAMES[o], (unsigned long long)ok[o]);
+            kore_buf_appendf(buf, "tcblcb_backend_operations_total{op=\"%s\",result=\"error\"} %llu\n",
+                METRICS_OP_NAMES[o], (unsigned long long)errors[o]);
+        }
+    }
+
+    kore_buf_appendf(buf,
+        "# HELP tcblcb_backend_operation_duration_seconds Couchbase operation latency by type.\n"
+        "# TYPE tcblcb_backend_operation_duration_seconds histogram\n");
+    for (size_t o = 0; o < METRICS_NUM_OPS; o++) {
+        if (duration[o].count > 0) {
+            append_hist(buf, "tcblcb_backend_operation_duration_seconds", "op", METRICS_OP_NAMES[o], &duration[o]);
+        }
+    }
+
+    kore_buf_appendf(buf,
+        "# HELP tcblcb_sdk_operation_duration_seconds Couchbase operation latency measured by libcouchbase by type.\n"
+        "# TYPE tcblcb_sdk_operation_duration_seconds histogram\n");
+    for (size_t o = 0; o < METRICS_NUM_OPS; o++) {
+        if (sdk[o].count > 0) {
+            append_hist(buf, "tcblcb_sdk_operation_duration_seconds", "op", METRICS_OP_NAMES[o], &sdk[o]);
+        }
+    }
+
+    kore_buf_appendf(buf,
+        "# HELP tcblcb_sdk_dispatch_duration_seconds Time from dispatching a Couchbase operation to the server until its response by type.\n"
+        "# TYPE tcblcb_sdk_dispatch_duration_seconds histogram\n");
+    for (size_t o = 0; o < METRICS_NUM_OPS; o++) {
+        if (dispatch[o].count > 0) {
+            append_hist(buf, "tcblcb_sdk_dispatch_duration_seconds", "op", METRICS_OP_NAMES[o], &dispatch[o]);
+        }
+    }
+
+    kore_buf_appendf(buf,
+        "# HELP tcblcb_sdk_server_duration_seconds Couchbase operation latency reported by the data service by type.\n"
+        "# TYPE tcblcb_sdk_server_duration_seconds histogram\n");
+    for (size_t o = 0; o < METRICS_NUM_OPS; o++) {
+        if (server[o].count > 0) {
+            append_hist(buf, "tcblcb_sdk_server_duration_seconds", "op", METRICS_OP_NAMES[o], &server[o]);
+        }
+    }
+
+    kore_buf_appendf(buf,
+        "# HELP tcblcb_sdk_slow_operations_total Couchbase operations over the tracing threshold by type.\n"
+        "# TYPE tcblcb_sdk_slow_operations_total counter\n");
+    for (size_t o = 0; o < METRICS_NUM_OPS; o++) {
+        if (sdk[o].count > 0 || slow[o] > 0) {
+            kore_buf_appendf(buf, "tcblcb_sdk_slow_operations_total{op=\"%s\"} %llu\n",
+                METRICS_OP_NAMES[o], (unsigned long long)slow[o]);
+        }
+    }
+
+    kore_buf_appendf(buf,
+        "# HELP tcblcb_sdk_orphaned_responses_total Responses that arrived after their Couchbase operation had completed (e.g., timed out) by type.\n"
+        "# TYPE tcblcb_sdk_orphaned_responses_total counter\n");
+    for (size_t o = 0; o < METRICS_NUM_OPS; o++) {
+        if (sdk[o].count > 0 || orphans[o] > 0) {
+            kore_buf_appendf(buf, "tcblcb_sdk_orphaned_responses_total{op=\"%s\"} %llu\n",
+                METRICS_OP_NAMES[o], (unsigned long long)orphans[o]);
+        }
+    }
+}
+
+static void append_statement_metrics(struct kore_buf *buf)
+{
+    u_int64_t results[METRICS_NUM_STATEMENTS] = { 0 };
+    tcblcb_METRICS_HIST_TOTAL duration[METRICS_NUM_STATEMENTS] = { 0 };
+    tcblcb_METRICS_HIST_TOTAL service[METRICS_NUM_STATEMENTS] = { 0 };
+    tcblcb_METRICS_HIST_TOTAL execution[METRICS_NUM_STATEMENTS] = { 0 };
+
+    for (size_t w = 0; w < METRICS_MAX_WORKERS; w++) {
+        tcblcb_METRICS_SLOT *slot = &_tcblcb_metrics->slots[w];
+        for (size_t t = 0; t < METRICS_NUM_STATEMENTS; t++) {
+            results[t] += counter_load(&slot->statements[t].results);
+            hist_total(&duration[t], &slot->statements[t].duration);
+            hist_total(&service[t], &slot->statements[t].service);
+            hist_total(&execution[t], &slot->statements[t].execution);
+        }
+    }
+
+    kore_buf_appendf(buf,
+        "# HELP tcblcb_statement_results_total Results reported by the query and search services by statement.\n"
+        "# TYPE tcblcb_statement_results_total counter\n");
+    for (size_t t = 0; t < METRICS_NUM_STATEMENTS; t++) {
+        if (duration[t].count > 0) {
+            kore_buf_appendf(buf, "tcblcb_statement_results_total{statement=\"%s\"} %llu\n",
+                METRICS_STATEMENT_NAMES[t], (unsigned long long)results[t]);
+        }
+    }
+
+    kore_buf_appendf(buf,
+        "# HELP tcblcb_statement_duration_seconds Statement latency seen by the client by statement.\n"
+        "# TYPE tcblcb_statement_duration_seconds histogram\n");
+    for (size_t t = 0; t < METRICS_NUM_STATEMENTS; t++) {
+        if (duration[t].count > 0) {
+            append_hist(buf, "tcblcb_statement_duration_seconds", "statement", METRICS_STATEMENT_NAMES[t], &duration[t]);
+        }
+    }
+
+    kore_buf_appendf(buf,
+        "# HELP tcblcb_statement_service_seconds Statement latency reported by the query (elapsedTime) and search (took) services by statement.\n"
+        "# TYPE tcblcb_statement_service_seconds histogram\n");
+    for (size_t t = 0; t < METRICS_NUM_STATEMENTS; t++) {
+        if (service[t].count > 0) {
+            append_hist(buf, "tcblcb_statement_service_seconds", "statement", METRICS_STATEMENT_NAMES[t], &service[t]);
+        }
+    }
+
+    kore_buf_appendf(buf,
+        "# HELP tcblcb_statement_execution_seconds Statement execution time reported by the query service (executionTime) by statement.\n"
+        "# TYPE tcblcb_statement_execution_seconds histogram\n");
+    for (size_t t = 0; t < METRICS_NUM_STATEMENTS; t++) {
+        if (execution[t].count > 0) {
+            append_hist(buf, "tcblcb_statement_execution_seconds", "statement", METRICS_STATEMENT_NAMES[t], &execution[t]);
+        }
+    }
+}
+
+static void append_cache_metrics(struct kore_buf *buf)
+{
+    u_int64_t entries[METRICS_NUM_CACHES] = { 0 };
+    u_int64_t bytes[METRICS_NUM_CACHES] = { 0 };
+
+    for (size_t w = 0; w < METRICS_MAX_WORKERS; w++) {
+        tcblcb_METRICS_SLOT *slot = &_tcblcb_metrics->slots[w];
+        for (size_t c = 0; c < METRICS_NUM_CACHES; c++) {
+            entries[c] += counter_load(&slot->caches[c].entries);
+            bytes[c] += counter_load(&slot->caches[c].bytes);
+        }
+    }
+
+    kore_buf_appendf(buf,
+        "# HELP tcblcb_worker_cache_entries Entries in the per-worker caches, summed over the workers.\n"
+        "# TYPE tcblcb_worker_cache_entries gauge\n");
+    for (size_t c = 0; c < METRICS_NUM_CACHES; c++) {
+        kore_buf_appendf(buf, "tcblcb_worker_cache_entries{cache=\"%s\"} %llu\n",
+            METRICS_CACHE_NAMES[c], (unsigned long long)entries[c]);
+    }
+
+    kore_buf_appendf(buf,
+        "# HELP tcblcb_worker_cache_bytes Memory accounted to the per-worker caches, summed over the workers.\n"
+        "# TYPE tcblcb_worker_cache_bytes gauge\n");
+    for (size_t c = 0; c < METRICS_NUM_CACHES; c++) {
+        kore_buf_appendf(buf, "tcblcb_worker_cache_bytes{cache=\"%s\"} %llu\n",
+            METRICS_CACHE_NAMES[c], (unsigned long long)bytes[c]);
+    }
+}
+
+int tcblcb_page_metrics(struct http_request *req)
+{
+    u_int64_t started = tcblcb_metrics_now();
+    tcblcb_metrics_request_start(METRICS_ROUTE_METRICS);
+
+    if (_tcblcb_metrics == NULL) {
+        http_response(req, 503, NULL, 0);
+        return (KORE_RESULT_OK);
+    }
+
+    struct kore_buf *buf = kore_buf_alloc(64 * 1024);
+    append_route_metrics(buf);
+    append_op_metrics(buf);
+    append_statement_metrics(buf);
+    append_cache_metrics(buf);
+
+    // this scrape is recorded before it's sent, so it's counted by the next one
+    tcblcb_metrics_request_end(METRICS_ROUTE_METRICS, 200, buf->offset, started);
+
+    http_response_header(req, "content-type", METRICS_CONTENT_TYPE_STRING);
+    http_response(req, 200, buf->data, buf->offset);
+    kore_buf_free(buf);
+
+    return (KORE_RESULT_OK);
+}
@@ -0,0 +1,132 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef tcblcb_METRICS_HEADER_SEEN
+#define tcblcb_METRICS_HEADER_SEEN
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <kore/kore.h>
+#include <kore/http.h>
+
+// request and backend operation metrics, served in Prometheus text format by `/metrics`.
+//
+// every worker records into its own slot of a shared memory mapping (created by the parent before
+// the workers are forked), with relaxed atomic counters, so recording never takes a lock or
+// contends with another worker. `/metrics` adds the slots up when it's scraped.
+//
+// latencies go into log-linear histograms (like HDR histograms): each power of two from
+// METRICS_HIST_MIN_US is split into a few linear sub-buckets, so the relative error stays the
+// same from sub-millisecond cache hits to multi-second queries.
+
+// the routes in `conf/try-cb-lcb.conf` (`/apidocs` is served by Kore itself so isn't recorded)
+typedef enum {
+    METRICS_ROUTE_INDEX,
+    METRICS_ROUTE_AIRPORTS,
+    METRICS_ROUTE_FPATHS,
+    METRICS_ROUTE_HOTELS,
+    METRICS_ROUTE_USER_LOGIN,
+    METRICS_ROUTE_USER_SIGNUP,
+    METRICS_ROUTE_USER_FLIGHTS,
+    METRICS_ROUTE_METRICS,
+    METRICS_NUM_ROUTES
+} tcblcb_METRICS_ROUTE;
+
+// backend operation types
+typedef enum {
+    METRICS_OP_QUERY,
+    METRICS_OP_SEARCH,
+    METRICS_OP_GET,
+    METRICS_OP_STORE,
+    METRICS_OP_SUBDOC,
+    METRICS_NUM_OPS
+} tcblcb_METRICS_OP;
+
+// query and search statements, which also record the service side timings from their final
+// metadata row, so the client side latency can be split into service time and network/SDK time
+typedef enum {
+    METRICS_STATEMENT_AIRPORTS_FAA,
+    METRICS_STATEMENT_AIRPORTS_ICAO,
+    METRICS_STATEMENT_AIRPORTS_NAME,
+    METRICS_STATEMENT_FPATHS_AIRPORTS,
+    METRICS_STATEMENT_FPATHS_ROUTES,
+    METRICS_STATEMENT_HOTELS_SEARCH,
+    METRICS_NUM_STATEMENTS
+} tcblcb_METRICS_STATEMENT;
+
+// caches private to each worker, whose sizes are reported as gauges summed over the workers
+typedef enum {
+    METRICS_CACHE_AIRPORT_FAA,
+    METRICS_NUM_CACHES
+} tcblcb_METRICS_CACHE;
+
+// map the shared slots (from the parent). returns false if they could not be mapped, in which
+// case nothing is recorded.
+bool tcblcb_metrics_init(void);
+
+// unmap the shared slots.
+void tcblcb_metrics_destroy(void);
+
+// monotonic clock (in microseconds) that durations are measured with.
+u_int64_t tcblcb_metrics_now(void);
+
+// the path `route` is recorded under (e.g., "/api/tenants/{tenant}/user/login").
+const char *tcblcb_metrics_route_name(tcblcb_METRICS_ROUTE route);
+
+// record that a request for `route` has started.
+void tcblcb_metrics_request_start(tcblcb_METRICS_ROUTE route);
+
+// record that a request for `route` which started at `started` has completed with `status`,
+// having sent `response_bytes` of body (a status of 0 means the client went away first).
+void tcblcb_metrics_request_end(tcblcb_METRICS_ROUTE route, int status, size_t response_bytes, u_int64_t started);
+
+// record a backend operation that was scheduled at `started` and has just completed.
+void tcblcb_metrics_backend_op(tcblcb_METRICS_OP op, bool ok, u_int64_t started);
+
+// record the latency of an operation measured by lcb itself (reported through its meter).
+void tcblcb_metrics_sdk_op(tcblcb_METRICS_OP op, u_int64_t us);
+
+// record the timings of an operation traced by lcb: from dispatching it to the server until its
+// response, and the server duration reported in the response (0 if either is unknown). `slow` if
+// it was over the tracing threshold.
+void tcblcb_metrics_sdk_span(tcblcb_METRICS_OP op, u_int64_t dispatch_us, u_int64_t server_us, bool slow);
+
+// record a response that arrived after its operation had completed (e.g., timed out).
+void tcblcb_metrics_sdk_orphan(tcblcb_METRICS_OP op);
+
+// record a query or search statement that was scheduled at `started` and has just completed.
+void tcblcb_metrics_statement(tcblcb_METRICS_STATEMENT statement, u_int64_t started);
+
+// record the service side timings from the final metadata row of a statement: `elapsedTime`,
+// `executionTime` and `resultCount` for N1QL, `took` and `total_hits` for FTS. returns the result
+// count (0 if there is none).
+u_int64_t tcblcb_metrics_statement_meta(tcblcb_METRICS_STATEMENT statement, const char *meta, size_t nmeta);
+
+// record the current size of this worker's `cache` (e.g., after it has been modified).
+void tcblcb_metrics_cache_size(tcblcb_METRICS_CACHE cache, size_t entries, size_t bytes);
+
+// `/metrics` handler.
+int tcblcb_page_metrics(struct http_request *req);
+
+#endif /* !tcblcb_METRICS_HEADER_SEEN */
@@ -0,0 +1,467 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+// MAP_ANONYMOUS isn't part of POSIX
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <kore/kore.h>
+
+#include "shm-cache.h"
+#include "util.h"
+
+// the mapping starts with the cache header, followed by the shards. each shard is laid out as
+//
+//   [shard header][index slots, in buckets of SHMCACHE_WAYS][data ring]
+//
+// an entry's key and value are written back to back at the ring head (never wrapping around the
+// end of the ring) and the head only ever grows, so an entry is still intact for as long as the
+// head hasn't moved a whole ring past it. the index slot pointing at it is then reused when its
+// key is next looked up or replaced, or when the clock hand picks it for a new entry.
+//
+// readers use the shard's sequence number like a seqlock: it's odd while a writer is changing the
+// shard, and a copy taken while it changed is thrown away. anything read from shared memory is
+// bounds checked before it's used, since it may be torn until the sequence has been checked.
+
+#define SHMCACHE_SHARDS         16      // power of two
+#define SHMCACHE_WAYS           8       // index slots per bucket
+#define SHMCACHE_AVG_ENTRY      2048    // expected entry size, used to size the index
+#define SHMCACHE_READ_ATTEMPTS  4
+#define SHMCACHE_ALIGN          64      // keep shard headers on their own cache lines
+
+#define ShmAlign(size) (((size) + SHMCACHE_ALIGN - 1) & ~(size_t)(SHMCACHE_ALIGN - 1))
+
+typedef struct tcblcb_SHMENTRY {
+    u_int64_t hash;         // 0 if the slot is free
+    u_int64_t pos;          // ring position of the entry (key then value)
+    u_int64_t stale;        // soft expiry
+    u_int64_t expires;
+    u_int32_t key_len;
+    u_int32_t value_len;
+} tcblcb_SHMENTRY;
+
+typedef struct tcblcb_SHMSLOT {
+    tcblcb_SHMENTRY entry;
+    atomic_uint referenced; // set by readers, cleared as the clock hand passes
+} tcblcb_SHMSLOT;
+
+typedef struct tcblcb_SHMSHARD {
+    pthread_mutex_t lock;   // held by writers
+    atomic_uint seq;        // odd while a writer is changing the shard
+    u_int64_t head;         // ring position the next entry is written at
+    u_int32_t hand;         // clock hand
+} tcblcb_SHMSHARD;
+
+struct tcblcb_SHMCACHE {
+    char name[32];
+    size_t map_size;
+    size_t shard_size;      // bytes from one shard to the next
+    size_t num_buckets;     // per shard
+    size_t data_size;       // ring bytes per shard
+    size_t max_entry;       // largest key and value that is stored
+};
+
+// FNV-1a
+static u_int64_t shmcache_hash(const char *key, size_t key_len)
+{
+    u_int64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < key_len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    // 0 marks a free slot
+    return hash != 0 ? hash : 1;
+}
+
+static tcblcb_SHMSHARD *shmcache_shard(tcblcb_SHMCACHE *cache, u_int64_t hash)
+{
+    u_int8_t *shards = (u_int8_t *)cache + ShmAlign(sizeof(tcblcb_SHMCACHE));
+    return (tcblcb_SHMSHARD *)(shards + (hash & (SHMCACHE_SHARDS - 1)) * cache->shard_size);
+}
+
+static tcblcb_SHMSLOT *shmcache_slots(tcblcb_SHMSHARD *shard)
+{
+    return (tcblcb_SHMSLOT *)((u_int8_t *)shard + ShmAlign(sizeof(tcblcb_SHMSHARD)));
+}
+
+static tcblcb_SHMSLOT *shmcache_bucket(tcblcb_SHMCACHE *cache, tcblcb_SHMSHARD *shard, u_int64_t hash)
+{
+    // the low bits already picked the shard
+    return shmcache_slots(shard) + ((hash >> 4) & (cache->num_buckets - 1)) * SHMCACHE_WAYS;
+}
+
+static u_int8_t *shmcache_data(tcblcb_SHMCACHE *cache, tcblcb_SHMSHARD *shard)
+{
+    return (u_int8_t *)shmcache_slots(shard) + ShmAlign(cache->num_buckets * SHMCACHE_WAYS * sizeof(tcblcb_SHMSLOT));
+}
+
+// true if the entry hasn't expired and its data is still intact in the ring.
+static bool shmcache_entry_live(const tcblcb_SHMCACHE *cache, const tcblcb_SHMENTRY *entry, u_int64_t head, u_int64_t now)
+{
+    size_t len = (size_t)entry->key_len + entry->value_len;
+    return entry->hash != 0
+        && entry->expires > now
+        && entry->pos <= head
+        && head - entry->pos <= cache->data_size
+        && len <= cache->data_size - entry->pos % cache->data_size;
+}
+
+static void shmcache_write_begin(tcblcb_SHMSHARD *shard, unsigned int seq)
+{
+    atomic_store_explicit(&shard->seq, seq, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void shmcache_write_end(tcblcb_SHMSHARD *shard, unsigned int seq)
+{
+    atomic_store_explicit(&shard->seq, seq, memory_order_release);
+}
+
+static bool shmcache_lock(tcblcb_SHMCACHE *cache, tcblcb_SHMSHARD *shard)
+{
+    bool locked = false;
+
+    int rc = pthread_mutex_lock(&shard->lock);
+    if (rc == EOWNERDEAD) {
+        // a worker died holding the lock, maybe part way through an entry, so the shard's index
+        // is emptied before it's used again (the sequence may have been left odd too)
+        kore_log(LOG_WARNING, "Shared cache %s: clearing a shard left locked by a dead worker", cache->name);
+
+        unsigned int seq = atomic_load_explicit(&shard->seq, memory_order_relaxed) | 1;
+        shmcache_write_begin(shard, seq);
+        memset(shmcache_slots(shard), 0, cache->num_buckets * SHMCACHE_WAYS * sizeof(tcblcb_SHMSLOT));
+        shmcache_write_end(shard, seq + 1);
+
+        rc = pthread_mutex_consistent(&shard->lock);
+    }
+    IfBadErrnoGotoDone(rc, "Failed to lock shared cache shard");
+
+    locked = true;
+
+done:
+    return locked;
+}
+
+// find the slot holding a live entry for the key (only while holding the shard lock).
+static tcblcb_SHMSLOT *shmcache_slot_find(tcblcb_SHMCACHE *cache, tcblcb_SHMSHARD *shard, tcblcb_SHMSLOT *bucket, u_int64_t hash, const char *key, size_t key_len, u_int64_t now)
+{
+    const u_int8_t *data = shmcache_data(cache, shard);
+
+    for (size_t i = 0; i < SHMCACHE_WAYS; i++) {
+        tcblcb_SHMENTRY *entry = &bucket[i].entry;
+        if (entry->hash == hash && entry->key_len == key_len
+            && shmcache_entry_live(cache, entry, shard->head, now)
+            && memcmp(data + entry->pos % cache->data_size, key, key_len) == 0) {
+            return &bucket[i];
+        }
+    }
+
+    return NULL;
+}
+
+// pick the slot for a new entry: a free (or dead) slot, else the first slot the clock hand finds
+// that hasn't been read since the hand last passed it.
+static tcblcb_SHMSLOT *shmcache_slot_for(tcblcb_SHMCACHE *cache, tcblcb_SHMSHARD *shard, tcblcb_SHMSLOT *bucket, u_int64_t now)
+{
+    for (size_t i = 0; i < SHMCACHE_WAYS; i++) {
+        if (!shmcache_entry_live(cache, &bucket[i].entry, shard->head, now)) {
+            return &bucket[i];
+        }
+    }
+
+    // every slot is referenced at most once per pass, so this stops on the second pass at the latest
+    for (size_t i = 0; i < 2 * SHMCACHE_WAYS; i++) {
+        tcblcb_SHMSLOT *slot = &bucket[shard->hand++ % SHMCACHE_WAYS];
+        if (atomic_exchange_explicit(&slot->referenced, 0, memory_order_relaxed) == 0) {
+            return slot;
+        }
+    }
+
+    return &bucket[shard->hand++ % SHMCACHE_WAYS];
+}
+
+// push a stale entry's soft expiry back while it's refreshed. returns false if another lookup
+// got there first (or the entry changed), so only one lookup across the workers refreshes it.
+static bool shmcache_claim_refresh(tcblcb_SHMCACHE *cache, tcblcb_SHMSHARD *shard, tcblcb_SHMSLOT *bucket, u_int64_t hash, const char *key, size_t key_len, u_int64_t now)
+{
+    bool claimed = false;
+
+    if (!shmcache_lock(cache, shard)) {
+        return false;
+    }
+
+    tcblcb_SHMSLOT *slot = shmcache_slot_find(cache, shard, bucket, hash, key, key_len, now);
+    if (slot != NULL && slot->entry.stale <= now) {
+        unsigned int seq = atomic_load_explicit(&shard->seq, memory_order_relaxed);
+        shmcache_write_begin(shard, seq + 1);
+        slot->entry.stale = now + CACHE_REFRESH_RETRY_MS;
+        shmcache_write_end(shard, seq + 2);
+        claimed = true;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return claimed;
+}
+
+tcblcb_SHMCACHE *tcblcb_shmcache_create(const char *name, size_t max_bytes)
+{
+    bool valid = false;
+
+    tcblcb_SHMCACHE *cache = NULL;
+    pthread_mutexattr_t lock_attr;
+    bool lock_attr_init = false;
+
+    // split the budget into a ring per shard, with an index slot per expected entry
+    size_t data_size = ShmAlign(max_bytes / SHMCACHE_SHARDS);
+    size_t num_buckets = 1;
+    while (num_buckets * SHMCACHE_WAYS * SHMCACHE_AVG_ENTRY < data_size) {
+        num_buckets *= 2;
+    }
+
+    size_t shard_size = ShmAlign(sizeof(tcblcb_SHMSHARD))
+        + ShmAlign(num_buckets * SHMCACHE_WAYS * sizeof(tcblcb_SHMSLOT))
+        + data_size;
+    size_t map_size = ShmAlign(sizeof(tcblcb_SHMCACHE)) + SHMCACHE_SHARDS * shard_size;
+
+    // anonymous shared memory is zeroed and inherited by the forked workers
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    IfTrueGotoDone(
+        (map == MAP_FAILED),
+        "Failed to map shared cache memory"
+    );
+
+    cache = map;
+    snprintf(cache->name, sizeof(cache->name), "%s", name);
+    cache->map_size = map_size;
+    cache->shard_size = shard_size;
+    cache->num_buckets = num_buckets;
+    cache->data_size = data_size;
+
+    // a single entry can't push more than a quarter of its shard out of the ring
+    cache->max_entry = data_size / 4;
+
+    IfBadErrnoGotoDone(
+        pthread_mutexattr_init(&lock_attr),
+        "Failed to create shared cache lock attributes"
+    );
+    lock_attr_init = true;
+    IfBadErrnoGotoDone(
+        pthread_mutexattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED),
+        "Failed to share shared cache locks between processes"
+    );
+    IfBadErrnoGotoDone(
+        pthread_mutexattr_setrobust(&lock_attr, PTHREAD_MUTEX_ROBUST),
+        "Failed to make shared cache locks robust"
+    );
+
+    for (size_t i = 0; i < SHMCACHE_SHARDS; i++) {
+        tcblcb_SHMSHARD *shard = shmcache_shard(cache, i);
+        IfBadErrnoGotoDone(
+            pthread_mutex_init(&shard->lock, &lock_attr),
+            "Failed to create shared cache shard lock"
+        );
+        atomic_init(&shard->seq, 0);
+    }
+
+    kore_log(LOG_INFO, "Shared cache %s: %zu bytes in %d shards (%zu slots each)",
+        cache->name, map_size, SHMCACHE_SHARDS, num_buckets * SHMCACHE_WAYS);
+
+    valid = true;
+
+done:
+    if (lock_attr_init) {
+        pthread_mutexattr_destroy(&lock_attr);
+    }
+
+    if (!valid && cache != NULL) {
+        munmap(cache, map_size);
+        cache = NULL;
+    }
+
+    return cache;
+}
+
+void tcblcb_shmcache_destroy(tcblcb_SHMCACHE *cache)
+{
+    munmap(cache, cache->map_size);
+}
+
+tcblcb_CACHE_RESULT tcblcb_shmcache_get(tcblcb_SHMCACHE *cache, const char *key, size_t key_len, struct kore_buf *value)
+{
+    u_int64_t hash = shmcache_hash(key, key_len);
+    tcblcb_SHMSHARD *shard = shmcache_shard(cache, hash);
+    tcblcb_SHMSLOT *bucket = shmcache_bucket(cache, shard, hash);
+    const u_int8_t *data = shmcache_data(cache, shard);
+
+    size_t value_start = value != NULL ? value->offset : 0;
+    u_int64_t now = kore_time_ms();
+
+    for (int attempt = 0; attempt < SHMCACHE_READ_ATTEMPTS; attempt++) {
+        unsigned int seq = atomic_load_explicit(&shard->seq, memory_order_acquire);
+        if (seq & 1) {
+            continue;
+        }
+
+        tcblcb_SHMSLOT *hit_slot = NULL;
+        bool stale = false;
+        u_int64_t head = shard->head;
+
+        for (size_t i = 0; i < SHMCACHE_WAYS; i++) {
+            tcblcb_SHMENTRY entry = bucket[i].entry;
+            if (entry.hash != hash || entry.key_len != key_len || !shmcache_entry_live(cache, &entry, head, now)) {
+                continue;
+            }
+
+            const u_int8_t *entry_data = data + entry.pos % cache->data_size;
+            if (memcmp(entry_data, key, key_len) != 0) {
+                continue;
+            }
+
+            if (value != NULL) {
+                kore_buf_append(value, entry_data + key_len, entry.value_len);
+            }
+            hit_slot = &bucket[i];
+            stale = entry.stale <= now;
+            break;
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&shard->seq, memory_order_relaxed) == seq) {
+            if (hit_slot == NULL) {
+                return CACHE_MISS;
+            }
+
+            // only written when it changes so hot entries don't keep bouncing the cache line
+            if (atomic_load_explicit(&hit_slot->referenced, memory_order_relaxed) == 0) {
+                atomic_store_explicit(&hit_slot->referenced, 1, memory_order_relaxed);
+            }
+            return stale && shmcache_claim_refresh(cache, shard, bucket, hash, key, key_len, now) ? CACHE_STALE : CACHE_HIT;
+        }
+
+        // a writer changed the shard, so the copy may be torn
+        if (value != NULL) {
+            value->offset = value_start;
+        }
+    }
+
+    LogDebug("Shared cache %s: gave up reading a busy shard", cache->name);
+    return CACHE_MISS;
+}
+
+// store an entry, or leave the live entry already stored for the key if `replace` is false.
+static bool shmcache_store(tcblcb_SHMCACHE *cache, const char *key, size_t key_len, const char *value, size_t value_len, u_int64_t soft_ttl_ms, u_int64_t ttl_ms, bool replace, bool *exists)
+{
+    size_t len = key_len + value_len;
+    if (len > cache->max_entry) {
+        LogDebug("Shared cache %s: entry is too large (%zu bytes)", cache->name, len);
+        return false;
+    }
+
+    u_int64_t hash = shmcache_hash(key, key_len);
+    tcblcb_SHMSHARD *shard = shmcache_shard(cache, hash);
+    tcblcb_SHMSLOT *bucket = shmcache_bucket(cache, shard, hash);
+    u_int8_t *data = shmcache_data(cache, shard);
+
+    if (!shmcache_lock(cache, shard)) {
+        return false;
+    }
+
+    u_int64_t now = kore_time_ms();
+    tcblcb_SHMSLOT *slot = shmcache_slot_find(cache, shard, bucket, hash, key, key_len, now);
+    if (slot != NULL && !replace) {
+        *exists = true;
+        pthread_mutex_unlock(&shard->lock);
+        return false;
+    }
+
+    unsigned int seq = atomic_load_explicit(&shard->seq, memory_order_relaxed);
+    shmcache_write_begin(shard, seq + 1);
+
+    if (slot == NULL) {
+        slot = shmcache_slot_for(cache, shard, bucket, now);
+    }
+
+    // entries never wrap around the end of the ring
+    size_t offset = shard->head % cache->data_size;
+    if (offset + len > cache->data_size) {
+        shard->head += cache->data_size - offset;
+        offset = 0;
+    }
+
+    memcpy(data + offset, key, key_len);
+    memcpy(data + offset + key_len, value, value_len);
+
+    slot->entry.hash = hash;
+    slot->entry.pos = shard->head;
+    slot->entry.stale = now + soft_ttl_ms;
+    slot->entry.expires = now + ttl_ms;
+    slot->entry.key_len = (u_int32_t)key_len;
+    slot->entry.value_len = (u_int32_t)value_len;
+    atomic_store_explicit(&slot->referenced, 0, memory_order_relaxed);
+
+    shard->head += len;
+
+    shmcache_write_end(shard, seq + 2);
+    pthread_mutex_unlock(&shard->lock);
+
+    return true;
+}
+
+bool tcblcb_shmcache_put(tcblcb_SHMCACHE *cache, const char *key, size_t key_len, const char *value, size_t value_len, u_int64_t soft_ttl_ms, u_int64_t ttl_ms)
+{
+    bool exists = false;
+    return shmcache_store(cache, key, key_len, value, value_len, soft_ttl_ms, ttl_ms, true, &exists);
+}
+
+bool tcblcb_shmcache_add(tcblcb_SHMCACHE *cache, const char *key, size_t key_len, const char *value, size_t value_len, u_int64_t ttl_ms, bool *exists)
+{
+    *exists = false;
+    return shmcache_store(cache, key, key_len, value, value_len, ttl_ms, ttl_ms, false, exists);
+}
+
+void tcblcb_shmcache_remove(tcblcb_SHMCACHE *cache, const char *key, size_t key_len)
+{
+    u_int64_t hash = shmcache_hash(key, key_len);
+    tcblcb_SHMSHARD *shard = shmcache_shard(cache, hash);
+    tcblcb_SHMSLOT *bucket = shmcache_bucket(cache, shard, hash);
+
+    if (!shmcache_lock(cache, shard)) {
+        return;
+    }
+
+    tcblcb_SHMSLOT *slot = shmcache_slot_find(cache, shard, bucket, hash, key, key_len, kore_time_ms());
+    if (slot != NULL) {
+        unsigned int seq = atomic_load_explicit(&shard->seq, memory_order_relaxed);
+        shmcache_write_begin(shard, seq + 1);
+        slot->entry.hash = 0;
+        shmcache_write_end(shard, seq + 2);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
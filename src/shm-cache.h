@@ -0,0 +1,67 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef tcblcb_SHM_CACHE_HEADER_SEEN
+#define tcblcb_SHM_CACHE_HEADER_SEEN
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <kore/kore.h>
+
+#include "cache.h"
+
+// fixed-size key/value cache in shared memory, so every Kore worker process reads (and warms) the
+// same entries instead of each keeping its own copy. it must be created by the parent before the
+// workers are forked, which then inherit the mapping.
+//
+// the cache is split into shards by key hash. reads never take a lock: they copy the entry out
+// and retry (or give up and miss) if a writer changed the shard meanwhile. writes take the
+// shard's lock. each shard has a fixed number of index slots, reused with clock (second chance)
+// eviction, and a ring of entry data, where new entries overwrite the oldest ones.
+//
+// entries have a soft TTL like the per-worker cache: the first lookup past it (in any worker)
+// gets CACHE_STALE along with the value and should refresh the entry.
+typedef struct tcblcb_SHMCACHE tcblcb_SHMCACHE;
+
+// create a cache using `max_bytes` of shared memory.
+tcblcb_SHMCACHE *tcblcb_shmcache_create(const char *name, size_t max_bytes);
+
+// unmap the cache (only from the process that will no longer use it).
+void tcblcb_shmcache_destroy(tcblcb_SHMCACHE *cache);
+
+// look up `key`, appending a copy of the value to `value` (if not NULL) on a hit or stale hit. a
+// lookup that keeps racing with writers is a miss.
+tcblcb_CACHE_RESULT tcblcb_shmcache_get(tcblcb_SHMCACHE *cache, const char *key, size_t key_len, struct kore_buf *value);
+
+// store a copy of `value` for `ttl_ms` (stale after `soft_ttl_ms`), replacing any existing entry.
+// returns false if the entry could not be stored (e.g., it's too large for a shard).
+bool tcblcb_shmcache_put(tcblcb_SHMCACHE *cache, const char *key, size_t key_len, const char *value, size_t value_len, u_int64_t soft_ttl_ms, u_int64_t ttl_ms);
+
+// store a copy of `value` for `ttl_ms` (never stale) only if there is no entry for `key` yet,
+// which is decided atomically across the workers. `exists` is set if that's why it wasn't stored.
+bool tcblcb_shmcache_add(tcblcb_SHMCACHE *cache, const char *key, size_t key_len, const char *value, size_t value_len, u_int64_t ttl_ms, bool *exists);
+
+// drop the entry for `key` (if any).
+void tcblcb_shmcache_remove(tcblcb_SHMCACHE *cache, const char *key, size_t key_len);
+
+#endif /* !tcblcb_SHM_CACHE_HEADER_SEEN */
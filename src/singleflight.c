@@ -0,0 +1,218 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+
+#include <string.h>
+#include <sys/queue.h>
+#include <kore/kore.h>
+
+#include "singleflight.h"
+#include "util.h"
+
+// how long a flight is marked for the other workers, which is also the longest they wait for it
+#define FLIGHT_MAX_WAIT_MS 3000
+// how often requests in other workers check whether the flight has landed
+#define FLIGHT_POLL_MS 20
+
+#define FLIGHT_MARKER_PREFIX "flight|"
+#define FLIGHT_MARKER_PREFIX_STRLEN (sizeof(FLIGHT_MARKER_PREFIX) - 1)
+
+// a request in this worker waiting for a flight
+typedef struct tcblcb_FLIGHTWAITER {
+    LIST_ENTRY(tcblcb_FLIGHTWAITER) entry;
+    tcblcb_REQCTX *ctx;
+} tcblcb_FLIGHTWAITER;
+
+struct tcblcb_FLIGHT {
+    LIST_ENTRY(tcblcb_FLIGHT) entry;
+    char *key;
+    char *marker;               // NULL if the other workers don't know about the flight
+    size_t marker_len;
+    tcblcb_SHMCACHE *cache;
+    LIST_HEAD(tcblcb_FLIGHTWAITERS, tcblcb_FLIGHTWAITER) waiters;
+};
+
+// a request waiting for a flight led by another worker
+typedef struct tcblcb_FLIGHTWATCH {
+    tcblcb_REQCTX *ctx;
+    tcblcb_SHMCACHE *cache;
+    char *marker;
+    size_t marker_len;
+    u_int64_t deadline;
+} tcblcb_FLIGHTWATCH;
+
+static _Thread_local LIST_HEAD(tcblcb_FLIGHTS, tcblcb_FLIGHT) _flights = LIST_HEAD_INITIALIZER(_flights);
+
+static char *flight_marker(const char *key, size_t *marker_len)
+{
+    size_t key_len = strlen(key);
+    char *marker = malloc(FLIGHT_MARKER_PREFIX_STRLEN + key_len + 1);
+    if (marker != NULL) {
+        memcpy(marker, FLIGHT_MARKER_PREFIX, FLIGHT_MARKER_PREFIX_STRLEN);
+        memcpy(marker + FLIGHT_MARKER_PREFIX_STRLEN, key, key_len + 1);
+        *marker_len = FLIGHT_MARKER_PREFIX_STRLEN + key_len;
+    }
+    return marker;
+}
+
+static void flight_watch_check(void *arg, u_int64_t now)
+{
+    tcblcb_FLIGHTWATCH *watch = arg;
+
+    if (now < watch->deadline
+        && tcblcb_shmcache_get(watch->cache, watch->marker, watch->marker_len, NULL) == CACHE_HIT) {
+        // still in flight
+        kore_timer_add(flight_watch_check, FLIGHT_POLL_MS, watch, KORE_TIMER_ONESHOT);
+        return;
+    }
+
+    tcblcb_REQCTX *ctx = watch->ctx;
+    free(watch->marker);
+    free(watch);
+
+    tcblcb_reqctx_op_done(ctx);
+}
+
+// wait for the flight another worker marked with `marker`, which the watch takes over.
+static bool flight_watch(tcblcb_REQCTX *ctx, tcblcb_SHMCACHE *cache, char *marker, size_t marker_len)
+{
+    bool watching = false;
+
+    tcblcb_FLIGHTWATCH *watch = calloc(1, sizeof(tcblcb_FLIGHTWATCH));
+    IfNULLGotoDone(watch, "Can't allocate flight watch");
+
+    watch->ctx = ctx;
+    watch->cache = cache;
+    watch->marker = marker;
+    watch->marker_len = marker_len;
+    watch->deadline = kore_time_ms() + FLIGHT_MAX_WAIT_MS;
+
+    tcblcb_reqctx_op_scheduled(ctx);
+    kore_timer_add(flight_watch_check, FLIGHT_POLL_MS, watch, KORE_TIMER_ONESHOT);
+    watching = true;
+
+done:
+    return watching;
+}
+
+bool tcblcb_flight_join(tcblcb_REQCTX *ctx, tcblcb_SHMCACHE *cache, const char *key, tcblcb_FLIGHT **flight)
+{
+    bool joined = false;
+    char *marker = NULL;
+    size_t marker_len = 0;
+    tcblcb_FLIGHT *new_flight = NULL;
+
+    *flight = NULL;
+
+    tcblcb_FLIGHT *existing;
+    LIST_FOREACH(existing, &_flights, entry) {
+        if (strcmp(existing->key, key) == 0) {
+            break;
+        }
+    }
+
+    if (existing != NULL) {
+        tcblcb_FLIGHTWAITER *waiter = calloc(1, sizeof(tcblcb_FLIGHTWAITER));
+        IfNULLGotoDone(waiter, "Can't allocate flight waiter");
+
+        waiter->ctx = ctx;
+        LIST_INSERT_HEAD(&existing->waiters, waiter, entry);
+        tcblcb_reqctx_op_scheduled(ctx);
+        LogDebug("Joined flight %s", key);
+        joined = true;
+        goto done;
+    }
+
+    // claim the flight for this worker, unless another worker already did
+    if (cache != NULL) {
+        bool exists = false;
+        marker = flight_marker(key, &marker_len);
+        if (marker != NULL && !tcblcb_shmcache_add(cache, marker, marker_len, "", 0, FLIGHT_MAX_WAIT_MS, &exists)) {
+            if (exists && flight_watch(ctx, cache, marker, marker_len)) {
+                marker = NULL;
+                LogDebug("Joined flight %s from another worker", key);
+                joined = true;
+                goto done;
+            }
+
+            // lead without the other workers knowing
+            free(marker);
+            marker = NULL;
+        }
+    }
+
+    new_flight = calloc(1, sizeof(tcblcb_FLIGHT));
+    IfNULLGotoDone(new_flight, "Can't allocate flight");
+
+    new_flight->key = strdup(key);
+    IfNULLGotoDone(new_flight->key, "Can't allocate flight key");
+
+    new_flight->marker = marker;
+    new_flight->marker_len = marker_len;
+    new_flight->cache = cache;
+    marker = NULL;
+    LIST_INIT(&new_flight->waiters);
+
+    LIST_INSERT_HEAD(&_flights, new_flight, entry);
+    *flight = new_flight;
+    new_flight = NULL;
+
+done:
+    if (new_flight != NULL) {
+        free(new_flight->key);
+        free(new_flight);
+    }
+    if (marker != NULL) {
+        // claimed in the shared cache, but not tracked here
+        tcblcb_shmcache_remove(cache, marker, marker_len);
+        free(marker);
+    }
+
+    return joined;
+}
+
+void tcblcb_flight_land(tcblcb_FLIGHT *flight)
+{
+    if (flight == NULL) {
+        return;
+    }
+
+    LIST_REMOVE(flight, entry);
+
+    if (flight->marker != NULL) {
+        tcblcb_shmcache_remove(flight->cache, flight->marker, flight->marker_len);
+        free(flight->marker);
+    }
+
+    tcblcb_FLIGHTWAITER *waiter;
+    while ((waiter = LIST_FIRST(&flight->waiters)) != NULL) {
+        LIST_REMOVE(waiter, entry);
+        tcblcb_REQCTX *ctx = waiter->ctx;
+        free(waiter);
+
+        tcblcb_reqctx_op_done(ctx);
+    }
+
+    free(flight->key);
+    free(flight);
+}
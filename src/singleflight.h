@@ -0,0 +1,53 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+
+#ifndef tcblcb_SINGLEFLIGHT_HEADER_SEEN
+#define tcblcb_SINGLEFLIGHT_HEADER_SEEN
+
+#include <stdbool.h>
+
+#include "shm-cache.h"
+#include "try-cb-lcb.h"
+
+// coalesces identical backend operations that are in flight at the same time. the first request
+// for a key leads and runs the operation; requests for the same key that arrive before it lands
+// wait for it instead of issuing their own, then pick up the result from the shared response
+// cache. the key should identify the statement and its parameters, e.g., the response cache key.
+//
+// leaders in one worker are tracked in a list, and also marked in the shared cache so requests
+// in the other workers can wait for them too (by polling the marker, with a deadline). a woken
+// request that doesn't find the result cached (the leader failed, or its response wasn't
+// cacheable) runs the operation itself without joining again.
+typedef struct tcblcb_FLIGHT tcblcb_FLIGHT;
+
+// join the operation in flight for `key`, if there is one. returns true if the request is now
+// waiting for it: the handler must suspend (with tcblcb_reqctx_suspend) and check the cache once
+// woken. otherwise the request leads: `flight` is set (NULL if it couldn't be tracked) and must
+// be landed once the result is cached, or the operation failed.
+bool tcblcb_flight_join(tcblcb_REQCTX *ctx, tcblcb_SHMCACHE *cache, const char *key, tcblcb_FLIGHT **flight);
+
+// land a flight, waking every request waiting for it. a NULL flight is ignored.
+void tcblcb_flight_land(tcblcb_FLIGHT *flight);
+
+#endif /* !tcblcb_SINGLEFLIGHT_HEADER_SEEN */
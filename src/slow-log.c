@@ -0,0 +1,223 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <kore/kore.h>
+
+#include "metrics.h"
+#include "slow-log.h"
+#include "util.h"
+
+#define SLOWLOG_RING_SIZE (256 * 1024)
+#define SLOWLOG_FLUSH_MS 1000
+
+// set by the parent before the workers are forked
+static int _slowlog_fd = -1;
+static u_int64_t _slowlog_threshold_us = 0;
+static unsigned int _slowlog_rate = 0;
+static unsigned int _slowlog_sample = 1;
+
+typedef struct tcblcb_SLOWLOG {
+    char *ring;
+    u_int64_t head;             // bytes written into the ring so far
+    u_int64_t tail;             // bytes flushed from the ring so far
+    struct kore_timer *timer;
+    u_int64_t slow;             // slow requests seen (for sampling)
+    double tokens;              // rate limit bucket, refilled at `rate` per second
+    u_int64_t refilled;         // when the bucket was last refilled (metrics clock)
+    u_int64_t rate_limited;     // lines dropped since the last flush
+    u_int64_t ring_full;
+} tcblcb_SLOWLOG;
+
+static _Thread_local tcblcb_SLOWLOG *_slowlog = NULL;
+
+static void slowlog_ring_copy(tcblcb_SLOWLOG *log, const char *data, size_t len)
+{
+    size_t start = log->head % SLOWLOG_RING_SIZE;
+    size_t first = len < SLOWLOG_RING_SIZE - start ? len : SLOWLOG_RING_SIZE - start;
+
+    memcpy(log->ring + start, data, first);
+    memcpy(log->ring, data + first, len - first);
+    log->head += len;
+}
+
+// copy a line and its newline into the ring. returns false if there isn't room for it.
+static bool slowlog_ring_put(tcblcb_SLOWLOG *log, const char *line, size_t len)
+{
+    if (SLOWLOG_RING_SIZE - (log->head - log->tail) < len + 1) {
+        return false;
+    }
+
+    slowlog_ring_copy(log, line, len);
+    slowlog_ring_copy(log, "\n", 1);
+    return true;
+}
+
+static void slowlog_flush(tcblcb_SLOWLOG *log)
+{
+    // drops are reported in the ring too, so they're written in order with the lines
+    if (log->rate_limited > 0 || log->ring_full > 0) {
+        char line[128];
+        int len = snprintf(line, sizeof(line), "{\"type\":\"slow_log_dropped\",\"rate_limited\":%llu,\"ring_full\":%llu}",
+            (unsigned long long)log->rate_limited, (unsigned long long)log->ring_full);
+        if (slowlog_ring_put(log, line, (size_t)len)) {
+            log->rate_limited = 0;
+            log->ring_full = 0;
+        }
+    }
+
+    while (log->head > log->tail) {
+        size_t used = log->head - log->tail;
+        size_t start = log->tail % SLOWLOG_RING_SIZE;
+        size_t first = used < SLOWLOG_RING_SIZE - start ? used : SLOWLOG_RING_SIZE - start;
+
+        // one call for both halves of the ring, so an append isn't split by another worker's
+        struct iovec iov[2] = {
+            { .iov_base = log->ring + start, .iov_len = first },
+            { .iov_base = log->ring, .iov_len = used - first },
+        };
+        ssize_t written = writev(_slowlog_fd, iov, used > first ? 2 : 1);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // try again with the next flush if the file can't take any more right now
+            if (errno != EAGAIN) {
+                kore_log(LOG_WARNING, "Failed to write slow log: %s", strerror(errno));
+                log->tail = log->head;
+            }
+            return;
+        }
+        log->tail += (u_int64_t)written;
+    }
+}
+
+static void slowlog_flush_timer(__unused void *arg, __unused u_int64_t now)
+{
+    if (_slowlog != NULL) {
+        slowlog_flush(_slowlog);
+    }
+}
+
+void tcblcb_slowlog_configure(int fd, u_int64_t threshold_us, unsigned int rate, unsigned int sample)
+{
+    _slowlog_fd = fd;
+    _slowlog_threshold_us = threshold_us;
+    _slowlog_rate = rate;
+    _slowlog_sample = sample > 0 ? sample : 1;
+}
+
+bool tcblcb_slowlog_enabled(void)
+{
+    return _slowlog_fd >= 0;
+}
+
+void tcblcb_slowlog_start(void)
+{
+    if (!tcblcb_slowlog_enabled() || _slowlog != NULL) {
+        return;
+    }
+
+    tcblcb_SLOWLOG *log = calloc(1, sizeof(tcblcb_SLOWLOG));
+    if (log == NULL || (log->ring = malloc(SLOWLOG_RING_SIZE)) == NULL) {
+        kore_log(LOG_WARNING, "Failed to allocate slow log ring buffer");
+        free(log);
+        return;
+    }
+
+    log->tokens = _slowlog_rate;
+    log->refilled = tcblcb_metrics_now();
+    log->timer = kore_timer_add(slowlog_flush_timer, SLOWLOG_FLUSH_MS, NULL, 0);
+    _slowlog = log;
+}
+
+void tcblcb_slowlog_stop(void)
+{
+    tcblcb_SLOWLOG *log = _slowlog;
+    if (log == NULL) {
+        return;
+    }
+
+    if (log->timer != NULL) {
+        kore_timer_remove(log->timer);
+    }
+    slowlog_flush(log);
+
+    free(log->ring);
+    free(log);
+    _slowlog = NULL;
+}
+
+bool tcblcb_slowlog_want(u_int64_t us)
+{
+    tcblcb_SLOWLOG *log = _slowlog;
+    if (log == NULL || us < _slowlog_threshold_us) {
+        return false;
+    }
+
+    if (log->slow++ % _slowlog_sample != 0) {
+        return false;
+    }
+
+    // a rate of 0 is unlimited
+    if (_slowlog_rate == 0) {
+        return true;
+    }
+
+    // the bucket holds up to a second's worth of lines
+    u_int64_t now = tcblcb_metrics_now();
+    log->tokens += (double)(now - log->refilled) * _slowlog_rate / 1e6;
+    if (log->tokens > _slowlog_rate) {
+        log->tokens = _slowlog_rate;
+    }
+    log->refilled = now;
+
+    if (log->tokens < 1) {
+        log->rate_limited++;
+        return false;
+    }
+
+    log->tokens -= 1;
+    return true;
+}
+
+void tcblcb_slowlog_write(const char *line, size_t len)
+{
+    tcblcb_SLOWLOG *log = _slowlog;
+    if (log != NULL && !slowlog_ring_put(log, line, len)) {
+        log->ring_full++;
+    }
+}
+
+void tcblcb_slowlog_destroy(void)
+{
+    if (_slowlog_fd >= 0 && _slowlog_fd != STDERR_FILENO) {
+        close(_slowlog_fd);
+    }
+    _slowlog_fd = -1;
+}
@@ -0,0 +1,64 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef tcblcb_SLOWLOG_HEADER_SEEN
+#define tcblcb_SLOWLOG_HEADER_SEEN
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// slow request log: a JSON line for each request slower than a threshold.
+//
+// lines are copied into a ring buffer kept by each worker and written out in batches by a timer,
+// so a request never waits on the log file. workers are single threaded, so the request path and
+// the flush timer never run at the same time and the ring needs no locks. only 1 in `sample` slow
+// requests is considered, and those are limited to `rate` lines per second per worker, so a
+// latency incident can't turn into an I/O storm. lines that are rate limited or don't fit in the
+// ring are counted, and the counts are logged with the next flush.
+
+// enable the slow log (from the parent, before the workers are forked), writing to `fd` (which is
+// opened for appending, so lines from the workers don't overwrite each other).
+void tcblcb_slowlog_configure(int fd, u_int64_t threshold_us, unsigned int rate, unsigned int sample);
+
+// true if the slow log is enabled.
+bool tcblcb_slowlog_enabled(void);
+
+// start the worker's ring buffer and flush timer.
+void tcblcb_slowlog_start(void);
+
+// flush what's left in the worker's ring buffer and free it.
+void tcblcb_slowlog_stop(void);
+
+// true if a request that took `us` should be logged: it's over the threshold, sampled and within
+// the rate limit. the line should only be built (and then written) if it is.
+bool tcblcb_slowlog_want(u_int64_t us);
+
+// copy a line (without its newline) into the ring buffer. it's dropped (and counted) if the ring
+// is full.
+void tcblcb_slowlog_write(const char *line, size_t len);
+
+// stop writing to the slow log file and close it (from the parent).
+void tcblcb_slowlog_destroy(void);
+
+#endif /* !tcblcb_SLOWLOG_HEADER_SEEN */
@@ -20,7 +20,15 @@
  * IN THE SOFTWARE.
  */
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "try-cb-lcb.h"
+#include "lcb-iops.h"
+#include "airport-index.h"
+#include "slow-log.h"
 #include "util.h"
 
 #if defined(__linux__)
@@ -42,11 +50,34 @@ KORE_SECCOMP_FILTER("try-cb-lcb",
     KORE_SYSCALL_ALLOW(sendmsg),
     KORE_SYSCALL_ALLOW(recvmsg),
     KORE_SYSCALL_ALLOW(gettimeofday),
+    KORE_SYSCALL_ALLOW(poll),
+    // shared response cache locks
+    KORE_SYSCALL_ALLOW(futex),
+    // slow log flushes
+    KORE_SYSCALL_ALLOW(writev),
 )
 #endif /* linux */
 
 _Thread_local lcb_INSTANCE *_tcblcb_lcb_instance = NULL;
 
+// IO options that run the instance on the Kore worker event loop
+static _Thread_local lcb_io_opt_t _tcblcb_lcb_iops = NULL;
+
+// mapped by the parent before the workers are forked, so they all share it
+#define RESPONSE_CACHE_MAX_BYTES (64 * 1024 * 1024)
+tcblcb_SHMCACHE *_tcblcb_response_cache = NULL;
+
+// request arenas start with one chunk of this size, and one is kept spare for the next request
+#define REQCTX_ARENA_CHUNK_SIZE (16 * 1024)
+static _Thread_local tcblcb_ARENA *_tcblcb_spare_arena = NULL;
+
+// when the request being handled for the first time started (0 otherwise), for its context
+static _Thread_local u_int64_t _tcblcb_request_started = 0;
+
+// generated request IDs are unique per worker start (its id and start time) and request count
+static _Thread_local time_t _tcblcb_request_id_epoch = 0;
+static _Thread_local u_int64_t _tcblcb_request_id_count = 0;
+
 // See `docker-compose.yml` for the `db` alias that resolves to the couchbase-server docker hostname.
 static const char   DEFAULT_SCHEME_STRING[] = "couchbase://";
 static const size_t DEFAULT_SCHEME_STRLEN   = sizeof(DEFAULT_SCHEME_STRING) - 1;
@@ -63,6 +94,23 @@ static const char   ENV_CB_SCHEME[] = "CB_SCHEME";
 static const char   ENV_CB_HOST[]   = "CB_HOST";
 static const char   ENV_CB_USER[]   = "CB_USER";
 static const char   ENV_CB_PSWD[]   = "CB_PSWD";
+static const char   ENV_SERVER_TIMING[] = "TCBLCB_SERVER_TIMING";
+static const char   ENV_TRACING_THRESHOLD_KV[]     = "TCBLCB_TRACING_THRESHOLD_KV";
+static const char   ENV_TRACING_THRESHOLD_QUERY[]  = "TCBLCB_TRACING_THRESHOLD_QUERY";
+static const char   ENV_TRACING_THRESHOLD_SEARCH[] = "TCBLCB_TRACING_THRESHOLD_SEARCH";
+static const char   ENV_SLOW_LOG_THRESHOLD[] = "TCBLCB_SLOW_LOG_THRESHOLD";
+static const char   ENV_SLOW_LOG_FILE[]      = "TCBLCB_SLOW_LOG_FILE";
+static const char   ENV_SLOW_LOG_RATE[]      = "TCBLCB_SLOW_LOG_RATE";
+static const char   ENV_SLOW_LOG_SAMPLE[]    = "TCBLCB_SLOW_LOG_SAMPLE";
+
+// slow log lines per second per worker, unless set with TCBLCB_SLOW_LOG_RATE
+#define SLOW_LOG_DEFAULT_RATE 10
+
+// longest path or query string value written to the slow log
+#define SLOW_LOG_VALUE_MAX 128
+
+// most path parameters in a route
+#define SLOW_LOG_PATH_PARAMS_MAX 4
 
 static const char  *_cb_scheme_string = DEFAULT_SCHEME_STRING;
 static size_t       _cb_scheme_strlen = DEFAULT_SCHEME_STRLEN;
@@ -76,11 +124,40 @@ static size_t       _cb_pswd_strlen   = DEFAULT_PSWD_STRLEN;
 static const char * _cb_conn_string = NULL;
 static size_t       _cb_conn_strlen = 0;
 
+// send Server-Timing with every response, not only when a request asks for it
+static bool         _server_timing = false;
+
+static const char  *TIMING_PHASE_NAMES[TIMING_NUM_PHASES] = {
+    [TIMING_PHASE_PARSE] = "parse",
+    [TIMING_PHASE_BODY] = "body",
+    [TIMING_PHASE_BUILD] = "build",
+    [TIMING_PHASE_SERIALIZE] = "serialize",
+};
+
+static const char  *TIMING_OP_NAMES[METRICS_NUM_OPS] = {
+    [METRICS_OP_QUERY] = "query",
+    [METRICS_OP_SEARCH] = "search",
+    [METRICS_OP_GET] = "get",
+    [METRICS_OP_STORE] = "store",
+    [METRICS_OP_SUBDOC] = "subdoc",
+};
+
 static void open_callback(__unused lcb_INSTANCE *instance, lcb_STATUS rc)
 {
     kore_log(LOG_NOTICE, "Open bucket callback result was: %s", lcb_strerror_short(rc));
 }
 
+// record a completed lcb operation in the metrics and the request timings.
+static void reqctx_backend_op(tcblcb_REQCTX *ctx, tcblcb_METRICS_OP op, bool ok, u_int64_t started)
+{
+    tcblcb_metrics_backend_op(op, ok, started);
+
+    if (ctx != NULL) {
+        ctx->op_count[op]++;
+        ctx->op_us[op] += tcblcb_metrics_now() - started;
+    }
+}
+
 static void get_callback(lcb_INSTANCE *instance, __unused int cbtype, const lcb_RESPGET *resp)
 {
     tcblcb_RESPDELEGATE *resp_delegate = NULL;
@@ -98,12 +175,20 @@ static void get_callback(lcb_INSTANCE *instance, __unused int cbtype, const lcb_
         "Response delegate callback is NULL"
     );
 
-    resp_delegate->callback(instance, resp_delegate->cookie, (lcb_RESPBASE *)resp);
+    if (tcblcb_reqctx_attached(resp_delegate->ctx)) {
+        tcblcb_ARENA *previous_arena = tcblcb_arena_enter(resp_delegate->ctx->arena);
+        resp_delegate->callback(instance, resp_delegate->cookie, (lcb_RESPBASE *)resp);
+        tcblcb_arena_leave(previous_arena);
+    }
 
 done:
-    // receiver is responsible for freeing this memory if command is scheduled
+    // receiver is responsible for freeing this memory if command is scheduled (before the
+    // context, and the arena it came from, can go away)
     if (resp_delegate != NULL) {
-        free(resp_delegate);
+        tcblcb_REQCTX *ctx = resp_delegate->ctx;
+        reqctx_backend_op(ctx, METRICS_OP_GET, lcb_respget_status(resp) == LCB_SUCCESS, resp_delegate->started);
+        tcblcb_free(resp_delegate);
+        tcblcb_reqctx_op_done(ctx);
     }
 }
 
@@ -124,12 +209,20 @@ static void store_callback(lcb_INSTANCE *instance, __unused int cbtype, const lc
         "Response delegate callback is NULL"
     );
 
-    resp_delegate->callback(instance, resp_delegate->cookie, (lcb_RESPBASE *)resp);
+    if (tcblcb_reqctx_attached(resp_delegate->ctx)) {
+        tcblcb_ARENA *previous_arena = tcblcb_arena_enter(resp_delegate->ctx->arena);
+        resp_delegate->callback(instance, resp_delegate->cookie, (lcb_RESPBASE *)resp);
+        tcblcb_arena_leave(previous_arena);
+    }
 
 done:
-    // receiver is responsible for freeing this memory if command is scheduled
+    // receiver is responsible for freeing this memory if command is scheduled (before the
+    // context, and the arena it came from, can go away)
     if (resp_delegate != NULL) {
-        free(resp_delegate);
+        tcblcb_REQCTX *ctx = resp_delegate->ctx;
+        reqctx_backend_op(ctx, METRICS_OP_STORE, lcb_respstore_status(resp) == LCB_SUCCESS, resp_delegate->started);
+        tcblcb_free(resp_delegate);
+        tcblcb_reqctx_op_done(ctx);
     }
 }
 
@@ -150,12 +243,20 @@ static void subdoc_callback(lcb_INSTANCE *instance, __unused int cbtype, const l
         "Response delegate callback is NULL"
     );
 
-    resp_delegate->callback(instance, resp_delegate->cookie, (lcb_RESPBASE *)resp);
+    if (tcblcb_reqctx_attached(resp_delegate->ctx)) {
+        tcblcb_ARENA *previous_arena = tcblcb_arena_enter(resp_delegate->ctx->arena);
+        resp_delegate->callback(instance, resp_delegate->cookie, (lcb_RESPBASE *)resp);
+        tcblcb_arena_leave(previous_arena);
+    }
 
 done:
-    // receiver is responsible for freeing this memory if command is scheduled
+    // receiver is responsible for freeing this memory if command is scheduled (before the
+    // context, and the arena it came from, can go away)
     if (resp_delegate != NULL) {
-        free(resp_delegate);
+        tcblcb_REQCTX *ctx = resp_delegate->ctx;
+        reqctx_backend_op(ctx, METRICS_OP_SUBDOC, lcb_respsubdoc_status(resp) == LCB_SUCCESS, resp_delegate->started);
+        tcblcb_free(resp_delegate);
+        tcblcb_reqctx_op_done(ctx);
     }
 }
 
@@ -165,6 +266,823 @@ static void destroy_cb_instance()
         lcb_destroy(_tcblcb_lcb_instance);
         _tcblcb_lcb_instance = NULL;
     }
+
+    tcblcb_tracing_destroy();
+
+    tcblcb_airport_index_destroy();
+
+    if (_tcblcb_spare_arena != NULL) {
+        tcblcb_arena_destroy(_tcblcb_spare_arena);
+        _tcblcb_spare_arena = NULL;
+    }
+
+    // the instance may release sockets and timers while being destroyed so this goes last
+    if (_tcblcb_lcb_iops != NULL) {
+        tcblcb_iops_destroy(_tcblcb_lcb_iops);
+        _tcblcb_lcb_iops = NULL;
+    }
+}
+
+tcblcb_RESPDELEGATE *tcblcb_respdelegate_create(tcblcb_REQCTX *ctx, void *cookie, tcblcb_RESPDELEGATE_CALLBACK callback)
+{
+    tcblcb_RESPDELEGATE *resp_delegate = tcblcb_malloc(sizeof(tcblcb_RESPDELEGATE));
+    if (resp_delegate != NULL) {
+        resp_delegate->ctx = ctx;
+        resp_delegate->cookie = cookie;
+        resp_delegate->callback = callback;
+        resp_delegate->started = tcblcb_metrics_now();
+    }
+    return resp_delegate;
+}
+
+static void reqctx_free(tcblcb_REQCTX *ctx)
+{
+    tcblcb_tracing_request_end(ctx->span);
+
+    if (ctx->data != NULL && ctx->data_free != NULL) {
+        ctx->data_free(ctx->data);
+    }
+
+    // everything else the request allocated goes with its arena
+    if (_tcblcb_spare_arena == NULL) {
+        tcblcb_arena_reset(ctx->arena);
+        _tcblcb_spare_arena = ctx->arena;
+    } else {
+        tcblcb_arena_destroy(ctx->arena);
+    }
+
+    free(ctx);
+}
+
+static void slow_log_append_ms(struct kore_buf *buf, u_int64_t us)
+{
+    kore_buf_appendf(buf, "%llu.%03llu", (unsigned long long)(us / 1000), (unsigned long long)(us % 1000));
+}
+
+// append a path or query string value (URL decoded and cut short) as a JSON string.
+static void slow_log_append_value(struct kore_buf *buf, const char *value, size_t len)
+{
+    char decoded[SLOW_LOG_VALUE_MAX + 1];
+    if (len > SLOW_LOG_VALUE_MAX) {
+        len = SLOW_LOG_VALUE_MAX;
+    }
+    memcpy(decoded, value, len);
+    decoded[len] = '\0';
+
+    // left as is if it can't be decoded (e.g., it was cut in the middle of an escape)
+    http_argument_urldecode(decoded);
+    append_json_string(buf, decoded);
+}
+
+// append a `"key":value` param, with the value redacted if the key looks secret.
+static void slow_log_append_param(struct kore_buf *buf, bool first, const char *key, size_t key_len, const char *value, size_t value_len)
+{
+    char key_string[SLOW_LOG_VALUE_MAX + 1];
+    if (key_len > SLOW_LOG_VALUE_MAX) {
+        key_len = SLOW_LOG_VALUE_MAX;
+    }
+    memcpy(key_string, key, key_len);
+    key_string[key_len] = '\0';
+
+    if (!first) {
+        kore_buf_append(buf, ",", 1);
+    }
+    append_json_string(buf, key_string);
+    kore_buf_append(buf, ":", 1);
+
+    if (is_secret_key(key, key_len)) {
+        append_json_string(buf, "[redacted]");
+    } else {
+        slow_log_append_value(buf, value, value_len);
+    }
+}
+
+typedef struct tcblcb_PATHPARAM {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+} tcblcb_PATHPARAM;
+
+// match the path up with the `{name}` segments of the route it was recorded under.
+static size_t slow_log_path_params(const char *route, const char *path, tcblcb_PATHPARAM *params)
+{
+    size_t nparams = 0;
+
+    while (*route != '\0' && *path != '\0' && nparams < SLOW_LOG_PATH_PARAMS_MAX) {
+        route += strspn(route, "/");
+        path += strspn(path, "/");
+
+        size_t route_len = strcspn(route, "/");
+        size_t path_len = strcspn(path, "/");
+        if (route_len > 2 && route[0] == '{' && route[route_len - 1] == '}') {
+            params[nparams].name = route + 1;
+            params[nparams].name_len = route_len - 2;
+            params[nparams].value = path;
+            params[nparams].value_len = path_len;
+            nparams++;
+        }
+
+        route += route_len;
+        path += path_len;
+    }
+
+    return nparams;
+}
+
+static void slow_log_append_params(struct kore_buf *buf, tcblcb_REQCTX *ctx, struct http_request *req)
+{
+    tcblcb_PATHPARAM path_params[SLOW_LOG_PATH_PARAMS_MAX];
+    size_t npath_params = slow_log_path_params(tcblcb_metrics_route_name(ctx->route), req->path, path_params);
+
+    for (size_t i = 0; i < npath_params; i++) {
+        if (path_params[i].name_len == strlen("tenant") && strncmp(path_params[i].name, "tenant", path_params[i].name_len) == 0) {
+            kore_buf_appendf(buf, ",\"tenant\":");
+            slow_log_append_value(buf, path_params[i].value, path_params[i].value_len);
+        }
+    }
+
+    kore_buf_appendf(buf, ",\"params\":{");
+    bool first = true;
+    for (size_t i = 0; i < npath_params; i++) {
+        slow_log_append_param(buf, first, path_params[i].name, path_params[i].name_len, path_params[i].value, path_params[i].value_len);
+        first = false;
+    }
+
+    const char *query = req->query_string;
+    while (query != NULL && *query != '\0') {
+        size_t len = strcspn(query, "&");
+        const char *equals = memchr(query, '=', len);
+        size_t key_len = equals != NULL ? (size_t)(equals - query) : len;
+        if (key_len > 0) {
+            const char *value = equals != NULL ? equals + 1 : query + len;
+            slow_log_append_param(buf, first, query, key_len, value, (size_t)(query + len - value));
+            first = false;
+        }
+
+        query += len;
+        query += strspn(query, "&");
+    }
+    kore_buf_append(buf, "}", 1);
+
+    // JSON bodies (e.g., login credentials) are only written out with their secrets redacted
+    if (ctx->body_sample != NULL) {
+        tcblcb_JSONDoc *doc = json_doc_parse(ctx->body_sample, ctx->body_len);
+        if (doc != NULL) {
+            kore_buf_appendf(buf, ",\"payload\":");
+            append_json_redacted(buf, ctx->body_sample, ctx->body_len);
+            json_doc_free(doc);
+        }
+    }
+    if (ctx->body_len > 0) {
+        kore_buf_appendf(buf, ",\"payload_bytes\":%zu", ctx->body_len);
+    }
+}
+
+// write a line for a slow request to the slow log.
+static void reqctx_slow_log(tcblcb_REQCTX *ctx, struct http_request *req, u_int64_t us)
+{
+    struct kore_buf buf;
+    kore_buf_init(&buf, 1024);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    kore_buf_appendf(&buf, "{\"type\":\"slow_request\",\"time\":%lld.%03ld,\"request_id\":",
+        (long long)now.tv_sec, now.tv_nsec / 1000000);
+    append_json_string(&buf, ctx->request_id);
+    kore_buf_appendf(&buf, ",\"method\":");
+    append_json_string(&buf, http_method_text(req->method));
+    kore_buf_appendf(&buf, ",\"route\":");
+    append_json_string(&buf, tcblcb_metrics_route_name(ctx->route));
+    kore_buf_appendf(&buf, ",\"status\":%d,\"duration_ms\":", req->status);
+    slow_log_append_ms(&buf, us);
+
+    slow_log_append_params(&buf, ctx, req);
+
+    kore_buf_appendf(&buf, ",\"phases_ms\":{");
+    bool first = true;
+    for (int phase = 0; phase < TIMING_NUM_PHASES; phase++) {
+        if (ctx->phases & (1u << phase)) {
+            kore_buf_appendf(&buf, "%s\"%s\":", first ? "" : ",", TIMING_PHASE_NAMES[phase]);
+            slow_log_append_ms(&buf, ctx->phase_us[phase]);
+            first = false;
+        }
+    }
+
+    unsigned int lcb_ops = 0;
+    kore_buf_appendf(&buf, "},\"ops\":{");
+    first = true;
+    for (int op = 0; op < METRICS_NUM_OPS; op++) {
+        if (ctx->op_count[op] > 0) {
+            kore_buf_appendf(&buf, "%s\"%s\":{\"count\":%u,\"ms\":", first ? "" : ",", TIMING_OP_NAMES[op], ctx->op_count[op]);
+            slow_log_append_ms(&buf, ctx->op_us[op]);
+            kore_buf_append(&buf, "}", 1);
+            lcb_ops += ctx->op_count[op];
+            first = false;
+        }
+    }
+
+    kore_buf_appendf(&buf, "},\"lcb_ops\":%u,\"rows\":%llu,\"response_bytes\":%zu}",
+        lcb_ops, (unsigned long long)ctx->rows, ctx->response_bytes);
+
+    tcblcb_slowlog_write((const char *)buf.data, buf.offset);
+    kore_buf_cleanup(&buf);
+}
+
+// called by Kore when the request is freed (completed or the client went away)
+static void reqctx_release(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    if (ctx == NULL) {
+        return;
+    }
+
+    if (ctx->recorded) {
+        tcblcb_metrics_request_end(ctx->route, req->status, ctx->response_bytes, ctx->started);
+
+        // only built if it's going to be written (over the threshold, sampled and within the rate)
+        u_int64_t us = tcblcb_metrics_now() - ctx->started;
+        if (tcblcb_slowlog_want(us)) {
+            reqctx_slow_log(ctx, req, us);
+        }
+    }
+
+    ctx->req = NULL;
+
+    // otherwise the last pending operation frees the context
+    if (ctx->npending == 0) {
+        reqctx_free(ctx);
+    }
+}
+
+// allocate a context and its state, leaving the context arena current.
+static tcblcb_REQCTX *reqctx_alloc(size_t data_len, void (*data_free)(void *data))
+{
+    tcblcb_REQCTX *ctx = calloc(1, sizeof(tcblcb_REQCTX));
+    IfNULLGotoDone(ctx, "Failed to allocate request context");
+
+    if (_tcblcb_spare_arena != NULL) {
+        ctx->arena = _tcblcb_spare_arena;
+        _tcblcb_spare_arena = NULL;
+    } else {
+        ctx->arena = tcblcb_arena_create(REQCTX_ARENA_CHUNK_SIZE);
+        if (ctx->arena == NULL) {
+            free(ctx);
+            ctx = NULL;
+        }
+        IfNULLGotoDone(ctx, "Failed to create request context arena");
+    }
+
+    // the rest of the state allocates from the request arena (`tcblcb_run_states` restores the
+    // previous arena afterwards)
+    tcblcb_ARENA *previous_arena = tcblcb_arena_enter(ctx->arena);
+
+    ctx->data_free = data_free;
+    if (data_len > 0) {
+        ctx->data = tcblcb_calloc(1, data_len);
+        if (ctx->data == NULL) {
+            tcblcb_arena_leave(previous_arena);
+            tcblcb_arena_destroy(ctx->arena);
+            free(ctx);
+            ctx = NULL;
+        }
+        IfNULLGotoDone(ctx, "Failed to allocate request context data");
+    }
+
+done:
+    return ctx;
+}
+
+static bool request_id_valid(const char *request_id)
+{
+    size_t len = strlen(request_id);
+    if (len == 0 || len > REQUEST_ID_MAX) {
+        return false;
+    }
+
+    // it's logged and echoed back, so only allow what's safe in both
+    for (size_t i = 0; i < len; i++) {
+        char c = request_id[i];
+        if (!isalnum((unsigned char)c) && c != '-' && c != '_' && c != '.' && c != ':') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// use the ID the client (or a proxy in front of the service) sent, otherwise generate one.
+static void reqctx_request_id(tcblcb_REQCTX *ctx, struct http_request *req)
+{
+    const char *header = NULL;
+    if (http_request_header(req, "X-Request-ID", &header) == KORE_RESULT_OK && request_id_valid(header)) {
+        snprintf(ctx->request_id, sizeof(ctx->request_id), "%s", header);
+        return;
+    }
+
+    snprintf(ctx->request_id, sizeof(ctx->request_id), "%llx-%u-%llu",
+        (unsigned long long)_tcblcb_request_id_epoch,
+        worker == NULL ? 0 : (unsigned int)worker->id,
+        (unsigned long long)++_tcblcb_request_id_count);
+}
+
+tcblcb_REQCTX *tcblcb_reqctx_create(struct http_request *req, size_t data_len, void (*data_free)(void *data))
+{
+    tcblcb_REQCTX *ctx = reqctx_alloc(data_len, data_free);
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    ctx->req = req;
+    ctx->started = _tcblcb_request_started != 0 ? _tcblcb_request_started : tcblcb_metrics_now();
+
+    reqctx_request_id(ctx, req);
+    ctx->span = tcblcb_tracing_request_start(ctx->request_id);
+
+    tcblcb_REQCTX **state = http_state_create(req, sizeof(tcblcb_REQCTX *), reqctx_release);
+    *state = ctx;
+
+    return ctx;
+}
+
+// background work is scheduled with a copy of its argument, which lives until it starts
+typedef struct tcblcb_BACKGROUND {
+    tcblcb_BACKGROUND_START start;
+    void (*done)(tcblcb_REQCTX *ctx);
+    size_t data_len;
+    void (*data_free)(void *data);
+    char arg[];
+} tcblcb_BACKGROUND;
+
+// finish background work (or a request that went away) once nothing is pending.
+static void reqctx_background_done(tcblcb_REQCTX *ctx)
+{
+    tcblcb_ARENA *previous_arena = tcblcb_arena_enter(ctx->arena);
+    ctx->done(ctx);
+    tcblcb_arena_leave(previous_arena);
+
+    reqctx_free(ctx);
+}
+
+static void background_run(void *arg, __unused u_int64_t now)
+{
+    tcblcb_BACKGROUND *background = arg;
+
+    tcblcb_ARENA *previous_arena = tcblcb_arena_enter(NULL);
+    tcblcb_REQCTX *ctx = reqctx_alloc(background->data_len, background->data_free);
+    IfNULLGotoDone(ctx, "Failed to create background context");
+
+    ctx->done = background->done;
+    background->start(ctx, background->arg);
+
+done:
+    tcblcb_arena_leave(previous_arena);
+    free(background);
+
+    // nothing was scheduled (or it all completed already)
+    if (ctx != NULL && ctx->npending == 0) {
+        reqctx_background_done(ctx);
+    }
+}
+
+bool tcblcb_background_schedule(tcblcb_BACKGROUND_START start, void (*done)(tcblcb_REQCTX *ctx), size_t data_len, void (*data_free)(void *data), const char *arg)
+{
+    size_t arg_len = strlen(arg);
+    tcblcb_BACKGROUND *background = malloc(sizeof(tcblcb_BACKGROUND) + arg_len + 1);
+    if (background == NULL) {
+        kore_log(LOG_WARNING, "Failed to allocate background work for: %s", arg);
+        return false;
+    }
+
+    background->start = start;
+    background->done = done;
+    background->data_len = data_len;
+    background->data_free = data_free;
+    memcpy(background->arg, arg, arg_len + 1);
+
+    kore_timer_add(background_run, 0, background, KORE_TIMER_ONESHOT);
+    return true;
+}
+
+void tcblcb_reqctx_finish_detached(tcblcb_REQCTX *ctx, void (*done)(tcblcb_REQCTX *ctx))
+{
+    // only looked at once the request has gone (see `tcblcb_reqctx_op_done`)
+    ctx->done = done;
+}
+
+tcblcb_REQCTX *tcblcb_reqctx_get(struct http_request *req)
+{
+    if (!http_state_exists(req)) {
+        return NULL;
+    }
+
+    tcblcb_REQCTX **state = http_state_get(req);
+    return state == NULL ? NULL : *state;
+}
+
+bool tcblcb_reqctx_attached(const tcblcb_REQCTX *ctx)
+{
+    return ctx != NULL && (ctx->req != NULL || ctx->done != NULL);
+}
+
+void tcblcb_reqctx_op_scheduled(tcblcb_REQCTX *ctx)
+{
+    if (ctx != NULL) {
+        ctx->npending++;
+    }
+}
+
+void tcblcb_reqctx_op_done(tcblcb_REQCTX *ctx)
+{
+    if (ctx == NULL || ctx->npending == 0) {
+        return;
+    }
+
+    if (--ctx->npending > 0) {
+        return;
+    }
+
+    if (ctx->req != NULL) {
+        http_request_wakeup(ctx->req);
+    } else if (ctx->done != NULL) {
+        reqctx_background_done(ctx);
+    } else {
+        reqctx_free(ctx);
+    }
+}
+
+void tcblcb_reqctx_query_scheduled(tcblcb_REQCTX *ctx, tcblcb_METRICS_OP op, tcblcb_METRICS_STATEMENT statement)
+{
+    ctx->query_op = op;
+    ctx->query_statement = statement;
+    ctx->query_started = tcblcb_metrics_now();
+    tcblcb_reqctx_op_scheduled(ctx);
+}
+
+void tcblcb_reqctx_query_done(tcblcb_REQCTX *ctx, bool ok)
+{
+    if (ctx != NULL && ctx->query_started != 0) {
+        reqctx_backend_op(ctx, ctx->query_op, ok, ctx->query_started);
+        tcblcb_metrics_statement(ctx->query_statement, ctx->query_started);
+        ctx->query_started = 0;
+    }
+    tcblcb_reqctx_op_done(ctx);
+}
+
+void tcblcb_reqctx_query_meta(tcblcb_REQCTX *ctx, const char *meta, size_t nmeta)
+{
+    ctx->rows += tcblcb_metrics_statement_meta(ctx->query_statement, meta, nmeta);
+}
+
+void tcblcb_reqctx_body(struct http_request *req, const char *body, size_t len)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    if (ctx == NULL) {
+        return;
+    }
+
+    ctx->body_len = len;
+    if (tcblcb_slowlog_enabled() && len > 0 && len <= REQCTX_BODY_SAMPLE_MAX) {
+        ctx->body_sample = tcblcb_malloc(len);
+        if (ctx->body_sample != NULL) {
+            memcpy(ctx->body_sample, body, len);
+        }
+    }
+}
+
+void tcblcb_reqctx_response_sent(struct http_request *req, size_t len)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    if (ctx != NULL) {
+        ctx->response_bytes += len;
+    }
+}
+
+void tcblcb_reqctx_phase(tcblcb_REQCTX *ctx, tcblcb_TIMING_PHASE phase, u_int64_t started)
+{
+    if (ctx != NULL) {
+        ctx->phases |= 1u << phase;
+        ctx->phase_us[phase] += tcblcb_metrics_now() - started;
+    }
+}
+
+static void append_server_timing(struct kore_buf *buf, const char *name, u_int64_t us, unsigned int count)
+{
+    if (buf->offset > 0) {
+        kore_buf_append(buf, ", ", 2);
+    }
+    kore_buf_appendf(buf, "%s;dur=%llu.%03llu", name, (unsigned long long)(us / 1000), (unsigned long long)(us % 1000));
+    if (count > 1) {
+        kore_buf_appendf(buf, ";desc=\"%u ops\"", count);
+    }
+}
+
+void tcblcb_reqctx_server_timing(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    if (ctx == NULL) {
+        return;
+    }
+
+    const char *requested = NULL;
+    if (!_server_timing && http_request_header(req, "X-Server-Timing", &requested) != KORE_RESULT_OK) {
+        return;
+    }
+
+    // durations are in milliseconds
+    struct kore_buf buf;
+    kore_buf_init(&buf, 256);
+
+    for (int phase = 0; phase < TIMING_NUM_PHASES; phase++) {
+        if (ctx->phases & (1u << phase)) {
+            append_server_timing(&buf, TIMING_PHASE_NAMES[phase], ctx->phase_us[phase], 0);
+        }
+    }
+    for (int op = 0; op < METRICS_NUM_OPS; op++) {
+        if (ctx->op_count[op] > 0) {
+            append_server_timing(&buf, TIMING_OP_NAMES[op], ctx->op_us[op], ctx->op_count[op]);
+        }
+    }
+    append_server_timing(&buf, "total", tcblcb_metrics_now() - ctx->started, 0);
+
+    http_response_header(req, "Server-Timing", kore_buf_stringify(&buf, NULL));
+
+    // browsers only show the timings to pages from the origin allowed to see them
+    const char *origin = NULL;
+    if (http_request_header(req, "Origin", &origin) == KORE_RESULT_OK) {
+        http_response_header(req, "Timing-Allow-Origin", origin);
+    }
+
+    kore_buf_cleanup(&buf);
+}
+
+void tcblcb_reqctx_request_id_header(struct http_request *req)
+{
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    if (ctx != NULL && ctx->request_id[0] != '\0') {
+        http_response_header(req, "X-Request-ID", ctx->request_id);
+    }
+}
+
+lcbtrace_SPAN *tcblcb_reqctx_span(tcblcb_REQCTX *ctx)
+{
+    return ctx == NULL ? NULL : tcblcb_tracing_parent(ctx->span);
+}
+
+int tcblcb_reqctx_suspend(tcblcb_REQCTX *ctx, int next_state)
+{
+    ctx->req->fsm_state = next_state;
+
+    // nothing was scheduled (or it all completed already) so carry straight on
+    if (ctx->npending == 0) {
+        return (HTTP_STATE_CONTINUE);
+    }
+
+    http_request_sleep(ctx->req);
+    return (HTTP_STATE_RETRY);
+}
+
+int tcblcb_run_states(struct http_request *req, tcblcb_METRICS_ROUTE route, struct http_state *states, u_int8_t nstates)
+{
+    bool first_run = !http_state_exists(req);
+
+    // handlers are called again each time the request wakes up so only process CORS once
+    if (first_run) {
+        ProcessCORSAndExitIfPreflight(req);
+        _tcblcb_request_started = tcblcb_metrics_now();
+    }
+
+    // states allocate from the request arena once the first state has created the context
+    tcblcb_REQCTX *ctx = tcblcb_reqctx_get(req);
+    tcblcb_ARENA *previous_arena = tcblcb_arena_enter(ctx == NULL ? NULL : ctx->arena);
+
+    int rc = http_state_run(states, nstates, req);
+
+    tcblcb_arena_leave(previous_arena);
+    _tcblcb_request_started = 0;
+
+    // the request is recorded from its context, which releases it (and its response) with the request
+    if (first_run && (ctx = tcblcb_reqctx_get(req)) != NULL) {
+        ctx->route = route;
+        ctx->recorded = true;
+        tcblcb_metrics_request_start(route);
+    }
+
+    return rc;
+}
+
+// called from a global callback and should not reference any other locals
+static void batch_item_callback(lcb_INSTANCE *instance, void *cookie, const lcb_RESPBASE *resp)
+{
+    tcblcb_BATCHITEM *item = (tcblcb_BATCHITEM *)cookie;
+    IfNULLGotoDone(
+        item,
+        "Batch item cookie was NULL"
+    );
+
+    tcblcb_BATCH *batch = item->batch;
+    if (batch->callback != NULL) {
+        batch->callback(instance, batch, item->index, resp);
+    }
+
+done:
+    // no clean up to do in this block
+    return;
+}
+
+tcblcb_BATCH *tcblcb_batch_create(lcb_INSTANCE *instance, tcblcb_REQCTX *ctx, size_t nitems, tcblcb_BATCH_CALLBACK callback, void *cookie, tcblcb_BATCH_RESULT_FREE result_free)
+{
+    bool valid = false;
+
+    tcblcb_BATCH *batch = tcblcb_calloc(1, sizeof(tcblcb_BATCH));
+    IfNULLGotoDone(batch, "Failed to allocate batch");
+
+    batch->instance = instance;
+    batch->ctx = ctx;
+    batch->callback = callback;
+    batch->cookie = cookie;
+    batch->result_free = result_free;
+    batch->nitems = nitems;
+
+    if (nitems > 0) {
+        batch->results = tcblcb_calloc(nitems, sizeof(void *));
+        IfNULLGotoDone(batch->results, "Failed to allocate batch results");
+        batch->items = tcblcb_calloc(nitems, sizeof(tcblcb_BATCHITEM));
+        IfNULLGotoDone(batch->items, "Failed to allocate batch items");
+    }
+
+    for (size_t i = 0; i < nitems; i++) {
+        batch->items[i].batch = batch;
+        batch->items[i].index = i;
+    }
+
+    valid = true;
+
+done:
+    if (!valid && batch != NULL) {
+        tcblcb_batch_free(batch);
+        batch = NULL;
+    }
+
+    return batch;
+}
+
+void tcblcb_batch_begin(tcblcb_BATCH *batch)
+{
+    lcb_sched_enter(batch->instance);
+}
+
+lcb_STATUS tcblcb_batch_get(tcblcb_BATCH *batch, size_t index, const lcb_CMDGET *cmd)
+{
+    lcb_STATUS rc = LCB_ERR_INVALID_ARGUMENT;
+    tcblcb_RESPDELEGATE *get_delegate = NULL;
+
+    IfTrueGotoDone(
+        (index >= batch->nitems),
+        "Batch index is out of range"
+    );
+
+    // receiver is responsible for freeing this memory if command is scheduled
+    rc = LCB_ERR_NO_MEMORY;
+    get_delegate = tcblcb_respdelegate_create(batch->ctx, &batch->items[index], batch_item_callback);
+    IfNULLGotoDone(get_delegate, "Failed to create batch get response delegate");
+
+    IfLCBFailGotoDone(
+        (rc = lcb_get(batch->instance, get_delegate, cmd)),
+        "Failed to queue batch get command"
+    );
+
+    tcblcb_reqctx_op_scheduled(batch->ctx);
+    batch->nscheduled++;
+    get_delegate = NULL;
+
+done:
+    // free memory if command was not scheduled
+    if (get_delegate != NULL) {
+        tcblcb_free(get_delegate);
+    }
+
+    return rc;
+}
+
+lcb_STATUS tcblcb_batch_subdoc(tcblcb_BATCH *batch, size_t index, const lcb_CMDSUBDOC *cmd)
+{
+    lcb_STATUS rc = LCB_ERR_INVALID_ARGUMENT;
+    tcblcb_RESPDELEGATE *subdoc_delegate = NULL;
+
+    IfTrueGotoDone(
+        (index >= batch->nitems),
+        "Batch index is out of range"
+    );
+
+    // receiver is responsible for freeing this memory if command is scheduled
+    rc = LCB_ERR_NO_MEMORY;
+    subdoc_delegate = tcblcb_respdelegate_create(batch->ctx, &batch->items[index], batch_item_callback);
+    IfNULLGotoDone(subdoc_delegate, "Failed to create batch subdoc response delegate");
+
+    IfLCBFailGotoDone(
+        (rc = lcb_subdoc(batch->instance, subdoc_delegate, cmd)),
+        "Failed to queue batch subdoc command"
+    );
+
+    tcblcb_reqctx_op_scheduled(batch->ctx);
+    batch->nscheduled++;
+    subdoc_delegate = NULL;
+
+done:
+    // free memory if command was not scheduled
+    if (subdoc_delegate != NULL) {
+        tcblcb_free(subdoc_delegate);
+    }
+
+    return rc;
+}
+
+void tcblcb_batch_end(tcblcb_BATCH *batch)
+{
+    LogDebug("Flushing batch: %zu of %zu commands queued", batch->nscheduled, batch->nitems);
+    lcb_sched_leave(batch->instance);
+}
+
+void tcblcb_batch_free(tcblcb_BATCH *batch)
+{
+    if (batch->results != NULL) {
+        for (size_t i = 0; i < batch->nitems; i++) {
+            if (batch->results[i] != NULL && batch->result_free != NULL) {
+                batch->result_free(batch->results[i]);
+            }
+        }
+        tcblcb_free(batch->results);
+    }
+
+    if (batch->items != NULL) {
+        tcblcb_free(batch->items);
+    }
+
+    tcblcb_free(batch);
+}
+
+static void tracing_threshold_env(const char *name, tcblcb_METRICS_OP op)
+{
+    char *value = getenv(name);
+    if (value == NULL || value[0] == '\0') {
+        return;
+    }
+
+    double seconds;
+    if (!parse_duration_string(value, &seconds) || seconds < 0) {
+        kore_log(LOG_WARNING, "Ignoring %s, it's not a duration: %s", name, value);
+        return;
+    }
+    tcblcb_tracing_set_threshold(op, (u_int64_t)(seconds * 1000000));
+}
+
+static unsigned int slow_log_count_env(const char *name, unsigned int default_count)
+{
+    char *value = getenv(name);
+    if (value == NULL || value[0] == '\0') {
+        return default_count;
+    }
+
+    char *end;
+    unsigned long count = strtoul(value, &end, 10);
+    if (*end != '\0' || count > UINT32_MAX) {
+        kore_log(LOG_WARNING, "Ignoring %s, it's not a count: %s", name, value);
+        return default_count;
+    }
+    return (unsigned int)count;
+}
+
+// the slow log is enabled by setting its threshold, and goes to stderr unless a file is given
+static void slow_log_configure(void)
+{
+    char *threshold = getenv(ENV_SLOW_LOG_THRESHOLD);
+    if (threshold == NULL || threshold[0] == '\0') {
+        return;
+    }
+
+    double seconds;
+    if (!parse_duration_string(threshold, &seconds) || seconds < 0) {
+        kore_log(LOG_WARNING, "Ignoring %s, it's not a duration: %s", ENV_SLOW_LOG_THRESHOLD, threshold);
+        return;
+    }
+
+    int fd = STDERR_FILENO;
+    char *path = getenv(ENV_SLOW_LOG_FILE);
+    if (path != NULL && path[0] != '\0') {
+        fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            kore_log(LOG_WARNING, "Failed to open slow log %s: %s", path, strerror(errno));
+            return;
+        }
+    }
+
+    unsigned int rate = slow_log_count_env(ENV_SLOW_LOG_RATE, SLOW_LOG_DEFAULT_RATE);
+    unsigned int sample = slow_log_count_env(ENV_SLOW_LOG_SAMPLE, 1);
+    tcblcb_slowlog_configure(fd, (u_int64_t)(seconds * 1000000), rate, sample);
+
+    kore_log(LOG_INFO, "Slow log: requests over %s (1 in %u, up to %u/s per worker) to %s",
+        threshold, sample > 0 ? sample : 1, rate, fd == STDERR_FILENO ? "stderr" : path);
 }
 
 void kore_parent_configure(__unused int argc, __unused char *argv[])
@@ -206,12 +1124,59 @@ void kore_parent_configure(__unused int argc, __unused char *argv[])
     
     kore_log(LOG_INFO, "Couchbase Connection: %s", _cb_conn_string);
     kore_log(LOG_INFO, "Couchbase Username: %s", _cb_user_string);
+
+    char *server_timing = getenv(ENV_SERVER_TIMING);
+    if (server_timing != NULL && strcmp(server_timing, "1") == 0) {
+        _server_timing = true;
+        kore_log(LOG_INFO, "Server-Timing: sent with every response");
+    }
+
+    // libcouchbase operations slower than these (e.g., "250ms") are logged
+    tracing_threshold_env(ENV_TRACING_THRESHOLD_KV, METRICS_OP_GET);
+    tracing_threshold_env(ENV_TRACING_THRESHOLD_KV, METRICS_OP_STORE);
+    tracing_threshold_env(ENV_TRACING_THRESHOLD_KV, METRICS_OP_SUBDOC);
+    tracing_threshold_env(ENV_TRACING_THRESHOLD_QUERY, METRICS_OP_QUERY);
+    tracing_threshold_env(ENV_TRACING_THRESHOLD_SEARCH, METRICS_OP_SEARCH);
+
+    slow_log_configure();
+
+    // responses are still served without the cache if it can't be created
+    _tcblcb_response_cache = tcblcb_shmcache_create("responses", RESPONSE_CACHE_MAX_BYTES);
+    if (_tcblcb_response_cache == NULL) {
+        kore_log(LOG_WARNING, "Shared response cache is not available");
+    }
+
+    // requests are still served without metrics if the slots can't be mapped
+    tcblcb_metrics_init();
+}
+
+void kore_parent_teardown()
+{
+    if (_tcblcb_response_cache != NULL) {
+        tcblcb_shmcache_destroy(_tcblcb_response_cache);
+        _tcblcb_response_cache = NULL;
+    }
+
+    tcblcb_metrics_destroy();
+    tcblcb_slowlog_destroy();
 }
 
 void kore_worker_configure()
 {
     bool connected = false;
 
+    // cJSON allocates from the current request arena (if any)
+    tcblcb_arena_init_json_hooks();
+
+    tcblcb_slowlog_start();
+
+    // run libcouchbase on the Kore worker event loop so handlers never have to block on it
+    _tcblcb_lcb_iops = tcblcb_iops_create();
+    IfNULLGotoDone(
+        _tcblcb_lcb_iops,
+        "Failed to create libcouchbase IO options"
+    );
+
     lcb_CREATEOPTS *create_options = NULL;
     lcb_createopts_create(&create_options, LCB_TYPE_CLUSTER);
     lcb_createopts_connstr(create_options, _cb_conn_string, _cb_conn_strlen);
@@ -220,6 +1185,13 @@ void kore_worker_configure()
         _cb_user_string, _cb_user_strlen,
         _cb_pswd_string, _cb_pswd_strlen
     );
+    lcb_createopts_io(create_options, _tcblcb_lcb_iops);
+
+    // operations are still run without being traced if the tracer can't be created
+    if (!tcblcb_tracing_init(create_options)) {
+        kore_log(LOG_WARNING, "libcouchbase tracing and operation metrics are not available");
+    }
+    _tcblcb_request_id_epoch = time(NULL);
 
     // Note that we're creating the instance as a thread local in the worker threads
     
@@ -236,13 +1208,15 @@ void kore_worker_configure()
         "libcouchbase instance is NULL"
     );
 
+    tcblcb_tracing_start(_tcblcb_lcb_instance);
+
     // schedule the initial connect operation
     IfLCBFailGotoDone(
         lcb_connect(_tcblcb_lcb_instance),
         "Failed to schedule the Couchbase connect operation"
     );
 
-    // wait for the initial connect operation to complete
+    // wait for the initial connect operation to complete (lcb_wait is fine before serving requests)
     IfLCBFailGotoDone(
         lcb_wait(_tcblcb_lcb_instance, LCB_WAIT_DEFAULT),
         "Failed to establish initial connection to Couchbase"
@@ -275,6 +1249,11 @@ void kore_worker_configure()
 
     connected = true;
 
+    // airport searches fall back to the query service if the index could not be loaded
+    if (!tcblcb_airport_index_init(_tcblcb_lcb_instance)) {
+        kore_log(LOG_WARNING, "Airport index is not available, airport searches will use N1QL");
+    }
+
 done:
     if (!connected) {
         destroy_cb_instance();
@@ -284,10 +1263,17 @@ done:
 void kore_worker_teardown()
 {
     destroy_cb_instance();
+    tcblcb_api_fpaths_destroy();
+
+    // requests may still have been logged while the instance was destroyed
+    tcblcb_slowlog_stop();
 }
 
 int tcblcb_page_index(struct http_request *req)
 {
+    u_int64_t started = tcblcb_metrics_now();
+    tcblcb_metrics_request_start(METRICS_ROUTE_INDEX);
+
     const char body[] = "<h1> Kore.io Travel Sample API </h1>"
     "A sample API for getting started with Couchbase Server that demonstrates using the <a href=\"https://docs.couchbase.com/c-sdk/current/hello-world/start-using-sdk.html\">C SDK</a> with the <a href=\"https://kore.io/\">Kore.io</a> framework to create a RESTful service API."
     "<ul>"
@@ -296,5 +1282,6 @@ int tcblcb_page_index(struct http_request *req)
     "</ul>";
 
     http_response(req, 200, body, sizeof(body));
+    tcblcb_metrics_request_end(METRICS_ROUTE_INDEX, 200, sizeof(body), started);
     return (KORE_RESULT_OK);
 }
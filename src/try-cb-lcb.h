@@ -27,19 +27,206 @@
 #include <strings.h>
 #include <kore/kore.h>
 #include <kore/http.h>
-#include <cjson/cJSON.h>
 #include <libcouchbase/couchbase.h>
 
+#include "arena.h"
+#include "lcb-tracing.h"
+#include "metrics.h"
+#include "shm-cache.h"
+
 // thread local instance
 extern _Thread_local lcb_INSTANCE *_tcblcb_lcb_instance;
 
+// responses shared by every worker (NULL if the cache could not be created)
+extern tcblcb_SHMCACHE *_tcblcb_response_cache;
+
+// phases of a request that are timed for its Server-Timing header (along with the time spent in
+// each type of lcb operation)
+typedef enum {
+    TIMING_PHASE_PARSE,         // path and query string parameters
+    TIMING_PHASE_BODY,          // reading the request body
+    TIMING_PHASE_BUILD,         // building statements and documents for lcb
+    TIMING_PHASE_SERIALIZE,     // writing the response body
+    TIMING_NUM_PHASES
+} tcblcb_TIMING_PHASE;
+
+// longest request ID taken from an `X-Request-ID` header (longer ones are replaced)
+#define REQUEST_ID_MAX 64
+
+// request bodies up to this size are kept for the slow log (larger ones are only counted)
+#define REQCTX_BODY_SAMPLE_MAX 1024
+
+// per-request context shared by a handler's HTTP states and the lcb callbacks it schedules.
+// handlers never block on lcb: they schedule operations, suspend the request and resume in their
+// next state once every pending operation has completed. the context outlives the request if the
+// client goes away while operations are still in flight.
+//
+// the context owns an arena that is current while the handler states and response delegates
+// run, so whatever they allocate is released in one go along with the context.
+typedef struct tcblcb_REQCTX {
+    struct http_request *req;   // NULL once Kore has released the request
+    unsigned int npending;      // scheduled lcb operations that have not completed yet
+    tcblcb_ARENA *arena;        // request allocations
+    void *data;                 // handler state (allocated from the arena)
+    void (*data_free)(void *data);
+    void (*done)(struct tcblcb_REQCTX *ctx);    // set for background work, or a request that finishes without its client
+    tcblcb_METRICS_ROUTE route; // route the request is recorded under
+    bool recorded;              // true if the request is recorded in the metrics
+    u_int64_t started;          // when the context was created (metrics clock)
+    size_t response_bytes;      // response body bytes sent so far
+    tcblcb_METRICS_OP query_op; // type of the query/search op in flight (one at a time)
+    tcblcb_METRICS_STATEMENT query_statement;
+    u_int64_t query_started;
+    unsigned int phases;        // bit per phase that has been timed
+    u_int64_t phase_us[TIMING_NUM_PHASES];
+    unsigned int op_count[METRICS_NUM_OPS];
+    u_int64_t op_us[METRICS_NUM_OPS];
+    char request_id[REQUEST_ID_MAX + 1];    // empty for background work
+    tcblcb_SPAN *span;          // parent of the lcb spans of the request's operations
+    u_int64_t rows;             // results reported by the query and search services
+    size_t body_len;            // request body bytes read
+    char *body_sample;          // copy of the request body, if the slow log keeps it
+} tcblcb_REQCTX;
+
+// create the context for a request, with zeroed handler state of `data_len` bytes. the context
+// arena is current for the rest of the state.
+tcblcb_REQCTX *tcblcb_reqctx_create(struct http_request *req, size_t data_len, void (*data_free)(void *data));
+
+// get the context created for a request (NULL if there is none).
+tcblcb_REQCTX *tcblcb_reqctx_get(struct http_request *req);
+
+// true if the request (or background work) is still around to receive results. a request whose
+// client went away can still receive them (see `tcblcb_reqctx_finish_detached`), so check
+// `ctx->req` before responding.
+bool tcblcb_reqctx_attached(const tcblcb_REQCTX *ctx);
+
+// schedules the operations for background work, like a handler state does for a request. `arg`
+// is a copy of the string the work was scheduled with.
+typedef void (*tcblcb_BACKGROUND_START)(tcblcb_REQCTX *ctx, const char *arg);
+
+// run work that no request waits on (e.g., refreshing a stale cache entry) from a timer on the
+// next pass of the event loop, so after the current request has been answered. `start` gets a
+// context with zeroed state of `data_len` bytes and its arena current, and `done` runs once
+// every operation it scheduled has completed, after which the context is freed.
+bool tcblcb_background_schedule(tcblcb_BACKGROUND_START start, void (*done)(tcblcb_REQCTX *ctx), size_t data_len, void (*data_free)(void *data), const char *arg);
+
+// keep a request's operations going if its client goes away before the response (e.g., because
+// other requests are waiting on what it fetches). the request then finishes like background work:
+// results are still delivered, and `done` runs once the last operation completes. it isn't
+// called for a request that is answered.
+void tcblcb_reqctx_finish_detached(tcblcb_REQCTX *ctx, void (*done)(tcblcb_REQCTX *ctx));
+
+// record that an lcb operation was successfully scheduled on behalf of the request.
+void tcblcb_reqctx_op_scheduled(tcblcb_REQCTX *ctx);
+
+// record that an lcb operation completed. wakes the request once nothing is pending.
+// the context may be freed by this call, so it must be the last use of `ctx` in a callback.
+void tcblcb_reqctx_op_done(tcblcb_REQCTX *ctx);
+
+// record that a query or search operation was successfully scheduled (like
+// `tcblcb_reqctx_op_scheduled`), timing it for the backend and `statement` metrics.
+void tcblcb_reqctx_query_scheduled(tcblcb_REQCTX *ctx, tcblcb_METRICS_OP op, tcblcb_METRICS_STATEMENT statement);
+
+// record that the query or search operation completed (from its final row), like
+// `tcblcb_reqctx_op_done`.
+void tcblcb_reqctx_query_done(tcblcb_REQCTX *ctx, bool ok);
+
+// record the final metadata row of the query or search operation in flight (for the statement
+// metrics and the rows counted for the request).
+void tcblcb_reqctx_query_meta(tcblcb_REQCTX *ctx, const char *meta, size_t nmeta);
+
+// record the request body once it has been read (ignored if the request has no context).
+void tcblcb_reqctx_body(struct http_request *req, const char *body, size_t len);
+
+// count response body bytes sent for the request metrics (ignored if the request has no context).
+void tcblcb_reqctx_response_sent(struct http_request *req, size_t len);
+
+// add the time since `started` (from `tcblcb_metrics_now`) to a phase of the request.
+void tcblcb_reqctx_phase(tcblcb_REQCTX *ctx, tcblcb_TIMING_PHASE phase, u_int64_t started);
+
+// add the Server-Timing header for the request (before its response is sent), if it's enabled
+// for every request or the request asked for it with an `X-Server-Timing` header.
+void tcblcb_reqctx_server_timing(struct http_request *req);
+
+// add the `X-Request-ID` header for the request (before its response is sent).
+void tcblcb_reqctx_request_id_header(struct http_request *req);
+
+// the lcb span to set as the parent span of the commands scheduled for the request, so their
+// spans are logged with its request ID (NULL if there is none, e.g. for background work).
+lcbtrace_SPAN *tcblcb_reqctx_span(tcblcb_REQCTX *ctx);
+
+// suspend the request until pending operations complete, resuming in `next_state`.
+int tcblcb_reqctx_suspend(tcblcb_REQCTX *ctx, int next_state);
+
+// process CORS once and run the handler states (exits early if preflight). the request is
+// recorded in the metrics under `route` once its first state has created the context.
+int tcblcb_run_states(struct http_request *req, tcblcb_METRICS_ROUTE route, struct http_state *states, u_int8_t nstates);
+
 // global callbacks use a response delegate for component logic (e.g., to aggregate responses)
 typedef void (*tcblcb_RESPDELEGATE_CALLBACK)(lcb_INSTANCE *instance, void *cookie, const lcb_RESPBASE *resp);
 
-// global callbacks use a response delegate for component logic (e.g., to aggregate responses)
+// global callbacks use a response delegate for component logic (e.g., to aggregate responses).
+// the delegate callback is skipped if the request has gone away.
 typedef struct tcblcb_RESPDELEGATE {
+    tcblcb_REQCTX *ctx;
     void *cookie;
     tcblcb_RESPDELEGATE_CALLBACK callback;
+    u_int64_t started;          // when the operation was scheduled (for the backend metrics)
 } tcblcb_RESPDELEGATE;
 
+// create a response delegate (from the request arena). receiver is responsible for releasing this
+// memory with `tcblcb_free` if command is scheduled.
+tcblcb_RESPDELEGATE *tcblcb_respdelegate_create(tcblcb_REQCTX *ctx, void *cookie, tcblcb_RESPDELEGATE_CALLBACK callback);
+
+// scatter-gather batch of get/subdoc commands for a request. the commands are queued inside a
+// single lcb scheduling window so they go out together, and each response is stored by the index
+// it was scheduled with. the request only wakes once the whole batch has completed.
+typedef struct tcblcb_BATCH tcblcb_BATCH;
+
+// called for each response in the batch (only while the request is still attached). anything
+// kept for the response should be stored in `batch->results[index]`.
+typedef void (*tcblcb_BATCH_CALLBACK)(lcb_INSTANCE *instance, tcblcb_BATCH *batch, size_t index, const lcb_RESPBASE *resp);
+
+// frees a result left in the batch when it's freed.
+typedef void (*tcblcb_BATCH_RESULT_FREE)(void *result);
+
+typedef struct tcblcb_BATCHITEM {
+    tcblcb_BATCH *batch;
+    size_t index;
+} tcblcb_BATCHITEM;
+
+struct tcblcb_BATCH {
+    lcb_INSTANCE *instance;
+    tcblcb_REQCTX *ctx;
+    tcblcb_BATCH_CALLBACK callback;
+    void *cookie;
+    size_t nitems;
+    size_t nscheduled;
+    void **results;
+    tcblcb_BATCH_RESULT_FREE result_free;
+    tcblcb_BATCHITEM *items;
+};
+
+// create a batch with room for `nitems` results. the batch must outlive its pending operations,
+// so it's normally owned by the handler state and freed along with it.
+tcblcb_BATCH *tcblcb_batch_create(lcb_INSTANCE *instance, tcblcb_REQCTX *ctx, size_t nitems, tcblcb_BATCH_CALLBACK callback, void *cookie, tcblcb_BATCH_RESULT_FREE result_free);
+
+// open the scheduling window. commands are queued until `tcblcb_batch_end`.
+void tcblcb_batch_begin(tcblcb_BATCH *batch);
+
+// queue a get command whose response is stored at `index`.
+lcb_STATUS tcblcb_batch_get(tcblcb_BATCH *batch, size_t index, const lcb_CMDGET *cmd);
+
+// queue a subdoc command whose response is stored at `index`.
+lcb_STATUS tcblcb_batch_subdoc(tcblcb_BATCH *batch, size_t index, const lcb_CMDSUBDOC *cmd);
+
+// close the scheduling window and flush every queued command.
+void tcblcb_batch_end(tcblcb_BATCH *batch);
+
+// free the batch along with any results still in it (with `result_free`).
+void tcblcb_batch_free(tcblcb_BATCH *batch);
+
+// free the caches the flight paths handler keeps for the life of the worker.
+void tcblcb_api_fpaths_destroy();
+
 #endif /* !tcblcb_MAIN_HEADER_SEEN */
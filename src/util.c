@@ -21,11 +21,18 @@
  */
 
 #include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <uuid/uuid.h>
 #include <kore/kore.h>
 #include <kore/http.h>
 
+#include <cjson/cJSON.h>
+
+#include "arena.h"
+#include "try-cb-lcb.h"
 #include "util.h"
 
 void dump_query_payload(lcb_CMDQUERY *cmd)
@@ -100,49 +107,90 @@ int weekday(const char *date_string)
     return (date_tm.tm_wday + 6) % 7;
 }
 
-// creates an array of cJSON_String stopping at the NULL terminator but cannot store JSON NULL values.
-cJSON *create_string_array_param_json(char *strings[], int nstrings)
+bool parse_duration_string(const char *str, double *seconds)
 {
-    cJSON * array_json = cJSON_CreateArray();
+    static const struct {
+        const char *unit;
+        double seconds;
+    } units[] = {
+        // longer units first so "ms" isn't taken for "m"
+        { "ns", 1e-9 },
+        { "us", 1e-6 },
+        { "\xc2\xb5s", 1e-6 },    // micro sign
+        { "\xce\xbcs", 1e-6 },    // greek mu
+        { "ms", 1e-3 },
+        { "s", 1 },
+        { "m", 60 },
+        { "h", 3600 },
+    };
 
-    for (int i=0; i<nstrings; i++) {
-        char *string = strings[i];
-        if (string == NULL) {
-            cJSON_AddItemToArray(array_json, cJSON_CreateNull());
-        } else {
-            cJSON_AddItemToArray(array_json, cJSON_CreateStringReference(string));
+    if (str == NULL || *str == '\0') {
+        return false;
+    }
+
+    double total = 0;
+    while (*str != '\0') {
+        char *end;
+        double value = strtod(str, &end);
+        if (end == str) {
+            return false;
+        }
+
+        size_t i;
+        for (i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+            size_t unit_len = strlen(units[i].unit);
+            if (strncmp(end, units[i].unit, unit_len) == 0) {
+                total += value * units[i].seconds;
+                str = end + unit_len;
+                break;
+            }
+        }
+        if (i == sizeof(units) / sizeof(units[0])) {
+            return false;
         }
     }
 
-    return array_json;
+    *seconds = total;
+    return true;
 }
 
-char *create_string_array_param_string(char *strings[], int nstrings)
+char *create_string_array_param_string(const char *strings[], int nstrings)
 {
-    char *array_string = NULL;
-
-    cJSON *array_json = create_string_array_param_json(strings, nstrings);
-    if (array_json != NULL) {
-        array_string = cJSON_PrintBuffered(array_json, BUFSIZ, false);
-        cJSON_Delete(array_json);
+    tcblcb_JSONWriter writer;
+    json_writer_init(&writer, false);
+    json_writer_begin_array(&writer);
+    for (int i=0; i<nstrings; i++) {
+        json_writer_string(&writer, strings[i]);
     }
-    
-    return array_string;
+    json_writer_end_array(&writer);
+
+    // params are kept past the next writer, so they're copied out of its buffer
+    char *array_string = json_writer_finish(&writer, NULL);
+    return array_string != NULL ? tcblcb_strdup(array_string) : NULL;
 }
 
 char *create_json_string_param(const char *value_string)
 {
-    cJSON *json_string = NULL;
-    if (value_string != NULL) {
-        json_string = cJSON_CreateStringReference(value_string);
+    if (value_string == NULL) {
+        return NULL;
     }
-    return json_string == NULL ? NULL : cJSON_PrintUnformatted(json_string);
+
+    tcblcb_JSONWriter writer;
+    json_writer_init(&writer, false);
+    json_writer_string(&writer, value_string);
+
+    char *param_string = json_writer_finish(&writer, NULL);
+    return param_string != NULL ? tcblcb_strdup(param_string) : NULL;
 }
 
 char *create_json_number_param(const double value_number)
 {
-    cJSON *json_number = cJSON_CreateNumber(value_number);
-    return json_number == NULL ? NULL : cJSON_PrintUnformatted(json_number);
+    tcblcb_JSONWriter writer;
+    json_writer_init(&writer, false);
+    json_writer_number(&writer, value_number);
+
+    char *param_string = json_writer_finish(&writer, NULL);
+    return param_string != NULL ? tcblcb_strdup(param_string) : NULL;
 }
 
 char *create_uuid_string()
@@ -150,13 +198,111 @@ char *create_uuid_string()
     uuid_t uuid;
     uuid_generate(uuid);
 
-    char *uuid_str = malloc(37);
-    uuid_unparse(uuid, uuid_str);
+    char *uuid_str = tcblcb_malloc(37);
+    if (uuid_str != NULL) {
+        uuid_unparse(uuid, uuid_str);
+    }
 
     return uuid_str;
 }
 
-lcb_STATUS get_json_doc_from_subdoc_resp(const lcb_RESPSUBDOC *resp, size_t index, cJSON **json)
+// the doc and the copy it's parsed from share one allocation
+struct tcblcb_JSONDoc {
+    cJSON *root;
+    char buffer[];
+};
+
+#define CJSONVal(value) ((cJSON *)(value))
+
+tcblcb_JSONDoc *json_doc_parse(const char *json, size_t njson)
+{
+    // the input is often one of lcb's read only response buffers, so names and strings are
+    // decoded in-situ in a single copy of it instead of each being allocated
+    tcblcb_JSONDoc *doc = tcblcb_malloc(sizeof(tcblcb_JSONDoc) + njson);
+    if (doc == NULL) {
+        return NULL;
+    }
+
+    memcpy(doc->buffer, json, njson);
+    doc->root = cJSON_ParseInSitu(doc->buffer, njson);
+    if (doc->root == NULL) {
+        tcblcb_free(doc);
+        return NULL;
+    }
+
+    return doc;
+}
+
+void json_doc_free(tcblcb_JSONDoc *doc)
+{
+    cJSON_Delete(doc->root);
+    tcblcb_free(doc);
+}
+
+const tcblcb_JSONValue *json_doc_root(const tcblcb_JSONDoc *doc)
+{
+    return (const tcblcb_JSONValue *)doc->root;
+}
+
+const tcblcb_JSONValue *json_object_get(const tcblcb_JSONValue *object, const char *key)
+{
+    return (const tcblcb_JSONValue *)cJSON_GetObjectItemCaseSensitive(CJSONVal(object), key);
+}
+
+const char *json_get_string(const tcblcb_JSONValue *value)
+{
+    return cJSON_GetStringValue(CJSONVal(value));
+}
+
+bool json_get_number(const tcblcb_JSONValue *value, double *number)
+{
+    if (!cJSON_IsNumber(CJSONVal(value))) {
+        return false;
+    }
+    *number = CJSONVal(value)->valuedouble;
+    return true;
+}
+
+bool json_is_object(const tcblcb_JSONValue *value)
+{
+    return cJSON_IsObject(CJSONVal(value));
+}
+
+bool json_is_array(const tcblcb_JSONValue *value)
+{
+    return cJSON_IsArray(CJSONVal(value));
+}
+
+size_t json_array_size(const tcblcb_JSONValue *array)
+{
+    return cJSON_IsArray(CJSONVal(array)) ? (size_t)cJSON_GetArraySize(CJSONVal(array)) : 0;
+}
+
+const tcblcb_JSONValue *json_array_first(const tcblcb_JSONValue *array)
+{
+    return cJSON_IsArray(CJSONVal(array)) ? (const tcblcb_JSONValue *)CJSONVal(array)->child : NULL;
+}
+
+const tcblcb_JSONValue *json_array_next(__unused const tcblcb_JSONValue *array, const tcblcb_JSONValue *element)
+{
+    return (const tcblcb_JSONValue *)CJSONVal(element)->next;
+}
+
+char *json_value_write(const tcblcb_JSONValue *value, size_t *len)
+{
+    if (value == NULL) {
+        return NULL;
+    }
+
+    char *json = cJSON_PrintBuffered(CJSONVal(value), 256, false);
+    if (json != NULL && len != NULL) {
+        *len = strlen(json);
+    }
+
+    return json;
+}
+
+lcb_STATUS get_json_doc_from_subdoc_resp(const lcb_RESPSUBDOC *resp, size_t index, tcblcb_JSONDoc **doc)
 {
     lcb_STATUS rc = LCB_ERR_GENERIC;
     
@@ -173,7 +319,7 @@ lcb_STATUS get_json_doc_from_subdoc_resp(const lcb_RESPSUBDOC *resp, size_t inde
     );
 
     if (value != NULL && nvalue > 0) {
-        *json = cJSON_ParseWithLength(value, nvalue);
+        *doc = json_doc_parse(value, nvalue);
     }
 
 done:
@@ -183,44 +329,362 @@ done:
 char *extract_string_value_from_subdoc_resp(const lcb_RESPSUBDOC *resp, size_t index)
 {
     char *result_value = NULL;
-    cJSON *result_value_json = NULL;
+
     IfLCBFailGotoDone(
-        get_json_doc_from_subdoc_resp(resp, index, &result_value_json),
-        "Failed to get subdoc result as JSON doc"
+        lcb_respsubdoc_result_status(resp, index),
+        "Subdoc result not available"
     );
 
-    char *parsed_result_value = cJSON_GetStringValue(result_value_json);
-    if (parsed_result_value != NULL) {
-        result_value = strdup(parsed_result_value);
-    }
+    const char *value = NULL;
+    size_t nvalue = 0;
+    IfLCBFailGotoDone(
+        lcb_respsubdoc_result_value(resp, index, &value, &nvalue),
+        "Failed to get subdoc result value"
+    );
 
-done:
-    if (result_value_json != NULL) {
-        cJSON_Delete(result_value_json);
+    if (value != NULL && nvalue > 0) {
+        result_value = decode_json_string(value, nvalue);
     }
 
+done:
     return result_value;
 }
 
 char *extract_string_value_from_json_string(const char *value, size_t nvalue)
 {
-    char *result_value = NULL;
+    return decode_json_string(value, nvalue);
+}
 
-    // we will delete this here because we only need the extracted value
-    cJSON *result_value_json = cJSON_ParseWithLength(value, nvalue);
-    if (result_value_json != NULL) {
-        char *parsed_result_value = cJSON_GetStringValue(result_value_json);
-        if (parsed_result_value != NULL) {
-            result_value = strdup(parsed_result_value);
+static const char *json_skip_whitespace(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+// find the closing quote of a string, starting just after its opening quote. `escaped` is set if
+// the string has escape sequences to decode. returns NULL if the string isn't terminated.
+static const char *json_string_end(const char *p, const char *end, bool *escaped)
+{
+    *escaped = false;
+    while (p < end) {
+        if (*p == '"') {
+            return p;
+        }
+        if (*p == '\\') {
+            *escaped = true;
+            p++;
         }
-        cJSON_Delete(result_value_json);
+        p++;
     }
+    return NULL;
+}
 
-    return result_value;
+static bool json_parse_hex4(const char *p, const char *end, unsigned int *value)
+{
+    if (end - p < 4) {
+        return false;
+    }
+
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        unsigned int digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else {
+            return false;
+        }
+        *value = (*value << 4) | digit;
+    }
+    return true;
+}
+
+// decode the characters between a string's quotes into a NUL terminated copy. an unescaped
+// string is never longer than its JSON form, so that's all that's allocated.
+static char *json_decode_string(const char *p, const char *end, bool escaped)
+{
+    char *str = tcblcb_malloc(end - p + 1);
+    if (str == NULL) {
+        return NULL;
+    }
+
+    if (!escaped) {
+        memcpy(str, p, end - p);
+        str[end - p] = '\0';
+        return str;
+    }
+
+    char *out = str;
+    while (p < end) {
+        if (*p != '\\') {
+            *out++ = *p++;
+            continue;
+        }
+
+        // json_string_end guarantees a character follows every backslash
+        p += 2;
+        switch (p[-1]) {
+            case '"':
+            case '\\':
+            case '/': *out++ = p[-1]; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u': {
+                unsigned int codepoint;
+                if (!json_parse_hex4(p, end, &codepoint)) {
+                    goto fail;
+                }
+                p += 4;
+
+                // characters outside the BMP are written as a UTF-16 surrogate pair
+                if (codepoint >= 0xd800 && codepoint <= 0xdbff) {
+                    unsigned int low;
+                    if (end - p < 6 || p[0] != '\\' || p[1] != 'u'
+                        || !json_parse_hex4(p + 2, end, &low) || low < 0xdc00 || low > 0xdfff) {
+                        goto fail;
+                    }
+                    p += 6;
+                    codepoint = 0x10000 + ((codepoint - 0xd800) << 10) + (low - 0xdc00);
+                } else if (codepoint >= 0xdc00 && codepoint <= 0xdfff) {
+                    goto fail;
+                }
+
+                if (codepoint < 0x80) {
+                    *out++ = (char)codepoint;
+                } else if (codepoint < 0x800) {
+                    *out++ = (char)(0xc0 | (codepoint >> 6));
+                    *out++ = (char)(0x80 | (codepoint & 0x3f));
+                } else if (codepoint < 0x10000) {
+                    *out++ = (char)(0xe0 | (codepoint >> 12));
+                    *out++ = (char)(0x80 | ((codepoint >> 6) & 0x3f));
+                    *out++ = (char)(0x80 | (codepoint & 0x3f));
+                } else {
+                    *out++ = (char)(0xf0 | (codepoint >> 18));
+                    *out++ = (char)(0x80 | ((codepoint >> 12) & 0x3f));
+                    *out++ = (char)(0x80 | ((codepoint >> 6) & 0x3f));
+                    *out++ = (char)(0x80 | (codepoint & 0x3f));
+                }
+                break;
+            }
+            default:
+                goto fail;
+        }
+    }
+
+    *out = '\0';
+    return str;
+
+fail:
+    tcblcb_free(str);
+    return NULL;
+}
+
+// skip a JSON value without decoding it. this only checks as much of the structure as it needs
+// to find where the value ends.
+static const char *json_skip_value(const char *p, const char *end)
+{
+    size_t depth = 0;
+    do {
+        p = json_skip_whitespace(p, end);
+        if (p >= end) {
+            return NULL;
+        }
+
+        bool escaped;
+        switch (*p) {
+            case '"':
+                p = json_string_end(p + 1, end, &escaped);
+                if (p == NULL) {
+                    return NULL;
+                }
+                p++;
+                break;
+            case '{':
+            case '[':
+                depth++;
+                p++;
+                break;
+            case '}':
+            case ']':
+                if (depth == 0) {
+                    return NULL;
+                }
+                depth--;
+                p++;
+                break;
+            case ',':
+            case ':':
+                if (depth == 0) {
+                    return NULL;
+                }
+                p++;
+                break;
+            default: {
+                // numbers and literals run until the next delimiter. the set is searched with an
+                // explicit length since strchr would match an embedded NUL and never advance.
+                static const char delimiters[] = ",:[]{}\" \t\n\r";
+                const char *token = p;
+                while (p < end && memchr(delimiters, *p, sizeof(delimiters) - 1) == NULL) {
+                    p++;
+                }
+                if (p == token) {
+                    return NULL;
+                }
+                break;
+            }
+        }
+    } while (depth > 0);
+
+    return p;
+}
+
+static const tcblcb_JSON_FIELD *find_json_field(const tcblcb_JSON_FIELD *fields, size_t nfields, const char *name, const char *name_end, bool escaped)
+{
+    const tcblcb_JSON_FIELD *field = NULL;
+
+    // names with escapes are rare enough to just decode before comparing
+    char *decoded_name = NULL;
+    if (escaped) {
+        decoded_name = json_decode_string(name, name_end, true);
+        if (decoded_name == NULL) {
+            return NULL;
+        }
+        name = decoded_name;
+        name_end = decoded_name + strlen(decoded_name);
+    }
+
+    size_t name_len = name_end - name;
+    for (size_t i = 0; i < nfields; i++) {
+        if (fields[i].name_len == name_len && memcmp(fields[i].name, name, name_len) == 0) {
+            field = &fields[i];
+            break;
+        }
+    }
+
+    if (decoded_name != NULL) {
+        tcblcb_free(decoded_name);
+    }
+
+    return field;
+}
+
+bool decode_json_object(const char *json, size_t njson, const tcblcb_JSON_FIELD *fields, size_t nfields, void *result)
+{
+    bool valid = false;
+
+    const char *end = json + njson;
+    const char *p = json_skip_whitespace(json, end);
+    if (p >= end || *p != '{') {
+        goto done;
+    }
+
+    p = json_skip_whitespace(p + 1, end);
+    if (p < end && *p == '}') {
+        valid = true;
+        goto done;
+    }
+
+    while (p < end && *p == '"') {
+        bool escaped;
+        const char *name = p + 1;
+        const char *name_end = json_string_end(name, end, &escaped);
+        if (name_end == NULL) {
+            goto done;
+        }
+        const tcblcb_JSON_FIELD *field = find_json_field(fields, nfields, name, name_end, escaped);
+
+        p = json_skip_whitespace(name_end + 1, end);
+        if (p >= end || *p != ':') {
+            goto done;
+        }
+        p = json_skip_whitespace(p + 1, end);
+
+        // the first of any duplicate names wins, as it does for cJSON lookups
+        char **string_field = NULL;
+        if (field != NULL && field->type == JSON_FIELD_STRING) {
+            string_field = (char **)((char *)result + field->offset);
+        }
+
+        if (string_field != NULL && *string_field == NULL && p < end && *p == '"') {
+            const char *value = p + 1;
+            const char *value_end = json_string_end(value, end, &escaped);
+            if (value_end == NULL) {
+                goto done;
+            }
+            *string_field = json_decode_string(value, value_end, escaped);
+            if (*string_field == NULL) {
+                goto done;
+            }
+            p = value_end + 1;
+        } else {
+            // anything else (including a field that isn't a string) is left out
+            p = json_skip_value(p, end);
+            if (p == NULL) {
+                goto done;
+            }
+        }
+
+        p = json_skip_whitespace(p, end);
+        if (p < end && *p == '}') {
+            valid = true;
+            goto done;
+        }
+        if (p >= end || *p != ',') {
+            goto done;
+        }
+        p = json_skip_whitespace(p + 1, end);
+    }
+
+done:
+    if (!valid) {
+        free_json_fields(fields, nfields, result);
+    }
+
+    return valid;
+}
+
+char *decode_json_string(const char *json, size_t njson)
+{
+    const char *end = json + njson;
+    const char *p = json_skip_whitespace(json, end);
+    if (p >= end || *p != '"') {
+        return NULL;
+    }
+
+    bool escaped;
+    const char *str_end = json_string_end(p + 1, end, &escaped);
+    if (str_end == NULL) {
+        return NULL;
+    }
+
+    return json_decode_string(p + 1, str_end, escaped);
+}
+
+void free_json_fields(const tcblcb_JSON_FIELD *fields, size_t nfields, void *result)
+{
+    for (size_t i = 0; i < nfields; i++) {
+        if (fields[i].type == JSON_FIELD_STRING) {
+            char **string_field = (char **)((char *)result + fields[i].offset);
+            if (*string_field != NULL) {
+                tcblcb_free(*string_field);
+                *string_field = NULL;
+            }
+        }
+    }
 }
 
 struct kore_buf *get_http_body_buf(struct http_request *req)
 {
+    u_int64_t started = tcblcb_metrics_now();
     u_int8_t data[BUFSIZ];
 	struct kore_buf *http_body_buf = kore_buf_alloc(BUFSIZ);
     ssize_t	last_bytes_read = 0;
@@ -237,6 +701,8 @@ struct kore_buf *get_http_body_buf(struct http_request *req)
         }
     } while(last_bytes_read > 0);
 
+    tcblcb_reqctx_phase(tcblcb_reqctx_get(req), TIMING_PHASE_BODY, started);
+    tcblcb_reqctx_body(req, (const char *)http_body_buf->data, http_body_buf->offset);
     return http_body_buf;
 }
 
@@ -258,3 +724,738 @@ void process_cors(struct http_request *req)
 		http_response_header(req, "Access-Control-Allow-Headers", cors_headers);
     }
 }
+
+void append_json_string(struct kore_buf *buf, const char *str)
+{
+    static const char hex_chars[] = "0123456789abcdef";
+
+    kore_buf_append(buf, "\"", 1);
+
+    // copy runs of characters that don't need escaping in one go
+    const char *run = str;
+    for (const char *c = str; *c != '\0'; c++) {
+        unsigned char ch = (unsigned char)*c;
+        if (ch >= 0x20 && ch != '"' && ch != '\\') {
+            continue;
+        }
+
+        if (c > run) {
+            kore_buf_append(buf, run, c - run);
+        }
+        run = c + 1;
+
+        switch (ch) {
+            case '"':  kore_buf_append(buf, "\\\"", 2); break;
+            case '\\': kore_buf_append(buf, "\\\\", 2); break;
+            case '\b': kore_buf_append(buf, "\\b", 2); break;
+            case '\f': kore_buf_append(buf, "\\f", 2); break;
+            case '\n': kore_buf_append(buf, "\\n", 2); break;
+            case '\r': kore_buf_append(buf, "\\r", 2); break;
+            case '\t': kore_buf_append(buf, "\\t", 2); break;
+            default: {
+                char escaped[6] = {'\\', 'u', '0', '0', hex_chars[ch >> 4], hex_chars[ch & 0x0f]};
+                kore_buf_append(buf, escaped, sizeof(escaped));
+                break;
+            }
+        }
+    }
+
+    if (*run != '\0') {
+        kore_buf_append(buf, run, strlen(run));
+    }
+
+    kore_buf_append(buf, "\"", 1);
+}
+
+bool is_secret_key(const char *key, size_t len)
+{
+    static const char *secrets[] = { "pass", "secret", "token", "auth" };
+
+    char lower[64];
+    if (len >= sizeof(lower)) {
+        len = sizeof(lower) - 1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        lower[i] = (char)tolower((unsigned char)key[i]);
+    }
+    lower[len] = '\0';
+
+    for (size_t i = 0; i < sizeof(secrets) / sizeof(secrets[0]); i++) {
+        if (strstr(lower, secrets[i]) != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// index just past the string starting (with its opening quote) at `i`.
+static size_t json_text_string_end(const char *json, size_t njson, size_t i)
+{
+    for (size_t j = i + 1; j < njson; j++) {
+        if (json[j] == '\\') {
+            j++;
+        } else if (json[j] == '"') {
+            return j + 1;
+        }
+    }
+    return njson;
+}
+
+// index just past the value starting at `i`.
+static size_t json_text_value_end(const char *json, size_t njson, size_t i)
+{
+    if (i >= njson) {
+        return njson;
+    }
+
+    if (json[i] == '"') {
+        return json_text_string_end(json, njson, i);
+    }
+
+    if (json[i] == '{' || json[i] == '[') {
+        int depth = 0;
+        size_t j = i;
+        while (j < njson) {
+            char c = json[j];
+            if (c == '"') {
+                j = json_text_string_end(json, njson, j);
+                continue;
+            }
+            if (c == '{' || c == '[') {
+                depth++;
+            } else if ((c == '}' || c == ']') && --depth == 0) {
+                return j + 1;
+            }
+            j++;
+        }
+        return njson;
+    }
+
+    size_t j = i;
+    while (j < njson && strchr(",}] \t\r\n", json[j]) == NULL) {
+        j++;
+    }
+    return j;
+}
+
+// copy a string token as is, except for raw control characters. the parser lets those through
+// inside strings, so they are escaped here to keep a crafted value from breaking the line.
+static void append_json_text_string(struct kore_buf *buf, const char *str, size_t len)
+{
+    static const char hex_chars[] = "0123456789abcdef";
+
+    size_t run = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = (unsigned char)str[i];
+        if (ch >= 0x20) {
+            continue;
+        }
+
+        if (i > run) {
+            kore_buf_append(buf, str + run, i - run);
+        }
+        run = i + 1;
+
+        char escaped[6] = {'\\', 'u', '0', '0', hex_chars[ch >> 4], hex_chars[ch & 0x0f]};
+        kore_buf_append(buf, escaped, sizeof(escaped));
+    }
+
+    if (len > run) {
+        kore_buf_append(buf, str + run, len - run);
+    }
+}
+
+void append_json_redacted(struct kore_buf *buf, const char *json, size_t njson)
+{
+    static const char redacted[] = "\"[redacted]\"";
+
+    size_t i = 0;
+    while (i < njson) {
+        char c = json[i];
+
+        // whitespace can only be between tokens, so dropping it keeps the text on one line (as
+        // does dropping any other control character, which would make the text invalid anyway)
+        if (isspace((unsigned char)c) || (unsigned char)c < 0x20) {
+            i++;
+            continue;
+        }
+        if (c != '"') {
+            kore_buf_append(buf, &c, 1);
+            i++;
+            continue;
+        }
+
+        size_t end = json_text_string_end(json, njson, i);
+        append_json_text_string(buf, json + i, end - i);
+
+        size_t next = end;
+        while (next < njson && isspace((unsigned char)json[next])) {
+            next++;
+        }
+
+        // an object key whose value is replaced if the key looks secret
+        bool secret = next < njson && json[next] == ':' && end - i >= 2 && is_secret_key(json + i + 1, end - i - 2);
+        i = end;
+        if (secret) {
+            size_t value = next + 1;
+            while (value < njson && isspace((unsigned char)json[value])) {
+                value++;
+            }
+            kore_buf_append(buf, ":", 1);
+            kore_buf_append(buf, redacted, sizeof(redacted) - 1);
+            i = json_text_value_end(json, njson, value);
+        }
+    }
+}
+
+// kept for the life of the worker. a buffer that grew for an unusually large document is
+// replaced when the next writer starts so the worker doesn't hold on to it.
+#define JSON_WRITER_BUF_SIZE        BUFSIZ
+#define JSON_WRITER_BUF_MAX_KEEP    (64 * 1024)
+
+static _Thread_local struct kore_buf *_json_writer_buf = NULL;
+
+void json_writer_init(tcblcb_JSONWriter *writer, bool format)
+{
+    if (_json_writer_buf != NULL && _json_writer_buf->length > JSON_WRITER_BUF_MAX_KEEP) {
+        kore_buf_free(_json_writer_buf);
+        _json_writer_buf = NULL;
+    }
+
+    if (_json_writer_buf == NULL) {
+        _json_writer_buf = kore_buf_alloc(JSON_WRITER_BUF_SIZE);
+    } else {
+        kore_buf_reset(_json_writer_buf);
+    }
+
+    memset(writer, 0, sizeof(tcblcb_JSONWriter));
+    writer->buf = _json_writer_buf;
+    writer->format = format;
+}
+
+static void json_writer_indent(tcblcb_JSONWriter *writer, size_t depth)
+{
+    static const char tabs[] = "\t\t\t\t\t\t\t\t";
+
+    kore_buf_append(writer->buf, "\n", 1);
+    while (depth > 0) {
+        size_t ntabs = depth < sizeof(tabs) - 1 ? depth : sizeof(tabs) - 1;
+        kore_buf_append(writer->buf, tabs, ntabs);
+        depth -= ntabs;
+    }
+}
+
+// write whatever has to come before a value and check that a value is allowed here.
+static bool json_writer_value_prefix(tcblcb_JSONWriter *writer)
+{
+    if (writer->failed) {
+        return false;
+    }
+
+    if (writer->after_key) {
+        writer->after_key = false;
+        return true;
+    }
+
+    if (writer->depth == 0) {
+        if (writer->has_root) {
+            writer->failed = true;
+            return false;
+        }
+        writer->has_root = true;
+        return true;
+    }
+
+    u_int64_t level = 1ULL << (writer->depth - 1);
+    if (!(writer->arrays & level)) {
+        // object members need a key
+        writer->failed = true;
+        return false;
+    }
+
+    if (writer->nonempty & level) {
+        kore_buf_append(writer->buf, writer->format ? ", " : ",", writer->format ? 2 : 1);
+    }
+    writer->nonempty |= level;
+
+    return true;
+}
+
+static void json_writer_begin(tcblcb_JSONWriter *writer, bool array)
+{
+    if (!json_writer_value_prefix(writer)) {
+        return;
+    }
+
+    if (writer->depth == JSON_WRITER_MAX_DEPTH) {
+        writer->failed = true;
+        return;
+    }
+
+    u_int64_t level = 1ULL << writer->depth;
+    writer->nonempty &= ~level;
+    if (array) {
+        writer->arrays |= level;
+    } else {
+        writer->arrays &= ~level;
+    }
+    writer->depth++;
+
+    kore_buf_append(writer->buf, array ? "[" : "{", 1);
+}
+
+static void json_writer_end(tcblcb_JSONWriter *writer, bool array)
+{
+    if (writer->failed) {
+        return;
+    }
+
+    u_int64_t level = writer->depth > 0 ? 1ULL << (writer->depth - 1) : 0;
+    if (level == 0 || writer->after_key || array != ((writer->arrays & level) != 0)) {
+        writer->failed = true;
+        return;
+    }
+    writer->depth--;
+
+    if (!array && writer->format && (writer->nonempty & level)) {
+        json_writer_indent(writer, writer->depth);
+    }
+    kore_buf_append(writer->buf, array ? "]" : "}", 1);
+}
+
+void json_writer_begin_object(tcblcb_JSONWriter *writer)
+{
+    json_writer_begin(writer, false);
+}
+
+void json_writer_end_object(tcblcb_JSONWriter *writer)
+{
+    json_writer_end(writer, false);
+}
+
+void json_writer_begin_array(tcblcb_JSONWriter *writer)
+{
+    json_writer_begin(writer, true);
+}
+
+void json_writer_end_array(tcblcb_JSONWriter *writer)
+{
+    json_writer_end(writer, true);
+}
+
+void json_writer_key(tcblcb_JSONWriter *writer, const char *key)
+{
+    if (writer->failed) {
+        return;
+    }
+
+    u_int64_t level = writer->depth > 0 ? 1ULL << (writer->depth - 1) : 0;
+    if (level == 0 || writer->after_key || (writer->arrays & level)) {
+        writer->failed = true;
+        return;
+    }
+
+    if (writer->nonempty & level) {
+        kore_buf_append(writer->buf, ",", 1);
+    }
+    writer->nonempty |= level;
+
+    if (writer->format) {
+        json_writer_indent(writer, writer->depth);
+    }
+    append_json_string(writer->buf, key);
+    kore_buf_append(writer->buf, writer->format ? ":\t" : ":", writer->format ? 2 : 1);
+
+    writer->after_key = true;
+}
+
+void json_writer_string(tcblcb_JSONWriter *writer, const char *str)
+{
+    if (str == NULL) {
+        json_writer_null(writer);
+    } else if (json_writer_value_prefix(writer)) {
+        append_json_string(writer->buf, str);
+    }
+}
+
+void json_writer_number(tcblcb_JSONWriter *writer, double number)
+{
+    if (!isfinite(number)) {
+        json_writer_null(writer);
+        return;
+    }
+
+    if (json_writer_value_prefix(writer)) {
+        // the shortest of these that reads back as the same number
+        char number_string[32];
+        snprintf(number_string, sizeof(number_string), "%.15g", number);
+        if (strtod(number_string, NULL) != number) {
+            snprintf(number_string, sizeof(number_string), "%.17g", number);
+        }
+        kore_buf_append(writer->buf, number_string, strlen(number_string));
+    }
+}
+
+void json_writer_bool(tcblcb_JSONWriter *writer, bool value)
+{
+    if (json_writer_value_prefix(writer)) {
+        kore_buf_append(writer->buf, value ? "true" : "false", value ? 4 : 5);
+    }
+}
+
+void json_writer_null(tcblcb_JSONWriter *writer)
+{
+    if (json_writer_value_prefix(writer)) {
+        kore_buf_append(writer->buf, "null", 4);
+    }
+}
+
+void json_writer_raw(tcblcb_JSONWriter *writer, const char *json, size_t njson)
+{
+    if (json_writer_value_prefix(writer)) {
+        kore_buf_append(writer->buf, json, njson);
+    }
+}
+
+void json_writer_json(tcblcb_JSONWriter *writer, const tcblcb_JSONValue *value)
+{
+    size_t njson = 0;
+    char *json = json_value_write(value, &njson);
+    if (json == NULL) {
+        writer->failed = true;
+        return;
+    }
+
+    json_writer_raw(writer, json, njson);
+    tcblcb_free(json);
+}
+
+char *json_writer_finish(tcblcb_JSONWriter *writer, size_t *len)
+{
+    if (writer->failed || writer->depth > 0 || !writer->has_root) {
+        return NULL;
+    }
+
+    return kore_buf_stringify(writer->buf, len);
+}
+
+void raw_response_init(tcblcb_RawResponse *resp)
+{
+    static const char data_start[] = "{\"data\":[";
+
+    resp->data_buf = kore_buf_alloc(BUFSIZ);
+    kore_buf_append(resp->data_buf, data_start, sizeof(data_start) - 1);
+    resp->context_buf = kore_buf_alloc(BUFSIZ);
+    resp->num_rows = 0;
+    resp->num_contexts = 0;
+    resp->stream_req = NULL;
+    resp->streaming = false;
+    resp->streamed = 0;
+}
+
+bool stream_requested(struct http_request *req)
+{
+    char *stream_string = NULL;
+    if (http_argument_get_string(req, "stream", &stream_string) != KORE_RESULT_OK) {
+        return false;
+    }
+    return strcmp(stream_string, "0") != 0;
+}
+
+void raw_response_add_row(tcblcb_RawResponse *resp, const char *row, size_t nrow)
+{
+    if (resp->num_rows++ > 0) {
+        kore_buf_append(resp->data_buf, ",", 1);
+    }
+    kore_buf_append(resp->data_buf, row, nrow);
+}
+
+bool raw_response_add_row_fields(tcblcb_RawResponse *resp, const char *row, size_t nrow, const char *fields, size_t nfields)
+{
+    // find the closing brace, ignoring any trailing whitespace
+    size_t close = nrow;
+    while (close > 0 && isspace((unsigned char)row[close - 1])) {
+        close--;
+    }
+    if (close < 2 || row[0] != '{' || row[close - 1] != '}') {
+        return false;
+    }
+    close--;
+
+    // an empty object doesn't need a separator before the new fields
+    size_t last = close;
+    while (last > 0 && isspace((unsigned char)row[last - 1])) {
+        last--;
+    }
+    bool empty = row[last - 1] == '{';
+
+    if (resp->num_rows++ > 0) {
+        kore_buf_append(resp->data_buf, ",", 1);
+    }
+    kore_buf_append(resp->data_buf, row, close);
+    if (!empty) {
+        kore_buf_append(resp->data_buf, ",", 1);
+    }
+    kore_buf_append(resp->data_buf, fields, nfields);
+    kore_buf_append(resp->data_buf, "}", 1);
+
+    return true;
+}
+
+void raw_response_add_context(tcblcb_RawResponse *resp, const char *context)
+{
+    if (resp->num_contexts++ > 0) {
+        kore_buf_append(resp->context_buf, ",", 1);
+    }
+    append_json_string(resp->context_buf, context);
+}
+
+void raw_response_stream(tcblcb_RawResponse *resp, struct http_request *req)
+{
+    resp->stream_req = req;
+}
+
+void send_response(struct http_request *req, int status, const void *body, size_t len)
+{
+    tcblcb_reqctx_request_id_header(req);
+    tcblcb_reqctx_server_timing(req);
+    tcblcb_reqctx_response_sent(req, len);
+    http_response(req, status, body, len);
+}
+
+// write a chunk of the streamed body (an empty chunk ends the body).
+static void send_response_chunk(struct http_request *req, const void *data, size_t len)
+{
+    tcblcb_reqctx_response_sent(req, len);
+
+    char size_line[24];
+    int size_linelen = snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+
+    net_send_queue(req->owner, size_line, (size_t)size_linelen);
+    if (len > 0) {
+        net_send_queue(req->owner, data, len);
+    }
+    net_send_queue(req->owner, "\r\n", 2);
+    net_send_flush(req->owner);
+}
+
+void raw_response_flush(tcblcb_RawResponse *resp)
+{
+    if (resp->stream_req == NULL || resp->data_buf->offset == resp->streamed) {
+        return;
+    }
+
+    // the status line and headers go out with the first rows
+    if (!resp->streaming) {
+        http_response_header(resp->stream_req, "transfer-encoding", "chunked");
+        resp->stream_req->flags |= HTTP_REQUEST_NO_CONTENT_LENGTH;
+        send_response(resp->stream_req, 200, NULL, 0);
+        resp->streaming = true;
+    }
+
+    // the rows stay in the buffer so the finished response can still be cached
+    send_response_chunk(resp->stream_req, resp->data_buf->data + resp->streamed, resp->data_buf->offset - resp->streamed);
+    resp->streamed = resp->data_buf->offset;
+}
+
+char *raw_response_finish(tcblcb_RawResponse *resp, size_t *len)
+{
+    static const char context_start[] = "],\"context\":[";
+    static const char context_end[] = "]}";
+
+    kore_buf_append(resp->data_buf, context_start, sizeof(context_start) - 1);
+    kore_buf_append(resp->data_buf, resp->context_buf->data, resp->context_buf->offset);
+    kore_buf_append(resp->data_buf, context_end, sizeof(context_end) - 1);
+
+    return kore_buf_stringify(resp->data_buf, len);
+}
+
+// FNV-1a of the response body, which is what its ETag is made from
+static u_int64_t response_body_hash(const char *body, size_t len)
+{
+    u_int64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)body[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// true if `etag` is in the If-None-Match list (weak comparison, as the header requires).
+static bool etag_requested(struct http_request *req, const char *etag, size_t etag_len)
+{
+    const char *if_none_match = NULL;
+    if (http_request_header(req, "If-None-Match", &if_none_match) != KORE_RESULT_OK) {
+        return false;
+    }
+
+    const char *tag = if_none_match;
+    while (*tag != '\0') {
+        while (*tag == ' ' || *tag == '\t' || *tag == ',') {
+            tag++;
+        }
+
+        const char *tag_end = tag;
+        while (*tag_end != '\0' && *tag_end != ',') {
+            tag_end++;
+        }
+
+        size_t tag_len = (size_t)(tag_end - tag);
+        while (tag_len > 0 && (tag[tag_len - 1] == ' ' || tag[tag_len - 1] == '\t')) {
+            tag_len--;
+        }
+        if (tag_len > 2 && strncmp(tag, "W/", 2) == 0) {
+            tag += 2;
+            tag_len -= 2;
+        }
+
+        if ((tag_len == 1 && *tag == '*') || (tag_len == etag_len && strncmp(tag, etag, etag_len) == 0)) {
+            return true;
+        }
+
+        tag = tag_end;
+    }
+
+    return false;
+}
+
+static void send_response_body_hashed(struct http_request *req, const char *body, size_t len, u_int64_t hash, const char *cache_control)
+{
+    char etag[24];
+    int etag_len = snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)hash);
+
+    http_response_header(req, "ETag", etag);
+    if (cache_control != NULL) {
+        http_response_header(req, "Cache-Control", cache_control);
+    }
+
+    if (etag_requested(req, etag, (size_t)etag_len)) {
+        send_response(req, 304, NULL, 0);
+    } else {
+        send_response(req, 200, body, len);
+    }
+}
+
+void send_response_body(struct http_request *req, const char *body, size_t len, const char *cache_control)
+{
+    send_response_body_hashed(req, body, len, response_body_hash(body, len), cache_control);
+}
+
+void raw_response_cache(tcblcb_RawResponse *resp, tcblcb_SHMCACHE *cache, const char *key, u_int64_t soft_ttl_ms, u_int64_t ttl_ms)
+{
+    resp->cache = cache;
+    resp->cache_key = key;
+    resp->cache_soft_ttl_ms = soft_ttl_ms;
+    resp->cache_ttl_ms = ttl_ms;
+}
+
+void raw_response_cache_control(tcblcb_RawResponse *resp, const char *policy)
+{
+    resp->cache_control = policy;
+}
+
+// cached responses are stored after their body hash, so a hit doesn't hash the body again.
+static void raw_response_put(tcblcb_RawResponse *resp, const char *response_string, size_t response_strlen, u_int64_t hash)
+{
+    if (resp->cache == NULL || resp->cache_key == NULL) {
+        return;
+    }
+
+    char *value = malloc(sizeof(hash) + response_strlen);
+    if (value == NULL) {
+        kore_log(LOG_WARNING, "Failed to allocate cached response: %s", resp->cache_key);
+        return;
+    }
+
+    memcpy(value, &hash, sizeof(hash));
+    memcpy(value + sizeof(hash), response_string, response_strlen);
+
+    tcblcb_shmcache_put(
+        resp->cache,
+        resp->cache_key, strlen(resp->cache_key),
+        value, sizeof(hash) + response_strlen,
+        resp->cache_soft_ttl_ms, resp->cache_ttl_ms
+    );
+
+    free(value);
+}
+
+void raw_response_store(tcblcb_RawResponse *resp)
+{
+    if (resp->data_buf == NULL) {
+        return;
+    }
+
+    size_t response_strlen;
+    char *response_string = raw_response_finish(resp, &response_strlen);
+    raw_response_put(resp, response_string, response_strlen, response_body_hash(response_string, response_strlen));
+}
+
+void raw_response_send(tcblcb_RawResponse *resp, struct http_request *req, bool failed)
+{
+    u_int64_t started = tcblcb_metrics_now();
+
+    if (resp->streaming) {
+        size_t response_strlen;
+        char *response_string = raw_response_finish(resp, &response_strlen);
+        tcblcb_reqctx_phase(tcblcb_reqctx_get(req), TIMING_PHASE_SERIALIZE, started);
+        send_response_chunk(req, response_string + resp->streamed, response_strlen - resp->streamed);
+        send_response_chunk(req, NULL, 0);
+
+        // requests coalesced on this one pick the response up from the cache
+        if (!failed) {
+            raw_response_put(resp, response_string, response_strlen, response_body_hash(response_string, response_strlen));
+        }
+    } else if (failed || resp->data_buf == NULL) {
+        send_response(req, 200, NULL, 0);
+    } else {
+        size_t response_strlen;
+        char *response_string = raw_response_finish(resp, &response_strlen);
+        u_int64_t hash = response_body_hash(response_string, response_strlen);
+        tcblcb_reqctx_phase(tcblcb_reqctx_get(req), TIMING_PHASE_SERIALIZE, started);
+        send_response_body_hashed(req, response_string, response_strlen, hash, resp->cache_control);
+        raw_response_put(resp, response_string, response_strlen, hash);
+    }
+}
+
+tcblcb_CACHE_RESULT send_cached_response(struct http_request *req, tcblcb_SHMCACHE *cache, const char *key, const char *cache_control)
+{
+    if (cache == NULL) {
+        return CACHE_MISS;
+    }
+
+    struct kore_buf *response_buf = kore_buf_alloc(BUFSIZ);
+    tcblcb_CACHE_RESULT result = tcblcb_shmcache_get(cache, key, strlen(key), response_buf);
+    if (result != CACHE_MISS && response_buf->offset < sizeof(u_int64_t)) {
+        result = CACHE_MISS;
+    }
+    if (result != CACHE_MISS) {
+        LogDebug("Response cache %s: %s", result == CACHE_STALE ? "stale hit" : "hit", key);
+
+        u_int64_t hash;
+        memcpy(&hash, response_buf->data, sizeof(hash));
+        send_response_body_hashed(
+            req,
+            (const char *)response_buf->data + sizeof(hash),
+            response_buf->offset - sizeof(hash),
+            hash,
+            cache_control
+        );
+    }
+
+    kore_buf_free(response_buf);
+    return result;
+}
+
+void raw_response_cleanup(tcblcb_RawResponse *resp)
+{
+    if (resp->data_buf != NULL) {
+        kore_buf_free(resp->data_buf);
+        resp->data_buf = NULL;
+    }
+
+    if (resp->context_buf != NULL) {
+        kore_buf_free(resp->context_buf);
+        resp->context_buf = NULL;
+    }
+}
@@ -24,10 +24,13 @@
 #define tcblcb_UTIL_HEADER_SEEN
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <kore/kore.h>
-#include <cjson/cJSON.h>
+#include <kore/http.h>
 #include <libcouchbase/couchbase.h>
 
+#include "shm-cache.h"
+
 #define __unused __attribute__((__unused__))
 
 #define __FILENAME__ (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
@@ -114,31 +117,102 @@ void to_upper_case(char *str);
 // return day of the week, where Monday == 0 ... Sunday == 6.
 int weekday(const char *date_string);
 
-// create a JSON array from an array of string references. caller must free.
-// strings provided are referenced (not copied).
-cJSON *create_string_array_param_json(char *strings[], int nstrings);
+// parse a duration as reported by the query service (e.g., "1m2.5s", "12.3ms", "850.1µs") into
+// seconds. returns false if it isn't a duration.
+bool parse_duration_string(const char *str, double *seconds);
 
-// create a serialized JSON array string from an array of string references. caller must free.
-char *create_string_array_param_string(char *strings[], int nstrings);
+// create a serialized JSON array string from an array of string references. caller must free with `tcblcb_free`.
+char *create_string_array_param_string(const char *strings[], int nstrings);
 
-// create a serialized JSON string param value. caller must free.
+// create a serialized JSON string param value. caller must free with `tcblcb_free`.
 char *create_json_string_param(const char *value_string);
 
-// create a serialized JSON string number value. caller must free.
+// create a serialized JSON string number value. caller must free with `tcblcb_free`.
 char *create_json_number_param(const double value_number);
 
-// create a UUID string. caller must free.
+// create a UUID string. caller must free with `tcblcb_free`.
 char *create_uuid_string();
 
-// get a JSON doc from a SUBDOC response (decoded from JSON fragment). caller must free.
-lcb_STATUS get_json_doc_from_subdoc_resp(const lcb_RESPSUBDOC *resp, size_t index, cJSON **json);
+// read-only facade over the JSON parser (the vendored cJSON), so handlers don't depend on the
+// engine behind it. the document is allocated from the request arena, and its values are only
+// valid until the document is freed.
+typedef struct tcblcb_JSONDoc tcblcb_JSONDoc;
+typedef struct tcblcb_JSONValue tcblcb_JSONValue;
+
+// parse a JSON document. returns NULL if it isn't valid JSON. caller must free with `json_doc_free`.
+tcblcb_JSONDoc *json_doc_parse(const char *json, size_t njson);
+void json_doc_free(tcblcb_JSONDoc *doc);
+
+const tcblcb_JSONValue *json_doc_root(const tcblcb_JSONDoc *doc);
+
+// get an object member by (case-sensitive) key. returns NULL if `object` isn't an object or has no
+// such member.
+const tcblcb_JSONValue *json_object_get(const tcblcb_JSONValue *object, const char *key);
+
+// get a string value. returns NULL if `value` isn't a string.
+const char *json_get_string(const tcblcb_JSONValue *value);
+
+// get a number value. returns false if `value` isn't a number.
+bool json_get_number(const tcblcb_JSONValue *value, double *number);
+
+bool json_is_object(const tcblcb_JSONValue *value);
+bool json_is_array(const tcblcb_JSONValue *value);
 
-// extract the string value from a SUBDOC response. caller must free.
+// number of elements in an array (0 if `array` isn't an array).
+size_t json_array_size(const tcblcb_JSONValue *array);
+
+// iterate over the elements of an array (none if `array` isn't an array).
+const tcblcb_JSONValue *json_array_first(const tcblcb_JSONValue *array);
+const tcblcb_JSONValue *json_array_next(const tcblcb_JSONValue *array, const tcblcb_JSONValue *element);
+
+#define json_array_for_each(element, array) \
+for ((element) = json_array_first(array); (element) != NULL; (element) = json_array_next((array), (element)))
+
+// write a value as unformatted JSON. returns NULL if `value` is NULL. caller must free with `tcblcb_free`.
+char *json_value_write(const tcblcb_JSONValue *value, size_t *len);
+
+// get a JSON doc from a SUBDOC response. caller must free with `json_doc_free`.
+lcb_STATUS get_json_doc_from_subdoc_resp(const lcb_RESPSUBDOC *resp, size_t index, tcblcb_JSONDoc **doc);
+
+// extract the string value from a SUBDOC response. caller must free with `tcblcb_free`.
 char *extract_string_value_from_subdoc_resp(const lcb_RESPSUBDOC *resp, size_t index);
 
-// extract the string value from a raw JSON string value (decoding as needed). caller must free.
+// extract the string value from a raw JSON string value (decoding as needed). caller must free with `tcblcb_free`.
 char *extract_string_value_from_json_string(const char *value, size_t nvalue);
 
+// schema for decoding known JSON objects (e.g., query rows) straight into a struct, without
+// building a JSON doc. each field maps an object member to a struct member of a given type:
+//
+//   static const tcblcb_JSON_FIELD row_fields[] = {
+//       JSON_FIELD("fromAirport", JSON_FIELD_STRING, tcblcb_FlightPathRow, from_airport),
+//   };
+typedef enum {
+    JSON_FIELD_STRING   // a `char *` set to a decoded copy of the string (free with `free_json_fields`)
+} tcblcb_JSON_FIELD_TYPE;
+
+typedef struct tcblcb_JSON_FIELD {
+    const char *name;
+    size_t name_len;
+    tcblcb_JSON_FIELD_TYPE type;
+    size_t offset;
+} tcblcb_JSON_FIELD;
+
+#define JSON_FIELD(name, type, struct_type, member) \
+{ name, sizeof(name) - 1, type, offsetof(struct_type, member) }
+
+#define json_fields_amount(fields) (sizeof(fields) / sizeof(fields[0]))
+
+// decode the members of a JSON object named by `fields` into the zeroed struct `result` in a
+// single pass. other members are skipped, as are members of the wrong type (so they're left
+// unset). returns false, with nothing left allocated, if the JSON isn't an object.
+bool decode_json_object(const char *json, size_t njson, const tcblcb_JSON_FIELD *fields, size_t nfields, void *result);
+
+// decode a raw JSON string value. returns NULL if it isn't a string. caller must free with `tcblcb_free`.
+char *decode_json_string(const char *json, size_t njson);
+
+// free the strings decoded into `result` (and reset them to NULL).
+void free_json_fields(const tcblcb_JSON_FIELD *fields, size_t nfields, void *result);
+
 // read the entire HTTP body into a buffer. caller must free.
 struct kore_buf *get_http_body_buf(struct http_request *req);
 
@@ -160,4 +234,142 @@ typedef struct tcblcb_HTTPResponse {
     size_t strlen;
 } tcblcb_HTTPResponse;
 
+// append a JSON string value (quoted and escaped) to a buffer.
+void append_json_string(struct kore_buf *buf, const char *str);
+
+// true if a key (e.g., of a JSON member or query string parameter) looks like it names a
+// password or other secret, so its value should not be logged.
+bool is_secret_key(const char *key, size_t len);
+
+// append valid JSON text on one line, with the value of every member whose key looks secret (at
+// any depth) replaced by "[redacted]".
+void append_json_redacted(struct kore_buf *buf, const char *json, size_t njson);
+
+// append-only JSON writer for responses and documents with a fixed shape, which are written
+// straight out as text instead of being built as a JSON tree and printed. the text goes into a
+// buffer kept by the worker, so only one writer can be in use at a time and the finished JSON is
+// only valid until the next writer is started (copy it if it has to be kept).
+//
+// a value written where it isn't allowed (e.g., an object member without a key) or nesting past
+// JSON_WRITER_MAX_DEPTH fails the writer, and `json_writer_finish` then returns NULL.
+#define JSON_WRITER_MAX_DEPTH 64
+
+typedef struct tcblcb_JSONWriter {
+    struct kore_buf *buf;
+    u_int64_t arrays;       // bit per nesting level, set if the level is an array
+    u_int64_t nonempty;     // bit per nesting level, set once the level has a value
+    size_t depth;
+    bool after_key;         // an object member's key has been written and needs its value
+    bool has_root;
+    bool format;            // tab indented like cJSON's formatted output
+    bool failed;
+} tcblcb_JSONWriter;
+
+// start a JSON document in the worker's buffer.
+void json_writer_init(tcblcb_JSONWriter *writer, bool format);
+
+void json_writer_begin_object(tcblcb_JSONWriter *writer);
+void json_writer_end_object(tcblcb_JSONWriter *writer);
+void json_writer_begin_array(tcblcb_JSONWriter *writer);
+void json_writer_end_array(tcblcb_JSONWriter *writer);
+
+// write the key of the next object member.
+void json_writer_key(tcblcb_JSONWriter *writer, const char *key);
+
+// write a string value (quoted and escaped). a NULL string is written as null.
+void json_writer_string(tcblcb_JSONWriter *writer, const char *str);
+
+// write a number value. numbers JSON can't represent (NaN and infinities) are written as null.
+void json_writer_number(tcblcb_JSONWriter *writer, double number);
+
+void json_writer_bool(tcblcb_JSONWriter *writer, bool value);
+void json_writer_null(tcblcb_JSONWriter *writer);
+
+// write a value that is already JSON text (e.g., a document from a KV get) as is.
+void json_writer_raw(tcblcb_JSONWriter *writer, const char *json, size_t njson);
+
+// write a parsed JSON value (unformatted).
+void json_writer_json(tcblcb_JSONWriter *writer, const tcblcb_JSONValue *value);
+
+// get the finished JSON, or NULL if the writer failed or the document isn't complete. the
+// string is owned by the worker buffer.
+char *json_writer_finish(tcblcb_JSONWriter *writer, size_t *len);
+
+// response builder for `{"data":[...],"context":[...]}` that copies raw JSON rows (e.g., straight
+// from an N1QL row callback) into the response instead of parsing and printing them again.
+//
+// a builder can also stream: rows are then sent with chunked transfer encoding each time they are
+// flushed. they are still kept, so a streamed response can be cached like any other.
+typedef struct tcblcb_RawResponse {
+    struct kore_buf *data_buf;
+    struct kore_buf *context_buf;
+    size_t num_rows;
+    size_t num_contexts;
+    struct http_request *stream_req;    // set if the client asked for a streamed response
+    bool streaming;                     // true once the headers have been sent
+    size_t streamed;                    // bytes of `data_buf` already sent
+    tcblcb_SHMCACHE *cache;             // set to keep the finished response in a cache
+    const char *cache_key;
+    u_int64_t cache_soft_ttl_ms;
+    u_int64_t cache_ttl_ms;
+    const char *cache_control;          // Cache-Control policy for a successful response
+} tcblcb_RawResponse;
+
+// true if the client opted in to a streamed response (`?stream=1`). the query string must have
+// been populated.
+bool stream_requested(struct http_request *req);
+
+// start the response envelope.
+void raw_response_init(tcblcb_RawResponse *resp);
+
+// append a raw JSON row to the data array.
+void raw_response_add_row(tcblcb_RawResponse *resp, const char *row, size_t nrow);
+
+// append a raw JSON object row with extra `"name":value` fields spliced in before its closing
+// brace. returns false (without adding anything) if the row isn't an object.
+bool raw_response_add_row_fields(tcblcb_RawResponse *resp, const char *row, size_t nrow, const char *fields, size_t nfields);
+
+// append a string to the context array.
+void raw_response_add_context(tcblcb_RawResponse *resp, const char *context);
+
+// stream the response to `req` as rows are flushed. nothing is sent until the first flush.
+void raw_response_stream(tcblcb_RawResponse *resp, struct http_request *req);
+
+// send the rows added since the last flush (does nothing unless streaming). must only be called
+// while the request is still attached.
+void raw_response_flush(tcblcb_RawResponse *resp);
+
+// close the envelope and get the response string, which is owned by the builder.
+char *raw_response_finish(tcblcb_RawResponse *resp, size_t *len);
+
+// store the response in `cache` under `key` (which must outlive the builder) once it's sent.
+// failed responses aren't stored.
+void raw_response_cache(tcblcb_RawResponse *resp, tcblcb_SHMCACHE *cache, const char *key, u_int64_t soft_ttl_ms, u_int64_t ttl_ms);
+
+// send `policy` as the Cache-Control header of a successful (not streamed) response.
+void raw_response_cache_control(tcblcb_RawResponse *resp, const char *policy);
+
+// close the envelope and store the response in its cache without sending it (e.g., when a cached
+// response is refreshed in the background, or the request went away before its response).
+void raw_response_store(tcblcb_RawResponse *resp);
+
+// close the envelope and send the response. a failed request gets an empty body, unless rows
+// were already streamed, in which case the envelope is closed around what was sent.
+void raw_response_send(tcblcb_RawResponse *resp, struct http_request *req, bool failed);
+
+// send a response like `http_response`, counting the body bytes for the request metrics.
+void send_response(struct http_request *req, int status, const void *body, size_t len);
+
+// send a 200 response with a strong ETag (a hash of the body), or a bodyless 304 if the request's
+// If-None-Match already has that ETag. `cache_control` (if not NULL) is sent with either.
+void send_response_body(struct http_request *req, const char *body, size_t len, const char *cache_control);
+
+// send the response cached under `key` (with `cache_control`, as above), if there is one. returns
+// CACHE_MISS (also if `cache` is NULL) without responding, or CACHE_STALE if the caller should
+// refresh the cached response.
+tcblcb_CACHE_RESULT send_cached_response(struct http_request *req, tcblcb_SHMCACHE *cache, const char *key, const char *cache_control);
+
+// free the builder buffers.
+void raw_response_cleanup(tcblcb_RawResponse *resp);
+
 #endif /* !tcblcb_UTIL_HEADER_SEEN */
@@ -0,0 +1,204 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+// benchmarks for the vendored cJSON's conversions, timed against the previous versions of them
+// (cjson-reference.c). run with `make bench`.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "fakes.h"
+
+#include "cjson/cJSON.h"
+#include "cjson-reference.h"
+
+// each benchmark runs for at least this long
+#define BENCH_MIN_NS 200000000ULL
+
+static u_int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t)ts.tv_sec * 1000000000ULL + (u_int64_t)ts.tv_nsec;
+}
+
+// keeps the compiler from dropping the work being timed
+static volatile size_t _sink = 0;
+
+// run `fn` over `n` inputs until BENCH_MIN_NS has passed. returns the nanoseconds per input.
+static double bench(void (*fn)(size_t i), size_t n)
+{
+    u_int64_t started = now_ns();
+    u_int64_t elapsed = 0;
+    size_t rounds = 0;
+    do {
+        for (size_t i = 0; i < n; i++) {
+            fn(i);
+        }
+        rounds++;
+        elapsed = now_ns() - started;
+    } while (elapsed < BENCH_MIN_NS);
+
+    return (double)elapsed / (double)(rounds * n);
+}
+
+static void report(const char *name, double current_ns, double reference_ns)
+{
+    printf("%-36s %9.1f ns %9.1f ns %6.2fx\n", name, current_ns, reference_ns, reference_ns / current_ns);
+}
+
+// strings: a row of JSON strings of one length, with an escape in one in four
+#define STRINGS 100
+
+static cJSON *_strings[STRINGS];
+static char _string_output[4096 * 6 + 3];
+
+static void print_string_current(size_t i)
+{
+    cJSON_PrintPreallocated(_strings[i], _string_output, (int)sizeof(_string_output), false);
+    _sink += (size_t)_string_output[1];
+}
+
+static void print_string_reference(size_t i)
+{
+    _sink += reference_print_string(_strings[i]->valuestring, _string_output);
+}
+
+static void bench_print_string(void)
+{
+    static const size_t lengths[] = { 16, 64, 256, 1024, 4096 };
+    static char string[4096 + 1];
+
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        for (size_t i = 0; i < STRINGS; i++) {
+            for (size_t j = 0; j < lengths[l]; j++) {
+                string[j] = (char)('a' + (i + j) % 26);
+            }
+            if (i % 4 == 0) {
+                string[(i * 7) % lengths[l]] = '\n';
+            }
+            string[lengths[l]] = '\0';
+            _strings[i] = cJSON_CreateString(string);
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "print string (%zu bytes)", lengths[l]);
+        report(name, bench(print_string_current, STRINGS), bench(print_string_reference, STRINGS));
+
+        for (size_t i = 0; i < STRINGS; i++) {
+            cJSON_Delete(_strings[i]);
+        }
+    }
+}
+
+// numbers: flight times and prices as the routes compute them, and document ids
+#define NUMBERS 300
+
+static cJSON *_numbers[NUMBERS];
+static char _number_output[64];
+
+static void print_number_current(size_t i)
+{
+    cJSON_PrintPreallocated(_numbers[i], _number_output, (int)sizeof(_number_output), false);
+    _sink += (size_t)_number_output[0];
+}
+
+static void print_number_reference(size_t i)
+{
+    _sink += reference_print_number(_numbers[i]->valuedouble, _number_output);
+}
+
+static void bench_print_number(void)
+{
+    for (size_t i = 0; i < NUMBERS; i++) {
+        double d = 0;
+        switch (i % 3) {
+            case 0:
+                d = (double)(60 + i * 7 % 600);
+                break;
+            case 1:
+                d = (double)(5000 + i * 977 % 90000) / 100.0;
+                break;
+            default:
+                d = (double)(10000 + i * 31);
+                break;
+        }
+        _numbers[i] = cJSON_CreateNumber(d);
+    }
+
+    report("print number (route values)", bench(print_number_current, NUMBERS), bench(print_number_reference, NUMBERS));
+
+    for (size_t i = 0; i < NUMBERS; i++) {
+        cJSON_Delete(_numbers[i]);
+    }
+}
+
+// the same values as text. cJSON_Parse also creates (and this frees) an item for each, which the
+// previous conversion alone is not charged for.
+static char _number_texts[NUMBERS][32];
+
+static void parse_number_current(size_t i)
+{
+    cJSON *item = cJSON_Parse(_number_texts[i]);
+    _sink += (size_t)item->valueint;
+    cJSON_Delete(item);
+}
+
+static void parse_number_reference(size_t i)
+{
+    double value = 0;
+    int valueint = 0;
+    size_t consumed = 0;
+    reference_parse_number(_number_texts[i], &value, &valueint, &consumed);
+    _sink += (size_t)valueint;
+}
+
+static void bench_parse_number(void)
+{
+    for (size_t i = 0; i < NUMBERS; i++) {
+        switch (i % 3) {
+            case 0:
+                snprintf(_number_texts[i], sizeof(_number_texts[i]), "%zu", 60 + i * 7 % 600);
+                break;
+            case 1:
+                snprintf(_number_texts[i], sizeof(_number_texts[i]), "%.2f", (double)(5000 + i * 977 % 90000) / 100.0);
+                break;
+            default:
+                // coordinates, as the airport documents have them
+                snprintf(_number_texts[i], sizeof(_number_texts[i]), "%.6f", -122.0 + (double)(i * 7919 % 1000000) / 1e6);
+                break;
+        }
+    }
+
+    report("parse number (route values)", bench(parse_number_current, NUMBERS), bench(parse_number_reference, NUMBERS));
+}
+
+int main(void)
+{
+    printf("%-36s %12s %12s %7s\n", "", "cJSON", "previous", "");
+    bench_print_string();
+    bench_print_number();
+    bench_parse_number();
+    return 0;
+}
@@ -0,0 +1,172 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+// benchmarks for the JSON facade (util.c) over the documents the handlers read. documents are
+// parsed from a request arena, as the handlers parse them.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "fakes.h"
+
+#include "arena.h"
+#include "util.h"
+
+// each benchmark runs for at least this long
+#define BENCH_MIN_NS 200000000ULL
+
+static u_int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t)ts.tv_sec * 1000000000ULL + (u_int64_t)ts.tv_nsec;
+}
+
+// keeps the compiler from dropping the work being timed
+static volatile size_t _sink = 0;
+
+static tcblcb_ARENA *_arena = NULL;
+
+// run `fn` on `json` until BENCH_MIN_NS has passed, resetting the arena after each document as
+// each request gets a fresh one, and report the time per document.
+static void bench(const char *name, void (*fn)(const char *json, size_t njson), const char *json)
+{
+    size_t njson = strlen(json);
+    u_int64_t started = now_ns();
+    u_int64_t elapsed = 0;
+    size_t rounds = 0;
+    do {
+        for (int i = 0; i < 100; i++) {
+            fn(json, njson);
+            tcblcb_arena_reset(_arena);
+        }
+        rounds += 100;
+        elapsed = now_ns() - started;
+    } while (elapsed < BENCH_MIN_NS);
+
+    double ns = (double)elapsed / (double)rounds;
+    printf("%-36s %6zu bytes %9.1f ns %8.1f MB/s\n", name, njson, ns, (double)njson * 1000.0 / ns);
+}
+
+// the login body (api-user-auth.c)
+static const char LOGIN_BODY[] = "{\"user\":\"traveller@example.com\",\"password\":\"correct horse battery staple\"}";
+
+static void read_login(const char *json, size_t njson)
+{
+    tcblcb_JSONDoc *doc = json_doc_parse(json, njson);
+    const tcblcb_JSONValue *root = json_doc_root(doc);
+    _sink += strlen(json_get_string(json_object_get(root, "user")));
+    _sink += strlen(json_get_string(json_object_get(root, "password")));
+    json_doc_free(doc);
+}
+
+// a flight booking (api-user-flights.c), whose flight is written back out to be stored
+static const char BOOKING_BODY[] =
+    "{\"flights\":[{\"name\":\"American Airlines\",\"flight\":\"AA344\",\"price\":384.5,"
+    "\"date\":\"05/24/2021 06:30:00\",\"sourceairport\":\"SFO\",\"destinationairport\":\"LAX\","
+    "\"bookedon\":\"try-cb-lcb\",\"utc\":\"06:30:00\",\"flighttime\":95,\"equipment\":\"738 320\"}]}";
+
+static void read_booking(const char *json, size_t njson)
+{
+    tcblcb_JSONDoc *doc = json_doc_parse(json, njson);
+    const tcblcb_JSONValue *flights = json_object_get(json_doc_root(doc), "flights");
+    size_t len = 0;
+    char *flight = json_value_write(json_array_first(flights), &len);
+    _sink += len;
+    tcblcb_free(flight);
+    json_doc_free(doc);
+}
+
+// a user's booking IDs (read back from the user document)
+static char _booking_ids[64 * 48];
+
+static void read_booking_ids(const char *json, size_t njson)
+{
+    tcblcb_JSONDoc *doc = json_doc_parse(json, njson);
+    const tcblcb_JSONValue *booking_id = NULL;
+    json_array_for_each(booking_id, json_doc_root(doc)) {
+        _sink += strlen(json_get_string(booking_id));
+    }
+    json_doc_free(doc);
+}
+
+// a hotel document, as its fields come back for the search results (api-hotels.c)
+static const char HOTEL_DOCUMENT[] =
+    "{\"address\":\"Capstone Road, ME7 3JE\",\"alias\":null,\"checkin\":null,\"checkout\":null,"
+    "\"city\":\"Medway\",\"country\":\"United Kingdom\",\"description\":\"40 bed summer hostel about "
+    "3 miles from Gillingham, housed in a districtive converted Oast House in a semi-rural setting.\","
+    "\"directions\":null,\"email\":null,\"fax\":null,\"free_breakfast\":true,\"free_internet\":false,"
+    "\"free_parking\":true,\"geo\":{\"accuracy\":\"RANGE_INTERPOLATED\",\"lat\":51.35785,\"lon\":0.55818},"
+    "\"id\":10025,\"name\":\"Medway Youth Hostel\",\"pets_ok\":true,\"phone\":\"+44 870 770 5964\","
+    "\"price\":null,\"public_likes\":[\"Julius Tromp I\",\"Corrine Hilll\",\"Jaeden McKenzie\","
+    "\"Vallie Ryan\",\"Brian Kilback\",\"Lilian McLaughlin\",\"Ms. Moses Feeney\",\"Elnora Trantow\"],"
+    "\"reviews\":[{\"author\":\"Ozella Sipes\",\"content\":\"This was our 2nd trip here and we enjoyed "
+    "it as much or more than last year. Excellent location across from the French Market and just "
+    "across the street from the streetcar stop. Very convenient to several small but good restaurants. "
+    "Very clean and well maintained.\",\"date\":\"2013-06-22 18:33:50 +0300\",\"ratings\":{\"Cleanliness\":5,"
+    "\"Location\":4,\"Overall\":4,\"Rooms\":3,\"Service\":5,\"Value\":4}},{\"author\":\"Barton Marks\","
+    "\"content\":\"We found the hotel de la Monnaie through Interval and we thought we'd give it a try "
+    "while we attended a conference in New Orleans. This place was a perfect location and it definitely "
+    "beat staying downtown at the Marriott with the others attending the conference.\",\"date\":"
+    "\"2015-03-02 19:56:13 +0300\",\"ratings\":{\"Business service (e.g., internet access)\":4,"
+    "\"Check in / front desk\":4,\"Cleanliness\":4,\"Location\":4,\"Overall\":4,\"Rooms\":3,\"Service\":3,"
+    "\"Value\":5}}],\"state\":null,\"title\":\"Gillingham (Kent)\",\"tollfree\":null,\"type\":\"hotel\","
+    "\"url\":\"http://www.yha.org.uk\",\"vacancy\":true}";
+
+static void read_hotel(const char *json, size_t njson)
+{
+    tcblcb_JSONDoc *doc = json_doc_parse(json, njson);
+    const tcblcb_JSONValue *root = json_doc_root(doc);
+    _sink += strlen(json_get_string(json_object_get(root, "name")));
+    _sink += strlen(json_get_string(json_object_get(root, "description")));
+    _sink += strlen(json_get_string(json_object_get(root, "address")));
+    _sink += strlen(json_get_string(json_object_get(root, "city")));
+    _sink += strlen(json_get_string(json_object_get(root, "country")));
+    json_doc_free(doc);
+}
+
+int main(void)
+{
+    tcblcb_arena_init_json_hooks();
+    _arena = tcblcb_arena_create(16 * 1024);
+    tcblcb_ARENA *previous_arena = tcblcb_arena_enter(_arena);
+
+    size_t len = 0;
+    _booking_ids[len++] = '[';
+    for (int i = 0; i < 48; i++) {
+        len += (size_t)snprintf(_booking_ids + len, sizeof(_booking_ids) - len, "%s\"%08x-4b1e-4c2d-9a7f-%012x\"",
+            i > 0 ? "," : "", 0x1f3a0000u + (unsigned int)i * 7919u, 0x5c0ffee0u + (unsigned int)i);
+    }
+    snprintf(_booking_ids + len, sizeof(_booking_ids) - len, "]");
+
+    printf("JSON facade\n");
+    bench("login body", read_login, LOGIN_BODY);
+    bench("booking body", read_booking, BOOKING_BODY);
+    bench("booking ids (48)", read_booking_ids, _booking_ids);
+    bench("hotel document", read_hotel, HOTEL_DOCUMENT);
+
+    tcblcb_arena_leave(previous_arena);
+    tcblcb_arena_destroy(_arena);
+    return 0;
+}
@@ -0,0 +1,174 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+// print_string_ptr, print_number and parse_number from cJSON 1.7.14 (src/cjson/cJSON.c), with
+// only their buffer handling changed. the C locale is assumed, so the decimal point is always '.'.
+
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cjson-reference.h"
+
+size_t reference_print_string(const char *input, char *output)
+{
+    const unsigned char *input_pointer = NULL;
+    char *output_pointer = NULL;
+    size_t output_length = 0;
+    size_t escape_characters = 0;
+
+    for (input_pointer = (const unsigned char *)input; *input_pointer; input_pointer++) {
+        switch (*input_pointer) {
+            case '\"':
+            case '\\':
+            case '\b':
+            case '\f':
+            case '\n':
+            case '\r':
+            case '\t':
+                escape_characters++;
+                break;
+            default:
+                if (*input_pointer < 32) {
+                    escape_characters += 5;
+                }
+                break;
+        }
+    }
+    output_length = (size_t)(input_pointer - (const unsigned char *)input) + escape_characters;
+
+    output[0] = '\"';
+    if (escape_characters == 0) {
+        memcpy(output + 1, input, output_length);
+        output[output_length + 1] = '\"';
+        output[output_length + 2] = '\0';
+        return output_length + 2;
+    }
+
+    output_pointer = output + 1;
+    for (input_pointer = (const unsigned char *)input; *input_pointer != '\0'; input_pointer++, output_pointer++) {
+        if (*input_pointer > 31 && *input_pointer != '\"' && *input_pointer != '\\') {
+            *output_pointer = (char)*input_pointer;
+            continue;
+        }
+
+        *output_pointer++ = '\\';
+        switch (*input_pointer) {
+            case '\\':
+                *output_pointer = '\\';
+                break;
+            case '\"':
+                *output_pointer = '\"';
+                break;
+            case '\b':
+                *output_pointer = 'b';
+                break;
+            case '\f':
+                *output_pointer = 'f';
+                break;
+            case '\n':
+                *output_pointer = 'n';
+                break;
+            case '\r':
+                *output_pointer = 'r';
+                break;
+            case '\t':
+                *output_pointer = 't';
+                break;
+            default:
+                sprintf(output_pointer, "u%04x", *input_pointer);
+                output_pointer += 4;
+                break;
+        }
+    }
+    output[output_length + 1] = '\"';
+    output[output_length + 2] = '\0';
+
+    return output_length + 2;
+}
+
+// cJSON's compare_double: equal to within DBL_EPSILON relative to the larger
+static bool compare_double(double a, double b)
+{
+    double max = fabs(a) > fabs(b) ? fabs(a) : fabs(b);
+    return fabs(a - b) <= max * DBL_EPSILON;
+}
+
+// cJSON's number_buffer
+#define NUMBER_BUFFER_SIZE 26
+
+size_t reference_print_number(double d, char *output)
+{
+    int length = 0;
+    double test = 0.0;
+
+    if (isnan(d) || isinf(d)) {
+        length = snprintf(output, NUMBER_BUFFER_SIZE, "null");
+    } else {
+        // try 15 significant digits, and 17 if those don't give the same number back
+        length = snprintf(output, NUMBER_BUFFER_SIZE, "%1.15g", d);
+        if (sscanf(output, "%lg", &test) != 1 || !compare_double(test, d)) {
+            length = snprintf(output, NUMBER_BUFFER_SIZE, "%1.17g", d);
+        }
+    }
+
+    return (size_t)length;
+}
+
+bool reference_parse_number(const char *input, double *value, int *valueint, size_t *consumed)
+{
+    char number_c_string[64];
+    char *after_end = NULL;
+    size_t i = 0;
+
+    // copy what could be part of the number, for strtod
+    for (i = 0; i < sizeof(number_c_string) - 1; i++) {
+        char c = input[i];
+        if ((c < '0' || c > '9') && c != '+' && c != '-' && c != 'e' && c != 'E' && c != '.') {
+            break;
+        }
+        number_c_string[i] = c;
+    }
+    number_c_string[i] = '\0';
+
+    double number = strtod(number_c_string, &after_end);
+    if (after_end == number_c_string) {
+        return false;
+    }
+
+    // saturated on overflow
+    *value = number;
+    if (number >= INT_MAX) {
+        *valueint = INT_MAX;
+    } else if (number <= (double)INT_MIN) {
+        *valueint = INT_MIN;
+    } else {
+        *valueint = (int)number;
+    }
+    *consumed = (size_t)(after_end - number_c_string);
+
+    return true;
+}
@@ -0,0 +1,45 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef tcblcb_CJSON_REFERENCE_HEADER_SEEN
+#define tcblcb_CJSON_REFERENCE_HEADER_SEEN
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// the vendored cJSON's conversions as they were before they were sped up, which the fuzz tests
+// check the current ones give the same results as (and the benchmarks time them against).
+
+// print `input` as a JSON string (quotes included) into `output`, which has room for six times
+// its length plus three. returns the length printed.
+size_t reference_print_string(const char *input, char *output);
+
+// print `d` as a JSON number ("null" if it isn't finite) into `output`, which has room for 26.
+// returns the length printed.
+size_t reference_print_number(double d, char *output);
+
+// parse the number at the start of `input` into `value` and `valueint`, setting `consumed` to the
+// length read. returns false if there isn't one.
+bool reference_parse_number(const char *input, double *value, int *valueint, size_t *consumed);
+
+#endif /* !tcblcb_CJSON_REFERENCE_HEADER_SEEN */
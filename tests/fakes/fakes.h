@@ -0,0 +1,130 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+#ifndef tcblcb_FAKES_HEADER_SEEN
+#define tcblcb_FAKES_HEADER_SEEN
+
+#include <stdbool.h>
+#include <kore/kore.h>
+#include <kore/http.h>
+#include <libcouchbase/couchbase.h>
+
+// controls for the Kore and libcouchbase fakes the tests run the service code against. the
+// fakes run everything in the test's process and thread, like a single Kore worker.
+
+// kore
+
+// what `kore_time_ms` returns (tests move it forward to expire cache entries)
+extern u_int64_t fake_time_ms;
+
+// forget the logged lines.
+void fake_log_reset(void);
+
+// true if a line logged since the last reset contains `text`.
+bool fake_log_contains(const char *text);
+
+// run the timers that are due, as the event loop would. returns how many ran.
+size_t fake_timers_run(void);
+
+// what the socket `fd` is registered with the event loop as (NULL if it isn't).
+struct kore_event *fake_event_registered(int fd);
+
+// report an edge for the socket `fd` (KORE_EVENT_READ/WRITE flags, or an error) to whatever it is
+// registered as, like the event loop does. returns false if it isn't registered.
+bool fake_event_dispatch(int fd, int flags, int error);
+
+// set up a request from a client (on `c`), which the test frees with `fake_request_free`.
+void fake_request_init(struct http_request *req, struct connection *c, u_int8_t method, const char *path);
+
+// add a request header or query string argument (the strings must outlive the request).
+void fake_request_header(struct http_request *req, const char *name, const char *value);
+void fake_request_arg(struct http_request *req, const char *name, const char *value);
+
+// free the request like Kore does once it's done or the client went away.
+void fake_request_free(struct http_request *req);
+
+// the value of a response header that was set (NULL if it wasn't).
+const char *fake_response_header(struct http_request *req, const char *name);
+
+// libcouchbase
+
+typedef struct fake_lcb_OP {
+    int cbtype;             // LCB_CALLBACK_GET or LCB_CALLBACK_SDLOOKUP
+    void *cookie;
+    bool in_window;         // scheduled between `lcb_sched_enter` and `lcb_sched_leave`
+    bool responded;
+} fake_lcb_OP;
+
+#define FAKE_LCB_MAX_OPS 256
+#define FAKE_LCB_MAX_RESULTS 8
+
+struct lcb_RESPGET_ {
+    lcb_STATUS status;
+    void *cookie;
+};
+
+struct lcb_RESPSTORE_ {
+    lcb_STATUS status;
+    void *cookie;
+};
+
+// a subdoc lookup response with a result per spec
+struct lcb_RESPSUBDOC_ {
+    lcb_STATUS status;
+    void *cookie;
+    size_t nresults;
+    lcb_STATUS result_status[FAKE_LCB_MAX_RESULTS];
+    const char *result_value[FAKE_LCB_MAX_RESULTS];
+};
+
+// operations scheduled on the instance since the last reset
+extern fake_lcb_OP fake_lcb_ops[FAKE_LCB_MAX_OPS];
+extern size_t fake_lcb_nops;
+
+// scheduling windows opened and closed since the last reset
+extern unsigned int fake_lcb_sched_enters;
+extern unsigned int fake_lcb_sched_leaves;
+
+// the status the next scheduled operation fails with (LCB_SUCCESS to schedule it)
+extern lcb_STATUS fake_lcb_schedule_status;
+
+// forget the scheduled operations.
+void fake_lcb_reset(void);
+
+// deliver the response to a scheduled operation through the callback installed for its type.
+// `resp` may give the results of a subdoc lookup (its status and cookie are filled in).
+void fake_lcb_respond(size_t op, lcb_STATUS status, struct lcb_RESPSUBDOC_ *resp);
+
+// the tracer and meter set in the instance options (NULL if none were)
+extern lcbtrace_TRACER *fake_lcb_tracer;
+extern const lcbmetrics_METER *fake_lcb_meter;
+
+// the span lcb hands the tracer as the parent of the operations scheduled under `span`.
+void *fake_lcbtrace_external(lcbtrace_SPAN *span);
+
+// report an operation latency to the meter, as lcb does for operation metrics.
+void fake_lcb_record_value(const char *service, const char *operation, uint64_t value);
+
+// sockets closed through the BSD procs wired with `lcb_iops_wire_bsd_impl2`
+extern unsigned int fake_lcb_closes;
+
+#endif /* !tcblcb_FAKES_HEADER_SEEN */
@@ -0,0 +1,111 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+// the parts of the Kore 4.1.0 HTTP API the service uses. the request carries a few extra fields
+// for the tests to set up what the client sent and check what the service answered (see
+// `tests/fakes/fakes.h`).
+
+#ifndef tcblcb_FAKE_KORE_HTTP_HEADER_SEEN
+#define tcblcb_FAKE_KORE_HTTP_HEADER_SEEN
+
+#include <stdbool.h>
+
+#include "kore.h"
+
+#define HTTP_METHOD_GET         0x0001
+#define HTTP_METHOD_POST        0x0002
+#define HTTP_METHOD_PUT         0x0004
+#define HTTP_METHOD_DELETE      0x0010
+#define HTTP_METHOD_HEAD        0x0020
+#define HTTP_METHOD_OPTIONS     0x0040
+
+#define HTTP_STATE_ERROR        0
+#define HTTP_STATE_CONTINUE     1
+#define HTTP_STATE_COMPLETE     2
+#define HTTP_STATE_RETRY        3
+
+#define HTTP_REQUEST_NO_CONTENT_LENGTH  0x0080
+
+#define FAKE_HTTP_MAX_FIELDS    8
+
+// what was written to the client's connection (e.g., streamed response chunks)
+struct connection {
+    struct kore_buf sent;
+};
+
+struct http_request {
+    u_int8_t method;
+    u_int8_t fsm_state;
+    u_int16_t flags;
+    int status;
+    char *path;
+    char *query_string;
+    struct connection *owner;
+
+    // state from `http_state_create` and its cleanup (run when the request is freed)
+    void *hdlr_extra;
+    void (*state_cleanup)(struct http_request *req);
+
+    // fakes only: the request headers, query string arguments and body
+    const char *headers[FAKE_HTTP_MAX_FIELDS][2];
+    const char *args[FAKE_HTTP_MAX_FIELDS][2];
+    const char *body;
+    size_t body_len;
+    size_t body_read;
+
+    // fakes only: the response, with its headers as "name: value\n" lines
+    int responses;
+    struct kore_buf response_headers;
+    struct kore_buf response;
+    bool sleeping;
+    int wakeups;
+};
+
+struct http_state {
+    const char *name;
+    int (*cb)(struct http_request *req);
+};
+
+#define http_state_amount(s) (sizeof(s) / sizeof(s[0]))
+
+int http_state_run(struct http_state *states, u_int8_t nstates, struct http_request *req);
+void *http_state_create(struct http_request *req, size_t len, void (*onfree)(struct http_request *req));
+void *http_state_get(struct http_request *req);
+int http_state_exists(struct http_request *req);
+void http_state_cleanup(struct http_request *req);
+
+void http_request_sleep(struct http_request *req);
+void http_request_wakeup(struct http_request *req);
+const char *http_method_text(int method);
+
+int http_request_header(struct http_request *req, const char *header, const char **out);
+int http_argument_get_string(struct http_request *req, const char *name, char **out);
+int http_argument_urldecode(char *arg);
+ssize_t http_body_read(struct http_request *req, void *out, size_t len);
+
+void http_response(struct http_request *req, int status, const void *data, size_t len);
+void http_response_header(struct http_request *req, const char *header, const char *value);
+
+void net_send_queue(struct connection *c, const void *data, size_t len);
+int net_send_flush(struct connection *c);
+
+#endif /* !tcblcb_FAKE_KORE_HTTP_HEADER_SEEN */
@@ -0,0 +1,102 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+// the parts of the Kore 4.1.0 API the service uses, declared the same way so the sources build
+// unchanged against the fakes in `tests/fakes/kore.c`.
+
+#ifndef tcblcb_FAKE_KORE_HEADER_SEEN
+#define tcblcb_FAKE_KORE_HEADER_SEEN
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#if !defined(__unused)
+#define __unused __attribute__((__unused__))
+#endif
+
+#define KORE_RESULT_ERROR   0
+#define KORE_RESULT_OK      1
+#define KORE_RESULT_RETRY   2
+
+#define KORE_TIMER_ONESHOT  0x01
+
+#define KORE_EVENT_READ     0x01
+#define KORE_EVENT_WRITE    0x02
+#define KORE_EVENT_ERROR    0x04
+
+// the head of anything registered with the event loop, which the edges for its socket go to
+struct kore_event {
+    int type;
+    int flags;
+    void (*handle)(void *arg, int error);
+};
+
+struct kore_buf {
+    u_int8_t *data;
+    int flags;
+    size_t length;
+    size_t offset;
+};
+
+struct kore_timer;
+
+struct kore_worker {
+    u_int16_t id;
+    pid_t pid;
+};
+
+// the worker the code runs in (the fake has id 1)
+extern struct kore_worker *worker;
+
+struct kore_buf *kore_buf_alloc(size_t initial);
+void kore_buf_free(struct kore_buf *buf);
+void kore_buf_init(struct kore_buf *buf, size_t initial);
+void kore_buf_cleanup(struct kore_buf *buf);
+void kore_buf_append(struct kore_buf *buf, const void *data, size_t len);
+void kore_buf_appendf(struct kore_buf *buf, const char *fmt, ...);
+char *kore_buf_stringify(struct kore_buf *buf, size_t *len);
+void kore_buf_reset(struct kore_buf *buf);
+
+void kore_log(int prio, const char *fmt, ...);
+
+struct kore_timer *kore_timer_add(void (*cb)(void *arg, u_int64_t now), u_int64_t interval, void *arg, int flags);
+void kore_timer_remove(struct kore_timer *timer);
+
+u_int64_t kore_time_ms(void);
+
+void kore_platform_event_all(int fd, void *c);
+void kore_platform_disable_read(int fd);
+
+// the start up and teardown hooks the application provides
+void kore_parent_configure(int argc, char *argv[]);
+void kore_parent_teardown(void);
+void kore_worker_configure(void);
+void kore_worker_teardown(void);
+
+#endif /* !tcblcb_FAKE_KORE_HEADER_SEEN */
@@ -0,0 +1,33 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+// the tests don't run under seccomp, so the service's filter is only checked for syntax.
+
+#ifndef tcblcb_FAKE_KORE_SECCOMP_HEADER_SEEN
+#define tcblcb_FAKE_KORE_SECCOMP_HEADER_SEEN
+
+#define KORE_SYSCALL_ALLOW(name) 0
+
+#define KORE_SECCOMP_FILTER(name, ...) \
+    static const int _tcblcb_fake_seccomp_filter[] __attribute__((unused)) = { __VA_ARGS__ };
+
+#endif /* !tcblcb_FAKE_KORE_SECCOMP_HEADER_SEEN */
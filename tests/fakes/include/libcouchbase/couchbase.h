@@ -0,0 +1,122 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+// the parts of the libcouchbase 3.x API used by the modules under test (the request context,
+// batches, util and tracing), implemented by `tests/fakes/lcb.c`. handles are opaque like in
+// lcb; the tests build responses through `tests/fakes/fakes.h`.
+
+#ifndef tcblcb_FAKE_LCB_HEADER_SEEN
+#define tcblcb_FAKE_LCB_HEADER_SEEN
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    LCB_SUCCESS = 0,
+    LCB_ERR_GENERIC,
+    LCB_ERR_TIMEOUT,
+    LCB_ERR_NO_MEMORY,
+    LCB_ERR_INVALID_ARGUMENT,
+    LCB_ERR_DOCUMENT_NOT_FOUND,
+    LCB_ERR_SUBDOC_PATH_NOT_FOUND,
+    LCB_ERR_REQUEST_CANCELED,
+} lcb_STATUS;
+
+typedef enum {
+    LCB_TYPE_BUCKET,
+    LCB_TYPE_CLUSTER,
+} lcb_INSTANCE_TYPE;
+
+typedef enum {
+    LCB_WAIT_DEFAULT,
+    LCB_WAIT_NOCHECK,
+} lcb_WAITFLAGS;
+
+enum {
+    LCB_CALLBACK_DEFAULT,
+    LCB_CALLBACK_GET,
+    LCB_CALLBACK_STORE,
+    LCB_CALLBACK_SDLOOKUP,
+    LCB_CALLBACK_SDMUTATE,
+    LCB_CALLBACK__MAX,
+};
+
+typedef struct lcb_st lcb_INSTANCE;
+typedef struct lcb_CREATEOPTS_ lcb_CREATEOPTS;
+typedef struct lcb_io_opt_st *lcb_io_opt_t;
+
+typedef struct lcb_RESPBASE_ lcb_RESPBASE;
+typedef struct lcb_RESPGET_ lcb_RESPGET;
+typedef struct lcb_RESPSTORE_ lcb_RESPSTORE;
+typedef struct lcb_RESPSUBDOC_ lcb_RESPSUBDOC;
+typedef struct lcb_CMDGET_ lcb_CMDGET;
+typedef struct lcb_CMDSUBDOC_ lcb_CMDSUBDOC;
+typedef struct lcb_CMDQUERY_ lcb_CMDQUERY;
+
+typedef void (*lcb_RESPCALLBACK)(lcb_INSTANCE *instance, int cbtype, const lcb_RESPBASE *resp);
+typedef void (*lcb_open_callback)(lcb_INSTANCE *instance, lcb_STATUS rc);
+
+const char *lcb_strerror_short(lcb_STATUS rc);
+const char *lcb_strerror_long(lcb_STATUS rc);
+
+lcb_STATUS lcb_createopts_create(lcb_CREATEOPTS **options, lcb_INSTANCE_TYPE type);
+lcb_STATUS lcb_createopts_destroy(lcb_CREATEOPTS *options);
+lcb_STATUS lcb_createopts_connstr(lcb_CREATEOPTS *options, const char *connstr, size_t connstr_len);
+lcb_STATUS lcb_createopts_credentials(lcb_CREATEOPTS *options, const char *username, size_t username_len, const char *password, size_t password_len);
+lcb_STATUS lcb_createopts_io(lcb_CREATEOPTS *options, struct lcb_io_opt_st *io);
+
+lcb_STATUS lcb_create(lcb_INSTANCE **instance, const lcb_CREATEOPTS *options);
+lcb_STATUS lcb_connect(lcb_INSTANCE *instance);
+lcb_STATUS lcb_wait(lcb_INSTANCE *instance, lcb_WAITFLAGS flags);
+lcb_STATUS lcb_get_bootstrap_status(lcb_INSTANCE *instance);
+lcb_STATUS lcb_open(lcb_INSTANCE *instance, const char *bucket, size_t bucket_len);
+void lcb_destroy(lcb_INSTANCE *instance);
+
+lcb_open_callback lcb_set_open_callback(lcb_INSTANCE *instance, lcb_open_callback callback);
+lcb_RESPCALLBACK lcb_install_callback(lcb_INSTANCE *instance, int cbtype, lcb_RESPCALLBACK callback);
+
+void lcb_sched_enter(lcb_INSTANCE *instance);
+void lcb_sched_leave(lcb_INSTANCE *instance);
+
+lcb_STATUS lcb_get(lcb_INSTANCE *instance, void *cookie, const lcb_CMDGET *cmd);
+lcb_STATUS lcb_respget_status(const lcb_RESPGET *resp);
+lcb_STATUS lcb_respget_cookie(const lcb_RESPGET *resp, void **cookie);
+
+lcb_STATUS lcb_respstore_status(const lcb_RESPSTORE *resp);
+lcb_STATUS lcb_respstore_cookie(const lcb_RESPSTORE *resp, void **cookie);
+
+lcb_STATUS lcb_subdoc(lcb_INSTANCE *instance, void *cookie, const lcb_CMDSUBDOC *cmd);
+lcb_STATUS lcb_respsubdoc_status(const lcb_RESPSUBDOC *resp);
+lcb_STATUS lcb_respsubdoc_cookie(const lcb_RESPSUBDOC *resp, void **cookie);
+lcb_STATUS lcb_respsubdoc_result_status(const lcb_RESPSUBDOC *resp, size_t index);
+lcb_STATUS lcb_respsubdoc_result_value(const lcb_RESPSUBDOC *resp, size_t index, const char **value, size_t *value_len);
+
+lcb_STATUS lcb_cmdquery_encoded_payload(lcb_CMDQUERY *cmd, const char **payload, size_t *payload_len);
+
+#include "tracing.h"
+#include "metrics.h"
+
+lcb_STATUS lcb_createopts_tracer(lcb_CREATEOPTS *options, struct lcbtrace_TRACER *tracer);
+lcb_STATUS lcb_createopts_meter(lcb_CREATEOPTS *options, const lcbmetrics_METER *meter);
+lcb_STATUS lcb_cntl_string(lcb_INSTANCE *instance, const char *key, const char *value);
+
+#endif /* !tcblcb_FAKE_LCB_HEADER_SEEN */
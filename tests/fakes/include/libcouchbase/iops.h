@@ -0,0 +1,101 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+// the parts of the IO plugin interface that src/lcb-iops.c implements: the "event" model, with
+// libcouchbase's own BSD socket calls (of which only close is faked).
+
+#ifndef tcblcb_FAKE_LCB_IOPS_HEADER_SEEN
+#define tcblcb_FAKE_LCB_IOPS_HEADER_SEEN
+
+#include <stdint.h>
+
+#include "couchbase.h"
+
+typedef uint32_t lcb_U32;
+typedef int lcb_socket_t;
+
+#define LCB_READ_EVENT  0x02
+#define LCB_WRITE_EVENT 0x04
+#define LCB_ERROR_EVENT 0x08
+#define LCB_RW_EVENT    (LCB_READ_EVENT | LCB_WRITE_EVENT)
+
+typedef enum {
+    LCB_IOMODEL_EVENT,
+    LCB_IOMODEL_COMPLETION
+} lcb_iomodel_t;
+
+typedef void (*lcb_ioE_callback)(lcb_socket_t sock, short events, void *uarg);
+
+typedef struct {
+    void (*start)(lcb_io_opt_t iops);
+    void (*stop)(lcb_io_opt_t iops);
+    void (*tick)(lcb_io_opt_t iops);
+} lcb_loop_procs;
+
+typedef struct {
+    void *(*create)(lcb_io_opt_t iops);
+    void (*destroy)(lcb_io_opt_t iops, void *timer);
+    void (*cancel)(lcb_io_opt_t iops, void *timer);
+    int (*schedule)(lcb_io_opt_t iops, void *timer, lcb_U32 usecs, void *uarg, lcb_ioE_callback callback);
+} lcb_timer_procs;
+
+typedef struct {
+    void *(*create)(lcb_io_opt_t iops);
+    void (*destroy)(lcb_io_opt_t iops, void *event);
+    void (*cancel)(lcb_io_opt_t iops, lcb_socket_t sock, void *event);
+    int (*watch)(lcb_io_opt_t iops, lcb_socket_t sock, void *event, short evflags, void *uarg, lcb_ioE_callback callback);
+} lcb_ev_procs;
+
+typedef struct {
+    void (*close)(lcb_io_opt_t iops, lcb_socket_t sock);
+} lcb_bsd_procs;
+
+typedef struct {
+    void *unused;
+} lcb_completion_procs;
+
+typedef void (*lcb_io_procs_fn)(
+    int version,
+    lcb_loop_procs *loop_procs,
+    lcb_timer_procs *timer_procs,
+    lcb_bsd_procs *bsd_procs,
+    lcb_ev_procs *ev_procs,
+    lcb_completion_procs *completion_procs,
+    lcb_iomodel_t *iomodel);
+
+struct lcb_io_opt_st {
+    int version;
+    union {
+        struct {
+            void *cookie;
+            int error;
+            int need_cleanup;
+            lcb_io_procs_fn get_procs;
+        } v3;
+    } v;
+};
+
+// wire the plain BSD socket calls (`close` closes the descriptor, counted in
+// `fake_lcb_closes`).
+void lcb_iops_wire_bsd_impl2(lcb_bsd_procs *procs, int version);
+
+#endif /* !tcblcb_FAKE_LCB_IOPS_HEADER_SEEN */
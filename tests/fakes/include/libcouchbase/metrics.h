@@ -0,0 +1,51 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+// the meter API of libcouchbase 3.x.
+
+#ifndef tcblcb_FAKE_LCB_METRICS_HEADER_SEEN
+#define tcblcb_FAKE_LCB_METRICS_HEADER_SEEN
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct lcbmetrics_METER_ lcbmetrics_METER;
+typedef struct lcbmetrics_VALUERECORDER_ lcbmetrics_VALUERECORDER;
+
+typedef struct lcbmetrics_TAG_ {
+    const char *key;
+    const char *value;
+} lcbmetrics_TAG;
+
+typedef const lcbmetrics_VALUERECORDER *(*lcbmetrics_VALUE_RECORDER_CALLBACK)(const lcbmetrics_METER *meter, const char *name, const lcbmetrics_TAG *tags, size_t ntags);
+typedef void (*lcbmetrics_RECORD_VALUE_CALLBACK)(const lcbmetrics_VALUERECORDER *recorder, uint64_t value);
+
+lcb_STATUS lcbmetrics_meter_create(lcbmetrics_METER **meter, void *cookie);
+lcb_STATUS lcbmetrics_meter_value_recorder_callback(lcbmetrics_METER *meter, lcbmetrics_VALUE_RECORDER_CALLBACK callback);
+lcb_STATUS lcbmetrics_meter_destroy(lcbmetrics_METER *meter);
+
+lcb_STATUS lcbmetrics_valuerecorder_create(lcbmetrics_VALUERECORDER **recorder, void *cookie);
+lcb_STATUS lcbmetrics_valuerecorder_record_value_callback(lcbmetrics_VALUERECORDER *recorder, lcbmetrics_RECORD_VALUE_CALLBACK callback);
+lcb_STATUS lcbmetrics_valuerecorder_cookie(const lcbmetrics_VALUERECORDER *recorder, void **cookie);
+lcb_STATUS lcbmetrics_valuerecorder_destroy(lcbmetrics_VALUERECORDER *recorder);
+
+#endif /* !tcblcb_FAKE_LCB_METRICS_HEADER_SEEN */
@@ -0,0 +1,59 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+// the external tracer API (version 1) of libcouchbase 3.x.
+
+#ifndef tcblcb_FAKE_LCB_TRACING_HEADER_SEEN
+#define tcblcb_FAKE_LCB_TRACING_HEADER_SEEN
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LCBTRACE_F_THRESHOLD    0x01
+#define LCBTRACE_F_EXTERNAL     0x02
+
+#define LCBTRACE_NOW            0
+
+typedef struct lcbtrace_SPAN_ lcbtrace_SPAN;
+
+typedef struct lcbtrace_TRACER {
+    uint16_t version;
+    uint64_t flags;
+    void *cookie;
+    void (*destructor)(struct lcbtrace_TRACER *tracer);
+    union {
+        struct {
+            void *(*start_span)(struct lcbtrace_TRACER *tracer, const char *name, void *parent);
+            void (*end_span)(void *span);
+            void (*destroy_span)(void *span);
+            void (*add_tag_string)(void *span, const char *name, const char *value, size_t value_len);
+            void (*add_tag_uint64)(void *span, const char *name, uint64_t value);
+        } v1;
+    } v;
+} lcbtrace_TRACER;
+
+lcbtrace_TRACER *lcbtrace_new(struct lcb_st *instance, uint64_t flags);
+void lcbtrace_destroy(lcbtrace_TRACER *tracer);
+lcb_STATUS lcbtrace_span_wrap(lcbtrace_TRACER *tracer, const char *opname, uint64_t start, void *external_span, lcbtrace_SPAN **lcbspan);
+void lcbtrace_span_finish(lcbtrace_SPAN *span, uint64_t now);
+
+#endif /* !tcblcb_FAKE_LCB_TRACING_HEADER_SEEN */
@@ -0,0 +1,521 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+// Kore for the tests: buffers behave like Kore's, the clock and timers are driven by the test,
+// and requests answer from what the test set up (see fakes.h).
+
+#include <ctype.h>
+#include <strings.h>
+
+#include "fakes.h"
+
+#define FAKE_LOG_LINES  64
+#define FAKE_LOG_LINE   512
+#define FAKE_TIMERS     64
+#define FAKE_EVENT_FDS  1024
+
+static struct kore_worker fake_worker = { .id = 1, .pid = 0 };
+struct kore_worker *worker = &fake_worker;
+
+u_int64_t fake_time_ms = 1000000;
+
+static char fake_log[FAKE_LOG_LINES][FAKE_LOG_LINE];
+static size_t fake_log_lines = 0;
+
+struct kore_timer {
+    void (*cb)(void *arg, u_int64_t now);
+    void *arg;
+    u_int64_t interval;
+    u_int64_t next;
+    int flags;
+    bool active;
+};
+
+static struct kore_timer fake_timers[FAKE_TIMERS];
+
+// what each socket registered with the event loop dispatches to
+static struct kore_event *fake_events[FAKE_EVENT_FDS];
+
+static void fake_abort(const char *msg)
+{
+    fprintf(stderr, "fakes: %s\n", msg);
+    abort();
+}
+
+struct kore_buf *kore_buf_alloc(size_t initial)
+{
+    struct kore_buf *buf = malloc(sizeof(*buf));
+    if (buf == NULL) {
+        fake_abort("out of memory");
+    }
+    kore_buf_init(buf, initial);
+    return buf;
+}
+
+void kore_buf_init(struct kore_buf *buf, size_t initial)
+{
+    buf->data = NULL;
+    buf->flags = 0;
+    buf->length = 0;
+    buf->offset = 0;
+
+    if (initial > 0) {
+        buf->data = malloc(initial);
+        if (buf->data == NULL) {
+            fake_abort("out of memory");
+        }
+        buf->length = initial;
+    }
+}
+
+void kore_buf_cleanup(struct kore_buf *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->length = 0;
+    buf->offset = 0;
+}
+
+void kore_buf_free(struct kore_buf *buf)
+{
+    kore_buf_cleanup(buf);
+    free(buf);
+}
+
+static void kore_buf_reserve(struct kore_buf *buf, size_t len)
+{
+    if (buf->offset + len <= buf->length) {
+        return;
+    }
+
+    size_t length = buf->length + len + 128;
+    u_int8_t *data = realloc(buf->data, length);
+    if (data == NULL) {
+        fake_abort("out of memory");
+    }
+    buf->data = data;
+    buf->length = length;
+}
+
+void kore_buf_append(struct kore_buf *buf, const void *data, size_t len)
+{
+    kore_buf_reserve(buf, len);
+    if (len > 0) {
+        memcpy(buf->data + buf->offset, data, len);
+        buf->offset += len;
+    }
+}
+
+void kore_buf_appendf(struct kore_buf *buf, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    // room for the terminator vsnprintf writes
+    kore_buf_reserve(buf, (size_t)len + 1);
+
+    va_start(args, fmt);
+    vsnprintf((char *)buf->data + buf->offset, (size_t)len + 1, fmt, args);
+    va_end(args);
+    buf->offset += (size_t)len;
+}
+
+// like Kore, the terminator isn't counted in the buffer offset
+char *kore_buf_stringify(struct kore_buf *buf, size_t *len)
+{
+    kore_buf_reserve(buf, 1);
+    buf->data[buf->offset] = '\0';
+    if (len != NULL) {
+        *len = buf->offset;
+    }
+    return (char *)buf->data;
+}
+
+void kore_buf_reset(struct kore_buf *buf)
+{
+    buf->offset = 0;
+}
+
+void kore_log(int prio, const char *fmt, ...)
+{
+    char line[FAKE_LOG_LINE];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    if (getenv("TCBLCB_TEST_VERBOSE") != NULL) {
+        fprintf(stderr, "log(%d): %s\n", prio, line);
+    }
+
+    memcpy(fake_log[fake_log_lines++ % FAKE_LOG_LINES], line, sizeof(line));
+}
+
+void fake_log_reset(void)
+{
+    fake_log_lines = 0;
+}
+
+bool fake_log_contains(const char *text)
+{
+    size_t first = fake_log_lines > FAKE_LOG_LINES ? fake_log_lines - FAKE_LOG_LINES : 0;
+    for (size_t i = first; i < fake_log_lines; i++) {
+        if (strstr(fake_log[i % FAKE_LOG_LINES], text) != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+u_int64_t kore_time_ms(void)
+{
+    return fake_time_ms;
+}
+
+struct kore_timer *kore_timer_add(void (*cb)(void *arg, u_int64_t now), u_int64_t interval, void *arg, int flags)
+{
+    for (size_t i = 0; i < FAKE_TIMERS; i++) {
+        struct kore_timer *timer = &fake_timers[i];
+        if (!timer->active) {
+            timer->cb = cb;
+            timer->arg = arg;
+            timer->interval = interval;
+            timer->next = fake_time_ms + interval;
+            timer->flags = flags;
+            timer->active = true;
+            return timer;
+        }
+    }
+
+    fake_abort("too many timers");
+    return NULL;
+}
+
+void kore_timer_remove(struct kore_timer *timer)
+{
+    timer->active = false;
+}
+
+size_t fake_timers_run(void)
+{
+    size_t ran = 0;
+
+    // timers added by a callback wait for the next run
+    bool due[FAKE_TIMERS];
+    for (size_t i = 0; i < FAKE_TIMERS; i++) {
+        due[i] = fake_timers[i].active && fake_timers[i].next <= fake_time_ms;
+    }
+
+    for (size_t i = 0; i < FAKE_TIMERS; i++) {
+        struct kore_timer *timer = &fake_timers[i];
+        if (!due[i] || !timer->active) {
+            continue;
+        }
+
+        if (timer->flags & KORE_TIMER_ONESHOT) {
+            timer->active = false;
+        } else {
+            timer->next = fake_time_ms + timer->interval;
+        }
+        timer->cb(timer->arg, fake_time_ms);
+        ran++;
+    }
+
+    return ran;
+}
+
+static void fake_event_check_fd(int fd)
+{
+    if (fd < 0 || fd >= FAKE_EVENT_FDS) {
+        fake_abort("socket out of range");
+    }
+}
+
+void kore_platform_event_all(int fd, void *c)
+{
+    fake_event_check_fd(fd);
+    fake_events[fd] = c;
+}
+
+void kore_platform_disable_read(int fd)
+{
+    fake_event_check_fd(fd);
+    fake_events[fd] = NULL;
+}
+
+struct kore_event *fake_event_registered(int fd)
+{
+    fake_event_check_fd(fd);
+    return fake_events[fd];
+}
+
+bool fake_event_dispatch(int fd, int flags, int error)
+{
+    struct kore_event *evt = fake_event_registered(fd);
+    if (evt == NULL) {
+        return false;
+    }
+
+    evt->flags |= flags;
+    evt->handle(evt, error);
+    return true;
+}
+
+void fake_request_init(struct http_request *req, struct connection *c, u_int8_t method, const char *path)
+{
+    memset(req, 0, sizeof(*req));
+    req->method = method;
+    req->path = (char *)path;
+    req->owner = c;
+    kore_buf_init(&req->response_headers, 256);
+    kore_buf_init(&req->response, 256);
+
+    if (c != NULL) {
+        kore_buf_init(&c->sent, 256);
+    }
+}
+
+static void fake_fields_add(const char *fields[FAKE_HTTP_MAX_FIELDS][2], const char *name, const char *value)
+{
+    for (size_t i = 0; i < FAKE_HTTP_MAX_FIELDS; i++) {
+        if (fields[i][0] == NULL) {
+            fields[i][0] = name;
+            fields[i][1] = value;
+            return;
+        }
+    }
+    fake_abort("too many request fields");
+}
+
+void fake_request_header(struct http_request *req, const char *name, const char *value)
+{
+    fake_fields_add(req->headers, name, value);
+}
+
+void fake_request_arg(struct http_request *req, const char *name, const char *value)
+{
+    fake_fields_add(req->args, name, value);
+}
+
+void fake_request_free(struct http_request *req)
+{
+    if (req->state_cleanup != NULL) {
+        req->state_cleanup(req);
+    }
+    free(req->hdlr_extra);
+    req->hdlr_extra = NULL;
+
+    kore_buf_cleanup(&req->response_headers);
+    kore_buf_cleanup(&req->response);
+    if (req->owner != NULL) {
+        kore_buf_cleanup(&req->owner->sent);
+    }
+}
+
+const char *fake_response_header(struct http_request *req, const char *name)
+{
+    static char value[1024];
+    const char *found = NULL;
+    size_t found_len = 0;
+
+    // the last one set wins
+    const char *lines = kore_buf_stringify(&req->response_headers, NULL);
+    size_t name_len = strlen(name);
+    for (const char *line = lines; *line != '\0'; ) {
+        const char *end = strchr(line, '\n');
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            found = line + name_len + 2;
+            found_len = (size_t)(end - found);
+        }
+        line = end + 1;
+    }
+
+    if (found == NULL) {
+        return NULL;
+    }
+    snprintf(value, sizeof(value), "%.*s", (int)found_len, found);
+    return value;
+}
+
+int http_state_run(struct http_state *states, u_int8_t nstates, struct http_request *req)
+{
+    for (;;) {
+        if (req->fsm_state >= nstates) {
+            fake_abort("http_state_run: no such state");
+        }
+
+        switch (states[req->fsm_state].cb(req)) {
+        case HTTP_STATE_CONTINUE:
+            break;
+        case HTTP_STATE_RETRY:
+            return (KORE_RESULT_RETRY);
+        case HTTP_STATE_ERROR:
+            return (KORE_RESULT_OK);
+        case HTTP_STATE_COMPLETE:
+            req->fsm_state = 0;
+            return (KORE_RESULT_OK);
+        default:
+            fake_abort("http_state_run: unknown state result");
+        }
+    }
+}
+
+void *http_state_create(struct http_request *req, size_t len, void (*onfree)(struct http_request *req))
+{
+    if (req->hdlr_extra != NULL) {
+        fake_abort("http_state_create: state already exists");
+    }
+
+    req->hdlr_extra = calloc(1, len);
+    if (req->hdlr_extra == NULL) {
+        fake_abort("out of memory");
+    }
+    req->state_cleanup = onfree;
+    return req->hdlr_extra;
+}
+
+void *http_state_get(struct http_request *req)
+{
+    return req->hdlr_extra;
+}
+
+int http_state_exists(struct http_request *req)
+{
+    return req->hdlr_extra != NULL;
+}
+
+void http_state_cleanup(struct http_request *req)
+{
+    free(req->hdlr_extra);
+    req->hdlr_extra = NULL;
+}
+
+void http_request_sleep(struct http_request *req)
+{
+    req->sleeping = true;
+}
+
+void http_request_wakeup(struct http_request *req)
+{
+    req->sleeping = false;
+    req->wakeups++;
+}
+
+const char *http_method_text(int method)
+{
+    switch (method) {
+    case HTTP_METHOD_GET:
+        return "GET";
+    case HTTP_METHOD_POST:
+        return "POST";
+    case HTTP_METHOD_PUT:
+        return "PUT";
+    case HTTP_METHOD_DELETE:
+        return "DELETE";
+    case HTTP_METHOD_HEAD:
+        return "HEAD";
+    case HTTP_METHOD_OPTIONS:
+        return "OPTIONS";
+    default:
+        return "";
+    }
+}
+
+static int fake_fields_get(const char *fields[FAKE_HTTP_MAX_FIELDS][2], const char *name, bool ignore_case, const char **out)
+{
+    for (size_t i = 0; i < FAKE_HTTP_MAX_FIELDS && fields[i][0] != NULL; i++) {
+        if ((ignore_case ? strcasecmp(fields[i][0], name) : strcmp(fields[i][0], name)) == 0) {
+            *out = fields[i][1];
+            return (KORE_RESULT_OK);
+        }
+    }
+    return (KORE_RESULT_ERROR);
+}
+
+int http_request_header(struct http_request *req, const char *header, const char **out)
+{
+    return fake_fields_get(req->headers, header, true, out);
+}
+
+int http_argument_get_string(struct http_request *req, const char *name, char **out)
+{
+    return fake_fields_get(req->args, name, false, (const char **)out);
+}
+
+int http_argument_urldecode(char *arg)
+{
+    char *in = arg;
+    char *out = arg;
+
+    while (*in != '\0') {
+        if (*in == '%' && isxdigit((unsigned char)in[1]) && isxdigit((unsigned char)in[2])) {
+            char hex[3] = { in[1], in[2], '\0' };
+            *out++ = (char)strtoul(hex, NULL, 16);
+            in += 3;
+        } else if (*in == '+') {
+            *out++ = ' ';
+            in++;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+
+    return (KORE_RESULT_OK);
+}
+
+ssize_t http_body_read(struct http_request *req, void *out, size_t len)
+{
+    size_t left = req->body_len - req->body_read;
+    if (len > left) {
+        len = left;
+    }
+    memcpy(out, req->body + req->body_read, len);
+    req->body_read += len;
+    return (ssize_t)len;
+}
+
+void http_response(struct http_request *req, int status, const void *data, size_t len)
+{
+    req->status = status;
+    req->responses++;
+    if (data != NULL) {
+        kore_buf_append(&req->response, data, len);
+    }
+}
+
+void http_response_header(struct http_request *req, const char *header, const char *value)
+{
+    kore_buf_appendf(&req->response_headers, "%s: %s\n", header, value);
+}
+
+void net_send_queue(struct connection *c, const void *data, size_t len)
+{
+    kore_buf_append(&c->sent, data, len);
+}
+
+int net_send_flush(__unused struct connection *c)
+{
+    return (KORE_RESULT_OK);
+}
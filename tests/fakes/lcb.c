@@ -0,0 +1,428 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+// libcouchbase for the tests: a single instance that records the operations scheduled on it,
+// which the test then answers (in any order) with `fake_lcb_respond`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libcouchbase/iops.h>
+
+#include "fakes.h"
+
+struct lcb_st {
+    lcb_RESPCALLBACK callbacks[LCB_CALLBACK__MAX];
+    int sched_depth;
+};
+
+struct lcb_CREATEOPTS_ {
+    lcb_INSTANCE_TYPE type;
+};
+
+struct lcbtrace_SPAN_ {
+    void *external;
+};
+
+struct lcbmetrics_METER_ {
+    void *cookie;
+    lcbmetrics_VALUE_RECORDER_CALLBACK callback;
+};
+
+struct lcbmetrics_VALUERECORDER_ {
+    void *cookie;
+    lcbmetrics_RECORD_VALUE_CALLBACK callback;
+};
+
+static struct lcb_st fake_instance;
+
+fake_lcb_OP fake_lcb_ops[FAKE_LCB_MAX_OPS];
+size_t fake_lcb_nops = 0;
+unsigned int fake_lcb_sched_enters = 0;
+unsigned int fake_lcb_sched_leaves = 0;
+lcb_STATUS fake_lcb_schedule_status = LCB_SUCCESS;
+
+lcbtrace_TRACER *fake_lcb_tracer = NULL;
+const lcbmetrics_METER *fake_lcb_meter = NULL;
+
+void fake_lcb_reset(void)
+{
+    memset(fake_lcb_ops, 0, sizeof(fake_lcb_ops));
+    fake_lcb_nops = 0;
+    fake_lcb_sched_enters = 0;
+    fake_lcb_sched_leaves = 0;
+    fake_lcb_schedule_status = LCB_SUCCESS;
+}
+
+static lcb_STATUS fake_lcb_schedule(lcb_INSTANCE *instance, int cbtype, void *cookie)
+{
+    if (fake_lcb_schedule_status != LCB_SUCCESS) {
+        lcb_STATUS rc = fake_lcb_schedule_status;
+        fake_lcb_schedule_status = LCB_SUCCESS;
+        return rc;
+    }
+    if (fake_lcb_nops == FAKE_LCB_MAX_OPS) {
+        return LCB_ERR_NO_MEMORY;
+    }
+
+    fake_lcb_OP *op = &fake_lcb_ops[fake_lcb_nops++];
+    op->cbtype = cbtype;
+    op->cookie = cookie;
+    op->in_window = instance->sched_depth > 0;
+    op->responded = false;
+    return LCB_SUCCESS;
+}
+
+void fake_lcb_respond(size_t index, lcb_STATUS status, struct lcb_RESPSUBDOC_ *resp)
+{
+    if (index >= fake_lcb_nops || fake_lcb_ops[index].responded) {
+        fprintf(stderr, "fakes: no operation %zu to respond to\n", index);
+        abort();
+    }
+
+    fake_lcb_OP *op = &fake_lcb_ops[index];
+    op->responded = true;
+    lcb_RESPCALLBACK callback = fake_instance.callbacks[op->cbtype];
+
+    if (op->cbtype == LCB_CALLBACK_GET) {
+        struct lcb_RESPGET_ get = { .status = status, .cookie = op->cookie };
+        callback(&fake_instance, op->cbtype, (const lcb_RESPBASE *)&get);
+    } else {
+        struct lcb_RESPSUBDOC_ subdoc = { 0 };
+        if (resp == NULL) {
+            resp = &subdoc;
+        }
+        resp->status = status;
+        resp->cookie = op->cookie;
+        callback(&fake_instance, op->cbtype, (const lcb_RESPBASE *)resp);
+    }
+}
+
+const char *lcb_strerror_short(lcb_STATUS rc)
+{
+    switch (rc) {
+    case LCB_SUCCESS:
+        return "LCB_SUCCESS (0)";
+    case LCB_ERR_TIMEOUT:
+        return "LCB_ERR_TIMEOUT (201)";
+    case LCB_ERR_NO_MEMORY:
+        return "LCB_ERR_NO_MEMORY (206)";
+    case LCB_ERR_DOCUMENT_NOT_FOUND:
+        return "LCB_ERR_DOCUMENT_NOT_FOUND (301)";
+    default:
+        return "LCB_ERR_GENERIC (100)";
+    }
+}
+
+const char *lcb_strerror_long(lcb_STATUS rc)
+{
+    return lcb_strerror_short(rc);
+}
+
+lcb_STATUS lcb_createopts_create(lcb_CREATEOPTS **options, lcb_INSTANCE_TYPE type)
+{
+    *options = calloc(1, sizeof(lcb_CREATEOPTS));
+    if (*options == NULL) {
+        return LCB_ERR_NO_MEMORY;
+    }
+    (*options)->type = type;
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcb_createopts_destroy(lcb_CREATEOPTS *options)
+{
+    free(options);
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcb_createopts_connstr(__unused lcb_CREATEOPTS *options, __unused const char *connstr, __unused size_t connstr_len)
+{
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcb_createopts_credentials(__unused lcb_CREATEOPTS *options,
+    __unused const char *username, __unused size_t username_len,
+    __unused const char *password, __unused size_t password_len)
+{
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcb_createopts_io(__unused lcb_CREATEOPTS *options, __unused struct lcb_io_opt_st *io)
+{
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcb_createopts_tracer(__unused lcb_CREATEOPTS *options, struct lcbtrace_TRACER *tracer)
+{
+    fake_lcb_tracer = tracer;
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcb_createopts_meter(__unused lcb_CREATEOPTS *options, const lcbmetrics_METER *meter)
+{
+    fake_lcb_meter = meter;
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcb_create(lcb_INSTANCE **instance, __unused const lcb_CREATEOPTS *options)
+{
+    memset(&fake_instance, 0, sizeof(fake_instance));
+    *instance = &fake_instance;
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcb_connect(__unused lcb_INSTANCE *instance)
+{
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcb_wait(__unused lcb_INSTANCE *instance, __unused lcb_WAITFLAGS flags)
+{
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcb_get_bootstrap_status(__unused lcb_INSTANCE *instance)
+{
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcb_open(__unused lcb_INSTANCE *instance, __unused const char *bucket, __unused size_t bucket_len)
+{
+    return LCB_SUCCESS;
+}
+
+void lcb_destroy(lcb_INSTANCE *instance)
+{
+    memset(instance, 0, sizeof(*instance));
+}
+
+lcb_STATUS lcb_cntl_string(__unused lcb_INSTANCE *instance, __unused const char *key, __unused const char *value)
+{
+    return LCB_SUCCESS;
+}
+
+lcb_open_callback lcb_set_open_callback(__unused lcb_INSTANCE *instance, __unused lcb_open_callback callback)
+{
+    return NULL;
+}
+
+lcb_RESPCALLBACK lcb_install_callback(lcb_INSTANCE *instance, int cbtype, lcb_RESPCALLBACK callback)
+{
+    lcb_RESPCALLBACK previous = instance->callbacks[cbtype];
+    instance->callbacks[cbtype] = callback;
+    return previous;
+}
+
+void lcb_sched_enter(lcb_INSTANCE *instance)
+{
+    instance->sched_depth++;
+    fake_lcb_sched_enters++;
+}
+
+void lcb_sched_leave(lcb_INSTANCE *instance)
+{
+    instance->sched_depth--;
+    fake_lcb_sched_leaves++;
+}
+
+lcb_STATUS lcb_get(lcb_INSTANCE *instance, void *cookie, __unused const lcb_CMDGET *cmd)
+{
+    return fake_lcb_schedule(instance, LCB_CALLBACK_GET, cookie);
+}
+
+lcb_STATUS lcb_respget_status(const lcb_RESPGET *resp)
+{
+    return resp->status;
+}
+
+lcb_STATUS lcb_respget_cookie(const lcb_RESPGET *resp, void **cookie)
+{
+    *cookie = resp->cookie;
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcb_respstore_status(const lcb_RESPSTORE *resp)
+{
+    return resp->status;
+}
+
+lcb_STATUS lcb_respstore_cookie(const lcb_RESPSTORE *resp, void **cookie)
+{
+    *cookie = resp->cookie;
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcb_subdoc(lcb_INSTANCE *instance, void *cookie, __unused const lcb_CMDSUBDOC *cmd)
+{
+    return fake_lcb_schedule(instance, LCB_CALLBACK_SDLOOKUP, cookie);
+}
+
+lcb_STATUS lcb_respsubdoc_status(const lcb_RESPSUBDOC *resp)
+{
+    return resp->status;
+}
+
+lcb_STATUS lcb_respsubdoc_cookie(const lcb_RESPSUBDOC *resp, void **cookie)
+{
+    *cookie = resp->cookie;
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcb_respsubdoc_result_status(const lcb_RESPSUBDOC *resp, size_t index)
+{
+    return index < resp->nresults ? resp->result_status[index] : LCB_ERR_INVALID_ARGUMENT;
+}
+
+lcb_STATUS lcb_respsubdoc_result_value(const lcb_RESPSUBDOC *resp, size_t index, const char **value, size_t *value_len)
+{
+    if (index >= resp->nresults) {
+        return LCB_ERR_INVALID_ARGUMENT;
+    }
+
+    *value = resp->result_value[index];
+    *value_len = *value != NULL ? strlen(*value) : 0;
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcb_cmdquery_encoded_payload(__unused lcb_CMDQUERY *cmd, const char **payload, size_t *payload_len)
+{
+    *payload = "{}";
+    *payload_len = 2;
+    return LCB_SUCCESS;
+}
+
+lcbtrace_TRACER *lcbtrace_new(__unused struct lcb_st *instance, uint64_t flags)
+{
+    lcbtrace_TRACER *tracer = calloc(1, sizeof(lcbtrace_TRACER));
+    if (tracer != NULL) {
+        tracer->flags = flags;
+    }
+    return tracer;
+}
+
+void lcbtrace_destroy(lcbtrace_TRACER *tracer)
+{
+    if (fake_lcb_tracer == tracer) {
+        fake_lcb_tracer = NULL;
+    }
+    free(tracer);
+}
+
+lcb_STATUS lcbtrace_span_wrap(__unused lcbtrace_TRACER *tracer, __unused const char *opname, __unused uint64_t start, void *external_span, lcbtrace_SPAN **lcbspan)
+{
+    *lcbspan = calloc(1, sizeof(lcbtrace_SPAN));
+    if (*lcbspan == NULL) {
+        return LCB_ERR_NO_MEMORY;
+    }
+    (*lcbspan)->external = external_span;
+    return LCB_SUCCESS;
+}
+
+void lcbtrace_span_finish(lcbtrace_SPAN *span, __unused uint64_t now)
+{
+    free(span);
+}
+
+void *fake_lcbtrace_external(lcbtrace_SPAN *span)
+{
+    return span == NULL ? NULL : span->external;
+}
+
+lcb_STATUS lcbmetrics_meter_create(lcbmetrics_METER **meter, void *cookie)
+{
+    *meter = calloc(1, sizeof(lcbmetrics_METER));
+    if (*meter == NULL) {
+        return LCB_ERR_NO_MEMORY;
+    }
+    (*meter)->cookie = cookie;
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcbmetrics_meter_value_recorder_callback(lcbmetrics_METER *meter, lcbmetrics_VALUE_RECORDER_CALLBACK callback)
+{
+    meter->callback = callback;
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcbmetrics_meter_destroy(lcbmetrics_METER *meter)
+{
+    if (fake_lcb_meter == meter) {
+        fake_lcb_meter = NULL;
+    }
+    free(meter);
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcbmetrics_valuerecorder_create(lcbmetrics_VALUERECORDER **recorder, void *cookie)
+{
+    *recorder = calloc(1, sizeof(lcbmetrics_VALUERECORDER));
+    if (*recorder == NULL) {
+        return LCB_ERR_NO_MEMORY;
+    }
+    (*recorder)->cookie = cookie;
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcbmetrics_valuerecorder_record_value_callback(lcbmetrics_VALUERECORDER *recorder, lcbmetrics_RECORD_VALUE_CALLBACK callback)
+{
+    recorder->callback = callback;
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcbmetrics_valuerecorder_cookie(const lcbmetrics_VALUERECORDER *recorder, void **cookie)
+{
+    *cookie = recorder->cookie;
+    return LCB_SUCCESS;
+}
+
+lcb_STATUS lcbmetrics_valuerecorder_destroy(lcbmetrics_VALUERECORDER *recorder)
+{
+    free(recorder);
+    return LCB_SUCCESS;
+}
+
+void fake_lcb_record_value(const char *service, const char *operation, uint64_t value)
+{
+    lcbmetrics_TAG tags[] = {
+        { "db.couchbase.service", service },
+        { "db.operation", operation },
+    };
+
+    const lcbmetrics_VALUERECORDER *recorder = fake_lcb_meter->callback(fake_lcb_meter, "db.couchbase.operations", tags, 2);
+    if (recorder != NULL && recorder->callback != NULL) {
+        recorder->callback(recorder, value);
+    }
+}
+
+unsigned int fake_lcb_closes = 0;
+
+static void fake_bsd_close(__unused lcb_io_opt_t iops, lcb_socket_t sock)
+{
+    fake_lcb_closes++;
+    close(sock);
+}
+
+void lcb_iops_wire_bsd_impl2(lcb_bsd_procs *procs, __unused int version)
+{
+    procs->close = fake_bsd_close;
+}
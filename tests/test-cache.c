@@ -0,0 +1,300 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+// per-worker cache (cache.c): hits, negative entries, expiry and LRU eviction by entry count and
+// by memory.
+
+#include "fakes.h"
+#include "test.h"
+
+#include "cache.h"
+
+#define MINUTE_MS (60 * 1000)
+
+static tcblcb_CACHE_RESULT get(tcblcb_CACHE *cache, const char *key, const char **value)
+{
+    size_t value_len = 0;
+    *value = NULL;
+    tcblcb_CACHE_RESULT result = tcblcb_cache_get(cache, key, strlen(key), value, &value_len);
+    if (*value != NULL) {
+        Check(value_len == strlen(*value));
+    }
+    return result;
+}
+
+static bool put(tcblcb_CACHE *cache, const char *key, const char *value, u_int64_t ttl_ms)
+{
+    return tcblcb_cache_put(cache, key, strlen(key), value, value != NULL ? strlen(value) : 0, ttl_ms, ttl_ms);
+}
+
+static void test_hit_and_miss(void)
+{
+    tcblcb_CACHE *cache = tcblcb_cache_create("test", 16, 1024 * 1024);
+    const char *value;
+
+    CheckInt(get(cache, "london", &value), CACHE_MISS);
+
+    Check(put(cache, "london", "LHR", MINUTE_MS));
+    CheckInt(get(cache, "london", &value), CACHE_HIT);
+    CheckStr(value, "LHR");
+
+    // replacing keeps a single entry
+    Check(put(cache, "london", "LGW", MINUTE_MS));
+    CheckInt(get(cache, "london", &value), CACHE_HIT);
+    CheckStr(value, "LGW");
+    CheckInt(tcblcb_cache_entries(cache), 1);
+
+    // keys are compared by length too, not only as prefixes
+    CheckInt(get(cache, "londo", &value), CACHE_MISS);
+    CheckInt(get(cache, "london ", &value), CACHE_MISS);
+
+    tcblcb_cache_destroy(cache);
+}
+
+static void test_negative(void)
+{
+    tcblcb_CACHE *cache = tcblcb_cache_create("test", 16, 1024 * 1024);
+    const char *value;
+
+    Check(put(cache, "atlantis", NULL, MINUTE_MS));
+    CheckInt(get(cache, "atlantis", &value), CACHE_NEGATIVE);
+    Check(value == NULL);
+
+    // negative entries expire like any other
+    fake_time_ms += MINUTE_MS;
+    CheckInt(get(cache, "atlantis", &value), CACHE_MISS);
+    CheckInt(tcblcb_cache_entries(cache), 0);
+
+    tcblcb_cache_destroy(cache);
+}
+
+static void test_expiry(void)
+{
+    tcblcb_CACHE *cache = tcblcb_cache_create("test", 16, 1024 * 1024);
+    const char *value;
+
+    Check(put(cache, "paris", "CDG", MINUTE_MS));
+
+    fake_time_ms += MINUTE_MS - 1;
+    CheckInt(get(cache, "paris", &value), CACHE_HIT);
+
+    // expired entries are dropped when they're looked up
+    fake_time_ms += 1;
+    CheckInt(get(cache, "paris", &value), CACHE_MISS);
+    CheckInt(tcblcb_cache_entries(cache), 0);
+    CheckInt(tcblcb_cache_bytes(cache), 0);
+
+    tcblcb_cache_destroy(cache);
+}
+
+static void test_stale(void)
+{
+    tcblcb_CACHE *cache = tcblcb_cache_create("test", 16, 1024 * 1024);
+    const char *value;
+
+    Check(tcblcb_cache_put(cache, "rome", 4, "FCO", 3, MINUTE_MS, 10 * MINUTE_MS));
+    CheckInt(get(cache, "rome", &value), CACHE_HIT);
+
+    // only the first lookup past the soft TTL is asked to refresh the entry
+    fake_time_ms += MINUTE_MS;
+    CheckInt(get(cache, "rome", &value), CACHE_STALE);
+    CheckStr(value, "FCO");
+    CheckInt(get(cache, "rome", &value), CACHE_HIT);
+
+    // and asked again if the refresh never landed
+    fake_time_ms += CACHE_REFRESH_RETRY_MS;
+    CheckInt(get(cache, "rome", &value), CACHE_STALE);
+
+    // a refresh replaces the entry with a fresh one
+    Check(tcblcb_cache_put(cache, "rome", 4, "CIA", 3, MINUTE_MS, 10 * MINUTE_MS));
+    CheckInt(get(cache, "rome", &value), CACHE_HIT);
+    CheckStr(value, "CIA");
+
+    tcblcb_cache_destroy(cache);
+}
+
+static void test_lru_entries(void)
+{
+    tcblcb_CACHE *cache = tcblcb_cache_create("test", 3, 1024 * 1024);
+    const char *value;
+
+    Check(put(cache, "a", "1", MINUTE_MS));
+    Check(put(cache, "b", "2", MINUTE_MS));
+    Check(put(cache, "c", "3", MINUTE_MS));
+
+    // using "a" makes "b" the least recently used
+    CheckInt(get(cache, "a", &value), CACHE_HIT);
+    Check(put(cache, "d", "4", MINUTE_MS));
+
+    CheckInt(tcblcb_cache_entries(cache), 3);
+    CheckInt(get(cache, "b", &value), CACHE_MISS);
+    CheckInt(get(cache, "a", &value), CACHE_HIT);
+    CheckInt(get(cache, "c", &value), CACHE_HIT);
+    CheckInt(get(cache, "d", &value), CACHE_HIT);
+
+    tcblcb_cache_destroy(cache);
+}
+
+static void test_many_keys(void)
+{
+    // more keys than buckets, so chains (and evicting from them) are exercised
+    tcblcb_CACHE *cache = tcblcb_cache_create("test", 100, 1024 * 1024);
+    char key[16];
+    char expected[16];
+    const char *value;
+
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        Check(put(cache, key, key, MINUTE_MS));
+    }
+    CheckInt(tcblcb_cache_entries(cache), 100);
+
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        snprintf(expected, sizeof(expected), "key%d", i);
+        tcblcb_CACHE_RESULT result = get(cache, key, &value);
+        if (i < 900) {
+            CheckInt(result, CACHE_MISS);
+        } else {
+            CheckInt(result, CACHE_HIT);
+            CheckStr(value, expected);
+        }
+    }
+
+    tcblcb_cache_destroy(cache);
+}
+
+static void test_bytes_accounting(void)
+{
+    tcblcb_CACHE *cache = tcblcb_cache_create("test", 16, 1024 * 1024);
+
+    // the value and the key are both counted, with their NULs, on top of a fixed overhead
+    Check(put(cache, "a", "1", MINUTE_MS));
+    size_t one = tcblcb_cache_bytes(cache);
+    Check(one > 4);
+    Check(put(cache, "b", "1234", MINUTE_MS));
+    CheckInt(tcblcb_cache_bytes(cache), 2 * one + 3);
+
+    // negative entries have no value to count
+    Check(put(cache, "c", NULL, MINUTE_MS));
+    CheckInt(tcblcb_cache_bytes(cache), 3 * one + 3 - 2);
+
+    // replacing an entry swaps its size rather than adding to it
+    Check(put(cache, "b", "1", MINUTE_MS));
+    CheckInt(tcblcb_cache_bytes(cache), 3 * one - 2);
+    CheckInt(tcblcb_cache_entries(cache), 3);
+
+    // and dropping expired entries gives it all back
+    const char *value;
+    fake_time_ms += MINUTE_MS;
+    CheckInt(get(cache, "a", &value), CACHE_MISS);
+    CheckInt(get(cache, "b", &value), CACHE_MISS);
+    CheckInt(get(cache, "c", &value), CACHE_MISS);
+    CheckInt(tcblcb_cache_entries(cache), 0);
+    CheckInt(tcblcb_cache_bytes(cache), 0);
+
+    tcblcb_cache_destroy(cache);
+}
+
+static void test_lru_bytes(void)
+{
+    // measure an entry with a one byte key and a ten byte value, then allow three of them
+    tcblcb_CACHE *probe = tcblcb_cache_create("probe", 1, 1024 * 1024);
+    Check(put(probe, "x", "0123456789", MINUTE_MS));
+    size_t entry = tcblcb_cache_bytes(probe);
+    tcblcb_cache_destroy(probe);
+
+    tcblcb_CACHE *cache = tcblcb_cache_create("test", 100, 3 * entry);
+    const char *value;
+
+    Check(put(cache, "a", "0123456789", MINUTE_MS));
+    Check(put(cache, "b", "0123456789", MINUTE_MS));
+    Check(put(cache, "c", "0123456789", MINUTE_MS));
+    CheckInt(tcblcb_cache_bytes(cache), 3 * entry);
+
+    // a fourth evicts the least recently used, "b" now that "a" has been used
+    CheckInt(get(cache, "a", &value), CACHE_HIT);
+    Check(put(cache, "d", "0123456789", MINUTE_MS));
+    CheckInt(tcblcb_cache_entries(cache), 3);
+    CheckInt(tcblcb_cache_bytes(cache), 3 * entry);
+    CheckInt(get(cache, "b", &value), CACHE_MISS);
+
+    // an entry as big as two evicts as many as it takes to fit, oldest first
+    char big[256];
+    Check(entry + 10 < sizeof(big));
+    memset(big, 'x', entry + 10);
+    big[entry + 10] = '\0';
+    Check(put(cache, "e", big, MINUTE_MS));
+    CheckInt(tcblcb_cache_entries(cache), 2);
+    CheckInt(tcblcb_cache_bytes(cache), 3 * entry);
+    CheckInt(get(cache, "c", &value), CACHE_MISS);
+    CheckInt(get(cache, "a", &value), CACHE_MISS);
+    CheckInt(get(cache, "d", &value), CACHE_HIT);
+    CheckInt(get(cache, "e", &value), CACHE_HIT);
+    CheckStr(value, big);
+
+    tcblcb_cache_destroy(cache);
+}
+
+static void test_too_large(void)
+{
+    tcblcb_CACHE *probe = tcblcb_cache_create("probe", 1, 1024 * 1024);
+    Check(put(probe, "x", "0123456789", MINUTE_MS));
+    size_t entry = tcblcb_cache_bytes(probe);
+    tcblcb_cache_destroy(probe);
+
+    tcblcb_CACHE *cache = tcblcb_cache_create("test", 100, entry);
+    const char *value;
+
+    Check(put(cache, "a", "0123456789", MINUTE_MS));
+    CheckInt(tcblcb_cache_bytes(cache), entry);
+
+    // an entry that could never fit is refused without evicting anything for it
+    Check(!put(cache, "b", "01234567890", MINUTE_MS));
+    CheckInt(get(cache, "b", &value), CACHE_MISS);
+    CheckInt(get(cache, "a", &value), CACHE_HIT);
+    CheckInt(tcblcb_cache_entries(cache), 1);
+    CheckInt(tcblcb_cache_bytes(cache), entry);
+
+    // replacing an entry with one too large drops the old value rather than keep serving it
+    Check(!put(cache, "a", "01234567890", MINUTE_MS));
+    CheckInt(get(cache, "a", &value), CACHE_MISS);
+    CheckInt(tcblcb_cache_entries(cache), 0);
+    CheckInt(tcblcb_cache_bytes(cache), 0);
+
+    tcblcb_cache_destroy(cache);
+}
+
+int main(void)
+{
+    RunTest(test_hit_and_miss);
+    RunTest(test_negative);
+    RunTest(test_expiry);
+    RunTest(test_stale);
+    RunTest(test_lru_entries);
+    RunTest(test_many_keys);
+    RunTest(test_bytes_accounting);
+    RunTest(test_lru_bytes);
+    RunTest(test_too_large);
+
+    return TestDone();
+}
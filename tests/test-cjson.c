@@ -0,0 +1,483 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+// the vendored cJSON (cjson/cJSON.c): its sped up conversions give exactly the same results as
+// they did before (cjson-reference.c) for random inputs, lookups through the index of a wide
+// object find what a linear lookup would, and parsing in-situ gives the same tree as copying.
+// `make check` runs a few thousand of each conversion, `make fuzz` many more.
+//
+//   test-cjson [iterations [seed]]
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "fakes.h"
+#include "test.h"
+
+#include "cjson/cJSON.h"
+#include "cjson-reference.h"
+
+#define DEFAULT_ITERATIONS 20000
+#define STRING_MAX 4096
+
+static unsigned long _iterations = DEFAULT_ITERATIONS;
+static u_int64_t _random_state = 1;
+
+// xorshift64*, so a failing seed can be run again
+static u_int64_t random_next(void)
+{
+    _random_state ^= _random_state >> 12;
+    _random_state ^= _random_state << 25;
+    _random_state ^= _random_state >> 27;
+    return _random_state * 0x2545F4914F6CDD1DULL;
+}
+
+static size_t random_below(size_t n)
+{
+    return (size_t)(random_next() % n);
+}
+
+// print a string with cJSON and check it against the previous printer.
+static void check_print_string(const char *string)
+{
+    static char expected[STRING_MAX * 6 + 3];
+    reference_print_string(string, expected);
+
+    cJSON *item = cJSON_CreateString(string);
+    char *printed = cJSON_PrintUnformatted(item);
+    CheckStr(printed, expected);
+    cJSON_free(printed);
+    cJSON_Delete(item);
+}
+
+static void test_print_string(void)
+{
+    static char string[STRING_MAX + 1];
+
+    check_print_string("");
+    check_print_string("plain");
+    check_print_string("\"\\\b\f\n\r\t\x01\x1f\x7f\xc3\xa9");
+
+    // an escape at every position either side of the 16 byte blocks
+    for (size_t len = 1; len <= 48; len++) {
+        for (size_t at = 0; at < len; at++) {
+            memset(string, 'a', len);
+            string[len] = '\0';
+            string[at] = "\"\\\n\x02"[at % 4];
+            check_print_string(string);
+        }
+    }
+
+    for (unsigned long i = 0; i < _iterations; i++) {
+        // mostly short strings, some long enough for the runs between escapes to matter
+        size_t len = random_below(8) == 0 ? random_below(STRING_MAX + 1) : random_below(300);
+
+        // any byte, or text with an escape now and then
+        bool any = random_below(4) == 0;
+        size_t escapes = 1 + random_below(128);
+        for (size_t j = 0; j < len; j++) {
+            if (any) {
+                string[j] = (char)(1 + random_below(255));
+            } else if (random_below(escapes) == 0) {
+                string[j] = "\"\\\b\f\n\r\t\x01\x1f"[random_below(9)];
+            } else {
+                string[j] = (char)(' ' + random_below(95));
+            }
+        }
+        string[len] = '\0';
+        check_print_string(string);
+    }
+}
+
+// print a number with cJSON and check it against the previous printer.
+static void check_print_number(double d)
+{
+    char expected[32];
+    size_t len = reference_print_number(d, expected);
+    expected[len] = '\0';
+
+    cJSON *item = cJSON_CreateNumber(d);
+    char *printed = cJSON_PrintUnformatted(item);
+    if (printed == NULL || strcmp(printed, expected) != 0) {
+        fprintf(stderr, "print_number(%a)\n", d);
+    }
+    CheckStr(printed, expected);
+    cJSON_free(printed);
+    cJSON_Delete(item);
+}
+
+static void test_print_number(void)
+{
+    static const double numbers[] = {
+        0.0, -0.0, 1.0, -1.0, 0.5, 0.1, 0.1 + 0.2, 1.0 / 3.0, 100.0, 123.45, 1e15, 1e15 - 1, 1e15 + 1,
+        1e16, 1e17, 1e21, 1e-4, 1e-5, 1e-7, 123456789012345.0, 9007199254740993.0, 4.35,
+        2147483647.0, 2147483648.0, -2147483648.0, -2147483649.0, 5e-324, 2.2250738585072014e-308,
+        1.7976931348623157e308, INFINITY, -INFINITY, NAN,
+    };
+    for (size_t i = 0; i < sizeof(numbers) / sizeof(numbers[0]); i++) {
+        check_print_number(numbers[i]);
+    }
+
+    for (unsigned long i = 0; i < _iterations; i++) {
+        double d = 0;
+        switch (random_below(5)) {
+            case 0: {
+                // any double at all
+                u_int64_t bits = random_next();
+                memcpy(&d, &bits, sizeof(d));
+                break;
+            }
+            case 1:
+                // integers up to the 15 digits the fast path prints
+                d = (double)(int64_t)(random_next() % 2000000000000001ULL) - 1e15;
+                break;
+            case 2:
+                // decimals of up to 17 digits, scaled by a power of ten either way
+                d = (double)(random_next() % 100000000000000000ULL) / pow(10, (double)random_below(40)) * pow(10, (double)random_below(20));
+                break;
+            case 3:
+                // prices and flight times as the routes compute them
+                d = (double)(random_below(200000) + 1) / 100.0 * (random_below(2) == 0 ? 1.0 : 0.75);
+                break;
+            default:
+                // small integers and fractions, negated half the time
+                d = (double)random_below(100000) / (double)(1 + random_below(1000));
+                break;
+        }
+        if (random_below(2) == 0) {
+            d = -d;
+        }
+        check_print_number(d);
+    }
+}
+
+// parse the number (and whatever follows it) in `text` with cJSON and check it against the
+// previous parser: accepted or not, the value, `valueint` and where it stopped reading.
+static void check_parse_number(const char *text)
+{
+    double expected = 0;
+    int expected_int = 0;
+    size_t expected_len = 0;
+    bool expected_ok = (text[0] == '-' || (text[0] >= '0' && text[0] <= '9'))
+        && reference_parse_number(text, &expected, &expected_int, &expected_len);
+
+    const char *end = NULL;
+    cJSON *item = cJSON_ParseWithOpts(text, &end, false);
+    bool ok = item != NULL && cJSON_IsNumber(item) == expected_ok;
+    if (item != NULL && expected_ok) {
+        ok = memcmp(&item->valuedouble, &expected, sizeof(expected)) == 0
+            && item->valueint == expected_int
+            && (size_t)(end - text) == expected_len;
+    } else {
+        ok = item == NULL && !expected_ok;
+    }
+    if (!ok) {
+        fprintf(stderr, "parse_number(\"%s\"): %s %a %d +%zu, expected %s %a %d +%zu\n", text,
+            item != NULL ? "ok" : "failed", item != NULL ? item->valuedouble : 0, item != NULL ? item->valueint : 0,
+            item != NULL ? (size_t)(end - text) : 0,
+            expected_ok ? "ok" : "failed", expected, expected_int, expected_len);
+    }
+    Check(ok);
+    cJSON_Delete(item);
+}
+
+static void test_parse_number(void)
+{
+    static const char *numbers[] = {
+        "0", "-0", "1", "-1", "0.5", "0.1", "123.45", "1e5", "1E5", "1e+5", "1e-5", "-1.5e-3",
+        "9007199254740992", "9007199254740993", "18446744073709551615", "1e22", "1e23", "1e-22",
+        "1e-23", "1234567890123456789", "12345678901234567890", "0.30000000000000004",
+        "2147483647", "2147483648", "-2147483648", "-2147483649", "1e400", "-1e400", "5e-324", "1e-400",
+        "1.e5", "1.", ".5", "-.5", "1e", "1e+", "-", "--1", "+1", "01", "1.5.5", "1-2", "1e5e5",
+        "00000000000000000000000000000000000000000000000000000000000000000001",
+        "1.0000000000000000000000000000000000000000000000000000000000000000001",
+        "1]", "2,", "3 ", "4x",
+    };
+    for (size_t i = 0; i < sizeof(numbers) / sizeof(numbers[0]); i++) {
+        check_parse_number(numbers[i]);
+    }
+
+    static const char number_chars[] = "0123456789+-eE.";
+    static const char *terminators[] = { "", "]", ",", " ", "}", "x" };
+    char text[96];
+    for (unsigned long i = 0; i < _iterations; i++) {
+        int len = 0;
+        switch (random_below(7)) {
+            case 0:
+            case 1: {
+                // any finite double at any precision, in both notations
+                u_int64_t bits = random_next();
+                double d = 0;
+                memcpy(&d, &bits, sizeof(d));
+                if (isnan(d) || isinf(d)) {
+                    d = 0.25;
+                }
+                len = snprintf(text, sizeof(text), random_below(2) == 0 ? "%.*g" : "%.*e", (int)random_below(20), d);
+                break;
+            }
+            case 2:
+                // 64-bit integers
+                len = snprintf(text, sizeof(text), "%lld", (long long)(random_next() >> random_below(64)) * (random_below(2) == 0 ? 1 : -1));
+                break;
+            case 3: {
+                // decimals with up to 25 digits, and an exponent now and then
+                long exponent = (long)random_below(64) - 32;
+                len = snprintf(text, sizeof(text), "%s%llu.%0*llu", random_below(2) == 0 ? "-" : "",
+                    (unsigned long long)(random_next() % 100000000000ULL),
+                    (int)random_below(15), (unsigned long long)(random_next() % 100000000000000ULL));
+                if (random_below(3) == 0) {
+                    len += snprintf(text + len, sizeof(text) - (size_t)len, "%se%ld", random_below(2) == 0 ? "" : "E", exponent);
+                }
+                break;
+            }
+            case 4:
+                // prices and flight times as the service writes them
+                len = snprintf(text, sizeof(text), "%.2f", (double)random_below(200000) / 100.0);
+                break;
+            case 5:
+                // long enough to be cut off where the previous parser stopped copying (63)
+                len = (int)(56 + random_below(16));
+                for (int j = 0; j < len; j++) {
+                    text[j] = (char)('0' + random_below(j < 40 ? 2 : 10));
+                }
+                if (random_below(2) == 0) {
+                    text[random_below((size_t)len)] = random_below(2) == 0 ? '.' : 'e';
+                }
+                text[len] = '\0';
+                break;
+            default:
+                // anything made of the characters numbers are
+                len = (int)(1 + random_below(24));
+                for (int j = 0; j < len; j++) {
+                    text[j] = number_chars[random_below(sizeof(number_chars) - 1)];
+                }
+                text[len] = '\0';
+                break;
+        }
+        snprintf(text + len, sizeof(text) - (size_t)len, "%s", terminators[random_below(6)]);
+        check_parse_number(text);
+    }
+}
+
+// an object wide enough to be indexed (see OBJECT_INDEX_THRESHOLD in cJSON.c), with members
+// "k0", "k1", ... numbered by position.
+#define WIDE_OBJECT_MEMBERS 40
+
+static cJSON *wide_object(void)
+{
+    cJSON *object = cJSON_CreateObject();
+    char name[16];
+    for (int i = 0; i < WIDE_OBJECT_MEMBERS; i++) {
+        snprintf(name, sizeof(name), "k%d", i);
+        cJSON_AddNumberToObject(object, name, i);
+    }
+    return object;
+}
+
+// the value of a number member found by a case sensitive (so indexed) lookup, or -1 if missing.
+static double member_value(const cJSON *object, const char *name)
+{
+    const cJSON *member = cJSON_GetObjectItemCaseSensitive(object, name);
+    return member != NULL ? member->valuedouble : -1;
+}
+
+static void test_object_index(void)
+{
+    cJSON *object = wide_object();
+    char name[16];
+
+    // every member is found through the index, and only those
+    for (int i = 0; i < WIDE_OBJECT_MEMBERS; i++) {
+        snprintf(name, sizeof(name), "k%d", i);
+        CheckInt(member_value(object, name), i);
+    }
+    Check(object->object_index != NULL);
+    CheckInt(member_value(object, "k40"), -1);
+    CheckInt(member_value(object, "K1"), -1);
+    CheckInt(cJSON_GetObjectItem(object, "K1")->valuedouble, 1);
+
+    // the first of duplicate names wins, as it does for a linear lookup
+    cJSON_AddNumberToObject(object, "k1", 100);
+    CheckInt(member_value(object, "k1"), 1);
+
+    // changing the members drops the index, so lookups see the change
+    cJSON_DeleteItemFromObjectCaseSensitive(object, "k1");
+    CheckInt(member_value(object, "k1"), 100);
+    cJSON_ReplaceItemInObjectCaseSensitive(object, "k2", cJSON_CreateNumber(200));
+    CheckInt(member_value(object, "k2"), 200);
+    cJSON_Delete(cJSON_DetachItemFromObjectCaseSensitive(object, "k3"));
+    CheckInt(member_value(object, "k3"), -1);
+    CheckInt(member_value(object, "k4"), 4);
+
+    // and a parsed object is indexed the same way
+    char *printed = cJSON_PrintUnformatted(object);
+    cJSON *parsed = cJSON_Parse(printed);
+    CheckInt(member_value(parsed, "k39"), 39);
+    CheckInt(member_value(parsed, "k2"), 200);
+    CheckInt(member_value(parsed, "k3"), -1);
+
+    cJSON_free(printed);
+    cJSON_Delete(parsed);
+    cJSON_Delete(object);
+}
+
+static void test_object_index_reference(void)
+{
+    cJSON *object = wide_object();
+    cJSON *reference = cJSON_CreateObjectReference(object->child);
+    cJSON *holder = cJSON_CreateObject();
+    cJSON_AddItemReferenceToObject(holder, "object", object);
+    cJSON *member_reference = cJSON_GetObjectItemCaseSensitive(holder, "object");
+
+    // lookups through a reference find the shared members without indexing them
+    CheckInt(member_value(object, "k5"), 5);
+    CheckInt(member_value(reference, "k5"), 5);
+    CheckInt(member_value(member_reference, "k5"), 5);
+    Check(reference->object_index == NULL);
+    Check(member_reference->object_index == NULL);
+
+    // so they still see the members after they change through the original
+    cJSON_ReplaceItemInObjectCaseSensitive(object, "k5", cJSON_CreateNumber(500));
+    CheckInt(member_value(reference, "k5"), 500);
+    CheckInt(member_value(member_reference, "k5"), 500);
+    cJSON_Delete(cJSON_DetachItemFromObjectCaseSensitive(object, "k6"));
+    CheckInt(member_value(reference, "k6"), -1);
+    CheckInt(member_value(member_reference, "k6"), -1);
+    CheckInt(member_value(reference, "k7"), 7);
+
+    // deleting a reference leaves the members alone
+    cJSON_Delete(reference);
+    cJSON_Delete(holder);
+    CheckInt(member_value(object, "k7"), 7);
+    cJSON_Delete(object);
+}
+
+static bool in_buffer(const char *ptr, const char *buffer, size_t len)
+{
+    return ptr >= buffer && ptr < buffer + len;
+}
+
+// parse `text` in-situ from an unterminated copy and check it against a copying parse: both fail,
+// or both print the same.
+static void check_parse_in_situ(const char *text, size_t len)
+{
+    char *buffer = malloc(len > 0 ? len : 1);
+    memcpy(buffer, text, len);
+
+    cJSON *expected = cJSON_ParseWithLength(text, len);
+    cJSON *parsed = cJSON_ParseInSitu(buffer, len);
+    if ((parsed == NULL) != (expected == NULL)) {
+        fprintf(stderr, "parse in-situ: %.*s\n", (int)len, text);
+    }
+    Check((parsed == NULL) == (expected == NULL));
+
+    if (parsed != NULL && expected != NULL) {
+        char *printed = cJSON_PrintUnformatted(parsed);
+        char *expected_printed = cJSON_PrintUnformatted(expected);
+        CheckStr(printed, expected_printed);
+        cJSON_free(expected_printed);
+        cJSON_free(printed);
+    }
+
+    cJSON_Delete(expected);
+    cJSON_Delete(parsed);
+    free(buffer);
+}
+
+static void test_parse_in_situ(void)
+{
+    static const char *documents[] = {
+        "{\"a\":\"b\",\"c\":[\"d\",1,true,null],\"e\":{\"f\":\"g\\n\\\"h\\u00e9\\ud83d\\ude00\"}}",
+        "\"plain\"",
+        " [ \"\" , {\"\":\"\"} ] ",
+        "{\"a\":}",
+        "\"unterminated",
+        "[\"\\x\"]",
+        "[\"\\ud800\"]",
+        "[\"\\u12\"]",
+        "",
+    };
+    for (size_t i = 0; i < sizeof(documents) / sizeof(documents[0]); i++) {
+        check_parse_in_situ(documents[i], strlen(documents[i]));
+    }
+
+    // names and string values point into the buffer, and are left alone by cJSON_Delete
+    char text[] = "{\"name\":\"va\\\"lue\",\"other\":\"x\"}";
+    size_t len = strlen(text);
+    cJSON *parsed = cJSON_ParseInSitu(text, len);
+    Check(parsed != NULL);
+    cJSON *name = cJSON_GetObjectItemCaseSensitive(parsed, "name");
+    CheckStr(cJSON_GetStringValue(name), "va\"lue");
+    Check(in_buffer(name->string, text, len));
+    Check(in_buffer(name->valuestring, text, len));
+
+    // a duplicate gets its own values, and setting a value copies it
+    cJSON *duplicate = cJSON_Duplicate(parsed, true);
+    cJSON *duplicate_name = cJSON_GetObjectItemCaseSensitive(duplicate, "name");
+    CheckStr(cJSON_GetStringValue(duplicate_name), "va\"lue");
+    Check(!in_buffer(duplicate_name->valuestring, text, len));
+    CheckStr(cJSON_SetValuestring(name, "a longer value than before"), "a longer value than before");
+    Check(!in_buffer(name->valuestring, text, len));
+    cJSON_Delete(duplicate);
+    cJSON_Delete(parsed);
+
+    // and random documents, whole or cut short, parse the same either way
+    static char string[STRING_MAX + 1];
+    for (unsigned long i = 0; i < _iterations / 10; i++) {
+        size_t slen = random_below(64);
+        for (size_t j = 0; j < slen; j++) {
+            string[j] = random_below(4) == 0 ? (char)(1 + random_below(255)) : (char)(' ' + random_below(95));
+        }
+        string[slen] = '\0';
+
+        cJSON *object = cJSON_CreateObject();
+        cJSON_AddStringToObject(object, string, string);
+        cJSON_AddItemToObject(object, "list", cJSON_CreateStringArray((const char *[]){ string, "", string }, 3));
+        char *printed = cJSON_PrintUnformatted(object);
+        size_t plen = strlen(printed);
+        check_parse_in_situ(printed, plen);
+        check_parse_in_situ(printed, random_below(plen));
+        cJSON_free(printed);
+        cJSON_Delete(object);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        _iterations = strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        _random_state = strtoull(argv[2], NULL, 10) | 1;
+    }
+
+    RunTest(test_print_string);
+    RunTest(test_print_number);
+    RunTest(test_parse_number);
+    RunTest(test_object_index);
+    RunTest(test_object_index_reference);
+    RunTest(test_parse_in_situ);
+
+    return TestDone();
+}
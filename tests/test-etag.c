@@ -0,0 +1,230 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+// ETags (util.c): responses carry a hash of their body as a strong ETag, and a request that
+// already has it in If-None-Match gets a bodyless 304 instead, whether or not it was cached.
+
+#include "fakes.h"
+#include "test.h"
+
+#include "shm-cache.h"
+#include "util.h"
+
+#define BODY "{\"data\":[{\"a\":1}],\"context\":[]}"
+#define MINUTE_MS (60 * 1000)
+
+static char etag[64];
+
+// send BODY to a request with the given If-None-Match (NULL for none). returns the status.
+static int send(const char *if_none_match, const char *cache_control)
+{
+    struct http_request req;
+
+    fake_request_init(&req, NULL, HTTP_METHOD_GET, "/api/airports");
+    if (if_none_match != NULL) {
+        fake_request_header(&req, "If-None-Match", if_none_match);
+    }
+    send_response_body(&req, BODY, strlen(BODY), cache_control);
+
+    int status = req.status;
+    CheckInt(req.responses, 1);
+    if (status == 304) {
+        CheckInt(req.response.offset, 0);
+    } else {
+        CheckStr(kore_buf_stringify(&req.response, NULL), BODY);
+    }
+
+    // the ETag and Cache-Control are sent with either
+    const char *tag = fake_response_header(&req, "ETag");
+    Check(tag != NULL);
+    snprintf(etag, sizeof(etag), "%s", tag != NULL ? tag : "");
+    const char *sent_cache_control = fake_response_header(&req, "Cache-Control");
+    if (cache_control == NULL) {
+        Check(sent_cache_control == NULL);
+    } else {
+        CheckStr(sent_cache_control, cache_control);
+    }
+
+    fake_request_free(&req);
+    return status;
+}
+
+static void test_etag(void)
+{
+    CheckInt(send(NULL, NULL), 200);
+
+    // a quoted 64 bit hash
+    CheckInt(strlen(etag), 18);
+    Check(etag[0] == '"' && etag[17] == '"');
+    CheckInt(strspn(etag + 1, "0123456789abcdef"), 16);
+
+    // of the body, so the same body always gets the same one
+    char first[64];
+    snprintf(first, sizeof(first), "%s", etag);
+    CheckInt(send(NULL, "public, max-age=60"), 200);
+    CheckStr(etag, first);
+
+    struct http_request req;
+    fake_request_init(&req, NULL, HTTP_METHOD_GET, "/api/airports");
+    send_response_body(&req, "{}", 2, NULL);
+    Check(strcmp(fake_response_header(&req, "ETag"), first) != 0);
+    fake_request_free(&req);
+}
+
+static void test_if_none_match(void)
+{
+    char header[256];
+
+    CheckInt(send(NULL, NULL), 200);
+    char tag[64];
+    snprintf(tag, sizeof(tag), "%s", etag);
+
+    CheckInt(send(tag, NULL), 304);
+    CheckInt(send(tag, "no-cache"), 304);
+
+    // anywhere in a list, with or without spaces
+    snprintf(header, sizeof(header), "\"0000000000000000\", %s", tag);
+    CheckInt(send(header, NULL), 304);
+    snprintf(header, sizeof(header), "%s,\"0000000000000000\"", tag);
+    CheckInt(send(header, NULL), 304);
+    snprintf(header, sizeof(header), "\"a\",\t%s\t, \"b\"", tag);
+    CheckInt(send(header, NULL), 304);
+
+    // weak validators match too, and so does anything
+    snprintf(header, sizeof(header), "W/%s", tag);
+    CheckInt(send(header, NULL), 304);
+    snprintf(header, sizeof(header), "\"a\", W/%s", tag);
+    CheckInt(send(header, NULL), 304);
+    CheckInt(send("*", NULL), 304);
+    CheckInt(send(" * ", NULL), 304);
+
+    // other tags don't
+    CheckInt(send("\"0000000000000000\"", NULL), 200);
+    CheckInt(send("", NULL), 200);
+    CheckInt(send(",,", NULL), 200);
+    CheckInt(send("W/", NULL), 200);
+    CheckInt(send("**", NULL), 200);
+
+    // nor does the tag unquoted, or only part of it
+    snprintf(header, sizeof(header), "%.16s", tag + 1);
+    CheckInt(send(header, NULL), 200);
+    snprintf(header, sizeof(header), "%.17s", tag);
+    CheckInt(send(header, NULL), 200);
+    snprintf(header, sizeof(header), "%sx", tag);
+    CheckInt(send(header, NULL), 200);
+}
+
+static void test_cached(void)
+{
+    tcblcb_SHMCACHE *cache = tcblcb_shmcache_create("test", 1024 * 1024);
+    struct http_request req;
+    tcblcb_RawResponse resp = { 0 };
+
+    CheckInt(send(NULL, NULL), 200);
+    char tag[64];
+    snprintf(tag, sizeof(tag), "%s", etag);
+
+    fake_request_init(&req, NULL, HTTP_METHOD_GET, "/api/airports");
+    CheckInt(send_cached_response(&req, cache, "airports|a", "public"), CACHE_MISS);
+    CheckInt(send_cached_response(&req, NULL, "airports|a", "public"), CACHE_MISS);
+    CheckInt(req.responses, 0);
+    fake_request_free(&req);
+
+    // a response sent from the builder is cached with its hash
+    fake_request_init(&req, NULL, HTTP_METHOD_GET, "/api/airports");
+    raw_response_init(&resp);
+    raw_response_cache(&resp, cache, "airports|a", MINUTE_MS, 2 * MINUTE_MS);
+    raw_response_cache_control(&resp, "public");
+    raw_response_add_row(&resp, "{\"a\":1}", 7);
+    raw_response_send(&resp, &req, false);
+    raw_response_cleanup(&resp);
+    CheckInt(req.status, 200);
+    CheckStr(kore_buf_stringify(&req.response, NULL), BODY);
+    CheckStr(fake_response_header(&req, "ETag"), tag);
+    CheckStr(fake_response_header(&req, "Cache-Control"), "public");
+    fake_request_free(&req);
+
+    // and sent from the cache with the same ETag
+    fake_request_init(&req, NULL, HTTP_METHOD_GET, "/api/airports");
+    CheckInt(send_cached_response(&req, cache, "airports|a", "public, max-age=300"), CACHE_HIT);
+    CheckInt(req.status, 200);
+    CheckStr(kore_buf_stringify(&req.response, NULL), BODY);
+    CheckStr(fake_response_header(&req, "ETag"), tag);
+    CheckStr(fake_response_header(&req, "Cache-Control"), "public, max-age=300");
+    fake_request_free(&req);
+
+    // or as a 304
+    fake_request_init(&req, NULL, HTTP_METHOD_GET, "/api/airports");
+    fake_request_header(&req, "If-None-Match", tag);
+    CheckInt(send_cached_response(&req, cache, "airports|a", NULL), CACHE_HIT);
+    CheckInt(req.status, 304);
+    CheckInt(req.response.offset, 0);
+    fake_request_free(&req);
+
+    // a stale hit is still sent (or 304d), and the caller told to refresh it
+    fake_time_ms += MINUTE_MS;
+    fake_request_init(&req, NULL, HTTP_METHOD_GET, "/api/airports");
+    fake_request_header(&req, "If-None-Match", tag);
+    CheckInt(send_cached_response(&req, cache, "airports|a", NULL), CACHE_STALE);
+    CheckInt(req.status, 304);
+    fake_request_free(&req);
+
+    // entries too short to hold a hash are misses
+    Check(tcblcb_shmcache_put(cache, "airports|b", 10, "1234", 4, MINUTE_MS, MINUTE_MS));
+    fake_request_init(&req, NULL, HTTP_METHOD_GET, "/api/airports");
+    CheckInt(send_cached_response(&req, cache, "airports|b", NULL), CACHE_MISS);
+    CheckInt(req.responses, 0);
+    fake_request_free(&req);
+
+    // failed responses aren't cached, and streamed ones have no ETag
+    fake_request_init(&req, NULL, HTTP_METHOD_GET, "/api/airports");
+    raw_response_init(&resp);
+    raw_response_cache(&resp, cache, "airports|c", MINUTE_MS, MINUTE_MS);
+    raw_response_send(&resp, &req, true);
+    raw_response_cleanup(&resp);
+    Check(fake_response_header(&req, "ETag") == NULL);
+    CheckInt(tcblcb_shmcache_get(cache, "airports|c", 10, NULL), CACHE_MISS);
+    fake_request_free(&req);
+
+    struct connection c;
+    fake_request_init(&req, &c, HTTP_METHOD_GET, "/api/airports");
+    raw_response_init(&resp);
+    raw_response_stream(&resp, &req);
+    raw_response_add_row(&resp, "{\"a\":1}", 7);
+    raw_response_flush(&resp);
+    raw_response_send(&resp, &req, false);
+    raw_response_cleanup(&resp);
+    Check(fake_response_header(&req, "ETag") == NULL);
+    fake_request_free(&req);
+
+    tcblcb_shmcache_destroy(cache);
+}
+
+int main(void)
+{
+    RunTest(test_etag);
+    RunTest(test_if_none_match);
+    RunTest(test_cached);
+
+    return TestDone();
+}
@@ -0,0 +1,371 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+// libcouchbase IO plugin (lcb-iops.c): sockets watched through Kore's edge triggered event loop,
+// with readiness remembered across re-arming, events and sockets going away while an edge is
+// pending, and the private loop `lcb_wait` runs until libcouchbase stops it.
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "fakes.h"
+#include "test.h"
+
+#include "lcb-iops.h"
+
+static lcb_io_opt_t _io = NULL;
+static lcb_loop_procs _loop;
+static lcb_timer_procs _timer;
+static lcb_bsd_procs _bsd;
+static lcb_ev_procs _ev;
+static lcb_completion_procs _completion;
+
+// what libcouchbase does with a socket's events (or a timer) in the tests
+typedef struct {
+    int calls;
+    lcb_socket_t sock;
+    short which;
+    bool drain;     // read until EAGAIN, as lcb does for a readable socket
+    bool stop;      // stop the loop, as lcb does once the bootstrap completes
+    void *event;
+} Watcher;
+
+static void iops_start(void)
+{
+    lcb_iomodel_t iomodel = LCB_IOMODEL_COMPLETION;
+
+    _io = tcblcb_iops_create();
+    Check(_io != NULL);
+    CheckInt(_io->version, 3);
+    CheckInt(_io->v.v3.need_cleanup, 0);
+    _io->v.v3.get_procs(4, &_loop, &_timer, &_bsd, &_ev, &_completion, &iomodel);
+    CheckInt(iomodel, LCB_IOMODEL_EVENT);
+}
+
+static void iops_end(void)
+{
+    tcblcb_iops_destroy(_io);
+    _io = NULL;
+}
+
+static void socket_pair(int fds[2])
+{
+    Check(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+}
+
+static void send_byte(int fd)
+{
+    CheckInt(write(fd, "x", 1), 1);
+}
+
+static void watcher_callback(lcb_socket_t sock, short which, void *arg)
+{
+    Watcher *w = arg;
+    w->calls++;
+    w->sock = sock;
+    w->which = which;
+
+    if (w->drain) {
+        char buf[64];
+        while (read(sock, buf, sizeof(buf)) > 0) {
+        }
+        Check(errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+    if (w->stop) {
+        _loop.stop(_io);
+    }
+}
+
+// a bootstrap: once the connect completes (writable) lcb watches for the config, and stops the
+// loop when that arrives (readable).
+static void bootstrap_callback(lcb_socket_t sock, short which, void *arg)
+{
+    Watcher *w = arg;
+
+    if (which & LCB_WRITE_EVENT) {
+        w->calls++;
+        _ev.watch(_io, sock, w->event, LCB_READ_EVENT, w, bootstrap_callback);
+    } else {
+        w->drain = true;
+        w->stop = true;
+        watcher_callback(sock, which, w);
+    }
+}
+
+static void timer_callback(__unused lcb_socket_t sock, __unused short which, void *arg)
+{
+    Watcher *w = arg;
+    w->calls++;
+    if (w->stop) {
+        _loop.stop(_io);
+    }
+}
+
+static void test_rearm(void)
+{
+    int fds[2];
+    Watcher w = { 0 };
+
+    iops_start();
+    socket_pair(fds);
+
+    void *event = _ev.create(_io);
+    Check(event != NULL);
+    CheckInt(_ev.watch(_io, fds[0], event, LCB_READ_EVENT, &w, watcher_callback), 0);
+    Check(fake_event_registered(fds[0]) == event);
+
+    // an edge is delivered straight away
+    send_byte(fds[1]);
+    Check(fake_event_dispatch(fds[0], KORE_EVENT_READ, 0));
+    CheckInt(w.calls, 1);
+    CheckInt(w.sock, fds[0]);
+    CheckInt(w.which, LCB_READ_EVENT);
+
+    // lcb drains the socket to EAGAIN and watches it again. nothing is delivered until the next
+    // edge, since the last one was consumed
+    w.drain = true;
+    send_byte(fds[1]);
+    Check(fake_event_dispatch(fds[0], KORE_EVENT_READ, 0));
+    CheckInt(w.calls, 2);
+    _ev.watch(_io, fds[0], event, LCB_READ_EVENT, &w, watcher_callback);
+    CheckInt(fake_timers_run(), 0);
+    CheckInt(w.calls, 2);
+
+    send_byte(fds[1]);
+    Check(fake_event_dispatch(fds[0], KORE_EVENT_READ, 0));
+    CheckInt(w.calls, 3);
+
+    // an edge while lcb isn't watching is remembered (the socket stays registered), and
+    // delivered once it watches again, from the loop rather than inside the watch
+    _ev.cancel(_io, fds[0], event);
+    Check(fake_event_registered(fds[0]) == event);
+    send_byte(fds[1]);
+    Check(fake_event_dispatch(fds[0], KORE_EVENT_READ, 0));
+    CheckInt(w.calls, 3);
+    _ev.watch(_io, fds[0], event, LCB_READ_EVENT, &w, watcher_callback);
+    CheckInt(w.calls, 3);
+    CheckInt(fake_timers_run(), 1);
+    CheckInt(w.calls, 4);
+    CheckInt(w.which, LCB_READ_EVENT);
+
+    // only what's watched is delivered, and the rest is kept for later
+    _ev.watch(_io, fds[0], event, LCB_WRITE_EVENT, &w, watcher_callback);
+    send_byte(fds[1]);
+    Check(fake_event_dispatch(fds[0], KORE_EVENT_READ | KORE_EVENT_WRITE, 0));
+    CheckInt(w.calls, 5);
+    CheckInt(w.which, LCB_WRITE_EVENT);
+    _ev.watch(_io, fds[0], event, LCB_READ_EVENT, &w, watcher_callback);
+    CheckInt(fake_timers_run(), 1);
+    CheckInt(w.calls, 6);
+    CheckInt(w.which, LCB_READ_EVENT);
+
+    // an error is reported as readable and writable, so lcb finds it on the socket
+    _ev.watch(_io, fds[0], event, LCB_RW_EVENT, &w, watcher_callback);
+    Check(fake_event_dispatch(fds[0], 0, 1));
+    CheckInt(w.calls, 7);
+    CheckInt(w.which, LCB_RW_EVENT);
+
+    // watching another socket moves the event over to it
+    int other[2];
+    socket_pair(other);
+    _ev.watch(_io, other[0], event, LCB_READ_EVENT, &w, watcher_callback);
+    Check(fake_event_registered(fds[0]) == NULL);
+    Check(fake_event_registered(other[0]) == event);
+
+    _ev.destroy(_io, event);
+    fake_timers_run();
+    _bsd.close(_io, other[0]);
+    _bsd.close(_io, fds[0]);
+    close(other[1]);
+    close(fds[1]);
+    iops_end();
+}
+
+static void test_destroyed_pending(void)
+{
+    int fds[2];
+    Watcher w = { 0 };
+
+    iops_start();
+    socket_pair(fds);
+
+    void *event = _ev.create(_io);
+    _ev.watch(_io, fds[0], event, LCB_READ_EVENT, &w, watcher_callback);
+    struct kore_event *evt = fake_event_registered(fds[0]);
+    Check(evt != NULL);
+
+    // the event is destroyed (its pooled socket outlives it) with an edge already in the event
+    // loop's batch. the socket leaves the loop
+    _ev.destroy(_io, event);
+    Check(fake_event_registered(fds[0]) == NULL);
+    Check(!fake_event_dispatch(fds[0], KORE_EVENT_READ, 0));
+
+    // and the edge still in the batch goes nowhere, since the event is only freed later
+    evt->flags |= KORE_EVENT_READ;
+    evt->handle(evt, 0);
+    CheckInt(w.calls, 0);
+    CheckInt(fake_timers_run(), 1);
+    CheckInt(w.calls, 0);
+
+    _bsd.close(_io, fds[0]);
+    close(fds[1]);
+    iops_end();
+}
+
+static void test_closed_pending(void)
+{
+    int fds[2];
+    Watcher w = { 0 };
+    unsigned int closes = fake_lcb_closes;
+
+    iops_start();
+    socket_pair(fds);
+
+    void *event = _ev.create(_io);
+    _ev.watch(_io, fds[0], event, LCB_READ_EVENT, &w, watcher_callback);
+    _ev.cancel(_io, fds[0], event);
+    Check(fake_event_dispatch(fds[0], KORE_EVENT_READ, 0));
+
+    // readiness is waiting to be delivered when the socket is closed
+    _ev.watch(_io, fds[0], event, LCB_READ_EVENT, &w, watcher_callback);
+    _bsd.close(_io, fds[0]);
+    CheckInt(fake_lcb_closes, closes + 1);
+    Check(fake_event_registered(fds[0]) == NULL);
+
+    // so there's nothing to deliver, even once the descriptor is reused
+    int reused[2];
+    socket_pair(reused);
+    CheckInt(fake_timers_run(), 1);
+    CheckInt(w.calls, 0);
+
+    // and the event can watch a new socket
+    _ev.watch(_io, reused[0], event, LCB_READ_EVENT, &w, watcher_callback);
+    Check(fake_event_registered(reused[0]) == event);
+    Check(fake_event_dispatch(reused[0], KORE_EVENT_READ, 0));
+    CheckInt(w.calls, 1);
+    CheckInt(w.sock, reused[0]);
+
+    // destroying the plugin frees events that were destroyed but not reaped yet
+    _ev.destroy(_io, event);
+    _bsd.close(_io, reused[0]);
+    close(reused[1]);
+    close(fds[1]);
+    iops_end();
+    CheckInt(fake_timers_run(), 0);
+}
+
+static void test_timers(void)
+{
+    Watcher w = { 0 };
+
+    iops_start();
+
+    // timers run on Kore's, rounded up to the millisecond
+    void *timer = _timer.create(_io);
+    CheckInt(_timer.schedule(_io, timer, 1500, &w, timer_callback), 0);
+    fake_time_ms += 1;
+    CheckInt(fake_timers_run(), 0);
+    fake_time_ms += 1;
+    CheckInt(fake_timers_run(), 1);
+    CheckInt(w.calls, 1);
+
+    // rescheduling replaces the pending one, and cancelling removes it
+    _timer.schedule(_io, timer, 1000, &w, timer_callback);
+    _timer.schedule(_io, timer, 5000, &w, timer_callback);
+    fake_time_ms += 1;
+    CheckInt(fake_timers_run(), 0);
+    _timer.cancel(_io, timer);
+    fake_time_ms += 10;
+    CheckInt(fake_timers_run(), 0);
+    CheckInt(w.calls, 1);
+
+    _timer.schedule(_io, timer, 1000, &w, timer_callback);
+    _timer.destroy(_io, timer);
+    fake_time_ms += 10;
+    CheckInt(fake_timers_run(), 0);
+
+    iops_end();
+}
+
+static void test_wait(void)
+{
+    int fds[2];
+    Watcher bootstrap = { 0 };
+    Watcher timeout = { 0 };
+    Watcher stopper = { .stop = true };
+
+    iops_start();
+
+    // with nothing to wait for the loop returns straight away
+    _loop.start(_io);
+
+    // the loop `lcb_wait` runs returns once the bootstrap completes, before its timeout
+    socket_pair(fds);
+    send_byte(fds[1]);
+    void *event = _ev.create(_io);
+    void *timer = _timer.create(_io);
+    _timer.schedule(_io, timer, 2500 * 1000, &timeout, timer_callback);
+    bootstrap.event = event;
+    _ev.watch(_io, fds[0], event, LCB_WRITE_EVENT, &bootstrap, bootstrap_callback);
+
+    _loop.start(_io);
+    CheckInt(bootstrap.calls, 2);
+    CheckInt(bootstrap.which, LCB_READ_EVENT);
+    CheckInt(timeout.calls, 0);
+
+    // stopping from a timer works too
+    _ev.cancel(_io, fds[0], event);
+    _timer.schedule(_io, timer, 0, &stopper, timer_callback);
+    _loop.start(_io);
+    CheckInt(stopper.calls, 1);
+    CheckInt(timeout.calls, 0);
+
+    // and a tick only handles what's ready, without waiting
+    Watcher w = { .drain = true };
+    _ev.watch(_io, fds[0], event, LCB_READ_EVENT, &w, watcher_callback);
+    send_byte(fds[1]);
+    _loop.tick(_io);
+    CheckInt(w.calls, 1);
+    _loop.tick(_io);
+    CheckInt(w.calls, 1);
+
+    _timer.destroy(_io, timer);
+    _ev.destroy(_io, event);
+    fake_timers_run();
+    _bsd.close(_io, fds[0]);
+    close(fds[1]);
+    iops_end();
+}
+
+int main(void)
+{
+    // a broken loop would otherwise wait forever
+    alarm(10);
+
+    RunTest(test_rearm);
+    RunTest(test_destroyed_pending);
+    RunTest(test_closed_pending);
+    RunTest(test_timers);
+    RunTest(test_wait);
+
+    return TestDone();
+}
@@ -0,0 +1,206 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+// schema-directed row decoding (util.c): picking named string members out of a JSON object in a
+// single pass, skipping everything else.
+
+#include <stddef.h>
+
+#include "fakes.h"
+#include "test.h"
+
+#include "arena.h"
+#include "util.h"
+
+typedef struct {
+    char *from;
+    char *to;
+} TestRow;
+
+static const tcblcb_JSON_FIELD row_fields[] = {
+    JSON_FIELD("from", JSON_FIELD_STRING, TestRow, from),
+    JSON_FIELD("to",   JSON_FIELD_STRING, TestRow, to),
+};
+
+static bool decode_len(const char *json, size_t njson, TestRow *row)
+{
+    memset(row, 0, sizeof(*row));
+    return decode_json_object(json, njson, row_fields, json_fields_amount(row_fields), row);
+}
+
+static bool decode(const char *json, TestRow *row)
+{
+    return decode_len(json, strlen(json), row);
+}
+
+static void row_free(TestRow *row)
+{
+    free_json_fields(row_fields, json_fields_amount(row_fields), row);
+    Check(row->from == NULL);
+    Check(row->to == NULL);
+}
+
+static void test_fields(void)
+{
+    TestRow row;
+
+    Check(decode("{\"from\":\"SFO\",\"to\":\"LAX\"}", &row));
+    CheckStr(row.from, "SFO");
+    CheckStr(row.to, "LAX");
+    row_free(&row);
+
+    // in any order, with any whitespace
+    Check(decode(" \n{ \"to\" :\t\"LAX\" ,\r\n \"from\": \"SFO\" } ", &row));
+    CheckStr(row.from, "SFO");
+    CheckStr(row.to, "LAX");
+    row_free(&row);
+
+    // missing fields are left unset
+    Check(decode("{\"from\":\"SFO\"}", &row));
+    CheckStr(row.from, "SFO");
+    Check(row.to == NULL);
+    row_free(&row);
+
+    Check(decode("{}", &row));
+    Check(row.from == NULL && row.to == NULL);
+    Check(decode("{ }", &row));
+    Check(row.from == NULL && row.to == NULL);
+
+    // as are fields that aren't strings
+    Check(decode("{\"from\":1,\"to\":null}", &row));
+    Check(row.from == NULL && row.to == NULL);
+    Check(decode("{\"from\":[\"SFO\"],\"to\":{\"faa\":\"LAX\"}}", &row));
+    Check(row.from == NULL && row.to == NULL);
+
+    // the first of duplicate names wins
+    Check(decode("{\"from\":\"SFO\",\"from\":\"OAK\"}", &row));
+    CheckStr(row.from, "SFO");
+    row_free(&row);
+
+    // names are compared exactly
+    Check(decode("{\"From\":\"SFO\",\"fro\":\"OAK\",\"fromm\":\"SJC\"}", &row));
+    Check(row.from == NULL);
+}
+
+static void test_skipped(void)
+{
+    TestRow row;
+
+    // other members of every type are skipped, including ones that look like the fields
+    Check(decode(
+        "{\"id\":10, \"n\":-1.5e3, \"t\":true, \"f\":false, \"z\":null, \"s\":\"},{\\\"to\\\":\\\"\","
+        " \"a\":[1, [2, {\"to\":\"XXX\"}], \"]\"], \"o\":{\"from\":\"XXX\", \"p\":{}},"
+        " \"from\":\"SFO\", \"e\":[], \"to\":\"LAX\"}", &row));
+    CheckStr(row.from, "SFO");
+    CheckStr(row.to, "LAX");
+    row_free(&row);
+}
+
+static void test_escapes(void)
+{
+    TestRow row;
+
+    Check(decode("{\"from\":\"a\\\"b\\\\c\\/d\\b\\f\\n\\r\\t\",\"to\":\"\\u0041\\u00e9\\u20ac\\ud83d\\ude00\"}", &row));
+    CheckStr(row.from, "a\"b\\c/d\b\f\n\r\t");
+    CheckStr(row.to, "A\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80");
+    row_free(&row);
+
+    // escaped names are decoded before they're compared
+    Check(decode("{\"fr\\u006fm\":\"SFO\",\"\\u0074o\":\"LAX\"}", &row));
+    CheckStr(row.from, "SFO");
+    CheckStr(row.to, "LAX");
+    row_free(&row);
+
+    // invalid escapes fail the whole object, with nothing left allocated
+    Check(!decode("{\"from\":\"SFO\",\"to\":\"\\x\"}", &row));
+    Check(row.from == NULL && row.to == NULL);
+    Check(!decode("{\"from\":\"SFO\",\"to\":\"\\u12\"}", &row));
+    Check(row.from == NULL && row.to == NULL);
+    Check(!decode("{\"from\":\"SFO\",\"to\":\"\\ud83d\"}", &row));
+    Check(row.from == NULL && row.to == NULL);
+    Check(!decode("{\"from\":\"SFO\",\"to\":\"\\ude00\"}", &row));
+    Check(row.from == NULL && row.to == NULL);
+
+    char *str = decode_json_string(" \"a\\nb\" ", 8);
+    CheckStr(str, "a\nb");
+    tcblcb_free(str);
+    Check(decode_json_string("1", 1) == NULL);
+    Check(decode_json_string("\"abc", 4) == NULL);
+}
+
+static void test_invalid(void)
+{
+    static const char *invalid[] = {
+        "", " ", "[]", "\"from\"", "null",
+        "{", "{\"from\"", "{\"from\":", "{\"from\":\"SFO\"", "{\"from\":\"SFO\",",
+        "{\"from\" \"SFO\"}", "{\"from\":\"SFO\" \"to\":\"LAX\"}", "{from:\"SFO\"}",
+        "{\"from\":\"SFO\",}", "{\"a\":}", "{\"a\":[1,2}", "{\"a\":]}",
+        "{\"a\":\"unterminated}", "{\"a\":[\"unterminated]}", "{\"from\":\"SFO\",\"a\":,}",
+    };
+    TestRow row;
+
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        if (decode(invalid[i], &row)) {
+            fprintf(stderr, "decoded: %s\n", invalid[i]);
+            Check(false);
+            row_free(&row);
+        }
+        Check(row.from == NULL && row.to == NULL);
+    }
+
+    // only as much of the input as given is read
+    Check(!decode_len("{\"from\":\"SFO\"}", 13, &row));
+    Check(row.from == NULL);
+    Check(!decode_len("{\"from\":\"SFO\"}", 11, &row));
+    Check(row.from == NULL);
+}
+
+static void test_embedded_nul(void)
+{
+    static const char nested[] = "{\"a\":[1,\0],\"from\":\"SFO\"}";
+    static const char member[] = "{\"a\":\0,\"from\":\"SFO\"}";
+    TestRow row;
+
+    // a NUL inside a skipped value used to stop the scan from advancing, which never finished
+    Check(decode_len(nested, sizeof(nested) - 1, &row));
+    CheckStr(row.from, "SFO");
+    row_free(&row);
+
+    Check(decode_len(member, sizeof(member) - 1, &row));
+    CheckStr(row.from, "SFO");
+    row_free(&row);
+
+    Check(!decode_len("{\"a\":[\0", 7, &row));
+    Check(row.from == NULL);
+}
+
+int main(void)
+{
+    RunTest(test_fields);
+    RunTest(test_skipped);
+    RunTest(test_escapes);
+    RunTest(test_invalid);
+    RunTest(test_embedded_nul);
+
+    return TestDone();
+}
@@ -0,0 +1,245 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+// the append-only JSON writer (util.c): what it writes matches what cJSON prints for the same
+// document, formatted or not, and a misused writer finishes with NULL.
+
+#include <math.h>
+
+#include "fakes.h"
+#include "test.h"
+
+#include "arena.h"
+#include "util.h"
+#include "cjson/cJSON.h"
+
+// write a login-style envelope: {"data":{"token":...,"ok":true,"n":[...]},"context":[...]}
+static char *write_envelope(tcblcb_JSONWriter *writer, bool format, const char *token)
+{
+    json_writer_init(writer, format);
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "data");
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "token");
+    json_writer_string(writer, token);
+    json_writer_key(writer, "ok");
+    json_writer_bool(writer, true);
+    json_writer_key(writer, "missing");
+    json_writer_string(writer, NULL);
+    json_writer_key(writer, "n");
+    json_writer_begin_array(writer);
+    json_writer_number(writer, 0);
+    json_writer_number(writer, -42);
+    json_writer_number(writer, 0.1);
+    json_writer_number(writer, 1e300);
+    json_writer_number(writer, NAN);
+    json_writer_end_array(writer);
+    json_writer_end_object(writer);
+    json_writer_key(writer, "context");
+    json_writer_begin_array(writer);
+    json_writer_string(writer, "KV get - scoped to inventory.hotel");
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "nested");
+    json_writer_raw(writer, "7", 1);
+    json_writer_end_object(writer);
+    json_writer_end_array(writer);
+    json_writer_end_object(writer);
+
+    return json_writer_finish(writer, NULL);
+}
+
+static cJSON *build_envelope(const char *token)
+{
+    cJSON *root = cJSON_CreateObject();
+    cJSON *data = cJSON_AddObjectToObject(root, "data");
+    cJSON_AddStringToObject(data, "token", token);
+    cJSON_AddTrueToObject(data, "ok");
+    cJSON_AddNullToObject(data, "missing");
+    cJSON *numbers = cJSON_AddArrayToObject(data, "n");
+    cJSON_AddItemToArray(numbers, cJSON_CreateNumber(0));
+    cJSON_AddItemToArray(numbers, cJSON_CreateNumber(-42));
+    cJSON_AddItemToArray(numbers, cJSON_CreateNumber(0.1));
+    cJSON_AddItemToArray(numbers, cJSON_CreateNumber(1e300));
+    cJSON_AddItemToArray(numbers, cJSON_CreateNull());
+    cJSON *context = cJSON_AddArrayToObject(root, "context");
+    cJSON_AddItemToArray(context, cJSON_CreateString("KV get - scoped to inventory.hotel"));
+    cJSON *nested = cJSON_CreateObject();
+    cJSON_AddItemToObject(nested, "nested", cJSON_CreateNumber(7));
+    cJSON_AddItemToArray(context, nested);
+
+    return root;
+}
+
+static void check_envelope(bool format, const char *token)
+{
+    tcblcb_JSONWriter writer;
+    char *written = write_envelope(&writer, format, token);
+
+    cJSON *built = build_envelope(token);
+    char *printed = format ? cJSON_Print(built) : cJSON_PrintUnformatted(built);
+    CheckStr(written, printed);
+    cJSON_free(printed);
+    cJSON_Delete(built);
+}
+
+static void test_matches_cjson(void)
+{
+    check_envelope(false, "eyJhbGciOiJIUzI1NiJ9.e30.sig");
+    check_envelope(true, "eyJhbGciOiJIUzI1NiJ9.e30.sig");
+    check_envelope(false, "quote \" backslash \\ newline \n tab \t bell \a");
+    check_envelope(true, "quote \" backslash \\ newline \n tab \t bell \a");
+    check_envelope(false, "");
+}
+
+static void test_values(void)
+{
+    tcblcb_JSONWriter writer;
+    size_t len = 0;
+
+    // a bare value is a document too
+    json_writer_init(&writer, false);
+    json_writer_string(&writer, "alone");
+    CheckStr(json_writer_finish(&writer, &len), "\"alone\"");
+    CheckInt(len, strlen("\"alone\""));
+
+    json_writer_init(&writer, false);
+    json_writer_begin_array(&writer);
+    json_writer_end_array(&writer);
+    CheckStr(json_writer_finish(&writer, NULL), "[]");
+
+    // a parsed value is written unformatted
+    static const char value[] = "{ \"a\" : [ 1 , \"b\" ] }";
+    tcblcb_JSONDoc *doc = json_doc_parse(value, sizeof(value) - 1);
+    json_writer_init(&writer, true);
+    json_writer_begin_array(&writer);
+    json_writer_json(&writer, json_doc_root(doc));
+    json_writer_bool(&writer, false);
+    json_writer_end_array(&writer);
+    CheckStr(json_writer_finish(&writer, NULL), "[{\"a\":[1,\"b\"]}, false]");
+    json_doc_free(doc);
+
+    // the buffer is reused, so a new writer starts from nothing
+    json_writer_init(&writer, false);
+    json_writer_null(&writer);
+    CheckStr(json_writer_finish(&writer, NULL), "null");
+}
+
+static void test_misuse(void)
+{
+    tcblcb_JSONWriter writer;
+
+    // nothing written
+    json_writer_init(&writer, false);
+    Check(json_writer_finish(&writer, NULL) == NULL);
+
+    // an object member without a key
+    json_writer_init(&writer, false);
+    json_writer_begin_object(&writer);
+    json_writer_string(&writer, "value");
+    json_writer_end_object(&writer);
+    Check(json_writer_finish(&writer, NULL) == NULL);
+
+    // a key without a value
+    json_writer_init(&writer, false);
+    json_writer_begin_object(&writer);
+    json_writer_key(&writer, "key");
+    json_writer_end_object(&writer);
+    Check(json_writer_finish(&writer, NULL) == NULL);
+
+    // a key in an array
+    json_writer_init(&writer, false);
+    json_writer_begin_array(&writer);
+    json_writer_key(&writer, "key");
+    json_writer_end_array(&writer);
+    Check(json_writer_finish(&writer, NULL) == NULL);
+
+    // unbalanced and mismatched containers
+    json_writer_init(&writer, false);
+    json_writer_begin_array(&writer);
+    Check(json_writer_finish(&writer, NULL) == NULL);
+
+    json_writer_init(&writer, false);
+    json_writer_begin_array(&writer);
+    json_writer_end_object(&writer);
+    Check(json_writer_finish(&writer, NULL) == NULL);
+
+    json_writer_init(&writer, false);
+    json_writer_end_array(&writer);
+    Check(json_writer_finish(&writer, NULL) == NULL);
+
+    // two roots
+    json_writer_init(&writer, false);
+    json_writer_null(&writer);
+    json_writer_null(&writer);
+    Check(json_writer_finish(&writer, NULL) == NULL);
+
+    // nesting as deep as allowed works, one more level fails
+    json_writer_init(&writer, false);
+    for (int i = 0; i < JSON_WRITER_MAX_DEPTH; i++) {
+        json_writer_begin_array(&writer);
+    }
+    for (int i = 0; i < JSON_WRITER_MAX_DEPTH; i++) {
+        json_writer_end_array(&writer);
+    }
+    Check(json_writer_finish(&writer, NULL) != NULL);
+
+    json_writer_init(&writer, false);
+    for (int i = 0; i <= JSON_WRITER_MAX_DEPTH; i++) {
+        json_writer_begin_array(&writer);
+    }
+    for (int i = 0; i <= JSON_WRITER_MAX_DEPTH; i++) {
+        json_writer_end_array(&writer);
+    }
+    Check(json_writer_finish(&writer, NULL) == NULL);
+}
+
+static void test_large_buffer(void)
+{
+    tcblcb_JSONWriter writer;
+
+    // a document bigger than the buffer that is kept still comes out whole
+    static char big[100 * 1024];
+    memset(big, 'x', sizeof(big) - 1);
+    json_writer_init(&writer, false);
+    json_writer_string(&writer, big);
+    size_t len = 0;
+    char *written = json_writer_finish(&writer, &len);
+    CheckInt(len, sizeof(big) + 1);
+    Check(written != NULL && written[0] == '"' && written[len - 1] == '"');
+
+    json_writer_init(&writer, false);
+    json_writer_bool(&writer, true);
+    CheckStr(json_writer_finish(&writer, NULL), "true");
+}
+
+int main(void)
+{
+    // cJSON allocates like it does in the workers, which json_writer_json relies on to free
+    tcblcb_arena_init_json_hooks();
+
+    RunTest(test_matches_cjson);
+    RunTest(test_values);
+    RunTest(test_misuse);
+    RunTest(test_large_buffer);
+
+    return TestDone();
+}
@@ -0,0 +1,279 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+// libcouchbase tracing (lcb-tracing.c): the latencies lcb's meter reports, and the operation
+// spans its tracer is handed, recorded in the `/metrics` histograms, with slow operations and
+// orphaned responses logged.
+
+#include <time.h>
+
+#include "fakes.h"
+#include "test.h"
+
+#include "lcb-tracing.h"
+#include "metrics.h"
+
+static char *page = NULL;
+
+// scrape `/metrics` into `page`.
+static void scrape(void)
+{
+    struct http_request req;
+
+    fake_request_init(&req, NULL, HTTP_METHOD_GET, "/metrics");
+    CheckInt(tcblcb_page_metrics(&req), KORE_RESULT_OK);
+    CheckInt(req.status, 200);
+
+    // with a newline before it, so the first line can be found like the others
+    free(page);
+    page = malloc(req.response.offset + 2);
+    page[0] = '\n';
+    memcpy(page + 1, req.response.data, req.response.offset);
+    page[req.response.offset + 1] = '\0';
+
+    fake_request_free(&req);
+}
+
+// true if `line` is a whole line of the page.
+static bool has_line(const char *line)
+{
+    size_t len = strlen(line);
+    for (const char *p = strstr(page, line); p != NULL; p = strstr(p + 1, line)) {
+        if (p[-1] == '\n' && p[len] == '\n') {
+            return true;
+        }
+    }
+    return false;
+}
+
+#define CheckLine(line) do { \
+    _test_checks++; \
+    if (page == NULL || !has_line(line)) { \
+        _test_failures++; \
+        fprintf(stderr, "%s:%d: no metrics line: %s\n", __FILE__, __LINE__, line); \
+    } \
+} while (0)
+
+#define CheckNoLine(prefix) do { \
+    _test_checks++; \
+    if (page == NULL || strstr(page, "\n" prefix) != NULL) { \
+        _test_failures++; \
+        fprintf(stderr, "%s:%d: unexpected metrics line: %s\n", __FILE__, __LINE__, prefix); \
+    } \
+} while (0)
+
+static void sleep_us(long us)
+{
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = us * 1000 };
+    nanosleep(&ts, NULL);
+}
+
+// start a span the way lcb does (with the span it was given as the parent).
+static void *span_start(const char *name, void *parent)
+{
+    return fake_lcb_tracer->v.v1.start_span(fake_lcb_tracer, name, parent);
+}
+
+static void span_end(void *span)
+{
+    fake_lcb_tracer->v.v1.end_span(span);
+}
+
+static void span_destroy(void *span)
+{
+    fake_lcb_tracer->v.v1.destroy_span(span);
+}
+
+// start the dispatch of an operation, tagged the way lcb tags it.
+static void *dispatch_start(void *op_span, const char *operation_id, u_int64_t server_us)
+{
+    void *span = span_start("dispatch_to_server", op_span);
+    fake_lcb_tracer->v.v1.add_tag_string(span, "db.couchbase.operation_id", operation_id, strlen(operation_id));
+    fake_lcb_tracer->v.v1.add_tag_string(span, "db.couchbase.local_id", "c0ffee/1", 8);
+    fake_lcb_tracer->v.v1.add_tag_string(span, "net.peer.name", "10.0.0.1", 8);
+    fake_lcb_tracer->v.v1.add_tag_uint64(span, "net.peer.port", 11210);
+    fake_lcb_tracer->v.v1.add_tag_uint64(span, "db.couchbase.server_duration", server_us);
+    return span;
+}
+
+static void test_meter(void)
+{
+    Check(tcblcb_metrics_init());
+
+    // operations are told apart by their name, or their service if the name isn't one we record
+    fake_lcb_record_value("kv", "get", 150);
+    fake_lcb_record_value("kv", "get", 300);
+    fake_lcb_record_value("kv", "upsert", 150);
+    fake_lcb_record_value("kv", "replace", 150);
+    fake_lcb_record_value("kv", "lookup_in", 150);
+    fake_lcb_record_value("query", "query", 150);
+    fake_lcb_record_value("search", "search_query", 150);
+
+    // and the rest aren't recorded
+    fake_lcb_record_value("kv", "exists", 150);
+    fake_lcb_record_value("analytics", "analytics", 150);
+    fake_lcb_record_value("management", NULL, 150);
+
+    scrape();
+    CheckLine("tcblcb_sdk_operation_duration_seconds_count{op=\"get\"} 2");
+    CheckLine("tcblcb_sdk_operation_duration_seconds_sum{op=\"get\"} 0.000450");
+    CheckLine("tcblcb_sdk_operation_duration_seconds_bucket{op=\"get\",le=\"0.000160\"} 1");
+    CheckLine("tcblcb_sdk_operation_duration_seconds_count{op=\"store\"} 2");
+    CheckLine("tcblcb_sdk_operation_duration_seconds_count{op=\"subdoc\"} 1");
+    CheckLine("tcblcb_sdk_operation_duration_seconds_count{op=\"query\"} 1");
+    CheckLine("tcblcb_sdk_operation_duration_seconds_count{op=\"search\"} 1");
+
+    // operations that have been seen are listed even before they were slow or orphaned
+    CheckLine("tcblcb_sdk_slow_operations_total{op=\"get\"} 0");
+    CheckLine("tcblcb_sdk_orphaned_responses_total{op=\"get\"} 0");
+
+    tcblcb_metrics_destroy();
+}
+
+static void test_spans(void)
+{
+    Check(tcblcb_metrics_init());
+    fake_log_reset();
+
+    // an operation for a request, dispatched twice (e.g., retried after a not my vbucket)
+    tcblcb_SPAN *request = tcblcb_tracing_request_start("req-1");
+    Check(request != NULL);
+    void *parent = fake_lcbtrace_external(tcblcb_tracing_parent(request));
+    Check(parent == request);
+
+    void *op = span_start("get", parent);
+    void *encoding = span_start("request_encoding", op);
+    span_end(encoding);
+    span_destroy(encoding);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        void *dispatch = dispatch_start(op, "0x1a", 120);
+        sleep_us(1000);
+        span_end(dispatch);
+        span_destroy(dispatch);
+    }
+    span_end(op);
+    span_destroy(op);
+
+    // operations nothing is recorded for are left alone
+    void *other = span_start("exists", parent);
+    void *dispatch = dispatch_start(other, "0x1b", 120);
+    span_end(dispatch);
+    span_destroy(dispatch);
+    span_end(other);
+    span_destroy(other);
+
+    tcblcb_tracing_request_end(request);
+
+    scrape();
+    CheckLine("tcblcb_sdk_dispatch_duration_seconds_count{op=\"get\"} 1");
+    CheckLine("tcblcb_sdk_server_duration_seconds_count{op=\"get\"} 1");
+    CheckLine("tcblcb_sdk_server_duration_seconds_sum{op=\"get\"} 0.000120");
+    Check(strstr(page, "tcblcb_sdk_dispatch_duration_seconds_sum{op=\"get\"} 0.000000") == NULL);
+    CheckNoLine("tcblcb_sdk_dispatch_duration_seconds_count{op=\"store\"}");
+    Check(!fake_log_contains("Slow Couchbase"));
+
+    tcblcb_metrics_destroy();
+}
+
+static void test_slow(void)
+{
+    Check(tcblcb_metrics_init());
+    fake_log_reset();
+    tcblcb_tracing_set_threshold(METRICS_OP_SUBDOC, 1000);
+
+    tcblcb_SPAN *request = tcblcb_tracing_request_start("req-2");
+    void *parent = fake_lcbtrace_external(tcblcb_tracing_parent(request));
+
+    // over the threshold
+    void *op = span_start("lookup_in", parent);
+    void *dispatch = dispatch_start(op, "0x2a", 250);
+    sleep_us(2000);
+    span_end(dispatch);
+    span_destroy(dispatch);
+    span_end(op);
+    span_destroy(op);
+
+    // and an operation that isn't part of a request
+    op = span_start("mutate_in", NULL);
+    sleep_us(2000);
+    span_end(op);
+    span_destroy(op);
+
+    tcblcb_tracing_request_end(request);
+
+    scrape();
+    CheckLine("tcblcb_sdk_slow_operations_total{op=\"subdoc\"} 2");
+    CheckLine("tcblcb_sdk_server_duration_seconds_sum{op=\"subdoc\"} 0.000250");
+    Check(fake_log_contains("Slow Couchbase lookup_in for request req-2:"));
+    Check(fake_log_contains("(operation_id 0x2a, local_id c0ffee/1, peer 10.0.0.1:11210)"));
+    Check(fake_log_contains("Slow Couchbase mutate_in for request -:"));
+
+    tcblcb_tracing_set_threshold(METRICS_OP_SUBDOC, 500000);
+    tcblcb_metrics_destroy();
+}
+
+static void test_orphan(void)
+{
+    Check(tcblcb_metrics_init());
+    fake_log_reset();
+
+    // the request, and the operation (e.g., timed out), have completed before the response arrives
+    tcblcb_SPAN *request = tcblcb_tracing_request_start("req-3");
+    void *parent = fake_lcbtrace_external(tcblcb_tracing_parent(request));
+    void *op = span_start("upsert", parent);
+    void *dispatch = dispatch_start(op, "0x3a", 80);
+    span_end(op);
+    span_destroy(op);
+    tcblcb_tracing_request_end(request);
+    Check(!fake_log_contains("Orphaned"));
+
+    span_end(dispatch);
+    span_destroy(dispatch);
+
+    scrape();
+    CheckLine("tcblcb_sdk_orphaned_responses_total{op=\"store\"} 1");
+    CheckNoLine("tcblcb_sdk_server_duration_seconds_count{op=\"store\"}");
+    Check(fake_log_contains("Orphaned Couchbase upsert response for request req-3:"));
+    Check(fake_log_contains("80 us server (operation_id 0x3a, local_id c0ffee/1, peer 10.0.0.1:11210)"));
+
+    tcblcb_metrics_destroy();
+}
+
+int main(void)
+{
+    Check(tcblcb_tracing_init(NULL));
+    Check(fake_lcb_tracer != NULL);
+    Check(fake_lcb_meter != NULL);
+
+    RunTest(test_meter);
+    RunTest(test_spans);
+    RunTest(test_slow);
+    RunTest(test_orphan);
+
+    tcblcb_tracing_destroy();
+    Check(fake_lcb_tracer == NULL);
+    Check(fake_lcb_meter == NULL);
+
+    free(page);
+    return TestDone();
+}
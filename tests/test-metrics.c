@@ -0,0 +1,292 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+// metrics (metrics.c): what `/metrics` serves for the recorded requests, operations, statements
+// and caches, summed over the workers' slots, and the histogram buckets latencies fall into.
+
+#include "fakes.h"
+#include "test.h"
+
+#include "metrics.h"
+
+static char *page = NULL;
+
+// scrape `/metrics` into `page`. returns the status.
+static int scrape(void)
+{
+    struct http_request req;
+
+    fake_request_init(&req, NULL, HTTP_METHOD_GET, "/metrics");
+    CheckInt(tcblcb_page_metrics(&req), KORE_RESULT_OK);
+
+    free(page);
+    page = NULL;
+    if (req.status == 200) {
+        CheckStr(fake_response_header(&req, "content-type"), "text/plain; version=0.0.4; charset=utf-8");
+
+        // with a newline before it, so the first line can be found like the others
+        page = malloc(req.response.offset + 2);
+        page[0] = '\n';
+        memcpy(page + 1, req.response.data, req.response.offset);
+        page[req.response.offset + 1] = '\0';
+    }
+
+    int status = req.status;
+    fake_request_free(&req);
+    return status;
+}
+
+// true if `line` is a whole line of the page.
+static bool has_line(const char *line)
+{
+    size_t len = strlen(line);
+    for (const char *p = strstr(page, line); p != NULL; p = strstr(p + 1, line)) {
+        if (p[-1] == '\n' && p[len] == '\n') {
+            return true;
+        }
+    }
+    return false;
+}
+
+#define CheckLine(line) do { \
+    _test_checks++; \
+    if (page == NULL || !has_line(line)) { \
+        _test_failures++; \
+        fprintf(stderr, "%s:%d: no metrics line: %s\n", __FILE__, __LINE__, line); \
+    } \
+} while (0)
+
+#define CheckNoLine(prefix) do { \
+    _test_checks++; \
+    if (page == NULL || strstr(page, "\n" prefix) != NULL) { \
+        _test_failures++; \
+        fprintf(stderr, "%s:%d: unexpected metrics line: %s\n", __FILE__, __LINE__, prefix); \
+    } \
+} while (0)
+
+static void test_not_mapped(void)
+{
+    // nothing is recorded, and there is nothing to serve
+    tcblcb_metrics_request_start(METRICS_ROUTE_AIRPORTS);
+    tcblcb_metrics_request_end(METRICS_ROUTE_AIRPORTS, 200, 10, tcblcb_metrics_now());
+    tcblcb_metrics_backend_op(METRICS_OP_GET, true, tcblcb_metrics_now());
+    tcblcb_metrics_sdk_op(METRICS_OP_GET, 100);
+    CheckInt(tcblcb_metrics_statement_meta(METRICS_STATEMENT_HOTELS_SEARCH, "{\"total_hits\":1}", 16), 0);
+    CheckInt(scrape(), 503);
+}
+
+static void test_buckets(void)
+{
+    Check(tcblcb_metrics_init());
+
+    // on either side of the bounds of the first few buckets, and past the last one
+    static const u_int64_t us[] = { 0, 127, 128, 159, 160, 191, 192, 255, 256, 33554431, 33554432, 1ULL << 40 };
+    u_int64_t sum = 0;
+    for (size_t i = 0; i < sizeof(us) / sizeof(us[0]); i++) {
+        tcblcb_metrics_sdk_op(METRICS_OP_GET, us[i]);
+        sum += us[i];
+    }
+
+    CheckInt(scrape(), 200);
+    CheckLine("tcblcb_sdk_operation_duration_seconds_bucket{op=\"get\",le=\"0.000128\"} 2");
+    CheckLine("tcblcb_sdk_operation_duration_seconds_bucket{op=\"get\",le=\"0.000160\"} 4");
+    CheckLine("tcblcb_sdk_operation_duration_seconds_bucket{op=\"get\",le=\"0.000192\"} 6");
+    CheckLine("tcblcb_sdk_operation_duration_seconds_bucket{op=\"get\",le=\"0.000224\"} 7");
+    CheckLine("tcblcb_sdk_operation_duration_seconds_bucket{op=\"get\",le=\"0.000256\"} 8");
+    CheckLine("tcblcb_sdk_operation_duration_seconds_bucket{op=\"get\",le=\"0.000320\"} 9");
+    CheckLine("tcblcb_sdk_operation_duration_seconds_bucket{op=\"get\",le=\"0.000384\"} 9");
+    CheckLine("tcblcb_sdk_operation_duration_seconds_bucket{op=\"get\",le=\"29.360128\"} 9");
+    CheckLine("tcblcb_sdk_operation_duration_seconds_bucket{op=\"get\",le=\"33.554432\"} 10");
+    CheckLine("tcblcb_sdk_operation_duration_seconds_bucket{op=\"get\",le=\"+Inf\"} 12");
+    CheckLine("tcblcb_sdk_operation_duration_seconds_count{op=\"get\"} 12");
+
+    char line[256];
+    snprintf(line, sizeof(line), "tcblcb_sdk_operation_duration_seconds_sum{op=\"get\"} %llu.%06llu",
+        (unsigned long long)(sum / 1000000), (unsigned long long)(sum % 1000000));
+    CheckLine(line);
+
+    // every bucket up to the overflow bucket is listed, with bounds that only go up
+    size_t nbuckets = 0;
+    double previous = 0;
+    static const char prefix[] = "\ntcblcb_sdk_operation_duration_seconds_bucket{op=\"get\",le=\"";
+    for (const char *p = strstr(page, prefix); p != NULL; p = strstr(p + 1, prefix)) {
+        double bound = strtod(p + sizeof(prefix) - 1, NULL);
+        if (strncmp(p + sizeof(prefix) - 1, "+Inf", 4) != 0) {
+            Check(bound > previous);
+            previous = bound;
+        }
+        nbuckets++;
+    }
+    CheckInt(nbuckets, 1 + 18 * 4 + 1);
+
+    // other ops have no series
+    CheckNoLine("tcblcb_sdk_operation_duration_seconds_bucket{op=\"query\"");
+
+    tcblcb_metrics_destroy();
+}
+
+static void test_requests(void)
+{
+    Check(tcblcb_metrics_init());
+
+    // nothing has been requested yet, but the scrape itself is in flight, and counted by the next one
+    CheckInt(scrape(), 200);
+    CheckNoLine("tcblcb_http_requests_total{");
+    CheckLine("tcblcb_http_requests_in_flight{route=\"/metrics\"} 1");
+    CheckNoLine("tcblcb_http_requests_in_flight{route=\"/api");
+    CheckInt(scrape(), 200);
+    CheckLine("tcblcb_http_requests_total{route=\"/metrics\",code=\"200\"} 1");
+
+    for (int i = 0; i < 4; i++) {
+        tcblcb_metrics_request_start(METRICS_ROUTE_AIRPORTS);
+    }
+    u_int64_t now = tcblcb_metrics_now();
+    tcblcb_metrics_request_end(METRICS_ROUTE_AIRPORTS, 200, 100, now);
+    tcblcb_metrics_request_end(METRICS_ROUTE_AIRPORTS, 200, 50, now);
+    tcblcb_metrics_request_end(METRICS_ROUTE_AIRPORTS, 0, 0, now);
+
+    // a worker with another slot
+    worker->id = 2;
+    tcblcb_metrics_request_start(METRICS_ROUTE_AIRPORTS);
+    tcblcb_metrics_request_end(METRICS_ROUTE_AIRPORTS, 418, 7, now);
+    tcblcb_metrics_request_start(METRICS_ROUTE_HOTELS);
+    tcblcb_metrics_request_end(METRICS_ROUTE_HOTELS, 304, 0, now);
+    worker->id = 1;
+
+    CheckInt(scrape(), 200);
+    CheckLine("tcblcb_http_requests_total{route=\"/api/airports\",code=\"200\"} 2");
+    CheckLine("tcblcb_http_requests_total{route=\"/api/airports\",code=\"499\"} 1");
+    CheckLine("tcblcb_http_requests_total{route=\"/api/airports\",code=\"other\"} 1");
+    CheckLine("tcblcb_http_requests_total{route=\"/api/hotels/{description}/{location}/\",code=\"304\"} 1");
+    CheckLine("tcblcb_http_requests_in_flight{route=\"/api/airports\"} 1");
+    CheckLine("tcblcb_http_requests_in_flight{route=\"/api/hotels/{description}/{location}/\"} 0");
+    CheckLine("tcblcb_http_response_bytes_total{route=\"/api/airports\"} 157");
+    CheckLine("tcblcb_http_request_duration_seconds_count{route=\"/api/airports\"} 4");
+    CheckLine("tcblcb_http_request_duration_seconds_count{route=\"/api/hotels/{description}/{location}/\"} 1");
+    CheckNoLine("tcblcb_http_requests_total{route=\"/\"");
+
+    tcblcb_metrics_destroy();
+}
+
+static void test_backend_ops(void)
+{
+    Check(tcblcb_metrics_init());
+
+    u_int64_t now = tcblcb_metrics_now();
+    tcblcb_metrics_backend_op(METRICS_OP_GET, true, now);
+    tcblcb_metrics_backend_op(METRICS_OP_GET, true, now);
+    tcblcb_metrics_backend_op(METRICS_OP_GET, false, now);
+    worker->id = 2;
+    tcblcb_metrics_backend_op(METRICS_OP_GET, true, now);
+    tcblcb_metrics_backend_op(METRICS_OP_QUERY, false, now);
+    worker->id = 1;
+
+    CheckInt(scrape(), 200);
+    CheckLine("tcblcb_backend_operations_total{op=\"get\",result=\"ok\"} 3");
+    CheckLine("tcblcb_backend_operations_total{op=\"get\",result=\"error\"} 1");
+    CheckLine("tcblcb_backend_operations_total{op=\"query\",result=\"ok\"} 0");
+    CheckLine("tcblcb_backend_operations_total{op=\"query\",result=\"error\"} 1");
+    CheckLine("tcblcb_backend_operation_duration_seconds_count{op=\"get\"} 4");
+    CheckLine("tcblcb_backend_operation_duration_seconds_count{op=\"query\"} 1");
+    CheckNoLine("tcblcb_backend_operations_total{op=\"store\"");
+
+    // a start time in the future (from another clock) counts as no time
+    tcblcb_metrics_backend_op(METRICS_OP_STORE, true, now + 1000000000);
+    CheckInt(scrape(), 200);
+    CheckLine("tcblcb_backend_operation_duration_seconds_bucket{op=\"store\",le=\"0.000128\"} 1");
+    CheckLine("tcblcb_backend_operation_duration_seconds_sum{op=\"store\"} 0.000000");
+
+    tcblcb_metrics_destroy();
+}
+
+static void test_statements(void)
+{
+    Check(tcblcb_metrics_init());
+
+    static const char n1ql[] = "{\"requestID\":\"1\",\"status\":\"success\",\"metrics\":"
+        "{\"elapsedTime\":\"12.5ms\",\"executionTime\":\"1.25ms\",\"resultCount\":3,\"resultSize\":120}}";
+    static const char fts[] = "{\"status\":{\"total\":1,\"failed\":0,\"successful\":1},"
+        "\"total_hits\":42,\"max_score\":1.5,\"took\":2500000}";
+
+    u_int64_t now = tcblcb_metrics_now();
+    tcblcb_metrics_statement(METRICS_STATEMENT_AIRPORTS_NAME, now);
+    CheckInt(tcblcb_metrics_statement_meta(METRICS_STATEMENT_AIRPORTS_NAME, n1ql, sizeof(n1ql) - 1), 3);
+    tcblcb_metrics_statement(METRICS_STATEMENT_HOTELS_SEARCH, now);
+    CheckInt(tcblcb_metrics_statement_meta(METRICS_STATEMENT_HOTELS_SEARCH, fts, sizeof(fts) - 1), 42);
+
+    // metadata without timings (or that isn't JSON) records nothing
+    tcblcb_metrics_statement(METRICS_STATEMENT_FPATHS_ROUTES, now);
+    CheckInt(tcblcb_metrics_statement_meta(METRICS_STATEMENT_FPATHS_ROUTES, "{\"metrics\":{}}", 14), 0);
+    CheckInt(tcblcb_metrics_statement_meta(METRICS_STATEMENT_FPATHS_ROUTES, "{\"metrics\":{\"elapsedTime\":12}}", 30), 0);
+    CheckInt(tcblcb_metrics_statement_meta(METRICS_STATEMENT_FPATHS_ROUTES, "not json", 8), 0);
+
+    CheckInt(scrape(), 200);
+    CheckLine("tcblcb_statement_results_total{statement=\"airports_name\"} 3");
+    CheckLine("tcblcb_statement_results_total{statement=\"hotels_search\"} 42");
+    CheckLine("tcblcb_statement_results_total{statement=\"flight_paths_routes\"} 0");
+    CheckLine("tcblcb_statement_duration_seconds_count{statement=\"airports_name\"} 1");
+    CheckLine("tcblcb_statement_service_seconds_sum{statement=\"airports_name\"} 0.012500");
+    CheckLine("tcblcb_statement_service_seconds_count{statement=\"airports_name\"} 1");
+    CheckLine("tcblcb_statement_execution_seconds_sum{statement=\"airports_name\"} 0.001250");
+    CheckLine("tcblcb_statement_service_seconds_sum{statement=\"hotels_search\"} 0.002500");
+    CheckNoLine("tcblcb_statement_execution_seconds_count{statement=\"hotels_search\"}");
+    CheckNoLine("tcblcb_statement_service_seconds_count{statement=\"flight_paths_routes\"}");
+    CheckNoLine("tcblcb_statement_results_total{statement=\"airports_faa\"}");
+
+    tcblcb_metrics_destroy();
+}
+
+static void test_caches(void)
+{
+    Check(tcblcb_metrics_init());
+
+    // always listed, and set (not added to) by each worker
+    CheckInt(scrape(), 200);
+    CheckLine("tcblcb_worker_cache_entries{cache=\"airport-faa\"} 0");
+    CheckLine("tcblcb_worker_cache_bytes{cache=\"airport-faa\"} 0");
+
+    tcblcb_metrics_cache_size(METRICS_CACHE_AIRPORT_FAA, 10, 1000);
+    tcblcb_metrics_cache_size(METRICS_CACHE_AIRPORT_FAA, 3, 300);
+    worker->id = 2;
+    tcblcb_metrics_cache_size(METRICS_CACHE_AIRPORT_FAA, 5, 500);
+    worker->id = 1;
+
+    CheckInt(scrape(), 200);
+    CheckLine("tcblcb_worker_cache_entries{cache=\"airport-faa\"} 8");
+    CheckLine("tcblcb_worker_cache_bytes{cache=\"airport-faa\"} 800");
+
+    tcblcb_metrics_destroy();
+}
+
+int main(void)
+{
+    RunTest(test_not_mapped);
+    RunTest(test_buckets);
+    RunTest(test_requests);
+    RunTest(test_backend_ops);
+    RunTest(test_statements);
+    RunTest(test_caches);
+
+    free(page);
+    return TestDone();
+}
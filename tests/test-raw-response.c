@@ -0,0 +1,262 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+// raw row responses (util.c): the `{"data":[...],"context":[...]}` envelope built from raw JSON
+// rows, with or without spliced in fields, and sent whole or streamed in chunks.
+
+#include "fakes.h"
+#include "test.h"
+
+#include "util.h"
+
+static char *add_fields(const char *row, const char *fields)
+{
+    tcblcb_RawResponse resp = { 0 };
+    raw_response_init(&resp);
+
+    char *result = NULL;
+    if (raw_response_add_row_fields(&resp, row, strlen(row), fields, strlen(fields))) {
+        result = strdup(raw_response_finish(&resp, NULL));
+    }
+
+    raw_response_cleanup(&resp);
+    return result;
+}
+
+static void test_envelope(void)
+{
+    tcblcb_RawResponse resp = { 0 };
+    size_t len;
+
+    raw_response_init(&resp);
+    CheckStr(raw_response_finish(&resp, &len), "{\"data\":[],\"context\":[]}");
+    CheckInt(len, strlen("{\"data\":[],\"context\":[]}"));
+    raw_response_cleanup(&resp);
+    Check(resp.data_buf == NULL);
+    Check(resp.context_buf == NULL);
+
+    // rows are copied as they are, and contexts are escaped as strings
+    raw_response_init(&resp);
+    raw_response_add_row(&resp, "{\"a\":1}", 7);
+    raw_response_add_row(&resp, "[1, 2]", 6);
+    raw_response_add_row(&resp, "\"three\"xx", 7);
+    raw_response_add_context(&resp, "N1QL query");
+    raw_response_add_context(&resp, "with \"quotes\"\n");
+    CheckStr(raw_response_finish(&resp, NULL),
+        "{\"data\":[{\"a\":1},[1, 2],\"three\"],\"context\":[\"N1QL query\",\"with \\\"quotes\\\"\\n\"]}");
+    CheckInt(resp.num_rows, 3);
+    CheckInt(resp.num_contexts, 2);
+    raw_response_cleanup(&resp);
+}
+
+static void test_row_fields(void)
+{
+    char *result;
+
+    result = add_fields("{\"a\":1}", "\"b\":2");
+    CheckStr(result, "{\"data\":[{\"a\":1,\"b\":2}],\"context\":[]}");
+    free(result);
+
+    // whitespace before and after the closing brace is dropped
+    result = add_fields("{ \"a\" : 1 } \n", "\"b\":2");
+    CheckStr(result, "{\"data\":[{ \"a\" : 1 ,\"b\":2}],\"context\":[]}");
+    free(result);
+
+    // an empty object gets no separator
+    result = add_fields("{}", "\"b\":2");
+    CheckStr(result, "{\"data\":[{\"b\":2}],\"context\":[]}");
+    free(result);
+    result = add_fields("{ \n}", "\"b\":2");
+    CheckStr(result, "{\"data\":[{ \n\"b\":2}],\"context\":[]}");
+    free(result);
+
+    // rows that aren't objects are refused and leave nothing behind
+    Check(add_fields("[1]", "\"b\":2") == NULL);
+    Check(add_fields("\"{}\"", "\"b\":2") == NULL);
+    Check(add_fields("{", "\"b\":2") == NULL);
+    Check(add_fields("}", "\"b\":2") == NULL);
+    Check(add_fields("", "\"b\":2") == NULL);
+    Check(add_fields("   ", "\"b\":2") == NULL);
+
+    tcblcb_RawResponse resp = { 0 };
+    raw_response_init(&resp);
+    Check(raw_response_add_row_fields(&resp, "{\"a\":1}", 7, "\"n\":1", 5));
+    Check(!raw_response_add_row_fields(&resp, "null", 4, "\"n\":2", 5));
+    Check(raw_response_add_row_fields(&resp, "{\"a\":3}", 7, "\"n\":3", 5));
+    CheckStr(raw_response_finish(&resp, NULL), "{\"data\":[{\"a\":1,\"n\":1},{\"a\":3,\"n\":3}],\"context\":[]}");
+    CheckInt(resp.num_rows, 2);
+    raw_response_cleanup(&resp);
+}
+
+static void test_send(void)
+{
+    struct http_request req;
+    tcblcb_RawResponse resp = { 0 };
+
+    fake_request_init(&req, NULL, HTTP_METHOD_GET, "/api/airports");
+    raw_response_init(&resp);
+    raw_response_add_row(&resp, "{\"a\":1}", 7);
+    raw_response_add_context(&resp, "ctx");
+    raw_response_send(&resp, &req, false);
+
+    CheckInt(req.responses, 1);
+    CheckInt(req.status, 200);
+    CheckStr(kore_buf_stringify(&req.response, NULL), "{\"data\":[{\"a\":1}],\"context\":[\"ctx\"]}");
+    Check(fake_response_header(&req, "transfer-encoding") == NULL);
+
+    raw_response_cleanup(&resp);
+    fake_request_free(&req);
+
+    // a failed request gets an empty body
+    fake_request_init(&req, NULL, HTTP_METHOD_GET, "/api/airports");
+    raw_response_init(&resp);
+    raw_response_add_row(&resp, "{\"a\":1}", 7);
+    raw_response_send(&resp, &req, true);
+
+    CheckInt(req.responses, 1);
+    CheckInt(req.status, 200);
+    CheckInt(req.response.offset, 0);
+
+    raw_response_cleanup(&resp);
+    fake_request_free(&req);
+}
+
+static void test_stream_requested(void)
+{
+    struct http_request req;
+
+    fake_request_init(&req, NULL, HTTP_METHOD_GET, "/api/hotels");
+    Check(!stream_requested(&req));
+    fake_request_free(&req);
+
+    fake_request_init(&req, NULL, HTTP_METHOD_GET, "/api/hotels");
+    fake_request_arg(&req, "stream", "1");
+    Check(stream_requested(&req));
+    fake_request_free(&req);
+
+    fake_request_init(&req, NULL, HTTP_METHOD_GET, "/api/hotels");
+    fake_request_arg(&req, "stream", "0");
+    Check(!stream_requested(&req));
+    fake_request_free(&req);
+}
+
+static void test_stream(void)
+{
+    struct connection c;
+    struct http_request req;
+    tcblcb_RawResponse resp = { 0 };
+
+    fake_request_init(&req, &c, HTTP_METHOD_GET, "/api/hotels");
+    raw_response_init(&resp);
+    raw_response_stream(&resp, &req);
+
+    // nothing goes out before the first flush
+    raw_response_add_row(&resp, "{\"a\":1}", 7);
+    CheckInt(req.responses, 0);
+    CheckInt(c.sent.offset, 0);
+
+    // which sends the headers and then the rows so far as a chunk
+    raw_response_flush(&resp);
+    CheckInt(req.responses, 1);
+    CheckInt(req.status, 200);
+    CheckStr(fake_response_header(&req, "transfer-encoding"), "chunked");
+    Check(req.flags & HTTP_REQUEST_NO_CONTENT_LENGTH);
+    CheckStr(kore_buf_stringify(&c.sent, NULL), "10\r\n{\"data\":[{\"a\":1}\r\n");
+
+    // flushing with nothing new sends nothing
+    raw_response_flush(&resp);
+    CheckInt(c.sent.offset, strlen("10\r\n{\"data\":[{\"a\":1}\r\n"));
+
+    raw_response_add_row(&resp, "{\"b\":2}", 7);
+    raw_response_add_row(&resp, "{\"c\":3}", 7);
+    raw_response_flush(&resp);
+    CheckInt(req.responses, 1);
+    CheckStr(kore_buf_stringify(&c.sent, NULL),
+        "10\r\n{\"data\":[{\"a\":1}\r\n"
+        "10\r\n,{\"b\":2},{\"c\":3}\r\n");
+
+    // sending closes the envelope in a last chunk and ends the body
+    raw_response_add_context(&resp, "ctx");
+    raw_response_send(&resp, &req, false);
+    CheckInt(req.responses, 1);
+    CheckStr(kore_buf_stringify(&c.sent, NULL),
+        "10\r\n{\"data\":[{\"a\":1}\r\n"
+        "10\r\n,{\"b\":2},{\"c\":3}\r\n"
+        "14\r\n],\"context\":[\"ctx\"]}\r\n"
+        "0\r\n\r\n");
+
+    raw_response_cleanup(&resp);
+    fake_request_free(&req);
+}
+
+static void test_stream_failed(void)
+{
+    struct connection c;
+    struct http_request req;
+    tcblcb_RawResponse resp = { 0 };
+
+    // the envelope is still closed around the rows that were sent
+    fake_request_init(&req, &c, HTTP_METHOD_GET, "/api/hotels");
+    raw_response_init(&resp);
+    raw_response_stream(&resp, &req);
+    raw_response_add_row(&resp, "1", 1);
+    raw_response_flush(&resp);
+    raw_response_add_row(&resp, "2", 1);
+    raw_response_send(&resp, &req, true);
+
+    CheckInt(req.responses, 1);
+    CheckStr(kore_buf_stringify(&c.sent, NULL),
+        "a\r\n{\"data\":[1\r\n"
+        "11\r\n,2],\"context\":[]}\r\n"
+        "0\r\n\r\n");
+
+    raw_response_cleanup(&resp);
+    fake_request_free(&req);
+
+    // and one that fails before anything was flushed is sent like any other failure
+    fake_request_init(&req, &c, HTTP_METHOD_GET, "/api/hotels");
+    raw_response_init(&resp);
+    raw_response_stream(&resp, &req);
+    raw_response_add_row(&resp, "1", 1);
+    raw_response_send(&resp, &req, true);
+
+    CheckInt(req.responses, 1);
+    CheckInt(req.response.offset, 0);
+    CheckInt(c.sent.offset, 0);
+    Check(fake_response_header(&req, "transfer-encoding") == NULL);
+
+    raw_response_cleanup(&resp);
+    fake_request_free(&req);
+}
+
+int main(void)
+{
+    RunTest(test_envelope);
+    RunTest(test_row_fields);
+    RunTest(test_send);
+    RunTest(test_stream_requested);
+    RunTest(test_stream);
+    RunTest(test_stream_failed);
+
+    return TestDone();
+}
@@ -0,0 +1,415 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+// request contexts (try-cb-lcb.c): scatter-gather batches of KV operations, which wake their
+// request once every response is in, background work that has no request, and the Server-Timing
+// and X-Request-ID response headers.
+
+#include <stdlib.h>
+
+#include "fakes.h"
+#include "test.h"
+
+#include "arena.h"
+#include "try-cb-lcb.h"
+
+typedef struct {
+    struct connection c;
+    struct http_request req;
+    tcblcb_REQCTX *ctx;
+} TestRequest;
+
+// create the context for a request that has been set up (and given any headers).
+static void request_create(TestRequest *test)
+{
+    test->ctx = tcblcb_reqctx_create(&test->req, 0, NULL);
+    Check(test->ctx != NULL);
+
+    // the context arena is left current (for the handler states), the tests run outside it
+    tcblcb_arena_leave(NULL);
+}
+
+static void request_start(TestRequest *test, const char *path)
+{
+    fake_request_init(&test->req, &test->c, HTTP_METHOD_GET, path);
+    request_create(test);
+}
+
+static void request_end(TestRequest *test)
+{
+    fake_request_free(&test->req);
+}
+
+// the batch responses seen by the callback, in the order they arrived
+static size_t responses[16];
+static lcb_STATUS response_status[16];
+static size_t nresponses = 0;
+
+static void batch_callback(__unused lcb_INSTANCE *instance, tcblcb_BATCH *batch, size_t index, const lcb_RESPBASE *resp)
+{
+    CheckInt(*(int *)batch->cookie, 42);
+    responses[nresponses] = index;
+    response_status[nresponses] = index == 3
+        ? lcb_respsubdoc_status((const lcb_RESPSUBDOC *)resp)
+        : lcb_respget_status((const lcb_RESPGET *)resp);
+    nresponses++;
+
+    // results are allocated from the request arena, as the handlers' are
+    size_t *result = tcblcb_malloc(sizeof(size_t));
+    *result = index;
+    batch->results[index] = result;
+}
+
+// create a batch from the request arena, as the handler states do
+static tcblcb_BATCH *batch_create(TestRequest *test, size_t nitems, void *cookie)
+{
+    tcblcb_ARENA *previous_arena = tcblcb_arena_enter(test->ctx->arena);
+    tcblcb_BATCH *batch = tcblcb_batch_create(_tcblcb_lcb_instance, test->ctx, nitems, batch_callback, cookie, tcblcb_free);
+    tcblcb_arena_leave(previous_arena);
+    return batch;
+}
+
+static void test_batch(void)
+{
+    TestRequest test;
+    int cookie = 42;
+
+    fake_lcb_reset();
+    nresponses = 0;
+    request_start(&test, "/api/hotels/a");
+
+    tcblcb_BATCH *batch = batch_create(&test, 5, &cookie);
+    Check(batch != NULL);
+
+    // the commands all go out in a single scheduling window
+    tcblcb_batch_begin(batch);
+    CheckInt(tcblcb_batch_get(batch, 0, NULL), LCB_SUCCESS);
+    CheckInt(tcblcb_batch_get(batch, 1, NULL), LCB_SUCCESS);
+    CheckInt(tcblcb_batch_get(batch, 2, NULL), LCB_SUCCESS);
+    CheckInt(tcblcb_batch_subdoc(batch, 3, NULL), LCB_SUCCESS);
+    CheckInt(tcblcb_batch_get(batch, 5, NULL), LCB_ERR_INVALID_ARGUMENT);
+    tcblcb_batch_end(batch);
+
+    CheckInt(fake_lcb_nops, 4);
+    CheckInt(fake_lcb_sched_enters, 1);
+    CheckInt(fake_lcb_sched_leaves, 1);
+    for (size_t i = 0; i < fake_lcb_nops; i++) {
+        Check(fake_lcb_ops[i].in_window);
+    }
+    CheckInt(fake_lcb_ops[3].cbtype, LCB_CALLBACK_SDLOOKUP);
+    CheckInt(batch->nscheduled, 4);
+
+    // the request sleeps until the last response, whatever order they arrive in
+    CheckInt(tcblcb_reqctx_suspend(test.ctx, 1), HTTP_STATE_RETRY);
+    Check(test.req.sleeping);
+    size_t arena_used = tcblcb_arena_used(test.ctx->arena);
+    fake_lcb_respond(2, LCB_SUCCESS, NULL);
+    fake_lcb_respond(0, LCB_ERR_DOCUMENT_NOT_FOUND, NULL);
+    fake_lcb_respond(3, LCB_SUCCESS, NULL);
+    CheckInt(test.req.wakeups, 0);
+    Check(test.req.sleeping);
+    fake_lcb_respond(1, LCB_SUCCESS, NULL);
+    CheckInt(test.req.wakeups, 1);
+    Check(!test.req.sleeping);
+
+    // and each response is given the index its command was queued with
+    CheckInt(nresponses, 4);
+    CheckInt(responses[0], 2);
+    CheckInt(responses[1], 0);
+    CheckInt(responses[2], 3);
+    CheckInt(responses[3], 1);
+    CheckInt(response_status[1], LCB_ERR_DOCUMENT_NOT_FOUND);
+    Check(tcblcb_arena_used(test.ctx->arena) > arena_used);
+    for (size_t i = 0; i < 4; i++) {
+        Check(batch->results[i] != NULL && *(size_t *)batch->results[i] == i);
+    }
+    Check(batch->results[4] == NULL);
+
+    // nothing pending, so the next state runs straight away
+    CheckInt(tcblcb_reqctx_suspend(test.ctx, 2), HTTP_STATE_CONTINUE);
+    CheckInt(test.req.fsm_state, 2);
+
+    tcblcb_batch_free(batch);
+    request_end(&test);
+}
+
+static void test_batch_schedule_failure(void)
+{
+    TestRequest test;
+    int cookie = 42;
+
+    fake_lcb_reset();
+    nresponses = 0;
+    request_start(&test, "/api/hotels/a");
+
+    tcblcb_BATCH *batch = batch_create(&test, 3, &cookie);
+    tcblcb_batch_begin(batch);
+    CheckInt(tcblcb_batch_get(batch, 0, NULL), LCB_SUCCESS);
+    fake_lcb_schedule_status = LCB_ERR_NO_MEMORY;
+    CheckInt(tcblcb_batch_get(batch, 1, NULL), LCB_ERR_NO_MEMORY);
+    CheckInt(tcblcb_batch_get(batch, 2, NULL), LCB_SUCCESS);
+    tcblcb_batch_end(batch);
+
+    // a command that failed to queue isn't waited for
+    CheckInt(batch->nscheduled, 2);
+    CheckInt(fake_lcb_nops, 2);
+    CheckInt(tcblcb_reqctx_suspend(test.ctx, 1), HTTP_STATE_RETRY);
+    fake_lcb_respond(1, LCB_SUCCESS, NULL);
+    CheckInt(test.req.wakeups, 0);
+    fake_lcb_respond(0, LCB_SUCCESS, NULL);
+    CheckInt(test.req.wakeups, 1);
+
+    CheckInt(nresponses, 2);
+    CheckInt(responses[0], 2);
+    CheckInt(responses[1], 0);
+    Check(batch->results[1] == NULL);
+
+    // results are freed with the batch
+    tcblcb_batch_free(batch);
+    request_end(&test);
+
+    // nor is a batch where nothing could be queued
+    fake_lcb_reset();
+    request_start(&test, "/api/hotels/a");
+    batch = batch_create(&test, 1, &cookie);
+    tcblcb_batch_begin(batch);
+    fake_lcb_schedule_status = LCB_ERR_TIMEOUT;
+    CheckInt(tcblcb_batch_get(batch, 0, NULL), LCB_ERR_TIMEOUT);
+    tcblcb_batch_end(batch);
+    CheckInt(tcblcb_reqctx_suspend(test.ctx, 1), HTTP_STATE_CONTINUE);
+    Check(!test.req.sleeping);
+
+    tcblcb_batch_free(batch);
+    request_end(&test);
+}
+
+static void test_batch_request_gone(void)
+{
+    TestRequest test;
+    int cookie = 42;
+
+    fake_lcb_reset();
+    nresponses = 0;
+    request_start(&test, "/api/hotels/a");
+
+    tcblcb_BATCH *batch = batch_create(&test, 2, &cookie);
+    tcblcb_batch_begin(batch);
+    CheckInt(tcblcb_batch_get(batch, 0, NULL), LCB_SUCCESS);
+    CheckInt(tcblcb_batch_get(batch, 1, NULL), LCB_SUCCESS);
+    tcblcb_batch_end(batch);
+    CheckInt(tcblcb_reqctx_suspend(test.ctx, 1), HTTP_STATE_RETRY);
+
+    // the client went away, so the responses only release the context (and the batch in its
+    // arena) once the last of them is in
+    fake_lcb_respond(0, LCB_SUCCESS, NULL);
+    request_end(&test);
+    fake_lcb_respond(1, LCB_SUCCESS, NULL);
+
+    CheckInt(nresponses, 1);
+    CheckInt(test.req.wakeups, 0);
+}
+
+// background work records what it saw, as the refresh handlers would act on it
+static tcblcb_REQCTX *background_ctx = NULL;
+static int background_starts = 0;
+static int background_dones = 0;
+
+static void background_start(tcblcb_REQCTX *ctx, const char *arg)
+{
+    background_starts++;
+    background_ctx = ctx;
+    CheckStr(arg, "hotels|a");
+
+    // there's no request, but results are still wanted, and allocations go to its arena
+    Check(ctx->req == NULL);
+    Check(tcblcb_reqctx_attached(ctx));
+    size_t arena_used = tcblcb_arena_used(ctx->arena);
+    Check(tcblcb_malloc(16) != NULL);
+    Check(tcblcb_arena_used(ctx->arena) > arena_used);
+
+    // its refresh query is in flight
+    tcblcb_reqctx_op_scheduled(ctx);
+}
+
+static void background_done(tcblcb_REQCTX *ctx)
+{
+    background_dones++;
+    Check(ctx == background_ctx);
+    CheckInt(ctx->npending, 0);
+}
+
+static void test_background(void)
+{
+    char arg[] = "hotels|a";
+
+    // the work starts on the next pass of the event loop, with its own copy of the argument
+    Check(tcblcb_background_schedule(background_start, background_done, 8, NULL, arg));
+    arg[0] = 'x';
+    CheckInt(background_starts, 0);
+    CheckInt(fake_timers_run(), 1);
+    CheckInt(background_starts, 1);
+    CheckInt(background_dones, 0);
+
+    // and finishes once its last operation completes, which frees the context
+    tcblcb_reqctx_op_done(background_ctx);
+    CheckInt(background_dones, 1);
+    CheckInt(fake_timers_run(), 0);
+}
+
+// the duration in a Server-Timing header for the metric `name` (-1 if it isn't there).
+static double timing_ms(const char *header, const char *name)
+{
+    size_t len = strlen(name);
+    for (const char *metric = header; metric != NULL && *metric != '\0'; ) {
+        if (strncmp(metric, name, len) == 0 && strncmp(metric + len, ";dur=", 5) == 0) {
+            return strtod(metric + len + 5, NULL);
+        }
+        metric = strstr(metric, ", ");
+        if (metric != NULL) {
+            metric += 2;
+        }
+    }
+    return -1;
+}
+
+static void test_server_timing(void)
+{
+    TestRequest test;
+    int cookie = 42;
+
+    // only sent to requests that ask for it (the service isn't started with it on for everyone)
+    request_start(&test, "/api/hotels/a");
+    tcblcb_reqctx_server_timing(&test.req);
+    Check(fake_response_header(&test.req, "Server-Timing") == NULL);
+    request_end(&test);
+
+    fake_lcb_reset();
+    nresponses = 0;
+    fake_request_init(&test.req, &test.c, HTTP_METHOD_GET, "/api/hotels/a");
+    fake_request_header(&test.req, "X-Server-Timing", "1");
+    fake_request_header(&test.req, "Origin", "http://localhost:8081");
+    request_create(&test);
+
+    // phases are added to, and each type of lcb operation is timed with its count
+    u_int64_t now = tcblcb_metrics_now();
+    tcblcb_reqctx_phase(test.ctx, TIMING_PHASE_PARSE, now - 1500);
+    tcblcb_reqctx_phase(test.ctx, TIMING_PHASE_SERIALIZE, now - 200000);
+    tcblcb_reqctx_phase(test.ctx, TIMING_PHASE_SERIALIZE, now - 50000);
+
+    tcblcb_BATCH *batch = batch_create(&test, 2, &cookie);
+    tcblcb_batch_begin(batch);
+    CheckInt(tcblcb_batch_get(batch, 0, NULL), LCB_SUCCESS);
+    CheckInt(tcblcb_batch_get(batch, 1, NULL), LCB_SUCCESS);
+    tcblcb_batch_end(batch);
+    fake_lcb_respond(0, LCB_SUCCESS, NULL);
+    fake_lcb_respond(1, LCB_SUCCESS, NULL);
+    tcblcb_batch_free(batch);
+
+    tcblcb_reqctx_server_timing(&test.req);
+    const char *header = fake_response_header(&test.req, "Server-Timing");
+    Check(header != NULL);
+    if (header != NULL) {
+        Check(strncmp(header, "parse;dur=", 10) == 0);
+        Check(timing_ms(header, "parse") >= 1.5 && timing_ms(header, "parse") < 100);
+        Check(timing_ms(header, "serialize") >= 250 && timing_ms(header, "serialize") < 350);
+        Check(timing_ms(header, "body") < 0);
+        Check(timing_ms(header, "build") < 0);
+        Check(timing_ms(header, "get") >= 0);
+        CheckContains(header, ";desc=\"2 ops\"");
+        Check(timing_ms(header, "query") < 0);
+        Check(timing_ms(header, "total") >= 0);
+
+        // in order: the phases, the operations and then the total
+        const char *serialize = strstr(header, "serialize;");
+        const char *get = strstr(header, "get;");
+        const char *total = strstr(header, "total;");
+        Check(serialize != NULL && get != NULL && total != NULL && serialize < get && get < total);
+    }
+    CheckStr(fake_response_header(&test.req, "Timing-Allow-Origin"), "http://localhost:8081");
+
+    request_end(&test);
+}
+
+static void test_request_id(void)
+{
+    TestRequest test;
+    char first[REQUEST_ID_MAX + 1];
+
+    // generated IDs are the worker start up time, the worker and a count
+    request_start(&test, "/api/hotels/a");
+    tcblcb_reqctx_request_id_header(&test.req);
+    const char *request_id = fake_response_header(&test.req, "X-Request-ID");
+    Check(request_id != NULL);
+    CheckContains(request_id, "-1-");
+    snprintf(first, sizeof(first), "%s", request_id != NULL ? request_id : "");
+    request_end(&test);
+
+    request_start(&test, "/api/hotels/a");
+    tcblcb_reqctx_request_id_header(&test.req);
+    request_id = fake_response_header(&test.req, "X-Request-ID");
+    Check(request_id != NULL && strcmp(request_id, first) != 0);
+    request_end(&test);
+
+    // the client's ID is passed back
+    fake_request_init(&test.req, &test.c, HTTP_METHOD_GET, "/api/hotels/a");
+    fake_request_header(&test.req, "X-Request-ID", "proxy-1:abc_2.3");
+    request_create(&test);
+    tcblcb_reqctx_request_id_header(&test.req);
+    CheckStr(fake_response_header(&test.req, "X-Request-ID"), "proxy-1:abc_2.3");
+    request_end(&test);
+
+    // unless it isn't safe to log and echo, or is too long
+    const char *invalid[] = {
+        "",
+        "a b",
+        "a\"b",
+        "a\r\nSet-Cookie: x",
+        "0123456789012345678901234567890123456789012345678901234567890123456789",
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        fake_request_init(&test.req, &test.c, HTTP_METHOD_GET, "/api/hotels/a");
+        fake_request_header(&test.req, "X-Request-ID", invalid[i]);
+        request_create(&test);
+        tcblcb_reqctx_request_id_header(&test.req);
+        request_id = fake_response_header(&test.req, "X-Request-ID");
+        Check(request_id != NULL && strcmp(request_id, invalid[i]) != 0);
+        CheckContains(request_id, "-1-");
+        request_end(&test);
+    }
+}
+
+int main(void)
+{
+    kore_worker_configure();
+    Check(_tcblcb_lcb_instance != NULL);
+
+    RunTest(test_batch);
+    RunTest(test_batch_schedule_failure);
+    RunTest(test_batch_request_gone);
+    RunTest(test_background);
+    RunTest(test_server_timing);
+    RunTest(test_request_id);
+
+    kore_worker_teardown();
+
+    return TestDone();
+}
@@ -0,0 +1,337 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+// shared memory cache (shm-cache.c): hits, stale claims, add, remove, ring and index eviction,
+// and readers in other processes never seeing an entry torn by a concurrent writer.
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fakes.h"
+#include "test.h"
+
+#include "shm-cache.h"
+
+#define MINUTE_MS (60 * 1000)
+
+// 16 shards of a 64KiB ring each, so entries are at most 16KiB
+#define TEST_CACHE_BYTES (1024 * 1024)
+
+static tcblcb_CACHE_RESULT get(tcblcb_SHMCACHE *cache, const char *key, struct kore_buf *value)
+{
+    kore_buf_reset(value);
+    return tcblcb_shmcache_get(cache, key, strlen(key), value);
+}
+
+static bool put(tcblcb_SHMCACHE *cache, const char *key, const char *value, u_int64_t ttl_ms)
+{
+    return tcblcb_shmcache_put(cache, key, strlen(key), value, strlen(value), ttl_ms, ttl_ms);
+}
+
+static void test_hit_and_miss(void)
+{
+    tcblcb_SHMCACHE *cache = tcblcb_shmcache_create("test", TEST_CACHE_BYTES);
+    struct kore_buf *value = kore_buf_alloc(64);
+
+    Check(cache != NULL);
+    CheckInt(get(cache, "london", value), CACHE_MISS);
+    CheckInt(value->offset, 0);
+
+    Check(put(cache, "london", "LHR", MINUTE_MS));
+    CheckInt(get(cache, "london", value), CACHE_HIT);
+    CheckStr(kore_buf_stringify(value, NULL), "LHR");
+
+    // the value is appended to what's in the buffer, and doesn't have to be copied at all
+    kore_buf_reset(value);
+    kore_buf_append(value, "value: ", 7);
+    CheckInt(tcblcb_shmcache_get(cache, "london", 6, value), CACHE_HIT);
+    CheckStr(kore_buf_stringify(value, NULL), "value: LHR");
+    CheckInt(tcblcb_shmcache_get(cache, "london", 6, NULL), CACHE_HIT);
+
+    Check(put(cache, "london", "LGW", MINUTE_MS));
+    CheckInt(get(cache, "london", value), CACHE_HIT);
+    CheckStr(kore_buf_stringify(value, NULL), "LGW");
+
+    // keys are compared by length too
+    CheckInt(get(cache, "londo", value), CACHE_MISS);
+    CheckInt(get(cache, "london ", value), CACHE_MISS);
+
+    // values can be binary and empty
+    Check(tcblcb_shmcache_put(cache, "binary", 6, "a\0b", 3, MINUTE_MS, MINUTE_MS));
+    CheckInt(get(cache, "binary", value), CACHE_HIT);
+    CheckInt(value->offset, 3);
+    Check(memcmp(value->data, "a\0b", 3) == 0);
+    Check(put(cache, "empty", "", MINUTE_MS));
+    CheckInt(get(cache, "empty", value), CACHE_HIT);
+    CheckInt(value->offset, 0);
+
+    // and entries expire
+    fake_time_ms += MINUTE_MS;
+    CheckInt(get(cache, "london", value), CACHE_MISS);
+    CheckInt(value->offset, 0);
+
+    kore_buf_free(value);
+    tcblcb_shmcache_destroy(cache);
+}
+
+static void test_stale(void)
+{
+    tcblcb_SHMCACHE *cache = tcblcb_shmcache_create("test", TEST_CACHE_BYTES);
+    struct kore_buf *value = kore_buf_alloc(64);
+
+    Check(tcblcb_shmcache_put(cache, "rome", 4, "FCO", 3, MINUTE_MS, 10 * MINUTE_MS));
+    CheckInt(get(cache, "rome", value), CACHE_HIT);
+
+    // only the first lookup past the soft TTL is asked to refresh the entry
+    fake_time_ms += MINUTE_MS;
+    CheckInt(get(cache, "rome", value), CACHE_STALE);
+    CheckStr(kore_buf_stringify(value, NULL), "FCO");
+    CheckInt(get(cache, "rome", value), CACHE_HIT);
+    CheckStr(kore_buf_stringify(value, NULL), "FCO");
+
+    // and asked again if the refresh never landed
+    fake_time_ms += CACHE_REFRESH_RETRY_MS;
+    CheckInt(get(cache, "rome", value), CACHE_STALE);
+    CheckInt(get(cache, "rome", value), CACHE_HIT);
+
+    Check(tcblcb_shmcache_put(cache, "rome", 4, "CIA", 3, MINUTE_MS, 10 * MINUTE_MS));
+    CheckInt(get(cache, "rome", value), CACHE_HIT);
+    CheckStr(kore_buf_stringify(value, NULL), "CIA");
+
+    kore_buf_free(value);
+    tcblcb_shmcache_destroy(cache);
+}
+
+static void test_add_and_remove(void)
+{
+    tcblcb_SHMCACHE *cache = tcblcb_shmcache_create("test", TEST_CACHE_BYTES);
+    struct kore_buf *value = kore_buf_alloc(64);
+    bool exists = true;
+
+    Check(tcblcb_shmcache_add(cache, "flight", 6, "1", 1, MINUTE_MS, &exists));
+    Check(!exists);
+
+    // a live entry is left as it is
+    Check(!tcblcb_shmcache_add(cache, "flight", 6, "2", 1, MINUTE_MS, &exists));
+    Check(exists);
+    CheckInt(get(cache, "flight", value), CACHE_HIT);
+    CheckStr(kore_buf_stringify(value, NULL), "1");
+
+    // added entries are never stale
+    fake_time_ms += MINUTE_MS - 1;
+    CheckInt(get(cache, "flight", value), CACHE_HIT);
+
+    // but an expired one is replaced
+    fake_time_ms += 1;
+    Check(tcblcb_shmcache_add(cache, "flight", 6, "3", 1, MINUTE_MS, &exists));
+    Check(!exists);
+    CheckInt(get(cache, "flight", value), CACHE_HIT);
+    CheckStr(kore_buf_stringify(value, NULL), "3");
+
+    // as is a removed one
+    tcblcb_shmcache_remove(cache, "flight", 6);
+    CheckInt(get(cache, "flight", value), CACHE_MISS);
+    Check(tcblcb_shmcache_add(cache, "flight", 6, "4", 1, MINUTE_MS, &exists));
+    Check(!exists);
+
+    // removing a key that isn't there does nothing
+    tcblcb_shmcache_remove(cache, "nothing", 7);
+    CheckInt(get(cache, "flight", value), CACHE_HIT);
+    CheckStr(kore_buf_stringify(value, NULL), "4");
+
+    kore_buf_free(value);
+    tcblcb_shmcache_destroy(cache);
+}
+
+static void test_too_large(void)
+{
+    tcblcb_SHMCACHE *cache = tcblcb_shmcache_create("test", TEST_CACHE_BYTES);
+    struct kore_buf *value = kore_buf_alloc(64);
+    bool exists;
+
+    size_t len = 20 * 1024;
+    char *large = malloc(len);
+    memset(large, 'x', len);
+
+    Check(!tcblcb_shmcache_put(cache, "large", 5, large, len, MINUTE_MS, MINUTE_MS));
+    Check(!tcblcb_shmcache_add(cache, "large", 5, large, len, MINUTE_MS, &exists));
+    Check(!exists);
+    CheckInt(get(cache, "large", value), CACHE_MISS);
+
+    // up to a quarter of a shard is fine
+    Check(tcblcb_shmcache_put(cache, "large", 5, large, 16 * 1024 - 5, MINUTE_MS, MINUTE_MS));
+    CheckInt(get(cache, "large", value), CACHE_HIT);
+    CheckInt(value->offset, 16 * 1024 - 5);
+
+    free(large);
+    kore_buf_free(value);
+    tcblcb_shmcache_destroy(cache);
+}
+
+// a value that says which key and length it was written for, so a torn or misplaced copy shows.
+static size_t make_value(char *value, size_t size, int key, unsigned int version)
+{
+    size_t len = 32 + (version * 7919u) % (size - 32);
+    int prefix = snprintf(value, size, "%d:%u:%zu:", key, version, len);
+    memset(value + prefix, 'a' + (version % 26), len - (size_t)prefix);
+    return len;
+}
+
+static bool check_value(const struct kore_buf *value, int key)
+{
+    char expected[4096];
+    int value_key;
+    unsigned int version;
+    size_t len;
+
+    if (value->offset >= sizeof(expected) || sscanf((const char *)value->data, "%d:%u:%zu:", &value_key, &version, &len) != 3) {
+        return false;
+    }
+    return value_key == key
+        && make_value(expected, sizeof(expected), key, version) == value->offset
+        && memcmp(value->data, expected, value->offset) == 0;
+}
+
+static void test_eviction(void)
+{
+    tcblcb_SHMCACHE *cache = tcblcb_shmcache_create("test", TEST_CACHE_BYTES);
+    struct kore_buf *value = kore_buf_alloc(4096);
+    char key[16];
+    char data[4096];
+
+    // several times what the rings hold, so they wrap and the index slots are reused
+    int nkeys = 3000;
+    for (int i = 0; i < nkeys; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        size_t len = make_value(data, sizeof(data), i, (unsigned int)i);
+        Check(tcblcb_shmcache_put(cache, key, strlen(key), data, len, MINUTE_MS, MINUTE_MS));
+    }
+
+    // older entries have been overwritten, and the entries still there are intact
+    int hits = 0;
+    size_t hit_bytes = 0;
+    for (int i = 0; i < nkeys; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        if (get(cache, key, value) == CACHE_HIT) {
+            hits++;
+            hit_bytes += value->offset;
+            Check(check_value(value, i));
+        }
+    }
+    Check(hits > 0);
+    Check(hits < nkeys);
+    Check(hit_bytes <= TEST_CACHE_BYTES);
+
+    // the most recent entries are all still there
+    for (int i = nkeys - 5; i < nkeys; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        CheckInt(get(cache, key, value), CACHE_HIT);
+    }
+
+    kore_buf_free(value);
+    tcblcb_shmcache_destroy(cache);
+}
+
+#define CONCURRENT_KEYS     64
+#define CONCURRENT_WRITES   100000
+#define CONCURRENT_READS    300000
+
+static int concurrent_writer(tcblcb_SHMCACHE *cache, unsigned int writer)
+{
+    char key[16];
+    char data[4096];
+
+    for (unsigned int i = 0; i < CONCURRENT_WRITES; i++) {
+        int k = (int)((i * 31 + writer) % CONCURRENT_KEYS);
+        snprintf(key, sizeof(key), "key%d", k);
+        size_t len = make_value(data, sizeof(data), k, i * 4 + writer);
+        tcblcb_shmcache_put(cache, key, strlen(key), data, len, MINUTE_MS, MINUTE_MS);
+    }
+
+    return 0;
+}
+
+static int concurrent_reader(tcblcb_SHMCACHE *cache, unsigned int reader)
+{
+    struct kore_buf *value = kore_buf_alloc(4096);
+    char key[16];
+    int failures = 0;
+
+    for (unsigned int i = 0; i < CONCURRENT_READS; i++) {
+        int k = (int)((i * 17 + reader) % CONCURRENT_KEYS);
+        snprintf(key, sizeof(key), "key%d", k);
+        if (get(cache, key, value) != CACHE_MISS && !check_value(value, k)) {
+            failures++;
+        }
+    }
+
+    kore_buf_free(value);
+    return failures > 0 ? 1 : 0;
+}
+
+static void test_concurrent(void)
+{
+    // a small cache, so the writers keep overwriting the entries the readers are copying
+    tcblcb_SHMCACHE *cache = tcblcb_shmcache_create("test", 256 * 1024);
+    pid_t pids[4];
+
+    for (unsigned int i = 0; i < 4; i++) {
+        pids[i] = fork();
+        Check(pids[i] >= 0);
+        if (pids[i] == 0) {
+            _exit(i < 2 ? concurrent_writer(cache, i) : concurrent_reader(cache, i));
+        }
+    }
+
+    for (unsigned int i = 0; i < 4; i++) {
+        int status = -1;
+        CheckInt(waitpid(pids[i], &status, 0), pids[i]);
+        Check(WIFEXITED(status));
+        CheckInt(WEXITSTATUS(status), 0);
+    }
+
+    // and what's left is intact too
+    struct kore_buf *value = kore_buf_alloc(4096);
+    char key[16];
+    for (int k = 0; k < CONCURRENT_KEYS; k++) {
+        snprintf(key, sizeof(key), "key%d", k);
+        if (get(cache, key, value) != CACHE_MISS) {
+            Check(check_value(value, k));
+        }
+    }
+    kore_buf_free(value);
+
+    tcblcb_shmcache_destroy(cache);
+}
+
+int main(void)
+{
+    RunTest(test_hit_and_miss);
+    RunTest(test_stale);
+    RunTest(test_add_and_remove);
+    RunTest(test_too_large);
+    RunTest(test_eviction);
+    RunTest(test_concurrent);
+
+    return TestDone();
+}
@@ -0,0 +1,425 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+
+// request coalescing (singleflight.c): requests joining a flight in the same worker or one led by
+// another worker, picking the leader's response up from the shared cache once it lands, and a
+// leader whose client goes away finishing its flight for the waiters.
+
+#include "fakes.h"
+#include "test.h"
+
+#include "arena.h"
+#include "shm-cache.h"
+#include "singleflight.h"
+#include "util.h"
+
+// as in singleflight.c
+#define FLIGHT_MAX_WAIT_MS 3000
+#define FLIGHT_POLL_MS 20
+
+#define MINUTE_MS (60 * 1000)
+
+typedef struct {
+    struct connection c;
+    struct http_request req;
+    tcblcb_REQCTX *ctx;
+} TestRequest;
+
+static void request_start(TestRequest *test, const char *path)
+{
+    fake_request_init(&test->req, &test->c, HTTP_METHOD_GET, path);
+    test->ctx = tcblcb_reqctx_create(&test->req, 0, NULL);
+    Check(test->ctx != NULL);
+
+    // the context is left current, as it is for the handler states
+    tcblcb_arena_leave(NULL);
+}
+
+static void request_end(TestRequest *test)
+{
+    fake_request_free(&test->req);
+}
+
+// wait for the flight the way a handler does. true if the request is asleep.
+static bool suspend(TestRequest *test)
+{
+    return tcblcb_reqctx_suspend(test->ctx, 1) == HTTP_STATE_RETRY;
+}
+
+static void test_same_worker(void)
+{
+    tcblcb_SHMCACHE *cache = tcblcb_shmcache_create("test", 1024 * 1024);
+    TestRequest leader, waiter1, waiter2, other;
+    tcblcb_FLIGHT *flight = NULL;
+    tcblcb_FLIGHT *other_flight = NULL;
+    tcblcb_FLIGHT *none = NULL;
+
+    request_start(&leader, "/api/hotels/a");
+    request_start(&waiter1, "/api/hotels/a");
+    request_start(&waiter2, "/api/hotels/a");
+    request_start(&other, "/api/hotels/b");
+
+    // the first request leads, and marks the flight for the other workers
+    Check(!tcblcb_flight_join(leader.ctx, cache, "hotels|a", &flight));
+    Check(flight != NULL);
+    CheckInt(tcblcb_shmcache_get(cache, "flight|hotels|a", 15, NULL), CACHE_HIT);
+
+    // the next ones for the same key wait for it
+    Check(tcblcb_flight_join(waiter1.ctx, cache, "hotels|a", &none));
+    Check(none == NULL);
+    Check(tcblcb_flight_join(waiter2.ctx, cache, "hotels|a", &none));
+    Check(suspend(&waiter1));
+    Check(suspend(&waiter2));
+
+    // and a different key gets its own flight
+    Check(!tcblcb_flight_join(other.ctx, cache, "hotels|b", &other_flight));
+    Check(other_flight != NULL);
+
+    // landing wakes every waiter once, and only them
+    tcblcb_flight_land(flight);
+    CheckInt(waiter1.req.wakeups, 1);
+    CheckInt(waiter2.req.wakeups, 1);
+    Check(!waiter1.req.sleeping);
+    Check(!waiter2.req.sleeping);
+    CheckInt(other.req.wakeups, 0);
+    CheckInt(tcblcb_shmcache_get(cache, "flight|hotels|a", 15, NULL), CACHE_MISS);
+
+    // the next request for the key leads again
+    Check(!tcblcb_flight_join(waiter1.ctx, cache, "hotels|a", &flight));
+    Check(flight != NULL);
+    tcblcb_flight_land(flight);
+    tcblcb_flight_land(other_flight);
+    tcblcb_flight_land(NULL);
+
+    request_end(&leader);
+    request_end(&waiter1);
+    request_end(&waiter2);
+    request_end(&other);
+    tcblcb_shmcache_destroy(cache);
+}
+
+static void test_no_shared_cache(void)
+{
+    TestRequest leader, waiter;
+    tcblcb_FLIGHT *flight = NULL;
+    tcblcb_FLIGHT *none = NULL;
+
+    // without a shared cache flights still coalesce within the worker
+    request_start(&leader, "/api/hotels/a");
+    request_start(&waiter, "/api/hotels/a");
+
+    Check(!tcblcb_flight_join(leader.ctx, NULL, "hotels|a", &flight));
+    Check(flight != NULL);
+    Check(tcblcb_flight_join(waiter.ctx, NULL, "hotels|a", &none));
+    Check(suspend(&waiter));
+
+    tcblcb_flight_land(flight);
+    CheckInt(waiter.req.wakeups, 1);
+
+    request_end(&leader);
+    request_end(&waiter);
+}
+
+static void test_other_worker(void)
+{
+    tcblcb_SHMCACHE *cache = tcblcb_shmcache_create("test", 1024 * 1024);
+    TestRequest waiter;
+    tcblcb_FLIGHT *none = NULL;
+    bool exists;
+
+    // another worker is leading the flight
+    Check(tcblcb_shmcache_add(cache, "flight|hotels|a", 15, "", 0, FLIGHT_MAX_WAIT_MS, &exists));
+
+    request_start(&waiter, "/api/hotels/a");
+    Check(tcblcb_flight_join(waiter.ctx, cache, "hotels|a", &none));
+    Check(none == NULL);
+    Check(suspend(&waiter));
+
+    // the waiter polls until the marker goes away
+    CheckInt(fake_timers_run(), 0);
+    fake_time_ms += FLIGHT_POLL_MS;
+    CheckInt(fake_timers_run(), 1);
+    CheckInt(waiter.req.wakeups, 0);
+    fake_time_ms += FLIGHT_POLL_MS;
+    CheckInt(fake_timers_run(), 1);
+    CheckInt(waiter.req.wakeups, 0);
+
+    tcblcb_shmcache_remove(cache, "flight|hotels|a", 15);
+    fake_time_ms += FLIGHT_POLL_MS;
+    CheckInt(fake_timers_run(), 1);
+    CheckInt(waiter.req.wakeups, 1);
+    Check(!waiter.req.sleeping);
+
+    // and stops polling
+    fake_time_ms += FLIGHT_POLL_MS;
+    CheckInt(fake_timers_run(), 0);
+
+    request_end(&waiter);
+    tcblcb_shmcache_destroy(cache);
+}
+
+static void test_other_worker_deadline(void)
+{
+    tcblcb_SHMCACHE *cache = tcblcb_shmcache_create("test", 1024 * 1024);
+    TestRequest waiter;
+    tcblcb_FLIGHT *none = NULL;
+    bool exists;
+
+    Check(tcblcb_shmcache_add(cache, "flight|hotels|a", 15, "", 0, 10 * FLIGHT_MAX_WAIT_MS, &exists));
+
+    request_start(&waiter, "/api/hotels/a");
+    Check(tcblcb_flight_join(waiter.ctx, cache, "hotels|a", &none));
+    Check(suspend(&waiter));
+
+    // a leader that never lands is only waited for so long
+    u_int64_t joined = fake_time_ms;
+    while (waiter.req.wakeups == 0 && fake_time_ms < joined + 2 * FLIGHT_MAX_WAIT_MS) {
+        fake_time_ms += FLIGHT_POLL_MS;
+        fake_timers_run();
+    }
+    CheckInt(waiter.req.wakeups, 1);
+    CheckInt(fake_time_ms - joined, FLIGHT_MAX_WAIT_MS);
+
+    request_end(&waiter);
+    tcblcb_shmcache_destroy(cache);
+}
+
+static void test_waiter_gone(void)
+{
+    tcblcb_SHMCACHE *cache = tcblcb_shmcache_create("test", 1024 * 1024);
+    TestRequest leader, waiter;
+    tcblcb_FLIGHT *flight = NULL;
+    tcblcb_FLIGHT *none = NULL;
+
+    request_start(&leader, "/api/hotels/a");
+    request_start(&waiter, "/api/hotels/a");
+
+    Check(!tcblcb_flight_join(leader.ctx, cache, "hotels|a", &flight));
+    Check(tcblcb_flight_join(waiter.ctx, cache, "hotels|a", &none));
+    Check(suspend(&waiter));
+
+    // the client went away, so landing only frees the waiter's context
+    request_end(&waiter);
+    tcblcb_flight_land(flight);
+
+    request_end(&leader);
+    tcblcb_shmcache_destroy(cache);
+}
+
+// a leader's state, as a handler keeps it: the response it builds from the rows, and its flight
+typedef struct {
+    tcblcb_SHMCACHE *cache;
+    tcblcb_FLIGHT *flight;
+    tcblcb_RawResponse response;
+    bool failed;
+} LeaderState;
+
+static void leader_state_free(void *data)
+{
+    LeaderState *state = data;
+
+    tcblcb_flight_land(state->flight);
+    raw_response_cleanup(&state->response);
+}
+
+// cache the response once the last operation completes without the client, as the hotels
+// handler does
+static void leader_detached_done(tcblcb_REQCTX *ctx)
+{
+    LeaderState *state = ctx->data;
+
+    if (!state->failed) {
+        raw_response_cache(&state->response, state->cache, "hotels|a", MINUTE_MS, MINUTE_MS);
+        raw_response_store(&state->response);
+    }
+}
+
+static LeaderState *leader_start(TestRequest *leader, tcblcb_SHMCACHE *cache)
+{
+    fake_request_init(&leader->req, &leader->c, HTTP_METHOD_GET, "/api/hotels/a");
+    leader->ctx = tcblcb_reqctx_create(&leader->req, sizeof(LeaderState), leader_state_free);
+    Check(leader->ctx != NULL);
+    tcblcb_arena_leave(NULL);
+
+    LeaderState *state = leader->ctx->data;
+    state->cache = cache;
+    raw_response_init(&state->response);
+
+    Check(!tcblcb_flight_join(leader->ctx, cache, "hotels|a", &state->flight));
+    Check(state->flight != NULL);
+    tcblcb_reqctx_finish_detached(leader->ctx, leader_detached_done);
+
+    // its search is in flight
+    tcblcb_reqctx_op_scheduled(leader->ctx);
+    return state;
+}
+
+static void test_leader_gone(void)
+{
+    tcblcb_SHMCACHE *cache = tcblcb_shmcache_create("test", 1024 * 1024);
+    TestRequest leader, waiter1, waiter2;
+    tcblcb_FLIGHT *none = NULL;
+
+    LeaderState *state = leader_start(&leader, cache);
+    request_start(&waiter1, "/api/hotels/a");
+    request_start(&waiter2, "/api/hotels/a");
+    Check(tcblcb_flight_join(waiter1.ctx, cache, "hotels|a", &none));
+    Check(tcblcb_flight_join(waiter2.ctx, cache, "hotels|a", &none));
+    Check(suspend(&waiter1));
+    Check(suspend(&waiter2));
+
+    // the leader's client goes away mid-search, which doesn't land the flight
+    raw_response_add_row(&state->response, "{\"a\":1}", 7);
+    request_end(&leader);
+    CheckInt(waiter1.req.wakeups, 0);
+    CheckInt(waiter2.req.wakeups, 0);
+
+    // the rest of its results are still delivered
+    tcblcb_REQCTX *ctx = leader.ctx;
+    Check(tcblcb_reqctx_attached(ctx));
+    Check(ctx->req == NULL);
+    raw_response_add_row(&state->response, "{\"b\":2}", 7);
+    CheckInt(tcblcb_shmcache_get(cache, "hotels|a", 8, NULL), CACHE_MISS);
+
+    // and once they're all in the response is cached before the waiters wake
+    tcblcb_reqctx_op_done(ctx);
+    CheckInt(waiter1.req.wakeups, 1);
+    CheckInt(waiter2.req.wakeups, 1);
+    CheckInt(tcblcb_shmcache_get(cache, "flight|hotels|a", 15, NULL), CACHE_MISS);
+
+    const char *expected = "{\"data\":[{\"a\":1},{\"b\":2}],\"context\":[]}";
+    CheckInt(send_cached_response(&waiter1.req, cache, "hotels|a", NULL), CACHE_HIT);
+    CheckStr(kore_buf_stringify(&waiter1.req.response, NULL), expected);
+    CheckInt(send_cached_response(&waiter2.req, cache, "hotels|a", NULL), CACHE_HIT);
+    CheckStr(kore_buf_stringify(&waiter2.req.response, NULL), expected);
+
+    request_end(&waiter1);
+    request_end(&waiter2);
+    tcblcb_shmcache_destroy(cache);
+}
+
+static void test_leader_gone_failed(void)
+{
+    tcblcb_SHMCACHE *cache = tcblcb_shmcache_create("test", 1024 * 1024);
+    TestRequest leader, waiter;
+    tcblcb_FLIGHT *none = NULL;
+
+    LeaderState *state = leader_start(&leader, cache);
+    request_start(&waiter, "/api/hotels/a");
+    Check(tcblcb_flight_join(waiter.ctx, cache, "hotels|a", &none));
+    Check(suspend(&waiter));
+
+    request_end(&leader);
+    CheckInt(waiter.req.wakeups, 0);
+
+    // a failed search lands the flight once it completes, without caching anything
+    state->failed = true;
+    tcblcb_reqctx_op_done(leader.ctx);
+    CheckInt(waiter.req.wakeups, 1);
+    CheckInt(tcblcb_shmcache_get(cache, "hotels|a", 8, NULL), CACHE_MISS);
+
+    request_end(&waiter);
+    tcblcb_shmcache_destroy(cache);
+}
+
+static void test_leader_answered(void)
+{
+    tcblcb_SHMCACHE *cache = tcblcb_shmcache_create("test", 1024 * 1024);
+    TestRequest leader;
+
+    LeaderState *state = leader_start(&leader, cache);
+    raw_response_add_row(&state->response, "{\"a\":1}", 7);
+
+    // a leader whose client stays is answered by its handler instead
+    tcblcb_reqctx_op_done(leader.ctx);
+    CheckInt(leader.req.wakeups, 1);
+    tcblcb_flight_land(state->flight);
+    state->flight = NULL;
+    request_end(&leader);
+    CheckInt(tcblcb_shmcache_get(cache, "hotels|a", 8, NULL), CACHE_MISS);
+
+    tcblcb_shmcache_destroy(cache);
+}
+
+static void test_streamed_response_cached(void)
+{
+    tcblcb_SHMCACHE *cache = tcblcb_shmcache_create("test", 1024 * 1024);
+    TestRequest leader, waiter;
+    tcblcb_RawResponse resp = { 0 };
+    tcblcb_FLIGHT *flight = NULL;
+    tcblcb_FLIGHT *none = NULL;
+
+    request_start(&leader, "/api/hotels/a");
+    request_start(&waiter, "/api/hotels/a");
+
+    Check(!tcblcb_flight_join(leader.ctx, cache, "hotels|a", &flight));
+    Check(tcblcb_flight_join(waiter.ctx, cache, "hotels|a", &none));
+    Check(suspend(&waiter));
+
+    // the leader streams its response, which is cached for the waiters all the same
+    raw_response_init(&resp);
+    raw_response_cache(&resp, cache, "hotels|a", MINUTE_MS, MINUTE_MS);
+    raw_response_stream(&resp, &leader.req);
+    raw_response_add_row(&resp, "{\"a\":1}", 7);
+    raw_response_flush(&resp);
+    raw_response_add_row(&resp, "{\"b\":2}", 7);
+    raw_response_send(&resp, &leader.req, false);
+    raw_response_cleanup(&resp);
+    tcblcb_flight_land(flight);
+
+    CheckInt(waiter.req.wakeups, 1);
+    CheckInt(send_cached_response(&waiter.req, cache, "hotels|a", NULL), CACHE_HIT);
+    CheckInt(waiter.req.status, 200);
+    CheckStr(kore_buf_stringify(&waiter.req.response, NULL), "{\"data\":[{\"a\":1},{\"b\":2}],\"context\":[]}");
+
+    // but a failed one isn't
+    request_end(&leader);
+    request_start(&leader, "/api/hotels/b");
+    raw_response_init(&resp);
+    raw_response_cache(&resp, cache, "hotels|b", MINUTE_MS, MINUTE_MS);
+    raw_response_stream(&resp, &leader.req);
+    raw_response_add_row(&resp, "{\"a\":1}", 7);
+    raw_response_flush(&resp);
+    raw_response_send(&resp, &leader.req, true);
+    raw_response_cleanup(&resp);
+    CheckInt(tcblcb_shmcache_get(cache, "hotels|b", 8, NULL), CACHE_MISS);
+
+    request_end(&leader);
+    request_end(&waiter);
+    tcblcb_shmcache_destroy(cache);
+}
+
+int main(void)
+{
+    RunTest(test_same_worker);
+    RunTest(test_no_shared_cache);
+    RunTest(test_other_worker);
+    RunTest(test_other_worker_deadline);
+    RunTest(test_waiter_gone);
+    RunTest(test_leader_gone);
+    RunTest(test_leader_gone_failed);
+    RunTest(test_leader_answered);
+    RunTest(test_streamed_response_cached);
+
+    return TestDone();
+}
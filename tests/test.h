@@ -0,0 +1,89 @@
+/**
+ * Copyright (C) 2021 Couchbase, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALING
+ * IN THE SOFTWARE.
+ */
+
+#ifndef tcblcb_TEST_HEADER_SEEN
+#define tcblcb_TEST_HEADER_SEEN
+
+#include <stdio.h>
+#include <string.h>
+
+// checks for the unit tests. a failed check is reported and the test carries on, so one run
+// shows every failure; `TestDone` then sets the exit status.
+
+static int _test_checks = 0;
+static int _test_failures = 0;
+
+#define Check(cond) do { \
+    _test_checks++; \
+    if (!(cond)) { \
+        _test_failures++; \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+} while (0)
+
+#define CheckInt(actual, expected) do { \
+    long long xactual = (long long)(actual); \
+    long long xexpected = (long long)(expected); \
+    _test_checks++; \
+    if (xactual != xexpected) { \
+        _test_failures++; \
+        fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, xactual, xexpected); \
+    } \
+} while (0)
+
+#define CheckStr(actual, expected) do { \
+    const char *xactual = (actual); \
+    const char *xexpected = (expected); \
+    _test_checks++; \
+    if (xactual == NULL || strcmp(xactual, xexpected) != 0) { \
+        _test_failures++; \
+        fprintf(stderr, "%s:%d: %s is \"%s\", expected \"%s\"\n", __FILE__, __LINE__, #actual, \
+            xactual != NULL ? xactual : "(null)", xexpected); \
+    } \
+} while (0)
+
+#define CheckContains(actual, expected) do { \
+    const char *xactual = (actual); \
+    const char *xexpected = (expected); \
+    _test_checks++; \
+    if (xactual == NULL || strstr(xactual, xexpected) == NULL) { \
+        _test_failures++; \
+        fprintf(stderr, "%s:%d: %s does not contain \"%s\": \"%s\"\n", __FILE__, __LINE__, #actual, \
+            xexpected, xactual != NULL ? xactual : "(null)"); \
+    } \
+} while (0)
+
+// run a test function, naming it in the output if it fails.
+#define RunTest(test) do { \
+    int xfailures = _test_failures; \
+    test(); \
+    if (_test_failures > xfailures) { \
+        fprintf(stderr, "FAIL %s\n", #test); \
+    } \
+} while (0)
+
+#define TestDone() ( \
+    printf("%s: %d checks, %d failed\n", __FILE__, _test_checks, _test_failures), \
+    _test_failures > 0 ? 1 : 0 \
+)
+
+#endif /* !tcblcb_TEST_HEADER_SEEN */